@@ -0,0 +1,70 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+#include "bench.h"
+
+/** glibc's own entry points, the wrappers below count and forward to them */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static uint64_t alloc_count = 0;
+
+/** Defined in the executable, these also catch allocations made in libtev and libc */
+void* malloc(size_t size)
+{
+    alloc_count++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+    alloc_count++;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    alloc_count++;
+    return __libc_realloc(ptr, size);
+}
+
+uint64_t bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void bench_alloc_reset()
+{
+    alloc_count = 0;
+}
+
+uint64_t bench_alloc_count()
+{
+    return alloc_count;
+}
+
+uint64_t bench_random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+void bench_report(const char* name, const char* params, uint64_t ops, uint64_t elapsed_ns, uint64_t allocs)
+{
+    double ns_per_op = ops > 0 ? (double)elapsed_ns / ops : 0;
+    double allocs_per_op = ops > 0 ? (double)allocs / ops : 0;
+    printf("{\"name\":\"%s\",%s%s\"ops\":%llu,\"ns_per_op\":%.2f,\"allocs_per_op\":%.3f}\n",
+        name, params, params[0] ? "," : "", (unsigned long long)ops, ns_per_op, allocs_per_op);
+    fflush(stdout);
+}
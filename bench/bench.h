@@ -0,0 +1,25 @@
+#pragma once
+
+/**
+ * Helpers shared by the microbenchmarks.
+ * Each benchmark prints one JSON object per line, run_bench.sh collects them.
+ */
+
+#include <stdint.h>
+
+/** Monotonic time in ns */
+uint64_t bench_now_ns();
+/** Allocations since the last reset, counted by the malloc wrappers in bench.c */
+void bench_alloc_reset();
+uint64_t bench_alloc_count();
+/** Deterministic pseudo random numbers, xorshift64 */
+uint64_t bench_random(uint64_t* state);
+/**
+ * Print one result.
+ * @param name The benchmark name, e.g. topic_tree.match
+ * @param params A JSON fragment of the parameters, e.g. "\"subscriptions\":1000", may be empty
+ * @param ops The number of operations timed
+ * @param elapsed_ns The time they took
+ * @param allocs The allocations they made
+ */
+void bench_report(const char* name, const char* params, uint64_t ops, uint64_t elapsed_ns, uint64_t allocs);
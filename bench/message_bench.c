@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "../message.h"
+
+/** Bytes moved per size, so large payloads do not take forever */
+#define BYTES_PER_SIZE (256 * 1024 * 1024)
+#define MIN_OPS (100000)
+#define MAX_OPS (2000000)
+
+static const uint32_t payload_sizes[] = {16, 256, 4096, 65536, 1024 * 1024};
+
+static void run(uint32_t payload_size)
+{
+    char params[64];
+    snprintf(params, sizeof(params), "\"payload_bytes\":%u", payload_size);
+    uint64_t ops = BYTES_PER_SIZE / payload_size;
+    if(ops < MIN_OPS / 100)
+        ops = MIN_OPS / 100;
+    if(ops > MAX_OPS)
+        ops = MAX_OPS;
+    uint8_t* payload = malloc(payload_size);
+    if(!payload)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(payload, 0x5a, payload_size);
+    tbus_message_sub_index_t sub_index = 1;
+    tbus_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.command = TBUS_MSG_CMD_PUB;
+    msg.topic = "bench/topic/a";
+    msg.data = payload;
+    msg.data_len = payload_size;
+    msg.p_sub_index = &sub_index;
+
+    size_t len = 0;
+    bench_alloc_reset();
+    uint64_t start = bench_now_ns();
+    for(uint64_t i = 0; i < ops; i++)
+    {
+        uint8_t* buffer = tbus_message_serialize(&msg, &len);
+        if(!buffer)
+        {
+            fprintf(stderr, "Failed to serialize\n");
+            exit(EXIT_FAILURE);
+        }
+        free(buffer);
+    }
+    bench_report("message.serialize", params, ops, bench_now_ns() - start, bench_alloc_count());
+
+    uint8_t* buffer = tbus_message_serialize(&msg, &len);
+    if(!buffer)
+    {
+        fprintf(stderr, "Failed to serialize\n");
+        exit(EXIT_FAILURE);
+    }
+    /** A view does not touch the payload, so the op count does not depend on its size */
+    uint64_t view_ops = MAX_OPS;
+    volatile uint32_t sink = 0;
+    bench_alloc_reset();
+    start = bench_now_ns();
+    for(uint64_t i = 0; i < view_ops; i++)
+    {
+        tbus_message_t view;
+        if(tbus_message_view(buffer, len, &view) != 0)
+        {
+            fprintf(stderr, "Failed to view\n");
+            exit(EXIT_FAILURE);
+        }
+        sink += view.data_len;
+    }
+    bench_report("message.view", params, view_ops, bench_now_ns() - start, bench_alloc_count());
+    free(buffer);
+    free(payload);
+}
+
+int main(int argc, char const *argv[])
+{
+    for(size_t i = 0; i < sizeof(payload_sizes) / sizeof(payload_sizes[0]); i++)
+        run(payload_sizes[i]);
+    return 0;
+}
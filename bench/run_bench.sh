@@ -0,0 +1,11 @@
+#!/bin/bash
+
+# Run the given benchmarks and print their results as one JSON document
+echo '{"benchmarks":['
+for bench in "$@"
+do
+    ./$bench || { echo "Benchmark $bench failed" >&2; exit 1; }
+done | sed '$!s/$/,/'
+rc=${PIPESTATUS[0]}
+echo ']}'
+exit $rc
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include "bench.h"
+#include "../topic_tree.h"
+
+#define TOPIC_SIZE (96)
+#define MATCH_OPS (100000)
+#define MATCH_BATCH (64)
+
+typedef struct
+{
+    size_t subscriptions;
+    int depth;
+    /** Percentage of subscriptions with a + or # */
+    int wildcard_percent;
+} config_t;
+
+static const config_t configs[] = {
+    {1000, 4, 10},
+    {10000, 4, 10},
+    {100000, 4, 10},
+    {1000000, 4, 10},
+    {100000, 4, 0},
+    {100000, 4, 50},
+    {100000, 2, 10},
+    {100000, 8, 10},
+};
+
+static uint64_t match_count = 0;
+
+static void on_match(void* data, void* ctx)
+{
+    match_count++;
+}
+
+static void free_data(void* data, void* ctx)
+{
+}
+
+/** A topic of depth segments, each one of fanout values. With wildcards, one segment may become + or the tail #. */
+static void make_topic(char* topic, int depth, uint64_t fanout, int wildcard_percent, uint64_t* state)
+{
+    int wildcard_at = -1;
+    bool hash = false;
+    if(wildcard_percent > 0 && (int)(bench_random(state) % 100) < wildcard_percent)
+    {
+        wildcard_at = bench_random(state) % depth;
+        hash = bench_random(state) % 2 == 0;
+    }
+    size_t len = 0;
+    for(int i = 0; i < depth; i++)
+    {
+        if(i > 0)
+            topic[len++] = '/';
+        if(i == wildcard_at && hash)
+        {
+            topic[len++] = '#';
+            break;
+        }
+        if(i == wildcard_at)
+            topic[len++] = '+';
+        else
+            len += snprintf(topic + len, TOPIC_SIZE - len, "s%llu", (unsigned long long)(bench_random(state) % fanout));
+    }
+    topic[len] = '\0';
+}
+
+static void run(const config_t* config)
+{
+    char params[128];
+    snprintf(params, sizeof(params), "\"subscriptions\":%zu,\"depth\":%d,\"wildcard_percent\":%d",
+        config->subscriptions, config->depth, config->wildcard_percent);
+    /** Enough values per segment for the subscriptions to be mostly distinct */
+    uint64_t fanout = (uint64_t)ceil(pow((double)config->subscriptions, 1.0 / config->depth)) * 2;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    char (*topics)[TOPIC_SIZE] = malloc(config->subscriptions * TOPIC_SIZE);
+    char (*publish_topics)[TOPIC_SIZE] = malloc(MATCH_OPS * TOPIC_SIZE);
+    if(!topics || !publish_topics)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t i = 0; i < config->subscriptions; i++)
+        make_topic(topics[i], config->depth, fanout, config->wildcard_percent, &state);
+    for(size_t i = 0; i < MATCH_OPS; i++)
+        make_topic(publish_topics[i], config->depth, fanout, 0, &state);
+
+    topic_tree_t* tree = topic_tree_new();
+    if(!tree)
+    {
+        fprintf(stderr, "Failed to create topic tree\n");
+        exit(EXIT_FAILURE);
+    }
+    bench_alloc_reset();
+    uint64_t start = bench_now_ns();
+    for(size_t i = 0; i < config->subscriptions; i++)
+    {
+        if(!tree->insert(tree, topics[i], topics[i]))
+        {
+            fprintf(stderr, "Failed to insert %s\n", topics[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    bench_report("topic_tree.insert", params, config->subscriptions, bench_now_ns() - start, bench_alloc_count());
+
+    match_count = 0;
+    bench_alloc_reset();
+    start = bench_now_ns();
+    for(size_t i = 0; i < MATCH_OPS; i++)
+        tree->match(tree, publish_topics[i], on_match, NULL);
+    bench_report("topic_tree.match", params, MATCH_OPS, bench_now_ns() - start, bench_alloc_count());
+
+    void* matches[MATCH_BATCH];
+    bench_alloc_reset();
+    start = bench_now_ns();
+    for(size_t i = 0; i < MATCH_OPS; i++)
+        match_count += tree->match_all(tree, publish_topics[i], matches, MATCH_BATCH);
+    bench_report("topic_tree.match_all", params, MATCH_OPS, bench_now_ns() - start, bench_alloc_count());
+
+    bench_alloc_reset();
+    start = bench_now_ns();
+    for(size_t i = 0; i < config->subscriptions; i++)
+        tree->remove(tree, topics[i]);
+    bench_report("topic_tree.remove", params, config->subscriptions, bench_now_ns() - start, bench_alloc_count());
+
+    tree->free(tree, free_data, NULL);
+    free(publish_topics);
+    free(topics);
+    /** Keep the matches from being optimized away */
+    if(match_count == (uint64_t)-1)
+        printf("\n");
+}
+
+int main(int argc, char const *argv[])
+{
+    for(size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++)
+        run(&configs[i]);
+    return 0;
+}
@@ -3,6 +3,7 @@
 #endif
 
 #include <stddef.h>
+#include <stdbool.h>
 #include <tev/tev.h>
 #include <tev/map.h>
 #include <unistd.h>
@@ -12,9 +13,21 @@
 #include <sys/un.h>
 #include <errno.h>
 #include <stdio.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <malloc.h>
+#include <sys/random.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <fcntl.h>
 #include "message.h"
 #include "message_reader.h"
+#include "frame_buffer.h"
 #include "topic_tree.h"
+#include "topic_intern.h"
+#include "journal.h"
 #include "list.h"
 #include "common.h"
 
@@ -22,10 +35,34 @@
  * The tbus broker
  */
 
-#define LISTEN_BACKLOG (10)
+#define DEFAULT_LISTEN_BACKLOG (SOMAXCONN)
+#define DEFAULT_CLIENT_SLAB_SIZE (256)
+#define DEFAULT_CREDIT_WINDOW (4 * 1024 * 1024)
+#define MAX_JOURNAL_PATTERNS (32)
+#define DEFAULT_JOURNAL_DIR "."
+#define DEFAULT_JOURNAL_SEGMENT_SIZE (64 * 1024 * 1024)
+#define DEFAULT_MAX_TOPIC_STATES (64 * 1024)
+#define JOURNAL_TRIM_INTERVAL_MS (1000)
+/** Oldest requests of a client are dropped beyond this */
+#define MAX_PENDING_REQUESTS (4096)
+#define MAX_BRIDGES (8)
+#define MAX_BRIDGE_PATTERNS (32)
+#define BRIDGE_RETRY_INTERVAL_MS (1000)
+/** Matching subscription lists of a publish walked without callbacks, more fall back to them */
+#define MATCH_BATCH (64)
+/** Payloads larger than this take several records on the upgrade socket */
+#define HANDOFF_CHUNK_SIZE (64 * 1024)
+/** How long the old broker waits for the new one to commit */
+#define HANDOFF_COMMIT_TIMEOUT_S (5)
+/** Datagrams of a publish sent in one sendmmsg */
+#define DGRAM_BATCH (64)
+/** Datagrams stay charged to the broker's socket until read, all datagram clients share it */
+#define DGRAM_SEND_BUFFER_SIZE (4 * 1024 * 1024)
 
 typedef struct tbus_subscription_s tbus_subscription_t;
 typedef struct tbus_client_s tbus_client_t;
+typedef struct tbus_share_group_s tbus_share_group_t;
+typedef struct tbus_bridge_s tbus_bridge_t;
 
 typedef struct
 {
@@ -33,6 +70,21 @@ typedef struct
     int ref_count;
     uint8_t* data;
     size_t size;
+    /** The flow controlled client that published this, credit is returned on release */
+    tbus_client_t* publisher;
+    /** Bytes credited back to publisher, its frame was smaller if the broker added TLVs */
+    size_t credit;
+    /** Points into data, rewritten before each send */
+    tbus_message_sub_index_t* p_sub_index;
+    tbus_message_seq_t seq;
+    /** The topic history holds one of the references */
+    bool in_history;
+    /** Picked by the replay in progress, its queued copies are dropped */
+    bool replaying;
+    /** Selects the client queue */
+    tbus_message_priority_t priority;
+    /** data was taken over from a reader, it goes back with frame_buffer_free */
+    bool from_reader;
 } tbus_buffer_t;
 
 #define GET_BUFFER_FROM_NODE(node) \
@@ -51,61 +103,346 @@ typedef struct
 
 struct tbus_subscription_s
 {
+    /** Linked in the topic tree entry, or in the members of group */
     list_head_t topic_tree_node;
-    char* topic;
+    /** Interned in broker->topic_names */
+    const char* topic;
+    /** The topic filter, points into topic. Differs from topic for shared subscriptions. */
+    const char* filter;
     tbus_message_sub_index_t sub_index;
     tbus_client_t* client;
+    /** NULL if not a shared subscription */
+    tbus_share_group_t* group;
+    /** Content filters checked before sending, NULL for none */
+    tbus_message_filter_t* filters;
+    uint32_t filter_count;
+    /** At most one message per interval_ms, 0 for every message */
+    uint32_t interval_ms;
+    uint64_t last_sent_ms;
+    /** The latest message held back until sample_timer, conflated on each publish */
+    tbus_buffer_t* sampled;
+    tev_timeout_handle_t sample_timer;
+    /** TBUS_MSG_SUB_FLAG_* */
+    tbus_message_sub_flags_t flags;
+    /** Id of the last request routed here, picks among servers with equal queues */
+    uint64_t last_request_id;
 };
 
 #define GET_SUBSCRIPTION_FROM_TOPIC_TREE_NODE(node) \
     ((tbus_subscription_t*)((char*)(node) - offsetof(tbus_subscription_t, topic_tree_node)))
 
+/** Subscribers of $share/<name>/<filter>, each message goes to one member */
+struct tbus_share_group_s
+{
+    list_head_t topic_tree_node;
+    char* name;
+    /** List<tbus_subscription_t&>, the least recently chosen first */
+    list_head_t members;
+};
+
+#define GET_SHARE_GROUP_FROM_TOPIC_TREE_NODE(node) \
+    ((tbus_share_group_t*)((char*)(node) - offsetof(tbus_share_group_t, topic_tree_node)))
+
 struct tbus_client_s
 {
     list_head_t broker_node;
     int fd;
+    /** Connected over SOCK_SEQPACKET */
+    bool seqpacket;
     message_reader_t* reader;
     /** Map<topic, tbus_subscription_t*> */
     map_handle_t subscriptions;
-    /** List<tbus_buffer_ref_t> */
-    list_head_t buffers;
+    /** List<tbus_buffer_ref_t>, one per priority */
+    list_head_t buffers[TBUS_MSG_PRIORITY_LEVELS];
+    /** Total length of buffers */
+    size_t queue_depth;
+    /** Partially sent, it has to finish before switching queues */
+    tbus_buffer_ref_t* writing;
+    /** Flow control */
+    bool flow_control;
+    tbus_message_credit_t credit_window;
+    /** Bytes published but not released yet */
+    size_t credit_outstanding;
+    /** Bytes released but not granted back yet */
+    size_t credit_pending;
+    /** List<tbus_request_t>, requests waiting for a reply, oldest first */
+    list_head_t requests;
+    size_t request_count;
+    /** Set if this is the connection of a bridge to another broker */
+    tbus_bridge_t* bridge;
+    /** The client's SOCK_DGRAM socket, registered once dgram_addr_len is not 0 */
+    struct sockaddr_un dgram_addr;
+    socklen_t dgram_addr_len;
+    /** Sent to dgram_addr, the client proves it owns the address by sending it back */
+    tbus_message_correlation_id_t dgram_nonce;
+    /** Small frames go as datagrams both ways */
+    bool dgram_ready;
+    /** Written to the stream since the client was last seen to have read all of it */
+    bool stream_unread;
 };
 
 #define GET_CLIENT_FROM_BROKER_NODE(node) \
     ((tbus_client_t*)((char*)(node) - offsetof(tbus_client_t, broker_node)))
 
+/** 
+ * Connects to another broker as a client and subscribes to the bridge patterns there.
+ * Remote messages are published locally, local messages matching the patterns are sent over.
+ * One connection carries both directions, so only one of two brokers bridges to the other.
+ * With -b on both, local subscribers get every remote message twice.
+ */
+struct tbus_bridge_s
+{
+    const char* uds_path;
+    /** NULL while disconnected */
+    tbus_client_t* client;
+    tev_timeout_handle_t retry_timer;
+};
+
+typedef struct
+{
+    list_head_t client_node;
+    /** Assigned by the broker, unique among all clients */
+    tbus_message_correlation_id_t id;
+    /** The requester's own correlation id */
+    tbus_message_correlation_id_t correlation_id;
+    tbus_client_t* requester;
+} tbus_request_t;
+
+#define GET_REQUEST_FROM_CLIENT_NODE(node) \
+    ((tbus_request_t*)((char*)(node) - offsetof(tbus_request_t, client_node)))
+
+/** Records of the state handed from a running broker to its replacement */
+typedef enum
+{
+    /** A listening socket, flags tell which */
+    HANDOFF_LISTENER = 1,
+    /** A client socket. values: credit window, credit to grant back. payload: its datagram address */
+    HANDOFF_CLIENT,
+    /** Of the last client. payload: topic, then its filters. values: sub index, interval ms. flags: sub flags */
+    HANDOFF_SUBSCRIPTION,
+    /** Of the last client. payload: the start of a frame not fully read */
+    HANDOFF_PARTIAL,
+    /** Of the last client. payload: a frame not fully sent, values: priority, bytes sent */
+    HANDOFF_PENDING,
+    /** payload: topic, values: last seq */
+    HANDOFF_TOPIC,
+    /** Of the last topic. payload: a frame, values: priority, seq */
+    HANDOFF_HISTORY,
+    /** values: broker id */
+    HANDOFF_DONE,
+    /** new -> old, everything was taken over. Until then the old broker keeps all of it. */
+    HANDOFF_COMMIT,
+} handoff_type_t;
+
+#define HANDOFF_FLAG_SEQPACKET (1 << 0)
+#define HANDOFF_FLAG_FLOW_CONTROL (1 << 1)
+#define HANDOFF_FLAG_DGRAM (1 << 2)
+
+/** Sent as a record of its own, the fd and the payload records follow */
+typedef struct
+{
+    uint32_t type;
+    uint32_t flags;
+    uint64_t values[2];
+    uint64_t size;
+} handoff_header_t;
+
+typedef struct
+{
+    /** In broker->topic_state_lru, the least recently published first */
+    list_head_t node;
+    char* topic;
+    tbus_message_seq_t last_seq;
+    /** Ring of the latest frames, NULL without history */
+    tbus_buffer_t** history;
+    size_t history_head;
+    size_t history_count;
+} tbus_topic_state_t;
+
+#define GET_TOPIC_STATE_FROM_NODE(list_node) \
+    ((tbus_topic_state_t*)((char*)(list_node) - offsetof(tbus_topic_state_t, node)))
+
+typedef struct
+{
+    const char* uds_path;
+    int listen_backlog;
+    /** Client slots allocated up front, more are malloc'd on demand */
+    size_t client_slab_size;
+    /** Also listen on uds_path TBUS_SEQPACKET_PATH_SUFFIX with SOCK_SEQPACKET */
+    bool seqpacket;
+    /** Also bind uds_path TBUS_DGRAM_PATH_SUFFIX with SOCK_DGRAM for small frames */
+    bool dgram;
+    /** Max credit window granted to flow controlled clients */
+    tbus_message_credit_t credit_window;
+    /** Topic patterns to journal */
+    const char* journal_patterns[MAX_JOURNAL_PATTERNS];
+    int journal_pattern_count;
+    const char* journal_dir;
+    journal_config_t journal;
+    /** Frames kept per topic for replay, 0 to disable */
+    size_t history_depth;
+    /** Assign per topic sequence numbers, implied by history */
+    bool sequence;
+    /** Topics tracked for sequence numbers and history, the least recently published is dropped beyond it */
+    size_t max_topic_states;
+    /** Brokers to bridge to */
+    const char* bridge_paths[MAX_BRIDGES];
+    int bridge_count;
+    /** Topic patterns forwarded in both directions over every bridge */
+    const char* bridge_patterns[MAX_BRIDGE_PATTERNS];
+    int bridge_pattern_count;
+    /** Pin to these CPUs if cpu_affinity */
+    bool cpu_affinity;
+    cpu_set_t cpus;
+    /** Run under SCHED_FIFO with this priority, 0 to keep the default scheduler */
+    int fifo_priority;
+    /** mlockall current and future pages */
+    bool lock_memory;
+    /** Heap bytes touched at startup and kept by malloc, 0 to disable. Frames above 64KB are not on the heap. */
+    size_t prefault_bytes;
+    /** Frame buffer mappings faulted in at startup and kept for good, 0 to disable */
+    size_t prefault_frame_count;
+    size_t prefault_frame_size;
+    /** Back large frame buffers with explicit huge pages */
+    bool huge_pages;
+    /** Take over from the broker listening here, then listen for the next one. NULL to disable. */
+    const char* upgrade_path;
+} tbus_broker_config_t;
+
 typedef struct
 {
     tev_handle_t tev;
+    tbus_broker_config_t config;
     int fd;
+    int seqpacket_fd;
+    int upgrade_fd;
+    /** One SOCK_DGRAM socket for all datagram clients, -1 without */
+    int dgram_fd;
+    message_reader_t* dgram_reader;
+    /** Map<datagram address, tbus_client_t&> */
+    map_handle_t dgram_clients;
     /** TopicTree<List<tbus_subscription_t&>*> */
     topic_tree_t* topics;
+    /** TopicTree<List<tbus_share_group_t>*> */
+    topic_tree_t* shared_topics;
+    /** Subscription topics, shared by all subscriptions to the same topic */
+    topic_intern_t* topic_names;
     /** List<tbus_client_t> */
     list_head_t clients;
+    /** Preallocated client slots, free ones are linked in free_clients by broker_node */
+    tbus_client_t* client_slab;
+    list_head_t free_clients;
     /** List<tbus_buffer_t> */
     list_head_t buffers;
+    /** Map<topic, tbus_topic_state_t*>, empty unless config.sequence */
+    map_handle_t topic_states;
+    /** The same states by topic, finds the topics of a wildcard replay */
+    topic_tree_t* topic_state_tree;
+    /** List<tbus_topic_state_t> */
+    list_head_t topic_state_lru;
+    size_t topic_state_count;
+    /** Map<tbus_message_correlation_id_t, tbus_request_t*> */
+    map_handle_t requests;
+    tbus_message_correlation_id_t next_request_id;
+    /** TopicTree<journal_t&>, NULL without journals */
+    topic_tree_t* journals;
+    journal_t* journal_list[MAX_JOURNAL_PATTERNS];
+    int journal_count;
+    tev_timeout_handle_t journal_trim_timer;
+    /** Pending while large frame buffers are kept with their pages */
+    tev_timeout_handle_t frame_trim_timer;
+    /** Stamped as the origin of local publishes, never 0 */
+    tbus_message_origin_t id;
+    tbus_bridge_t bridges[MAX_BRIDGES];
+    int bridge_count;
 } tbus_broker_t;
 
-static int broker_init(tev_handle_t tev, const char* uds_path);
+static int broker_init(tev_handle_t tev, const tbus_broker_config_t* config);
+static int realtime_setup(const tbus_broker_config_t* config);
+static int parse_cpu_list(const char* list, cpu_set_t* cpus);
 static void broker_deinit();
-static int uds_listen(const char* path);
+static void broker_exit();
+static int uds_listen(const char* path, int type);
+static int uds_connect(const char* path, int type);
 static void on_client_connect(void* ctx);
-static tbus_client_t* tbus_client_new(tev_handle_t tev, int fd);
+static tbus_client_t* tbus_client_new(tev_handle_t tev, int fd, bool seqpacket);
+static tbus_client_t* tbus_client_alloc();
+static void tbus_client_release(tbus_client_t* client);
 static void tbus_client_free(tbus_client_t* client);
 static void on_client_message(const tbus_message_t* msg, void* ctx);
 static void handle_subscription(const tbus_message_t* msg, tbus_client_t* client);
 static void handle_unsubscription(const tbus_message_t* msg, tbus_client_t* client);
-static void handle_publish(const tbus_message_t* msg, tbus_client_t* client);
+static void handle_publish(const tbus_message_t* msg, tbus_client_t* client, message_reader_t* reader);
+static void handle_credit(const tbus_message_t* msg, tbus_client_t* client);
+static void handle_request(const tbus_message_t* msg, tbus_client_t* client);
+static void handle_reply(const tbus_message_t* msg, tbus_client_t* client);
+static void handle_dgram(const tbus_message_t* msg, tbus_client_t* client);
+static int dgram_init();
+static void on_dgram_message(const tbus_message_t* msg, void* ctx);
+static void on_dgram_error(void* ctx);
+static void on_client_read(void* ctx);
+static bool client_stream_read_all(tbus_client_t* client);
+static int client_dgram_register(tbus_client_t* client, const void* addr, size_t addr_size);
+static void client_dgram_unregister(tbus_client_t* client);
+static void tbus_request_free(tbus_request_t* request);
+static void client_return_credit(tbus_client_t* client, size_t size);
+static int client_send_message(tbus_client_t* client, const tbus_message_t* msg);
+static int client_send_buffer(tbus_client_t* client, tbus_buffer_t* buffer, tbus_message_sub_index_t sub_index);
+static ssize_t client_send(tbus_client_t* client, const uint8_t* data, size_t len);
+static int client_queue_buffer(tbus_client_t* client, tbus_buffer_t* buffer, size_t bytes_written, tbus_message_sub_index_t sub_index);
+static void client_replay_history(tbus_client_t* client, tbus_subscription_t* sub, tbus_message_seq_t from_seq);
+static tbus_topic_state_t* topic_state_get(const char* topic);
+static void topic_state_push_history(tbus_topic_state_t* state, tbus_buffer_t* buffer);
+static void topic_state_free(tbus_topic_state_t* state);
+static void topic_state_free_with_ctx(void* data, void* ctx);
 static void publish_on_match(void* data, void* ctx);
+static void publish_on_match_shared(void* data, void* ctx);
+static int parse_shared_topic(const char* topic, const char** p_name, size_t* p_name_len, const char** p_filter);
+static int subscription_link(tbus_subscription_t* sub);
+static void subscription_unlink(tbus_subscription_t* sub);
+static tbus_buffer_ref_t* client_next_buffer_ref(tbus_client_t* client);
 static void on_client_write_ready(void* ctx);
 static void on_client_error(void* ctx);
 static tbus_subscription_t* tbus_subscription_new(const char* topic, tbus_message_sub_index_t* p_sub_index, tbus_client_t* client);
 static void tbus_subscription_free(tbus_subscription_t* sub);
+static int subscription_set_filters(tbus_subscription_t* sub, const tbus_message_t* msg);
+static bool subscription_accepts(const tbus_subscription_t* sub, const tbus_message_t* view);
+static void subscription_set_interval(tbus_subscription_t* sub, const tbus_message_t* msg);
+static void subscription_set_flags(tbus_subscription_t* sub, const tbus_message_t* msg);
+static bool subscription_hold_sample(tbus_subscription_t* sub, tbus_buffer_t* buffer);
+static void on_sample_timer(void* ctx);
+static uint64_t monotonic_ms();
+static tbus_share_group_t* tbus_share_group_new(const char* name, size_t name_len);
+static void tbus_share_group_free(tbus_share_group_t* group);
 static tbus_buffer_t* tbus_buffer_new(uint8_t* data, size_t size);
 static void tbus_buffer_free(tbus_buffer_t* buffer);
+static void tbus_buffer_release(tbus_buffer_t* buffer);
 static tbus_buffer_ref_t* tbus_buffer_ref_new(tbus_buffer_t* buffer);
 static void tbus_buffer_ref_free(tbus_buffer_ref_t* ref);
 static void free_list_head_with_ctx(void* data, void* ctx);
+static int journals_init(const tbus_broker_config_t* config);
+static void journals_recover();
+static void journal_recover_record(const uint8_t* data, size_t size, uint64_t timestamp_ms, void* ctx);
+static void journal_on_match(void* data, void* ctx);
+static void on_journal_trim_timer(void* ctx);
+static void on_frame_trim_timer(void* ctx);
+static void bridges_init(const tbus_broker_config_t* config);
+static void bridge_connect(tbus_bridge_t* bridge);
+static void bridge_schedule_retry(tbus_bridge_t* bridge);
+static void on_bridge_retry_timer(void* ctx);
+static bool bridge_pattern_match(const char* topic);
+static int handoff_receive(const char* path);
+static int handoff_restore(const handoff_header_t* header, uint8_t* data, int fd, tbus_client_t** p_client, tbus_topic_state_t** p_state);
+static void on_upgrade_connect(void* ctx);
+static int handoff_send_state(int conn);
+static int handoff_wait_commit(int conn);
+static bool handoff_peer_trusted(int conn);
+static void broker_abandon_clients();
+static int handoff_send_client(int conn, tbus_client_t* client);
+static int handoff_send_pending(int conn, tbus_buffer_ref_t* ref);
+static int handoff_send_topic(int conn, tbus_topic_state_t* state);
+static int handoff_send(int conn, uint32_t type, uint32_t flags, uint64_t value0, uint64_t value1, const void* data, size_t size, int fd);
+static int handoff_recv(int conn, handoff_header_t* header, uint8_t** p_data, int* p_fd);
 
 #ifdef USE_SIGNAL
 #include <sys/eventfd.h>
@@ -120,14 +457,149 @@ int main(int argc, char const *argv[])
 {
     int rc = 0;
     /** parse args */
-    char* uds_path = TBUS_DEFAULT_UDS_PATH;
+    tbus_broker_config_t config = {
+        .uds_path = TBUS_DEFAULT_UDS_PATH,
+        .listen_backlog = DEFAULT_LISTEN_BACKLOG,
+        .client_slab_size = DEFAULT_CLIENT_SLAB_SIZE,
+        .credit_window = DEFAULT_CREDIT_WINDOW,
+        .journal_dir = DEFAULT_JOURNAL_DIR,
+        .max_topic_states = DEFAULT_MAX_TOPIC_STATES,
+        .journal = {
+            .segment_size = DEFAULT_JOURNAL_SEGMENT_SIZE
+        }
+    };
     int opt;
-    while((opt = getopt(argc, (char**)argv, "p:v")) != -1)
+    while((opt = getopt(argc, (char**)argv, "p:sdL:C:c:j:J:S:B:T:H:QK:b:f:a:r:lP:W:GU:v")) != -1)
     {
         switch(opt)
         {
             case 'p':
-                uds_path = optarg;
+                config.uds_path = optarg;
+                break;
+            case 's':
+                config.seqpacket = true;
+                break;
+            case 'd':
+                config.dgram = true;
+                break;
+            case 'L':
+                config.listen_backlog = strtol(optarg, NULL, 0);
+                if(config.listen_backlog <= 0)
+                {
+                    fprintf(stderr, "Invalid listen backlog: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'C':
+                config.client_slab_size = strtoull(optarg, NULL, 0);
+                break;
+            case 'c':
+                config.credit_window = strtoul(optarg, NULL, 0);
+                if(config.credit_window == 0)
+                {
+                    fprintf(stderr, "Invalid credit window: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'j':
+                if(config.journal_pattern_count == MAX_JOURNAL_PATTERNS)
+                {
+                    fprintf(stderr, "Too many journal patterns\n");
+                    exit(EXIT_FAILURE);
+                }
+                config.journal_patterns[config.journal_pattern_count++] = optarg;
+                break;
+            case 'J':
+                config.journal_dir = optarg;
+                break;
+            case 'S':
+                config.journal.segment_size = strtoull(optarg, NULL, 0);
+                if(config.journal.segment_size == 0)
+                {
+                    fprintf(stderr, "Invalid journal segment size: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'B':
+                config.journal.max_bytes = strtoull(optarg, NULL, 0);
+                break;
+            case 'T':
+                config.journal.max_age_s = strtoul(optarg, NULL, 0);
+                break;
+            case 'H':
+                config.history_depth = strtoull(optarg, NULL, 0);
+                break;
+            case 'Q':
+                config.sequence = true;
+                break;
+            case 'K':
+                config.max_topic_states = strtoull(optarg, NULL, 0);
+                if(config.max_topic_states == 0)
+                {
+                    fprintf(stderr, "Invalid topic state limit: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                if(config.bridge_count == MAX_BRIDGES)
+                {
+                    fprintf(stderr, "Too many bridges\n");
+                    exit(EXIT_FAILURE);
+                }
+                config.bridge_paths[config.bridge_count++] = optarg;
+                break;
+            case 'f':
+                if(config.bridge_pattern_count == MAX_BRIDGE_PATTERNS)
+                {
+                    fprintf(stderr, "Too many bridge patterns\n");
+                    exit(EXIT_FAILURE);
+                }
+                config.bridge_patterns[config.bridge_pattern_count++] = optarg;
+                break;
+            case 'a':
+                if(parse_cpu_list(optarg, &config.cpus) != 0)
+                {
+                    fprintf(stderr, "Invalid cpu list: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                config.cpu_affinity = true;
+                break;
+            case 'r':
+                config.fifo_priority = strtol(optarg, NULL, 0);
+                if(config.fifo_priority < sched_get_priority_min(SCHED_FIFO)
+                    || config.fifo_priority > sched_get_priority_max(SCHED_FIFO))
+                {
+                    fprintf(stderr, "Invalid SCHED_FIFO priority: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                config.lock_memory = true;
+                break;
+            case 'P':
+                config.prefault_bytes = strtoull(optarg, NULL, 0);
+                break;
+            case 'W':
+            {
+                /** <count>:<bytes> */
+                char* end = NULL;
+                config.prefault_frame_count = strtoul(optarg, &end, 10);
+                if(*end == ':')
+                    config.prefault_frame_size = strtoull(end + 1, NULL, 0);
+                if(*end != ':' || config.prefault_frame_count > FRAME_BUFFER_CACHE_SIZE
+                    || (config.prefault_frame_count > 0 && config.prefault_frame_size <= FRAME_BUFFER_MAP_THRESHOLD))
+                {
+                    fprintf(stderr, "Invalid frame buffers to prefault, at most %d of more than %d bytes: %s\n",
+                        FRAME_BUFFER_CACHE_SIZE, FRAME_BUFFER_MAP_THRESHOLD, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'G':
+                config.huge_pages = true;
+                break;
+            case 'U':
+                config.upgrade_path = optarg;
                 break;
             case 'v':
                 printf("Tbus broker version: %s\n", TBUS_VERSION);
@@ -137,7 +609,17 @@ int main(int argc, char const *argv[])
                 break;
         }
     }
-    if(!uds_path)
+    if(!config.uds_path)
+        exit(EXIT_FAILURE);
+    /** Replay needs the sequence numbers */
+    if(config.history_depth > 0)
+        config.sequence = true;
+    if(config.bridge_count > 0 && config.bridge_pattern_count == 0)
+    {
+        fprintf(stderr, "Bridges need at least one pattern (-f)\n");
+        exit(EXIT_FAILURE);
+    }
+    if(realtime_setup(&config) != 0)
         exit(EXIT_FAILURE);
     /** init */
     tev_handle_t tev = tev_create_ctx();
@@ -162,7 +644,7 @@ int main(int argc, char const *argv[])
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 #endif
-    rc = broker_init(tev, uds_path);
+    rc = broker_init(tev, &config);
     if(rc != 0)
     {
         fprintf(stderr, "Failed to init broker\n");
@@ -197,50 +679,223 @@ static void signal_event_fd_read_handler(void* ctx)
     eventfd_t value = 0;
     if(eventfd_read(signal_event_fd, &value) == -1)
         return;
-    tev_handle_t tev = broker->tev;
-    broker_deinit();
-    tev_set_read_handler(tev, signal_event_fd, NULL, NULL);
-    close(signal_event_fd);
-    signal_event_fd = -1;
+    broker_exit();
 }
 #endif
 
-static int broker_init(tev_handle_t tev, const char* uds_path)
+static int broker_init(tev_handle_t tev, const tbus_broker_config_t* config)
 {
     if(broker)
         return -1;
-    if(!uds_path || !tev)
+    if(!config || !config->uds_path || !tev)
         goto error;
     broker = malloc(sizeof(tbus_broker_t));
     if(!broker)
         goto error;
     bzero(broker, sizeof(tbus_broker_t));
+    broker->fd = -1;
+    broker->seqpacket_fd = -1;
+    broker->upgrade_fd = -1;
+    broker->dgram_fd = -1;
     broker->tev = tev;
+    broker->config = *config;
     LIST_INIT(&broker->clients);
+    LIST_INIT(&broker->free_clients);
     LIST_INIT(&broker->buffers);
+    if(config->client_slab_size > 0)
+    {
+        broker->client_slab = malloc(config->client_slab_size * sizeof(tbus_client_t));
+        if(!broker->client_slab)
+            goto error;
+        for(size_t i = 0; i < config->client_slab_size; i++)
+            LIST_LINK(&broker->free_clients, &broker->client_slab[i].broker_node);
+    }
     broker->topics = topic_tree_new();
     if(!broker->topics)
         goto error;
-    broker->fd = uds_listen(uds_path);
+    broker->shared_topics = topic_tree_new();
+    if(!broker->shared_topics)
+        goto error;
+    broker->topic_names = topic_intern_new();
+    if(!broker->topic_names)
+        goto error;
+    broker->topic_states = map_create();
+    if(!broker->topic_states)
+        goto error;
+    broker->topic_state_tree = topic_tree_new();
+    if(!broker->topic_state_tree)
+        goto error;
+    LIST_INIT(&broker->topic_state_lru);
+    broker->requests = map_create();
+    if(!broker->requests)
+        goto error;
+    broker->dgram_clients = map_create();
+    if(!broker->dgram_clients)
+        goto error;
+    /** The old broker closes its journals before the handoff completes */
+    if(config->upgrade_path && handoff_receive(config->upgrade_path) != 0)
+        goto error;
+    if(journals_init(config) != 0)
+        goto error;
+    /** A broker taken over from has the topic state already */
     if(broker->fd < 0)
+        journals_recover();
+    /** Listening sockets taken over are kept as they are */
+    if(broker->fd < 0)
+        broker->fd = uds_listen(config->uds_path, SOCK_STREAM);
+    if(broker->fd < 0)
+        goto error;
+    if(tev_set_read_handler(broker->tev, broker->fd, on_client_connect, &broker->fd) < 0)
+        goto error;
+    if(config->seqpacket && broker->seqpacket_fd < 0)
+    {
+        char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+        int len = snprintf(path, sizeof(path), "%s" TBUS_SEQPACKET_PATH_SUFFIX, config->uds_path);
+        if(len < 0 || len >= sizeof(path))
+            goto error;
+        broker->seqpacket_fd = uds_listen(path, SOCK_SEQPACKET);
+        if(broker->seqpacket_fd < 0)
+            goto error;
+    }
+    if(broker->seqpacket_fd >= 0 && tev_set_read_handler(broker->tev, broker->seqpacket_fd, on_client_connect, &broker->seqpacket_fd) < 0)
         goto error;
-    if(tev_set_read_handler(broker->tev, broker->fd, on_client_connect, NULL) < 0)
+    if(config->dgram && broker->dgram_fd < 0)
+    {
+        char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+        int len = snprintf(path, sizeof(path), "%s" TBUS_DGRAM_PATH_SUFFIX, config->uds_path);
+        if(len < 0 || len >= sizeof(path))
+            goto error;
+        broker->dgram_fd = uds_listen(path, SOCK_DGRAM);
+        if(broker->dgram_fd < 0)
+            goto error;
+    }
+    if(broker->dgram_fd >= 0 && dgram_init() != 0)
         goto error;
+    if(config->upgrade_path)
+    {
+        broker->upgrade_fd = uds_listen(config->upgrade_path, SOCK_SEQPACKET);
+        if(broker->upgrade_fd < 0)
+            goto error;
+        if(tev_set_read_handler(broker->tev, broker->upgrade_fd, on_upgrade_connect, NULL) < 0)
+            goto error;
+    }
+    bridges_init(config);
     return 0;
 error:
     broker_deinit();
     return -1;
 }
 
+/** Keep page faults and preemption off the message path */
+static int realtime_setup(const tbus_broker_config_t* config)
+{
+    if(config->cpu_affinity && sched_setaffinity(0, sizeof(config->cpus), &config->cpus) != 0)
+    {
+        fprintf(stderr, "Failed to set cpu affinity: %s\n", strerror(errno));
+        return -1;
+    }
+    if(config->fifo_priority > 0)
+    {
+        struct sched_param param = { .sched_priority = config->fifo_priority };
+        if(sched_setscheduler(0, SCHED_FIFO, &param) != 0)
+        {
+            fprintf(stderr, "Failed to set SCHED_FIFO: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    if(config->lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        fprintf(stderr, "Failed to lock memory: %s\n", strerror(errno));
+        return -1;
+    }
+    frame_buffer_set_huge_pages(config->huge_pages);
+    if(config->prefault_bytes > 0)
+    {
+        /** Frame buffers up to FRAME_BUFFER_MAP_THRESHOLD are malloc'd, keep them all in the prefaulted heap */
+        mallopt(M_TRIM_THRESHOLD, -1);
+        mallopt(M_MMAP_MAX, 0);
+        uint8_t* pool = malloc(config->prefault_bytes);
+        if(!pool)
+        {
+            fprintf(stderr, "Failed to prefault %zu bytes\n", config->prefault_bytes);
+            return -1;
+        }
+        long page_size = sysconf(_SC_PAGESIZE);
+        for(size_t i = 0; i < config->prefault_bytes; i += page_size)
+            ((volatile uint8_t*)pool)[i] = 0;
+        /** Stays in the heap since trimming is off */
+        free(pool);
+    }
+    /** Kept by this thread, which runs the loop, large frames are read into them */
+    if(config->prefault_frame_count > 0 && frame_buffer_prefault(config->prefault_frame_count, config->prefault_frame_size) != 0)
+    {
+        fprintf(stderr, "Failed to prefault %zu frame buffers of %zu bytes\n", config->prefault_frame_count, config->prefault_frame_size);
+        return -1;
+    }
+    return 0;
+}
+
+/** Parse a list like 0,2-3 */
+static int parse_cpu_list(const char* list, cpu_set_t* cpus)
+{
+    CPU_ZERO(cpus);
+    const char* c = list;
+    while(*c != '\0')
+    {
+        char* end = NULL;
+        unsigned long first = strtoul(c, &end, 10);
+        if(end == c)
+            return -1;
+        unsigned long last = first;
+        c = end;
+        if(*c == '-')
+        {
+            c++;
+            last = strtoul(c, &end, 10);
+            if(end == c || last < first)
+                return -1;
+            c = end;
+        }
+        if(last >= CPU_SETSIZE)
+            return -1;
+        for(unsigned long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, cpus);
+        if(*c == ',')
+            c++;
+        else if(*c != '\0')
+            return -1;
+    }
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
 static void broker_deinit()
 {
     if(!broker)
         return;
+    for(int i = 0; i < broker->bridge_count; i++)
+    {
+        tbus_bridge_t* bridge = &broker->bridges[i];
+        if(bridge->retry_timer)
+            tev_clear_timeout(broker->tev, bridge->retry_timer);
+        /** Do not reconnect while freeing the clients */
+        if(bridge->client)
+            bridge->client->bridge = NULL;
+    }
     LIST_FOR_EACH_SAFE(&broker->clients, node)
     {
         tbus_client_t* client = GET_CLIENT_FROM_BROKER_NODE(node);
         tbus_client_free(client);
     }
+    /** Emptied by freeing the clients */
+    if(broker->dgram_clients)
+        map_delete(broker->dgram_clients, NULL, NULL);
+    if(broker->topic_state_tree)
+        broker->topic_state_tree->free(broker->topic_state_tree, NULL, NULL);
+    if(broker->topic_states)
+        map_delete(broker->topic_states, topic_state_free_with_ctx, NULL);
+    /** Requests are owned by their clients */
+    if(broker->requests)
+        map_delete(broker->requests, NULL, NULL);
     LIST_FOR_EACH_SAFE(&broker->buffers, node)
     {
         tbus_buffer_t* buffer = GET_BUFFER_FROM_NODE(node);
@@ -251,13 +906,58 @@ static void broker_deinit()
         tev_set_read_handler(broker->tev, broker->fd, NULL, NULL);
         close(broker->fd);
     }
+    if(broker->seqpacket_fd >= 0)
+    {
+        tev_set_read_handler(broker->tev, broker->seqpacket_fd, NULL, NULL);
+        close(broker->seqpacket_fd);
+    }
+    if(broker->upgrade_fd >= 0)
+    {
+        tev_set_read_handler(broker->tev, broker->upgrade_fd, NULL, NULL);
+        close(broker->upgrade_fd);
+    }
+    if(broker->dgram_reader)
+        broker->dgram_reader->close(broker->dgram_reader);
+    if(broker->dgram_fd >= 0)
+        close(broker->dgram_fd);
     if(broker->topics)
         broker->topics->free(broker->topics, free_list_head_with_ctx, NULL);
+    /** Groups are freed with their last member */
+    if(broker->shared_topics)
+        broker->shared_topics->free(broker->shared_topics, free_list_head_with_ctx, NULL);
+    /** Emptied by freeing the clients */
+    if(broker->topic_names)
+        broker->topic_names->free(broker->topic_names);
+    if(broker->journal_trim_timer)
+        tev_clear_timeout(broker->tev, broker->journal_trim_timer);
+    if(broker->frame_trim_timer)
+        tev_clear_timeout(broker->tev, broker->frame_trim_timer);
+    if(broker->journals)
+        broker->journals->free(broker->journals, NULL, NULL);
+    for(int i = 0; i < broker->journal_count; i++)
+        broker->journal_list[i]->close(broker->journal_list[i]);
+    free(broker->client_slab);
     free(broker);
     broker = NULL;
 }
 
-static int uds_listen(const char* path)
+/** Stop serving, the event loop ends once nothing is left */
+static void broker_exit()
+{
+    if(!broker)
+        return;
+#ifdef USE_SIGNAL
+    if(signal_event_fd >= 0)
+    {
+        tev_set_read_handler(broker->tev, signal_event_fd, NULL, NULL);
+        close(signal_event_fd);
+        signal_event_fd = -1;
+    }
+#endif
+    broker_deinit();
+}
+
+static int uds_listen(const char* path, int type)
 {
     struct sockaddr_un addr;
     memset(&addr, 0, sizeof(addr));
@@ -266,7 +966,7 @@ static int uds_listen(const char* path)
     socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(addr.sun_path) + 1;
     if(path[0] == '@')
         addr.sun_path[0] = 0;
-    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int fd = socket(AF_UNIX, type | SOCK_NONBLOCK, 0);
     if(fd < 0)
         return -1;
     if(bind(fd, (struct sockaddr*)&addr, addr_len) != 0)
@@ -274,7 +974,8 @@ static int uds_listen(const char* path)
         close(fd);
         return -1;
     }
-    if(listen(fd, LISTEN_BACKLOG) != 0)
+    /** Datagram sockets are only bound */
+    if(type != SOCK_DGRAM && listen(fd, broker->config.listen_backlog) != 0)
     {
         close(fd);
         return -1;
@@ -282,46 +983,77 @@ static int uds_listen(const char* path)
     return fd;
 }
 
-static void on_client_connect(void* ctx)
+static int uds_connect(const char* path, int type)
 {
-    int fd = -1;
-    tbus_client_t* client = NULL;
-
     struct sockaddr_un addr;
-    socklen_t addr_len = sizeof(addr);
-    fd = accept(broker->fd, (struct sockaddr*)&addr, &addr_len);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path) - 1)
+        return -1;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(addr.sun_path) + 1;
+    if(path[0] == '@')
+        addr.sun_path[0] = 0;
+    int fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if(fd < 0)
-        goto error;
-    client = tbus_client_new(broker->tev, fd);
-    if(!client)
-        goto error;
-    LIST_LINK(&broker->clients, &client->broker_node);
-    return;
-error:
-    if(client)
-        tbus_client_free(client);
-    if(fd >= 0)
+        return -1;
+    if(connect(fd, (struct sockaddr*)&addr, addr_len) != 0)
+    {
         close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void on_client_connect(void* ctx)
+{
+    int listen_fd = *(int*)ctx;
+    bool seqpacket = listen_fd == broker->seqpacket_fd;
+    /** Drain the backlog, reconnecting clients come in bursts */
+    for(;;)
+    {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            /** Drained, or out of fds and retried on the next readiness */
+            return;
+        }
+        tbus_client_t* client = tbus_client_new(broker->tev, fd, seqpacket);
+        if(!client)
+        {
+            close(fd);
+            continue;
+        }
+        LIST_LINK(&broker->clients, &client->broker_node);
+    }
 }
 
-static tbus_client_t* tbus_client_new(tev_handle_t tev, int fd)
+static tbus_client_t* tbus_client_new(tev_handle_t tev, int fd, bool seqpacket)
 {
-    tbus_client_t* client = malloc(sizeof(tbus_client_t));
+    tbus_client_t* client = tbus_client_alloc();
     if(!client)
         goto error;
     bzero(client, sizeof(tbus_client_t));
-    client->subscriptions = map_create();
-    if(!client->subscriptions)
-        goto error;
-    LIST_INIT(&client->buffers);
-    client->fd = fd;
+    /** Not in any list yet, safe to unlink */
+    LIST_INIT(&client->broker_node);
+    client->fd = -1;
+    for(int i = 0; i < TBUS_MSG_PRIORITY_LEVELS; i++)
+        LIST_INIT(&client->buffers[i]);
+    LIST_INIT(&client->requests);
+    client->seqpacket = seqpacket;
     client->reader = message_reader_new(tev, fd);
     if(!client->reader)
         goto error;
+    /** Owned by the caller until now */
+    client->fd = fd;
     client->reader->callbacks.on_message = on_client_message;
     client->reader->callbacks.on_message_ctx = client;
     client->reader->callbacks.on_error = on_client_error;
     client->reader->callbacks.on_error_ctx = client;
+    client->reader->callbacks.on_read = on_client_read;
+    client->reader->callbacks.on_read_ctx = client;
     return client;
 error:
     if(client)
@@ -333,8 +1065,17 @@ static void tbus_client_free(tbus_client_t* client)
 {
     if(!client)
         return;
+    if(client->bridge)
+    {
+        client->bridge->client = NULL;
+        bridge_schedule_retry(client->bridge);
+    }
     if(client->reader)
         client->reader->close(client->reader);
+    client_dgram_unregister(client);
+    /** Pending writes leave a write handler behind */
+    if(client->queue_depth > 0 && client->fd >= 0)
+        tev_set_write_handler(broker->tev, client->fd, NULL, NULL);
     if(client->fd >= 0)
         close(client->fd);
     if(client->subscriptions)
@@ -343,29 +1084,56 @@ static void tbus_client_free(tbus_client_t* client)
         map_forEach(client->subscriptions, entry)
         {
             tbus_subscription_t* sub = entry.value;
-            list_head_t* topic_tree_entry_data = sub->topic_tree_node.next;
-            LIST_UNLINK(&sub->topic_tree_node);
-            if(LIST_IS_EMPTY(topic_tree_entry_data))
-            {
-                broker->topics->remove(broker->topics, sub->topic);
-                free(topic_tree_entry_data);
-            }
+            subscription_unlink(sub);
             tbus_subscription_free(sub);
         }
         map_delete(client->subscriptions, NULL, NULL);
     }
-    LIST_FOR_EACH_SAFE(&client->buffers, node)
+    LIST_FOR_EACH_SAFE(&client->requests, node)
+    {
+        tbus_request_t* request = GET_REQUEST_FROM_CLIENT_NODE(node);
+        tbus_request_free(request);
+    }
+    if(client->flow_control)
+    {
+        /** Pending buffers may outlive their publisher */
+        LIST_FOR_EACH(&broker->buffers, node)
+        {
+            tbus_buffer_t* buffer = GET_BUFFER_FROM_NODE(node);
+            if(buffer->publisher == client)
+                buffer->publisher = NULL;
+        }
+    }
+    for(int i = 0; i < TBUS_MSG_PRIORITY_LEVELS; i++)
     {
-        tbus_buffer_ref_t* ref = GET_BUFFER_REF_FROM_NODE(node);
-        ref->buffer->ref_count --;
-        if(ref->buffer->ref_count == 0)
+        LIST_FOR_EACH_SAFE(&client->buffers[i], node)
         {
-            LIST_UNLINK(&ref->buffer->node);
-            tbus_buffer_free(ref->buffer);
+            tbus_buffer_ref_t* ref = GET_BUFFER_REF_FROM_NODE(node);
+            tbus_buffer_release(ref->buffer);
+            tbus_buffer_ref_free(ref);
         }
-        tbus_buffer_ref_free(ref);
     }
-    free(client);
+    tbus_client_release(client);
+}
+
+static tbus_client_t* tbus_client_alloc()
+{
+    if(LIST_IS_EMPTY(&broker->free_clients))
+        return malloc(sizeof(tbus_client_t));
+    list_head_t* node = broker->free_clients.next;
+    LIST_UNLINK(node);
+    return GET_CLIENT_FROM_BROKER_NODE(node);
+}
+
+/** Unlinks client from whichever list holds it, broker->clients or the error clients of a publish */
+static void tbus_client_release(tbus_client_t* client)
+{
+    LIST_UNLINK(&client->broker_node);
+    tbus_client_t* slab_end = broker->client_slab + broker->config.client_slab_size;
+    if(broker->client_slab && client >= broker->client_slab && client < slab_end)
+        LIST_LINK(&broker->free_clients, &client->broker_node);
+    else
+        free(client);
 }
 
 static void on_client_message(const tbus_message_t* msg, void* ctx)
@@ -373,6 +1141,9 @@ static void on_client_message(const tbus_message_t* msg, void* ctx)
     tbus_client_t* client = (tbus_client_t*)ctx;
     if(!msg || !client)
         return;
+    /** The remote broker only sends us messages of the bridge subscriptions */
+    if(client->bridge && msg->command != TBUS_MSG_CMD_PUB)
+        return;
     switch(msg->command)
     {
         case TBUS_MSG_CMD_SUB:
@@ -382,7 +1153,19 @@ static void on_client_message(const tbus_message_t* msg, void* ctx)
             handle_unsubscription(msg, client);
             break;
         case TBUS_MSG_CMD_PUB:
-            handle_publish(msg, client);
+            handle_publish(msg, client, client->reader);
+            break;
+        case TBUS_MSG_CMD_CREDIT:
+            handle_credit(msg, client);
+            break;
+        case TBUS_MSG_CMD_REQ:
+            handle_request(msg, client);
+            break;
+        case TBUS_MSG_CMD_REPLY:
+            handle_reply(msg, client);
+            break;
+        case TBUS_MSG_CMD_DGRAM:
+            handle_dgram(msg, client);
             break;
         default:
             break;
@@ -394,289 +1177,2046 @@ static void handle_subscription(const tbus_message_t* msg, tbus_client_t* client
     /** check parameters */
     if(!msg->topic || !msg->p_sub_index)
         return;
-    tbus_subscription_t* sub = map_get(client->subscriptions, msg->topic, strlen(msg->topic));
+    /** Created on the first subscription, publishers never need it */
+    if(!client->subscriptions)
+    {
+        client->subscriptions = map_create();
+        if(!client->subscriptions)
+            return;
+    }
+    /** Keyed by the interned topic, a topic nobody subscribes to yet is not subscribed by client either */
+    const char* topic = broker->topic_names->find(broker->topic_names, msg->topic);
+    tbus_subscription_t* sub = topic ? map_get(client->subscriptions, &topic, sizeof(topic)) : NULL;
     if(sub)
     {
-        /** update sub index for existing subscription */
+        /** update sub index and filters for existing subscription */
         READ_SUB_INDEX(msg, sub->sub_index);
-        return;
+        if(subscription_set_filters(sub, msg) != 0)
+            return;
+        subscription_set_interval(sub, msg);
+        subscription_set_flags(sub, msg);
+        goto replay;
     }
     sub = tbus_subscription_new(msg->topic, msg->p_sub_index, client);
     if(!sub)
         return;
-    if(!map_add(client->subscriptions, sub->topic, strlen(sub->topic), sub))
+    if(subscription_set_filters(sub, msg) != 0)
     {
         tbus_subscription_free(sub);
         return;
     }
-    list_head_t* topic_tree_entry = broker->topics->get(broker->topics, sub->topic);
-    if(!topic_tree_entry)
+    subscription_set_interval(sub, msg);
+    subscription_set_flags(sub, msg);
+    if(!map_add(client->subscriptions, &sub->topic, sizeof(sub->topic), sub))
     {
-        topic_tree_entry = malloc(sizeof(list_head_t));
-        if(!topic_tree_entry)
-        {
-            map_remove(client->subscriptions, sub->topic, strlen(sub->topic));
-            tbus_subscription_free(sub);
-            return;
-        }
-        LIST_INIT(topic_tree_entry);
-        if(!broker->topics->insert(broker->topics, sub->topic, topic_tree_entry))
-        {
-            free(topic_tree_entry);
-            map_remove(client->subscriptions, sub->topic, strlen(sub->topic));
-            tbus_subscription_free(sub);
-            return;
-        }
+        tbus_subscription_free(sub);
+        return;
+    }
+    if(subscription_link(sub) != 0)
+    {
+        map_remove(client->subscriptions, &sub->topic, sizeof(sub->topic));
+        tbus_subscription_free(sub);
+        return;
+    }
+replay:
+    if(msg->p_seq)
+    {
+        tbus_message_seq_t from_seq = 0;
+        READ_FIELD(msg->p_seq, from_seq);
+        client_replay_history(client, sub, from_seq);
     }
-    LIST_LINK(topic_tree_entry, &sub->topic_tree_node);
 }
 
 static void handle_unsubscription(const tbus_message_t* msg, tbus_client_t* client)
 {
     /** check parameters */
-    if(!msg->topic)
+    if(!msg->topic || !client->subscriptions)
         return;
-    tbus_subscription_t* sub = map_remove(client->subscriptions, msg->topic, strlen(msg->topic));
+    const char* topic = broker->topic_names->find(broker->topic_names, msg->topic);
+    if(!topic)
+        return;
+    tbus_subscription_t* sub = map_remove(client->subscriptions, &topic, sizeof(topic));
     if(!sub)
         return;
-    list_head_t* topic_tree_entry = sub->topic_tree_node.next;
-    LIST_UNLINK(&sub->topic_tree_node);
-    if(LIST_IS_EMPTY(topic_tree_entry))
-    {
-        broker->topics->remove(broker->topics, sub->topic);
-        free(topic_tree_entry);
-    }
+    subscription_unlink(sub);
     tbus_subscription_free(sub);
 }
 
-typedef struct
-{
-    tbus_buffer_t* buffer;
-    tbus_message_t* view;
-    list_head_t error_clients;
-} publish_on_match_ctx_t;
-
-static void handle_publish(const tbus_message_t* msg, tbus_client_t* client)
+/**
+ * @return 1 for $share/<name>/<filter>, 0 for a plain topic, -1 for a malformed shared topic
+ */
+static int parse_shared_topic(const char* topic, const char** p_name, size_t* p_name_len, const char** p_filter)
 {
-    /** Check parameters. */
-    if(!msg->topic || !msg->p_sub_index || !msg->data || msg->data_len == 0)
-        return;
-    size_t raw_buffer_size = 0;
-    uint8_t* raw_buffer = client->reader->get_buffer(client->reader, &raw_buffer_size);
-    tbus_buffer_t* buffer = tbus_buffer_new(raw_buffer, raw_buffer_size);
-    if(!buffer)
-        return;
-    publish_on_match_ctx_t ctx = {
-        .buffer = buffer,
-        .view = (tbus_message_t*)msg
-    };
-    LIST_INIT(&ctx.error_clients);
-    broker->topics->match(broker->topics, msg->topic, publish_on_match, &ctx);
-    if(ctx.buffer->ref_count == 0)
-    {
-        /** All first transmission finished */
-        /** Unref data */
-        ctx.buffer->data = NULL;
-        tbus_buffer_free(ctx.buffer);
-        return;
-    }
-    /** Acquire the buffer and store in buffers */
-    uint8_t* take_over_buffer = client->reader->take_over_buffer(client->reader, NULL);
-    /** Critical */
-    if(!take_over_buffer)
-    {
-        fprintf(stderr, "Critical error: Failed to take over buffer\n");
-        exit(EXIT_FAILURE);
-    }
-    LIST_LINK(&broker->buffers, &ctx.buffer->node);
-    /** Close error clients. Do it here to avoid client being one of them. */
-    LIST_FOR_EACH_SAFE(&ctx.error_clients, node)
+    size_t prefix_len = strlen(TBUS_SHARED_SUBSCRIPTION_PREFIX);
+    if(strncmp(topic, TBUS_SHARED_SUBSCRIPTION_PREFIX, prefix_len) != 0)
+        return 0;
+    const char* name = topic + prefix_len;
+    const char* end = strchr(name, '/');
+    if(!end || end == name || end[1] == '\0')
+        return -1;
+    for(const char* c = name; c < end; c++)
     {
-        tbus_client_t* error_client = GET_CLIENT_FROM_BROKER_NODE(node);
-        tbus_client_free(error_client);
+        if(*c == '+' || *c == '#')
+            return -1;
     }
+    *p_name = name;
+    *p_name_len = end - name;
+    *p_filter = end + 1;
+    return 1;
 }
 
+static int subscription_link(tbus_subscription_t* sub)
+{
+    const char* name = NULL;
+    size_t name_len = 0;
+    const char* filter = NULL;
+    int shared = parse_shared_topic(sub->topic, &name, &name_len, &filter);
+    if(shared < 0)
+        return -1;
+    topic_tree_t* tree = shared ? broker->shared_topics : broker->topics;
+    sub->filter = shared ? filter : sub->topic;
+    list_head_t* topic_tree_entry = tree->get(tree, sub->filter);
+    if(!topic_tree_entry)
+    {
+        topic_tree_entry = malloc(sizeof(list_head_t));
+        if(!topic_tree_entry)
+            return -1;
+        LIST_INIT(topic_tree_entry);
+        if(!tree->insert(tree, sub->filter, topic_tree_entry))
+        {
+            free(topic_tree_entry);
+            return -1;
+        }
+    }
+    if(!shared)
+    {
+        LIST_LINK(topic_tree_entry, &sub->topic_tree_node);
+        return 0;
+    }
+    tbus_share_group_t* group = NULL;
+    LIST_FOR_EACH(topic_tree_entry, node)
+    {
+        tbus_share_group_t* candidate = GET_SHARE_GROUP_FROM_TOPIC_TREE_NODE(node);
+        if(strlen(candidate->name) == name_len && strncmp(candidate->name, name, name_len) == 0)
+        {
+            group = candidate;
+            break;
+        }
+    }
+    if(!group)
+    {
+        group = tbus_share_group_new(name, name_len);
+        if(!group)
+        {
+            if(LIST_IS_EMPTY(topic_tree_entry))
+            {
+                tree->remove(tree, sub->filter);
+                free(topic_tree_entry);
+            }
+            return -1;
+        }
+        LIST_LINK(topic_tree_entry, &group->topic_tree_node);
+    }
+    LIST_LINK(&group->members, &sub->topic_tree_node);
+    sub->group = group;
+    return 0;
+}
+
+static void subscription_unlink(tbus_subscription_t* sub)
+{
+    topic_tree_t* tree = broker->topics;
+    list_head_t* node = &sub->topic_tree_node;
+    if(sub->group)
+    {
+        LIST_UNLINK(&sub->topic_tree_node);
+        if(!LIST_IS_EMPTY(&sub->group->members))
+            return;
+        /** Last member, the group goes as well */
+        tree = broker->shared_topics;
+        node = &sub->group->topic_tree_node;
+    }
+    list_head_t* topic_tree_entry = node->next;
+    LIST_UNLINK(node);
+    if(LIST_IS_EMPTY(topic_tree_entry))
+    {
+        tree->remove(tree, sub->filter);
+        free(topic_tree_entry);
+    }
+    if(sub->group)
+    {
+        tbus_share_group_free(sub->group);
+        sub->group = NULL;
+    }
+}
+
+typedef struct
+{
+    tbus_client_t* client;
+    tbus_message_sub_index_t sub_index;
+} publish_dgram_t;
+
+typedef struct
+{
+    tbus_buffer_t* buffer;
+    tbus_message_t* view;
+    /** The client the message came from */
+    tbus_client_t* source;
+    list_head_t error_clients;
+    int match_count;
+    /** REQ only: the serving subscription picked so far */
+    tbus_subscription_t* server;
+    /** Datagram deliveries, sent together in one sendmmsg */
+    publish_dgram_t dgrams[DGRAM_BATCH];
+    int dgram_count;
+} publish_on_match_ctx_t;
+
+static void publish_match(publish_on_match_ctx_t* ctx, const char* topic);
 static void publish_on_match_handle_subscription(tbus_subscription_t* sub, publish_on_match_ctx_t* publish_ctx);
+static bool publish_is_error_client(publish_on_match_ctx_t* publish_ctx, tbus_client_t* client);
+static void request_consider_server(publish_on_match_ctx_t* publish_ctx, tbus_subscription_t* sub);
+static void publish_send(publish_on_match_ctx_t* publish_ctx, tbus_client_t* client, tbus_message_sub_index_t sub_index);
+static void publish_flush_dgrams(publish_on_match_ctx_t* publish_ctx);
+
+static void publish_finish(publish_on_match_ctx_t* ctx, message_reader_t* reader);
+static void buffer_finish(tbus_buffer_t* buffer, message_reader_t* reader);
+
+/** reader delivered msg, the buffer is taken over from it if still needed */
+static void handle_publish(const tbus_message_t* msg, tbus_client_t* client, message_reader_t* reader)
+{
+    /** Check parameters. */
+    if(!msg->topic || !msg->p_sub_index || !msg->data || msg->data_len == 0)
+        return;
+    if(msg->p_origin)
+    {
+        tbus_message_origin_t origin = 0;
+        READ_FIELD(msg->p_origin, origin);
+        /** Our own message coming back over a bridge */
+        if(origin == broker->id)
+            return;
+    }
+    /** Bridged messages are not forwarded again, that would need more than the origin to stop loops */
+    bool forward = !client->bridge && broker->bridge_count > 0 && bridge_pattern_match(msg->topic);
+    size_t raw_buffer_size = 0;
+    uint8_t* raw_buffer = reader->get_buffer(reader, &raw_buffer_size);
+    size_t received_size = raw_buffer_size;
+    /**
+     * Clients never send SEQ and ORIGIN so plain frames stay readable by 1.0 peers.
+     * Add the ones needed here in a copy, which the buffer owns instead of the reader's frame.
+     */
+    tbus_message_t stamped;
+    tbus_message_seq_t seq = 0;
+    tbus_message_origin_t origin = broker->id;
+    if((broker->config.sequence && !msg->p_seq) || (forward && !msg->p_origin))
+    {
+        stamped = *msg;
+        if(broker->config.sequence && !stamped.p_seq)
+            stamped.p_seq = &seq;
+        if(forward && !stamped.p_origin)
+            stamped.p_origin = &origin;
+        raw_buffer = tbus_message_serialize(&stamped, &raw_buffer_size);
+        if(!raw_buffer)
+            return;
+        tbus_message_view(raw_buffer, raw_buffer_size, &stamped);
+        msg = &stamped;
+        reader = NULL;
+    }
+    tbus_buffer_t* buffer = tbus_buffer_new(raw_buffer, raw_buffer_size);
+    if(!buffer)
+    {
+        if(!reader)
+            free(raw_buffer);
+        return;
+    }
+    buffer->p_sub_index = msg->p_sub_index;
+    buffer->priority = tbus_message_get_priority(msg);
+    tbus_topic_state_t* state = NULL;
+    if(msg->p_seq && broker->config.sequence)
+    {
+        state = topic_state_get(msg->topic);
+        if(state)
+        {
+            buffer->seq = ++state->last_seq;
+            WRITE_FIELD(msg->p_seq, buffer->seq);
+        }
+    }
+    if(client->flow_control)
+    {
+        buffer->credit = received_size;
+        client->credit_outstanding += buffer->credit;
+        buffer->publisher = client;
+    }
+    /** Journal the frame as received, before the sub index is overwritten */
+    if(broker->journals)
+        broker->journals->match(broker->journals, msg->topic, journal_on_match, buffer);
+    publish_on_match_ctx_t ctx = {
+        .buffer = buffer,
+        .view = (tbus_message_t*)msg,
+        .source = client
+    };
+    LIST_INIT(&ctx.error_clients);
+    publish_match(&ctx, msg->topic);
+    if(forward)
+    {
+        for(int i = 0; i < broker->bridge_count; i++)
+        {
+            tbus_client_t* bridge_client = broker->bridges[i].client;
+            if(!bridge_client || publish_is_error_client(&ctx, bridge_client))
+                continue;
+            publish_send(&ctx, bridge_client, 0);
+        }
+    }
+    if(state && state->history)
+        topic_state_push_history(state, ctx.buffer);
+    publish_finish(&ctx, reader);
+}
+
+static void publish_finish(publish_on_match_ctx_t* ctx, message_reader_t* reader)
+{
+    publish_flush_dgrams(ctx);
+    buffer_finish(ctx->buffer, reader);
+    /** Close error clients. Do it here to avoid client being one of them. */
+    LIST_FOR_EACH_SAFE(&ctx->error_clients, node)
+    {
+        tbus_client_t* error_client = GET_CLIENT_FROM_BROKER_NODE(node);
+        tbus_client_free(error_client);
+    }
+}
+
+/** Keep a buffer made from reader's buffer if anyone still holds it, reader is NULL if the buffer owns its data */
+static void buffer_finish(tbus_buffer_t* buffer, message_reader_t* reader)
+{
+    if(buffer->ref_count == 0)
+    {
+        /** All first transmission finished */
+        if(buffer->publisher)
+            client_return_credit(buffer->publisher, buffer->credit);
+        /** Unref data */
+        if(reader)
+            buffer->data = NULL;
+        tbus_buffer_free(buffer);
+        return;
+    }
+    if(reader)
+    {
+        /** Acquire the buffer and store in buffers */
+        uint8_t* take_over_buffer = reader->take_over_buffer(reader, NULL);
+        /** Critical */
+        if(!take_over_buffer)
+        {
+            fprintf(stderr, "Critical error: Failed to take over buffer\n");
+            exit(EXIT_FAILURE);
+        }
+        buffer->from_reader = true;
+    }
+    LIST_LINK(&broker->buffers, &buffer->node);
+    if(buffer->publisher && buffer->ref_count == 1 && buffer->in_history)
+    {
+        /** Delivered to everyone, only kept for history */
+        client_return_credit(buffer->publisher, buffer->credit);
+        buffer->publisher = NULL;
+    }
+}
+
+static void handle_request(const tbus_message_t* msg, tbus_client_t* client)
+{
+    /** Check parameters. */
+    if(!msg->topic || !msg->p_sub_index || !msg->p_correlation_id || !msg->data || msg->data_len == 0)
+        return;
+    tbus_request_t* request = malloc(sizeof(tbus_request_t));
+    if(!request)
+        return;
+    bzero(request, sizeof(tbus_request_t));
+    request->id = ++broker->next_request_id;
+    READ_FIELD(msg->p_correlation_id, request->correlation_id);
+    request->requester = client;
+    if(!map_add(broker->requests, &request->id, sizeof(request->id), request))
+    {
+        free(request);
+        return;
+    }
+    LIST_LINK(&client->requests, &request->client_node);
+    client->request_count ++;
+    if(client->request_count > MAX_PENDING_REQUESTS)
+    {
+        /** Nobody replied to the oldest one, the requester has timed out long ago */
+        tbus_request_free(GET_REQUEST_FROM_CLIENT_NODE(client->requests.next));
+    }
+    size_t raw_buffer_size = 0;
+    uint8_t* raw_buffer = client->reader->get_buffer(client->reader, &raw_buffer_size);
+    tbus_buffer_t* buffer = tbus_buffer_new(raw_buffer, raw_buffer_size);
+    if(!buffer)
+        return;
+    buffer->p_sub_index = msg->p_sub_index;
+    buffer->priority = tbus_message_get_priority(msg);
+    /** Responders reply with the broker's id */
+    WRITE_FIELD(msg->p_correlation_id, request->id);
+    publish_on_match_ctx_t ctx = {
+        .buffer = buffer,
+        .view = (tbus_message_t*)msg,
+        .source = client
+    };
+    LIST_INIT(&ctx.error_clients);
+    publish_match(&ctx, msg->topic);
+    if(ctx.server)
+    {
+        ctx.server->last_request_id = request->id;
+        publish_on_match_handle_subscription(ctx.server, &ctx);
+    }
+    int rc = 0;
+    if(ctx.match_count == 0)
+    {
+        /** Tell the requester now instead of letting it time out */
+        tbus_message_t reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.command = TBUS_MSG_CMD_REPLY;
+        reply.p_correlation_id = &request->correlation_id;
+        rc = client_send_message(client, &reply);
+        tbus_request_free(request);
+    }
+    publish_finish(&ctx, client->reader);
+    /** Nothing matched, so client is not among the error clients publish_finish closed */
+    if(rc != 0)
+        on_client_error(client);
+}
+
+static void handle_reply(const tbus_message_t* msg, tbus_client_t* client)
+{
+    /** Check parameters. */
+    if(!msg->p_correlation_id || !msg->data || msg->data_len == 0)
+        return;
+    tbus_message_correlation_id_t id = 0;
+    READ_FIELD(msg->p_correlation_id, id);
+    tbus_request_t* request = map_get(broker->requests, &id, sizeof(id));
+    /** Late or duplicated reply */
+    if(!request)
+        return;
+    tbus_client_t* requester = request->requester;
+    WRITE_FIELD(msg->p_correlation_id, request->correlation_id);
+    tbus_request_free(request);
+    size_t raw_buffer_size = 0;
+    uint8_t* raw_buffer = client->reader->get_buffer(client->reader, &raw_buffer_size);
+    tbus_buffer_t* buffer = tbus_buffer_new(raw_buffer, raw_buffer_size);
+    if(!buffer)
+        return;
+    buffer->priority = tbus_message_get_priority(msg);
+    /** Straight back to the requester, no topic matching */
+    int rc = client_send_buffer(requester, buffer, 0);
+    buffer_finish(buffer, client->reader);
+    /** Also when it replied to itself, the reader stops once its client is closed in the callback */
+    if(rc != 0)
+        on_client_error(requester);
+}
+
+static void handle_dgram(const tbus_message_t* msg, tbus_client_t* client)
+{
+    /** Without -d the client keeps to the stream */
+    if(broker->dgram_fd < 0 || !msg->data || msg->data_len == 0)
+        return;
+    client_dgram_unregister(client);
+    if(client_dgram_register(client, msg->data, msg->data_len) != 0)
+        return;
+    if(getrandom(&client->dgram_nonce, sizeof(client->dgram_nonce), GRND_NONBLOCK) != sizeof(client->dgram_nonce))
+        goto error;
+    tbus_message_t ack;
+    memset(&ack, 0, sizeof(ack));
+    ack.command = TBUS_MSG_CMD_DGRAM;
+    ack.p_correlation_id = &client->dgram_nonce;
+    size_t size = 0;
+    uint8_t* data = tbus_message_serialize(&ack, &size);
+    if(!data)
+        goto error;
+    ssize_t sent = sendto(broker->dgram_fd, data, size, MSG_NOSIGNAL, (struct sockaddr*)&client->dgram_addr, client->dgram_addr_len);
+    free(data);
+    if(sent != size)
+        goto error;
+    return;
+error:
+    client_dgram_unregister(client);
+}
+
+static int dgram_init()
+{
+    /** Best effort, SO_SNDBUFFORCE needs CAP_NET_ADMIN and SO_SNDBUF is capped by wmem_max */
+    int size = DGRAM_SEND_BUFFER_SIZE;
+    if(setsockopt(broker->dgram_fd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) != 0)
+        setsockopt(broker->dgram_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    broker->dgram_reader = message_reader_new(broker->tev, broker->dgram_fd);
+    if(!broker->dgram_reader)
+        return -1;
+    broker->dgram_reader->callbacks.on_message = on_dgram_message;
+    broker->dgram_reader->callbacks.on_error = on_dgram_error;
+    return 0;
+}
+
+/** Datagrams are only taken from registered addresses, the kernel vouches for the source */
+static void on_dgram_message(const tbus_message_t* msg, void* ctx)
+{
+    socklen_t source_len = 0;
+    const struct sockaddr_un* source = (const struct sockaddr_un*)broker->dgram_reader->get_source(broker->dgram_reader, &source_len);
+    if(!source || source_len <= offsetof(struct sockaddr_un, sun_path))
+        return;
+    tbus_client_t* client = map_get(broker->dgram_clients, source->sun_path, source_len - offsetof(struct sockaddr_un, sun_path));
+    if(!client)
+        return;
+    if(msg->command == TBUS_MSG_CMD_DGRAM)
+    {
+        if(!msg->p_correlation_id)
+            return;
+        tbus_message_correlation_id_t nonce = 0;
+        READ_FIELD(msg->p_correlation_id, nonce);
+        if(nonce == client->dgram_nonce)
+            client->dgram_ready = true;
+        return;
+    }
+    /** Everything else goes over the stream */
+    if(client->dgram_ready && msg->command == TBUS_MSG_CMD_PUB)
+        handle_publish(msg, client, broker->dgram_reader);
+}
+
+static void on_dgram_error(void* ctx)
+{
+    /** No connection to lose, the clients find out on their streams */
+}
+
+/**
+ * A client only sends a datagram once the broker has read everything on its stream, see client_stream_read_all,
+ * so the datagrams already here were sent before the stream frame about to be read.
+ */
+static void on_client_read(void* ctx)
+{
+    tbus_client_t* client = (tbus_client_t*)ctx;
+    if(client->dgram_ready && broker->dgram_reader)
+        broker->dgram_reader->read_pending(broker->dgram_reader);
+}
+
+/** A datagram must not overtake stream frames the client has not read yet, they may still be in its socket */
+static bool client_stream_read_all(tbus_client_t* client)
+{
+    if(client->queue_depth != 0)
+        return false;
+    if(!client->stream_unread)
+        return true;
+    int unread = 0;
+    if(ioctl(client->fd, SIOCOUTQ, &unread) != 0 || unread > 0)
+        return false;
+    client->stream_unread = false;
+    return true;
+}
+
+static int client_dgram_register(tbus_client_t* client, const void* addr, size_t addr_size)
+{
+    if(addr_size > sizeof(client->dgram_addr.sun_path))
+        return -1;
+    /** Another client claims the same address, one of them lies */
+    if(map_get(broker->dgram_clients, addr, addr_size))
+        return -1;
+    memset(&client->dgram_addr, 0, sizeof(client->dgram_addr));
+    client->dgram_addr.sun_family = AF_UNIX;
+    memcpy(client->dgram_addr.sun_path, addr, addr_size);
+    if(!map_add(broker->dgram_clients, client->dgram_addr.sun_path, addr_size, client))
+        return -1;
+    client->dgram_addr_len = offsetof(struct sockaddr_un, sun_path) + addr_size;
+    return 0;
+}
+
+static void client_dgram_unregister(tbus_client_t* client)
+{
+    if(client->dgram_addr_len == 0)
+        return;
+    map_remove(broker->dgram_clients, client->dgram_addr.sun_path, client->dgram_addr_len - offsetof(struct sockaddr_un, sun_path));
+    client->dgram_addr_len = 0;
+    client->dgram_ready = false;
+}
+
+static void tbus_request_free(tbus_request_t* request)
+{
+    if(!request)
+        return;
+    map_remove(broker->requests, &request->id, sizeof(request->id));
+    LIST_UNLINK(&request->client_node);
+    request->requester->request_count --;
+    free(request);
+}
+
+/** Collect the matching lists first and walk them as a flat array */
+static void publish_match(publish_on_match_ctx_t* ctx, const char* topic)
+{
+    void* matches[MATCH_BATCH];
+    size_t count = broker->topics->match_all(broker->topics, topic, matches, MATCH_BATCH);
+    if(count > MATCH_BATCH)
+    {
+        broker->topics->match(broker->topics, topic, publish_on_match, ctx);
+    }
+    else
+    {
+        for(size_t i = 0; i < count; i++)
+            publish_on_match(matches[i], ctx);
+    }
+    count = broker->shared_topics->match_all(broker->shared_topics, topic, matches, MATCH_BATCH);
+    if(count > MATCH_BATCH)
+    {
+        broker->shared_topics->match(broker->shared_topics, topic, publish_on_match_shared, ctx);
+    }
+    else
+    {
+        for(size_t i = 0; i < count; i++)
+            publish_on_match_shared(matches[i], ctx);
+    }
+}
+
+static void publish_on_match(void* data, void* ctx)
+{
+    list_head_t* subs = (list_head_t*)data;
+    publish_on_match_ctx_t* publish_ctx = (publish_on_match_ctx_t*)ctx;
+    /** Overwrite the sub_index */
+    LIST_FOR_EACH_SAFE(subs, node)
+    {
+        tbus_subscription_t* sub = GET_SUBSCRIPTION_FROM_TOPIC_TREE_NODE(node);
+        if(publish_ctx->view->command == TBUS_MSG_CMD_REQ)
+            request_consider_server(publish_ctx, sub);
+        else
+            publish_on_match_handle_subscription(sub, publish_ctx);
+    }
+}
+
+/** Keep sub as the server of the request if its queue is shorter, ties go to the least recently chosen */
+static void request_consider_server(publish_on_match_ctx_t* publish_ctx, tbus_subscription_t* sub)
+{
+    if(!(sub->flags & TBUS_MSG_SUB_FLAG_SERVE))
+        return;
+    tbus_subscription_t* server = publish_ctx->server;
+    if(server && (sub->client->queue_depth > server->client->queue_depth
+        || (sub->client->queue_depth == server->client->queue_depth && sub->last_request_id >= server->last_request_id)))
+        return;
+    if(publish_is_error_client(publish_ctx, sub->client) || !subscription_accepts(sub, publish_ctx->view))
+        return;
+    publish_ctx->server = sub;
+}
+
+static void publish_on_match_shared(void* data, void* ctx)
+{
+    list_head_t* groups = (list_head_t*)data;
+    publish_on_match_ctx_t* publish_ctx = (publish_on_match_ctx_t*)ctx;
+    LIST_FOR_EACH(groups, group_node)
+    {
+        tbus_share_group_t* group = GET_SHARE_GROUP_FROM_TOPIC_TREE_NODE(group_node);
+        if(publish_ctx->view->command == TBUS_MSG_CMD_REQ)
+        {
+            /** Members compete with every other server of the topic */
+            LIST_FOR_EACH(&group->members, node)
+                request_consider_server(publish_ctx, GET_SUBSCRIPTION_FROM_TOPIC_TREE_NODE(node));
+            continue;
+        }
+        /** The shortest queue wins, ties go to the least recently chosen */
+        tbus_subscription_t* chosen = NULL;
+        LIST_FOR_EACH(&group->members, node)
+        {
+            tbus_subscription_t* sub = GET_SUBSCRIPTION_FROM_TOPIC_TREE_NODE(node);
+            if(chosen && sub->client->queue_depth >= chosen->client->queue_depth)
+                continue;
+            if(publish_is_error_client(publish_ctx, sub->client))
+                continue;
+            if(!subscription_accepts(sub, publish_ctx->view))
+                continue;
+            chosen = sub;
+            if(chosen->client->queue_depth == 0)
+                break;
+        }
+        if(!chosen)
+            continue;
+        /** Move to the back for round robin */
+        LIST_UNLINK(&chosen->topic_tree_node);
+        LIST_LINK(&group->members, &chosen->topic_tree_node);
+        publish_on_match_handle_subscription(chosen, publish_ctx);
+    }
+}
+
+static bool publish_is_error_client(publish_on_match_ctx_t* publish_ctx, tbus_client_t* client)
+{
+    /** This list should be short. */
+    LIST_FOR_EACH(&publish_ctx->error_clients, node)
+    {
+        tbus_client_t* error_client = GET_CLIENT_FROM_BROKER_NODE(node);
+        if(error_client == client)
+            return true;
+    }
+    return false;
+}
+
+static void publish_on_match_handle_subscription(tbus_subscription_t* sub, publish_on_match_ctx_t* publish_ctx)
+{
+    /** Check if client is already in error list */
+    if(publish_is_error_client(publish_ctx, sub->client))
+        return;
+    if((sub->flags & TBUS_MSG_SUB_FLAG_NO_LOCAL) && sub->client == publish_ctx->source)
+        return;
+    /** Filtered out data never reaches the socket */
+    if(!subscription_accepts(sub, publish_ctx->view))
+        return;
+    publish_ctx->match_count ++;
+    /** Requests are never conflated */
+    if(sub->interval_ms > 0 && publish_ctx->view->command == TBUS_MSG_CMD_PUB && subscription_hold_sample(sub, publish_ctx->buffer))
+        return;
+    /** Behind a stream backlog a datagram would overtake it */
+    tbus_client_t* client = sub->client;
+    if(client->dgram_ready && publish_ctx->buffer->size <= MESSAGE_RECORD_SIZE && client_stream_read_all(client))
+    {
+        publish_ctx->dgrams[publish_ctx->dgram_count].client = client;
+        publish_ctx->dgrams[publish_ctx->dgram_count].sub_index = sub->sub_index;
+        if(++publish_ctx->dgram_count == DGRAM_BATCH)
+            publish_flush_dgrams(publish_ctx);
+        return;
+    }
+    publish_send(publish_ctx, client, sub->sub_index);
+}
+
+/** Send over the stream, a broken client is closed once the publish is done */
+static void publish_send(publish_on_match_ctx_t* publish_ctx, tbus_client_t* client, tbus_message_sub_index_t sub_index)
+{
+    if(client_send_buffer(client, publish_ctx->buffer, sub_index) != 0)
+    {
+        /** Client error */
+        LIST_UNLINK(&client->broker_node);
+        LIST_LINK(&publish_ctx->error_clients, &client->broker_node);
+    }
+}
+
+/** 
+ * One datagram per delivery, each with its own sub index spliced in, all in one sendmmsg.
+ * Whatever the socket does not take goes over the stream instead.
+ */
+static void publish_flush_dgrams(publish_on_match_ctx_t* publish_ctx)
+{
+    int count = publish_ctx->dgram_count;
+    if(count == 0)
+        return;
+    publish_ctx->dgram_count = 0;
+    tbus_buffer_t* buffer = publish_ctx->buffer;
+    size_t head = (uint8_t*)buffer->p_sub_index - buffer->data;
+    size_t tail = head + sizeof(tbus_message_sub_index_t);
+    struct mmsghdr msgs[DGRAM_BATCH];
+    struct iovec iovs[DGRAM_BATCH][3];
+    memset(msgs, 0, count * sizeof(struct mmsghdr));
+    for(int i = 0; i < count; i++)
+    {
+        publish_dgram_t* dgram = &publish_ctx->dgrams[i];
+        iovs[i][0].iov_base = buffer->data;
+        iovs[i][0].iov_len = head;
+        iovs[i][1].iov_base = &dgram->sub_index;
+        iovs[i][1].iov_len = sizeof(tbus_message_sub_index_t);
+        iovs[i][2].iov_base = buffer->data + tail;
+        iovs[i][2].iov_len = buffer->size - tail;
+        msgs[i].msg_hdr.msg_iov = iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 3;
+        msgs[i].msg_hdr.msg_name = &dgram->client->dgram_addr;
+        msgs[i].msg_hdr.msg_namelen = dgram->client->dgram_addr_len;
+    }
+    int sent = 0;
+    while(sent < count)
+    {
+        int rc = sendmmsg(broker->dgram_fd, msgs + sent, count - sent, MSG_NOSIGNAL);
+        if(rc > 0)
+        {
+            sent += rc;
+            continue;
+        }
+        /** The socket is full, the rest would fail as well */
+        bool full = rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        for(int i = sent; i < (full ? count : sent + 1); i++)
+        {
+            tbus_client_t* client = publish_ctx->dgrams[i].client;
+            /** The client closed its datagram socket, keep to the stream */
+            if(!full)
+                client_dgram_unregister(client);
+            if(!publish_is_error_client(publish_ctx, client))
+                publish_send(publish_ctx, client, publish_ctx->dgrams[i].sub_index);
+        }
+        sent = full ? count : sent + 1;
+    }
+}
+
+static tbus_buffer_ref_t* client_next_buffer_ref(tbus_client_t* client)
+{
+    /** Never interleave frames */
+    if(client->writing)
+        return client->writing;
+    for(int i = TBUS_MSG_PRIORITY_LEVELS - 1; i >= 0; i--)
+    {
+        list_head_t* node = client->buffers[i].next;
+        if(node != &client->buffers[i])
+            return GET_BUFFER_REF_FROM_NODE(node);
+    }
+    return NULL;
+}
+
+static void on_client_write_ready(void* ctx)
+{
+    tbus_client_t* client = (tbus_client_t* )ctx;
+    tbus_buffer_ref_t* ref = NULL;
+    while((ref = client_next_buffer_ref(client)) != NULL)
+    {   
+        /** The buffer may be shared by other subscriptions */
+        if(ref->buffer->p_sub_index)
+            WRITE_FIELD(ref->buffer->p_sub_index, ref->sub_index);
+        ssize_t bytes_written = client_send(client, ref->buffer->data + ref->bytes_written, ref->buffer->size - ref->bytes_written);
+        if(bytes_written < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                /** Client is busy */
+                break;
+            }
+            /** Client error */
+            on_client_error(client);
+            return;
+        }
+        ref->bytes_written += bytes_written;
+        if(ref->bytes_written == ref->buffer->size)
+        {
+            /** Transmission finished */
+            LIST_UNLINK(&ref->node);
+            client->queue_depth --;
+            client->writing = NULL;
+            tbus_buffer_release(ref->buffer);
+            tbus_buffer_ref_free(ref);
+        }
+        else
+        {
+            client->writing = ref;
+            /** Socket is full, unless there are more records to go */
+            if(!client->seqpacket)
+                break;
+        }
+    }
+    if(client->queue_depth != 0)
+    {
+        /** Still have data to write. Write handler is still valid */
+        return;
+    }
+    tev_set_write_handler(broker->tev, client->fd, NULL, NULL);
+}
+
+static void on_client_error(void* ctx)
+{
+    tbus_client_t* client = (tbus_client_t*)ctx;
+    tbus_client_free(client);
+}
+
+static void handle_credit(const tbus_message_t* msg, tbus_client_t* client)
+{
+    if(client->flow_control)
+        return;
+    tbus_message_credit_t window = broker->config.credit_window;
+    if(msg->p_credit)
+    {
+        tbus_message_credit_t requested = 0;
+        READ_FIELD(msg->p_credit, requested);
+        if(requested != 0 && requested < window)
+            window = requested;
+    }
+    client->flow_control = true;
+    client->credit_window = window;
+    /** Grant the whole window */
+    client->credit_pending = window;
+    client_return_credit(client, 0);
+}
+
+static void client_return_credit(tbus_client_t* client, size_t size)
+{
+    if(size > client->credit_outstanding)
+        size = client->credit_outstanding;
+    client->credit_outstanding -= size;
+    client->credit_pending += size;
+    /** 
+     * Batch the grants. Always flush when nothing is outstanding, 
+     * otherwise a client waiting for credit may never get it.
+     */
+    if(client->credit_pending == 0)
+        return;
+    if(client->credit_outstanding != 0 && client->credit_pending < client->credit_window / 2)
+        return;
+    tbus_message_credit_t credit = client->credit_pending;
+    tbus_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.command = TBUS_MSG_CMD_CREDIT;
+    msg.p_credit = &credit;
+    /** On failure the reader will see the broken connection */
+    if(client_send_message(client, &msg) == 0)
+        client->credit_pending = 0;
+}
+
+static int client_send_message(tbus_client_t* client, const tbus_message_t* msg)
+{
+    size_t size = 0;
+    uint8_t* data = tbus_message_serialize(msg, &size);
+    if(!data)
+        return -1;
+    tbus_buffer_t* buffer = tbus_buffer_new(data, size);
+    if(!buffer)
+    {
+        free(data);
+        return -1;
+    }
+    tbus_message_t view;
+    if(tbus_message_view(data, size, &view) == 0)
+    {
+        buffer->p_sub_index = view.p_sub_index;
+        buffer->priority = tbus_message_get_priority(&view);
+    }
+    tbus_message_sub_index_t sub_index = 0;
+    if(msg->p_sub_index)
+        READ_SUB_INDEX(msg, sub_index);
+    int rc = client_send_buffer(client, buffer, sub_index);
+    if(buffer->ref_count == 0)
+        tbus_buffer_free(buffer);
+    else
+        LIST_LINK(&broker->buffers, &buffer->node);
+    return rc;
+}
+
+/** Send now or queue behind the client's pending buffers. -1 if the client is broken. */
+static int client_send_buffer(tbus_client_t* client, tbus_buffer_t* buffer, tbus_message_sub_index_t sub_index)
+{
+    ssize_t bytes_written = 0;
+    if(buffer->p_sub_index)
+        WRITE_FIELD(buffer->p_sub_index, sub_index);
+    /** Try write message in one go */
+    while(client->queue_depth == 0 && bytes_written < buffer->size)
+    {
+        ssize_t sent = client_send(client, buffer->data + bytes_written, buffer->size - bytes_written);
+        if(sent < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            /** Client is busy */
+            break;
+        }
+        bytes_written += sent;
+        /** Socket is full */
+        if(!client->seqpacket && bytes_written < buffer->size)
+            break;
+    }
+    if(bytes_written == buffer->size)
+        return 0;
+    return client_queue_buffer(client, buffer, bytes_written, sub_index);
+}
+
+/** A SOCK_SEQPACKET record holds at most MESSAGE_RECORD_SIZE, larger frames take several */
+static ssize_t client_send(tbus_client_t* client, const uint8_t* data, size_t len)
+{
+    if(client->fd < 0)
+    {
+        /** Handed over to another broker */
+        errno = EBADF;
+        return -1;
+    }
+    if(client->seqpacket && len > MESSAGE_RECORD_SIZE)
+        len = MESSAGE_RECORD_SIZE;
+    ssize_t sent = send(client->fd, data, len, MSG_NOSIGNAL);
+    if(sent > 0)
+        client->stream_unread = true;
+    return sent;
+}
+
+static int client_queue_buffer(tbus_client_t* client, tbus_buffer_t* buffer, size_t bytes_written, tbus_message_sub_index_t sub_index)
+{
+    tbus_buffer_ref_t* ref = tbus_buffer_ref_new(buffer);
+    if(!ref)
+        return -1;
+    ref->bytes_written = bytes_written;
+    ref->sub_index = sub_index;
+    LIST_LINK(&client->buffers[buffer->priority], &ref->node);
+    client->queue_depth ++;
+    if(bytes_written > 0)
+        client->writing = ref;
+    buffer->ref_count ++;
+    tev_set_write_handler(broker->tev, client->fd, on_client_write_ready, client);
+    return 0;
+}
+
+typedef struct
+{
+    tbus_client_t* client;
+    tbus_subscription_t* sub;
+    tbus_message_seq_t from_seq;
+    /** false while picking the frames, true while queueing them */
+    bool queue;
+    int rc;
+} replay_ctx_t;
+
+static void replay_on_topic_state(void* data, void* ctx);
+
+/**
+ * Sequence numbers are per topic, a wildcard replays each matching topic from from_seq.
+ * The replay goes out in sequence order, so the live frames already queued for sub that it repeats are dropped.
+ * Only a frame partly written already stays ahead of it, its topic replays from the next one.
+ */
+static void client_replay_history(tbus_client_t* client, tbus_subscription_t* sub, tbus_message_seq_t from_seq)
+{
+    replay_ctx_t ctx = {
+        .client = client,
+        .sub = sub,
+        .from_seq = from_seq
+    };
+    topic_tree_t* tree = broker->topic_state_tree;
+    tree->match_pattern(tree, sub->filter, replay_on_topic_state, &ctx);
+    for(int i = 0; i < TBUS_MSG_PRIORITY_LEVELS; i++)
+    {
+        LIST_FOR_EACH_SAFE(&client->buffers[i], node)
+        {
+            tbus_buffer_ref_t* ref = GET_BUFFER_REF_FROM_NODE(node);
+            if(ref == client->writing || ref->sub_index != sub->sub_index || !ref->buffer->replaying)
+                continue;
+            LIST_UNLINK(&ref->node);
+            client->queue_depth --;
+            tbus_buffer_release(ref->buffer);
+            tbus_buffer_ref_free(ref);
+        }
+    }
+    ctx.queue = true;
+    tree->match_pattern(tree, sub->filter, replay_on_topic_state, &ctx);
+}
+
+static void replay_on_topic_state(void* data, void* ctx)
+{
+    tbus_topic_state_t* state = (tbus_topic_state_t*)data;
+    replay_ctx_t* replay_ctx = (replay_ctx_t*)ctx;
+    tbus_client_t* client = replay_ctx->client;
+    tbus_subscription_t* sub = replay_ctx->sub;
+    if(!state->history)
+        return;
+    size_t depth = broker->config.history_depth;
+    size_t oldest = (state->history_head + depth - state->history_count) % depth;
+    for(size_t i = 0; i < state->history_count; i++)
+    {
+        tbus_buffer_t* buffer = state->history[(oldest + i) % depth];
+        if(!replay_ctx->queue)
+        {
+            if(buffer->seq < replay_ctx->from_seq)
+                continue;
+            /** Partly written already, the replay of its topic goes on after it */
+            if(client->writing && client->writing->buffer == buffer)
+            {
+                for(size_t j = 0; j < i; j++)
+                    state->history[(oldest + j) % depth]->replaying = false;
+                continue;
+            }
+            tbus_message_t view;
+            if(sub->filter_count > 0 && (tbus_message_view(buffer->data, buffer->size, &view) != 0 || !subscription_accepts(sub, &view)))
+                continue;
+            buffer->replaying = true;
+            continue;
+        }
+        if(!buffer->replaying)
+            continue;
+        buffer->replaying = false;
+        /** After a failure the rest is only unmarked, the reader will find out if the client is broken */
+        if(replay_ctx->rc != 0)
+            continue;
+        /** Sampled like live frames, at most the first goes out now and the latest is held */
+        if(sub->interval_ms > 0 && subscription_hold_sample(sub, buffer))
+            continue;
+        replay_ctx->rc = client_queue_buffer(client, buffer, 0, sub->sub_index);
+    }
+}
+
+static tbus_topic_state_t* topic_state_get(const char* topic)
+{
+    size_t topic_len = strlen(topic);
+    tbus_topic_state_t* state = map_get(broker->topic_states, (void*)topic, topic_len);
+    if(state)
+    {
+        LIST_UNLINK(&state->node);
+        LIST_LINK(&broker->topic_state_lru, &state->node);
+        return state;
+    }
+    if(broker->topic_state_count == broker->config.max_topic_states)
+    {
+        /** Drop the idlest topic, its sequence starts over if it is published again */
+        tbus_topic_state_t* idlest = GET_TOPIC_STATE_FROM_NODE(broker->topic_state_lru.next);
+        map_remove(broker->topic_states, idlest->topic, strlen(idlest->topic));
+        broker->topic_state_tree->remove(broker->topic_state_tree, idlest->topic);
+        LIST_UNLINK(&idlest->node);
+        broker->topic_state_count --;
+        topic_state_free(idlest);
+    }
+    state = malloc(sizeof(tbus_topic_state_t));
+    if(!state)
+        return NULL;
+    bzero(state, sizeof(tbus_topic_state_t));
+    state->topic = strdup(topic);
+    if(!state->topic)
+        goto error;
+    if(broker->config.history_depth > 0)
+    {
+        state->history = calloc(broker->config.history_depth, sizeof(tbus_buffer_t*));
+        if(!state->history)
+            goto error;
+    }
+    /** Fails for a malformed topic too, nobody can subscribe to it */
+    if(!broker->topic_state_tree->insert(broker->topic_state_tree, state->topic, state))
+        goto error;
+    if(!map_add(broker->topic_states, state->topic, topic_len, state))
+    {
+        broker->topic_state_tree->remove(broker->topic_state_tree, state->topic);
+        goto error;
+    }
+    LIST_LINK(&broker->topic_state_lru, &state->node);
+    broker->topic_state_count ++;
+    return state;
+error:
+    topic_state_free(state);
+    return NULL;
+}
+
+static void topic_state_push_history(tbus_topic_state_t* state, tbus_buffer_t* buffer)
+{
+    size_t depth = broker->config.history_depth;
+    if(state->history_count == depth)
+    {
+        /** Evict the oldest, it is at the head */
+        tbus_buffer_t* oldest = state->history[state->history_head];
+        oldest->in_history = false;
+        tbus_buffer_release(oldest);
+        state->history_count --;
+    }
+    state->history[state->history_head] = buffer;
+    state->history_head = (state->history_head + 1) % depth;
+    state->history_count ++;
+    buffer->in_history = true;
+    buffer->ref_count ++;
+}
+
+static void topic_state_free(tbus_topic_state_t* state)
+{
+    if(!state)
+        return;
+    if(state->history)
+    {
+        size_t depth = broker->config.history_depth;
+        size_t oldest = (state->history_head + depth - state->history_count) % depth;
+        for(size_t i = 0; i < state->history_count; i++)
+        {
+            tbus_buffer_t* buffer = state->history[(oldest + i) % depth];
+            buffer->in_history = false;
+            tbus_buffer_release(buffer);
+        }
+        free(state->history);
+    }
+    if(state->topic)
+        free(state->topic);
+    free(state);
+}
+
+static void topic_state_free_with_ctx(void* data, void* ctx)
+{
+    topic_state_free((tbus_topic_state_t*)data);
+}
+
+static tbus_subscription_t* tbus_subscription_new(const char* topic, tbus_message_sub_index_t* p_sub_index, tbus_client_t* client)
+{
+    if (!topic || !client)
+        return NULL;
+    tbus_subscription_t* sub = malloc(sizeof(tbus_subscription_t));
+    if(!sub)
+        goto error;
+    bzero(sub, sizeof(tbus_subscription_t));
+    sub->topic = broker->topic_names->get(broker->topic_names, topic);
+    if(!sub->topic)
+        goto error;
+    if (p_sub_index)
+        memcpy(&sub->sub_index, p_sub_index, sizeof(tbus_message_sub_index_t));
+    sub->client = client;
+    return sub;
+error:
+    if(sub)
+        tbus_subscription_free(sub);
+    return NULL;
+}
+
+static tbus_share_group_t* tbus_share_group_new(const char* name, size_t name_len)
+{
+    tbus_share_group_t* group = malloc(sizeof(tbus_share_group_t));
+    if(!group)
+        return NULL;
+    bzero(group, sizeof(tbus_share_group_t));
+    LIST_INIT(&group->members);
+    group->name = strndup(name, name_len);
+    if(!group->name)
+    {
+        free(group);
+        return NULL;
+    }
+    return group;
+}
+
+static void tbus_share_group_free(tbus_share_group_t* group)
+{
+    if(!group)
+        return;
+    if(group->name)
+        free(group->name);
+    free(group);
+}
+
+/** Take the filters of a SUB, no FILTER clears them */
+static int subscription_set_filters(tbus_subscription_t* sub, const tbus_message_t* msg)
+{
+    if(msg->filter_count > TBUS_MSG_MAX_FILTERS)
+        return -1;
+    tbus_message_filter_t* filters = NULL;
+    if(msg->filter_count > 0)
+    {
+        filters = malloc(msg->filter_count * sizeof(tbus_message_filter_t));
+        if(!filters)
+            return -1;
+        memcpy(filters, msg->p_filter, msg->filter_count * sizeof(tbus_message_filter_t));
+    }
+    free(sub->filters);
+    sub->filters = filters;
+    sub->filter_count = msg->filter_count;
+    return 0;
+}
+
+static bool subscription_accepts(const tbus_subscription_t* sub, const tbus_message_t* view)
+{
+    if(sub->filter_count == 0)
+        return true;
+    return tbus_message_filter_match(sub->filters, sub->filter_count, view->data, view->data_len);
+}
+
+/** Take the interval of a SUB, no INTERVAL delivers every message again */
+static void subscription_set_interval(tbus_subscription_t* sub, const tbus_message_t* msg)
+{
+    tbus_message_interval_t interval_ms = 0;
+    if(msg->p_interval)
+        READ_FIELD(msg->p_interval, interval_ms);
+    /** A held message still goes out on its timer */
+    sub->interval_ms = interval_ms;
+}
+
+static void subscription_set_flags(tbus_subscription_t* sub, const tbus_message_t* msg)
+{
+    sub->flags = msg->p_sub_flags ? *msg->p_sub_flags : 0;
+}
+
+/**
+ * Decide whether buffer goes out now or waits for the end of the interval.
+ * @return true if buffer is held, replacing any older held one
+ */
+static bool subscription_hold_sample(tbus_subscription_t* sub, tbus_buffer_t* buffer)
+{
+    uint64_t now = monotonic_ms();
+    if(!sub->sample_timer && now - sub->last_sent_ms >= sub->interval_ms)
+    {
+        sub->last_sent_ms = now;
+        return false;
+    }
+    if(!sub->sample_timer)
+    {
+        sub->sample_timer = tev_set_timeout(broker->tev, on_sample_timer, sub, sub->last_sent_ms + sub->interval_ms - now);
+        /** Better late than never, send it now */
+        if(!sub->sample_timer)
+            return false;
+    }
+    buffer->ref_count ++;
+    if(sub->sampled)
+        tbus_buffer_release(sub->sampled);
+    sub->sampled = buffer;
+    return true;
+}
+
+static void on_sample_timer(void* ctx)
+{
+    tbus_subscription_t* sub = (tbus_subscription_t*)ctx;
+    tbus_client_t* client = sub->client;
+    tbus_buffer_t* buffer = sub->sampled;
+    sub->sample_timer = NULL;
+    sub->sampled = NULL;
+    if(!buffer)
+        return;
+    sub->last_sent_ms = monotonic_ms();
+    int rc = client_send_buffer(client, buffer, sub->sub_index);
+    tbus_buffer_release(buffer);
+    if(rc != 0)
+        on_client_error(client);
+}
+
+static uint64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void tbus_subscription_free(tbus_subscription_t* sub)
+{
+    if(!sub)
+        return;
+    if(sub->sample_timer)
+        tev_clear_timeout(broker->tev, sub->sample_timer);
+    if(sub->sampled)
+        tbus_buffer_release(sub->sampled);
+    if(sub->filters)
+        free(sub->filters);
+    if(sub->topic)
+        broker->topic_names->release(broker->topic_names, sub->topic);
+    free(sub);
+}
+
+static tbus_buffer_t* tbus_buffer_new(uint8_t* data, size_t size)
+{
+    tbus_buffer_t* buffer = malloc(sizeof(tbus_buffer_t));
+    if(!buffer)
+        return NULL;
+    bzero(buffer, sizeof(tbus_buffer_t));
+    buffer->data = data;
+    buffer->size = size;
+    return buffer;
+}
+
+static void tbus_buffer_free(tbus_buffer_t* buffer)
+{
+    if(!buffer)
+        return;
+    if(buffer->data && buffer->from_reader)
+    {
+        /** Also trimmed by the reader, but it may be gone by now */
+        if(frame_buffer_free(buffer->data) && !broker->frame_trim_timer)
+            broker->frame_trim_timer = tev_set_timeout(broker->tev, on_frame_trim_timer, NULL, FRAME_BUFFER_IDLE_MS);
+    }
+    else if(buffer->data)
+        free(buffer->data);
+    free(buffer);
+}
+
+/** Drop one reference, the last one returns the publisher's credit and frees the buffer */
+static void tbus_buffer_release(tbus_buffer_t* buffer)
+{
+    buffer->ref_count --;
+    /** Credit does not wait for the history */
+    if(buffer->publisher && buffer->ref_count == (buffer->in_history ? 1 : 0))
+    {
+        client_return_credit(buffer->publisher, buffer->credit);
+        buffer->publisher = NULL;
+    }
+    if(buffer->ref_count > 0)
+        return;
+    LIST_UNLINK(&buffer->node);
+    tbus_buffer_free(buffer);
+}
+
+static tbus_buffer_ref_t* tbus_buffer_ref_new(tbus_buffer_t* buffer)
+{
+    tbus_buffer_ref_t* ref = malloc(sizeof(tbus_buffer_ref_t));
+    if(!ref)
+        return NULL;
+    bzero(ref, sizeof(tbus_buffer_ref_t));
+    ref->buffer = buffer;
+    return ref;
+}
+
+static void tbus_buffer_ref_free(tbus_buffer_ref_t* ref)
+{
+    if(!ref)
+        return;
+    free(ref);
+}
+
+static void free_list_head_with_ctx(void* data, void* ctx)
+{
+    if(data)
+        free(data);
+}
+
+static int journals_init(const tbus_broker_config_t* config)
+{
+    if(config->journal_pattern_count == 0)
+        return 0;
+    broker->journals = topic_tree_new();
+    if(!broker->journals)
+        return -1;
+    for(int i = 0; i < config->journal_pattern_count; i++)
+    {
+        const char* pattern = config->journal_patterns[i];
+        /** Segment files are named after the pattern, escape the path separator */
+        char name[NAME_MAX / 2];
+        size_t name_len = 0;
+        for(const char* c = pattern; *c; c++)
+        {
+            if(name_len + 4 > sizeof(name))
+            {
+                fprintf(stderr, "Journal pattern too long: %s\n", pattern);
+                return -1;
+            }
+            if(*c == '/' || *c == '%')
+                name_len += sprintf(name + name_len, "%%%02X", *c);
+            else
+                name[name_len++] = *c;
+        }
+        name[name_len] = '\0';
+        journal_t* journal = journal_new(config->journal_dir, name, &config->journal);
+        if(!journal)
+        {
+            fprintf(stderr, "Failed to open journal for %s in %s\n", pattern, config->journal_dir);
+            return -1;
+        }
+        if(broker->journals->insert(broker->journals, pattern, journal) != journal)
+        {
+            fprintf(stderr, "Invalid or duplicated journal pattern: %s\n", pattern);
+            journal->close(journal);
+            return -1;
+        }
+        broker->journal_list[broker->journal_count++] = journal;
+    }
+    if(config->journal.max_age_s != 0)
+    {
+        broker->journal_trim_timer = tev_set_timeout(broker->tev, on_journal_trim_timer, NULL, JOURNAL_TRIM_INTERVAL_MS);
+        if(!broker->journal_trim_timer)
+            return -1;
+    }
+    return 0;
+}
 
-static void publish_on_match(void* data, void* ctx)
+/** Continue the sequences of the journaled topics and refill their history after a restart */
+static void journals_recover()
 {
-    list_head_t* subs = (list_head_t*)data;
-    publish_on_match_ctx_t* publish_ctx = (publish_on_match_ctx_t*)ctx;
-    /** Overwrite the sub_index */
-    LIST_FOR_EACH_SAFE(subs, node)
+    if(!broker->config.sequence)
+        return;
+    for(int i = 0; i < broker->journal_count; i++)
+        broker->journal_list[i]->for_each(broker->journal_list[i], journal_recover_record, NULL);
+}
+
+static void journal_recover_record(const uint8_t* data, size_t size, uint64_t timestamp_ms, void* ctx)
+{
+    tbus_message_t view;
+    if(tbus_message_view(data, size, &view) != 0 || view.command != TBUS_MSG_CMD_PUB || !view.topic || !view.p_seq)
+        return;
+    tbus_message_seq_t seq = 0;
+    READ_FIELD(view.p_seq, seq);
+    if(seq == 0)
+        return;
+    tbus_topic_state_t* state = topic_state_get(view.topic);
+    /** Overlapping patterns journal the same frame more than once */
+    if(!state || seq <= state->last_seq)
+        return;
+    state->last_seq = seq;
+    if(!state->history)
+        return;
+    uint8_t* copy = malloc(size);
+    if(!copy)
+        return;
+    memcpy(copy, data, size);
+    tbus_buffer_t* buffer = tbus_buffer_new(copy, size);
+    if(!buffer)
     {
-        tbus_subscription_t* sub = GET_SUBSCRIPTION_FROM_TOPIC_TREE_NODE(node);
-        publish_on_match_handle_subscription(sub, publish_ctx);
+        free(copy);
+        return;
     }
+    /** Point into the copy */
+    tbus_message_view(copy, size, &view);
+    buffer->p_sub_index = view.p_sub_index;
+    buffer->priority = tbus_message_get_priority(&view);
+    buffer->seq = seq;
+    topic_state_push_history(state, buffer);
+    LIST_LINK(&broker->buffers, &buffer->node);
 }
 
-static void publish_on_match_handle_subscription(tbus_subscription_t* sub, publish_on_match_ctx_t* publish_ctx)
+static void journal_on_match(void* data, void* ctx)
 {
-    ssize_t bytes_written = 0;
-    /** Check if client is already in error list, this list should be short. */
-    LIST_FOR_EACH(&publish_ctx->error_clients, node)
+    journal_t* journal = (journal_t*)data;
+    tbus_buffer_t* buffer = (tbus_buffer_t*)ctx;
+    if(journal->append(journal, buffer->data, buffer->size) != 0)
+        fprintf(stderr, "Failed to append to journal\n");
+}
+
+static void on_journal_trim_timer(void* ctx)
+{
+    for(int i = 0; i < broker->journal_count; i++)
+        broker->journal_list[i]->trim(broker->journal_list[i]);
+    broker->journal_trim_timer = tev_set_timeout(broker->tev, on_journal_trim_timer, NULL, JOURNAL_TRIM_INTERVAL_MS);
+}
+
+static void on_frame_trim_timer(void* ctx)
+{
+    broker->frame_trim_timer = NULL;
+    if(frame_buffer_trim(FRAME_BUFFER_IDLE_MS))
+        broker->frame_trim_timer = tev_set_timeout(broker->tev, on_frame_trim_timer, NULL, FRAME_BUFFER_IDLE_MS);
+}
+
+static void bridges_init(const tbus_broker_config_t* config)
+{
+    /** Keep the id of the broker taken over from, its frames may still be in flight */
+    if(broker->id == 0 && getrandom(&broker->id, sizeof(broker->id), GRND_NONBLOCK) != sizeof(broker->id))
+        broker->id = ((tbus_message_origin_t)time(NULL) << 32) ^ (tbus_message_origin_t)getpid();
+    if(broker->id == 0)
+        broker->id = 1;
+    broker->bridge_count = config->bridge_count;
+    for(int i = 0; i < broker->bridge_count; i++)
     {
-        tbus_client_t* error_client = GET_CLIENT_FROM_BROKER_NODE(node);
-        if(error_client == sub->client)
+        tbus_bridge_t* bridge = &broker->bridges[i];
+        bridge->uds_path = config->bridge_paths[i];
+        /** The other broker may not be up yet, keep retrying */
+        bridge_connect(bridge);
+    }
+}
+
+static void bridge_connect(tbus_bridge_t* bridge)
+{
+    tbus_client_t* client = NULL;
+    int fd = uds_connect(bridge->uds_path, SOCK_STREAM);
+    if(fd < 0)
+        goto error;
+    client = tbus_client_new(broker->tev, fd, false);
+    if(!client)
+        goto error;
+    LIST_LINK(&broker->clients, &client->broker_node);
+    client->bridge = bridge;
+    bridge->client = client;
+    for(int i = 0; i < broker->config.bridge_pattern_count; i++)
+    {
+        tbus_message_sub_index_t sub_index = i;
+        tbus_message_t msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.command = TBUS_MSG_CMD_SUB;
+        msg.topic = (char*)broker->config.bridge_patterns[i];
+        msg.p_sub_index = &sub_index;
+        /** What we forward must not come straight back */
+        tbus_message_sub_flags_t flags = TBUS_MSG_SUB_FLAG_NO_LOCAL;
+        msg.p_sub_flags = &flags;
+        if(client_send_message(client, &msg) != 0)
+        {
+            /** Retries from tbus_client_free */
+            on_client_error(client);
             return;
+        }
     }
-    /** Overwrite sub index. */
-    WRITE_SUB_INDEX(publish_ctx->view, sub->sub_index);
-    /** Try write message in one go */
-    if(!LIST_IS_EMPTY(&sub->client->buffers))
+    return;
+error:
+    if(fd >= 0)
+        close(fd);
+    bridge_schedule_retry(bridge);
+}
+
+static void bridge_schedule_retry(tbus_bridge_t* bridge)
+{
+    if(bridge->retry_timer)
+        return;
+    bridge->retry_timer = tev_set_timeout(broker->tev, on_bridge_retry_timer, bridge, BRIDGE_RETRY_INTERVAL_MS);
+    if(!bridge->retry_timer)
+        fprintf(stderr, "Failed to schedule bridge reconnection to %s\n", bridge->uds_path);
+}
+
+static void on_bridge_retry_timer(void* ctx)
+{
+    tbus_bridge_t* bridge = (tbus_bridge_t*)ctx;
+    bridge->retry_timer = NULL;
+    bridge_connect(bridge);
+}
+
+static bool bridge_pattern_match(const char* topic)
+{
+    for(int i = 0; i < broker->config.bridge_pattern_count; i++)
     {
-        /** Client is busy */
-        goto add_ref;
+        if(topic_tree_pattern_match(broker->config.bridge_patterns[i], topic))
+            return true;
     }
-    bytes_written = send(sub->client->fd, publish_ctx->buffer->data, publish_ctx->buffer->size, MSG_NOSIGNAL);
-    if(bytes_written < 0)
+    return false;
+}
+
+/**
+ * Take over the sockets and state of the broker listening on path.
+ * Starts fresh if no broker is there.
+ */
+static int handoff_receive(const char* path)
+{
+    int conn = uds_connect(path, SOCK_SEQPACKET);
+    if(conn < 0)
+        return 0;
+    if(!handoff_peer_trusted(conn))
+        goto error;
+    /** The old broker stops serving while it hands over, block until it is done */
+    if(fcntl(conn, F_SETFL, 0) != 0)
+        goto error;
+    tbus_client_t* client = NULL;
+    tbus_topic_state_t* state = NULL;
+    for(;;)
     {
-        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        handoff_header_t header;
+        uint8_t* data = NULL;
+        int fd = -1;
+        if(handoff_recv(conn, &header, &data, &fd) != 0)
+            goto error;
+        if(header.type == HANDOFF_DONE)
         {
-            /** Client is busy */
-            goto add_ref;
+            broker->id = header.values[0];
+            break;
         }
-        /** Client error */
-        LIST_UNLINK(&sub->client->broker_node);
-        LIST_LINK(&publish_ctx->error_clients, &sub->client->broker_node);
-        return;
+        int rc = handoff_restore(&header, data, fd, &client, &state);
+        /** 1 if data was kept */
+        if(rc != 1)
+            free(data);
+        if(rc < 0)
+            goto error;
     }
-    if(bytes_written == publish_ctx->buffer->size)
-        return;
-add_ref:
-    tbus_buffer_ref_t* ref = tbus_buffer_ref_new(publish_ctx->buffer);
-    if(!ref)
+    /** Past this the sockets are ours, the old broker lets go of them */
+    if(handoff_send(conn, HANDOFF_COMMIT, 0, 0, 0, NULL, 0, -1) != 0)
+        goto error;
+    /** Closed once the old broker let go of everything, its journals included */
+    char eof;
+    while(recv(conn, &eof, sizeof(eof), 0) > 0)
+        ;
+    close(conn);
+    /** Credit of the frames taken over is not tracked here, grant it back at once */
+    LIST_FOR_EACH(&broker->clients, node)
     {
-        /** Critical for that client */
-        LIST_UNLINK(&sub->client->broker_node);
-        LIST_LINK(&publish_ctx->error_clients, &sub->client->broker_node);
-        return;
+        tbus_client_t* taken_over = GET_CLIENT_FROM_BROKER_NODE(node);
+        if(taken_over->flow_control)
+            client_return_credit(taken_over, 0);
     }
-    ref->bytes_written = bytes_written;
-    ref->sub_index = sub->sub_index;
-    LIST_LINK(&sub->client->buffers, &ref->node);
-    publish_ctx->buffer->ref_count ++;
-    tev_set_write_handler(broker->tev, sub->client->fd, on_client_write_ready, sub->client);
+    return 0;
+error:
+    fprintf(stderr, "Failed to take over from %s\n", path);
+    close(conn);
+    return -1;
 }
 
-static void on_client_write_ready(void* ctx)
+/** Apply one handoff record, takes fd */
+static int handoff_restore(const handoff_header_t* header, uint8_t* data, int fd, tbus_client_t** p_client, tbus_topic_state_t** p_state)
 {
-    tbus_client_t* client = (tbus_client_t* )ctx;
-    LIST_FOR_EACH_SAFE(&client->buffers, node)
-    {   
-        tbus_buffer_ref_t* ref = GET_BUFFER_REF_FROM_NODE(node);
-        ssize_t bytes_written = send(client->fd, ref->buffer->data + ref->bytes_written, ref->buffer->size - ref->bytes_written, MSG_NOSIGNAL);
-        if(bytes_written < 0)
+    tbus_client_t* client = *p_client;
+    switch(header->type)
+    {
+        case HANDOFF_LISTENER:
         {
-            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            if(fd < 0)
+                return -1;
+            int* p_fd = &broker->fd;
+            if(header->flags & HANDOFF_FLAG_SEQPACKET)
+                p_fd = &broker->seqpacket_fd;
+            else if(header->flags & HANDOFF_FLAG_DGRAM)
+                p_fd = &broker->dgram_fd;
+            if(*p_fd >= 0)
+                close(*p_fd);
+            *p_fd = fd;
+            return 0;
+        }
+        case HANDOFF_CLIENT:
+        {
+            if(fd < 0)
+                return -1;
+            client = tbus_client_new(broker->tev, fd, header->flags & HANDOFF_FLAG_SEQPACKET);
+            if(!client)
             {
-                /** Client is busy */
-                break;
+                /** Lost, the rest of its records are skipped */
+                close(fd);
+                *p_client = NULL;
+                return 0;
             }
-            /** Client error */
-            LIST_UNLINK(&client->broker_node);
-            tbus_buffer_ref_free(ref);
-            return;
+            LIST_LINK(&broker->clients, &client->broker_node);
+            if(header->flags & HANDOFF_FLAG_FLOW_CONTROL)
+            {
+                client->flow_control = true;
+                client->credit_window = header->values[0];
+                client->credit_pending = header->values[1];
+            }
+            /** Proven to the old broker already */
+            if((header->flags & HANDOFF_FLAG_DGRAM) && data && client_dgram_register(client, data, header->size) == 0)
+                client->dgram_ready = true;
+            *p_client = client;
+            return 0;
         }
-        ref->bytes_written += bytes_written;
-        if(ref->bytes_written == ref->buffer->size)
+        case HANDOFF_SUBSCRIPTION:
         {
-            /** Transmission finished */
-            LIST_UNLINK(&ref->node);
-            ref->buffer->ref_count --;
-            if(ref->buffer->ref_count == 0)
+            if(!client || !data)
+                return 0;
+            tbus_message_sub_index_t sub_index = header->values[0];
+            tbus_message_interval_t interval_ms = header->values[1];
+            tbus_message_sub_flags_t sub_flags = header->flags;
+            size_t topic_size = strnlen((char*)data, header->size) + 1;
+            tbus_message_t msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.command = TBUS_MSG_CMD_SUB;
+            msg.topic = (char*)data;
+            msg.p_sub_index = &sub_index;
+            if(interval_ms > 0)
+                msg.p_interval = &interval_ms;
+            msg.p_sub_flags = &sub_flags;
+            if(topic_size < header->size)
             {
-                LIST_UNLINK(&ref->buffer->node);
-                tbus_buffer_free(ref->buffer);
+                msg.p_filter = (tbus_message_filter_t*)(data + topic_size);
+                msg.filter_count = (header->size - topic_size) / sizeof(tbus_message_filter_t);
             }
-            tbus_buffer_ref_free(ref);
+            handle_subscription(&msg, client);
+            return 0;
+        }
+        case HANDOFF_PARTIAL:
+        {
+            if(!client)
+                return 0;
+            if(client->reader->set_partial(client->reader, data, header->size) != 0)
+            {
+                tbus_client_free(client);
+                *p_client = NULL;
+            }
+            return 0;
+        }
+        case HANDOFF_PENDING:
+        {
+            if(!client || !data)
+                return 0;
+            /** The sub index is already in place */
+            tbus_buffer_t* buffer = tbus_buffer_new(data, header->size);
+            if(!buffer)
+                return -1;
+            buffer->priority = header->values[0];
+            if(client_queue_buffer(client, buffer, header->values[1], 0) != 0)
+            {
+                buffer->data = NULL;
+                tbus_buffer_free(buffer);
+                return -1;
+            }
+            LIST_LINK(&broker->buffers, &buffer->node);
+            break;
         }
+        case HANDOFF_TOPIC:
+        {
+            if(!data)
+                return -1;
+            /** This broker may not track sequences */
+            *p_state = NULL;
+            if(!broker->config.sequence)
+                return 0;
+            tbus_topic_state_t* state = topic_state_get((const char*)data);
+            if(!state)
+                return -1;
+            state->last_seq = header->values[0];
+            *p_state = state;
+            return 0;
+        }
+        case HANDOFF_HISTORY:
+        {
+            tbus_topic_state_t* state = *p_state;
+            /** This broker may keep less or no history */
+            if(!state || !state->history || !data)
+                return 0;
+            tbus_message_t view;
+            if(tbus_message_view(data, header->size, &view) != 0)
+                return 0;
+            tbus_buffer_t* buffer = tbus_buffer_new(data, header->size);
+            if(!buffer)
+                return -1;
+            buffer->p_sub_index = view.p_sub_index;
+            buffer->priority = header->values[0];
+            buffer->seq = header->values[1];
+            topic_state_push_history(state, buffer);
+            LIST_LINK(&broker->buffers, &buffer->node);
+            break;
+        }
+        default:
+            if(fd >= 0)
+                close(fd);
+            return 0;
     }
-    if(!LIST_IS_EMPTY(&client->buffers))
+    /** The buffer owns data now */
+    return 1;
+}
+
+/** A new broker is taking over, hand everything to it and exit */
+static void on_upgrade_connect(void* ctx)
+{
+    int conn = accept4(broker->upgrade_fd, NULL, NULL, SOCK_CLOEXEC);
+    if(conn < 0)
+        return;
+    if(!handoff_peer_trusted(conn))
     {
-        /** Still have data to write. Write handler is still valid */
+        close(conn);
         return;
     }
-    tev_set_write_handler(broker->tev, client->fd, NULL, NULL);
+    /** Let the new broker listen for the next upgrade */
+    tev_set_read_handler(broker->tev, broker->upgrade_fd, NULL, NULL);
+    close(broker->upgrade_fd);
+    broker->upgrade_fd = -1;
+    if(handoff_send_state(conn) != 0 || handoff_wait_commit(conn) != 0)
+    {
+        fprintf(stderr, "Failed to hand over, keep serving\n");
+        /** The new broker did not commit, it drops its copies of the sockets without serving them */
+        close(conn);
+        broker->upgrade_fd = uds_listen(broker->config.upgrade_path, SOCK_SEQPACKET);
+        if(broker->upgrade_fd >= 0 && tev_set_read_handler(broker->tev, broker->upgrade_fd, on_upgrade_connect, NULL) < 0)
+        {
+            close(broker->upgrade_fd);
+            broker->upgrade_fd = -1;
+        }
+        return;
+    }
+    broker_abandon_clients();
+    broker_exit();
+    close(conn);
 }
 
-static void on_client_error(void* ctx)
+static int handoff_wait_commit(int conn)
 {
-    tbus_client_t* client = (tbus_client_t*)ctx;
-    LIST_UNLINK(&client->broker_node);
-    tbus_client_free(client);
+    struct timeval timeout = { .tv_sec = HANDOFF_COMMIT_TIMEOUT_S };
+    if(setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0)
+        return -1;
+    handoff_header_t header;
+    uint8_t* data = NULL;
+    int fd = -1;
+    if(handoff_recv(conn, &header, &data, &fd) != 0)
+        return -1;
+    free(data);
+    if(fd >= 0)
+        close(fd);
+    return header.type == HANDOFF_COMMIT ? 0 : -1;
 }
 
-static tbus_subscription_t* tbus_subscription_new(const char* topic, tbus_message_sub_index_t* p_sub_index, tbus_client_t* client)
+/** Only a broker of the same user may take over or hand over the clients */
+static bool handoff_peer_trusted(int conn)
 {
-    if (!topic || !client)
-        return NULL;
-    tbus_subscription_t* sub = malloc(sizeof(tbus_subscription_t));
-    if(!sub)
-        goto error;
-    bzero(sub, sizeof(tbus_subscription_t));
-    sub->topic = strdup(topic);
-    if(!sub->topic)
-        goto error;
-    if (p_sub_index)
-        memcpy(&sub->sub_index, p_sub_index, sizeof(tbus_message_sub_index_t));
-    sub->client = client;
-    return sub;
-error:
-    if(sub)
-        tbus_subscription_free(sub);
-    return NULL;
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0)
+        return false;
+    if(cred.uid != geteuid())
+    {
+        fprintf(stderr, "Upgrade peer of uid %u refused\n", (unsigned)cred.uid);
+        return false;
+    }
+    return true;
 }
 
-static void tbus_subscription_free(tbus_subscription_t* sub)
+/**
+ * The new broker owns the client sockets now. Drop our copies without the normal teardown,
+ * nothing must be written to them from here, credit returns included.
+ */
+static void broker_abandon_clients()
 {
-    if(!sub)
-        return;
-    if(sub->topic)
-        free(sub->topic);
-    free(sub);
+    LIST_FOR_EACH(&broker->clients, node)
+    {
+        tbus_client_t* client = GET_CLIENT_FROM_BROKER_NODE(node);
+        if(client->reader)
+        {
+            client->reader->close(client->reader);
+            client->reader = NULL;
+        }
+        if(client->fd < 0)
+            continue;
+        if(client->queue_depth > 0)
+            tev_set_write_handler(broker->tev, client->fd, NULL, NULL);
+        close(client->fd);
+        client->fd = -1;
+    }
+    LIST_FOR_EACH(&broker->buffers, node)
+    {
+        tbus_buffer_t* buffer = GET_BUFFER_FROM_NODE(node);
+        buffer->publisher = NULL;
+    }
 }
 
-static tbus_buffer_t* tbus_buffer_new(uint8_t* data, size_t size)
+static int handoff_send_state(int conn)
 {
-    tbus_buffer_t* buffer = malloc(sizeof(tbus_buffer_t));
-    if(!buffer)
-        return NULL;
-    bzero(buffer, sizeof(tbus_buffer_t));
-    buffer->data = data;
-    buffer->size = size;
-    return buffer;
+    if(handoff_send(conn, HANDOFF_LISTENER, 0, 0, 0, NULL, 0, broker->fd) != 0)
+        return -1;
+    if(broker->seqpacket_fd >= 0 && handoff_send(conn, HANDOFF_LISTENER, HANDOFF_FLAG_SEQPACKET, 0, 0, NULL, 0, broker->seqpacket_fd) != 0)
+        return -1;
+    if(broker->dgram_fd >= 0 && handoff_send(conn, HANDOFF_LISTENER, HANDOFF_FLAG_DGRAM, 0, 0, NULL, 0, broker->dgram_fd) != 0)
+        return -1;
+    LIST_FOR_EACH(&broker->clients, node)
+    {
+        tbus_client_t* client = GET_CLIENT_FROM_BROKER_NODE(node);
+        /** The new broker makes its own bridge connections */
+        if(client->bridge)
+            continue;
+        if(handoff_send_client(conn, client) != 0)
+            return -1;
+    }
+    map_entry_t entry = {0};
+    map_forEach(broker->topic_states, entry)
+    {
+        if(handoff_send_topic(conn, entry.value) != 0)
+            return -1;
+    }
+    return handoff_send(conn, HANDOFF_DONE, 0, broker->id, 0, NULL, 0, -1);
 }
 
-static void tbus_buffer_free(tbus_buffer_t* buffer)
+/** Pending requests are not handed over, their requesters time out */
+static int handoff_send_client(int conn, tbus_client_t* client)
 {
-    if(!buffer)
-        return;
-    if(buffer->data)
-        free(buffer->data);
-    free(buffer);
+    uint32_t flags = 0;
+    if(client->seqpacket)
+        flags |= HANDOFF_FLAG_SEQPACKET;
+    if(client->flow_control)
+        flags |= HANDOFF_FLAG_FLOW_CONTROL;
+    const void* dgram_addr = NULL;
+    size_t dgram_addr_size = 0;
+    if(client->dgram_ready)
+    {
+        flags |= HANDOFF_FLAG_DGRAM;
+        dgram_addr = client->dgram_addr.sun_path;
+        dgram_addr_size = client->dgram_addr_len - offsetof(struct sockaddr_un, sun_path);
+    }
+    if(handoff_send(conn, HANDOFF_CLIENT, flags, client->credit_window, client->credit_outstanding + client->credit_pending, dgram_addr, dgram_addr_size, client->fd) != 0)
+        return -1;
+    if(client->subscriptions)
+    {
+        map_entry_t entry = {0};
+        map_forEach(client->subscriptions, entry)
+        {
+            tbus_subscription_t* sub = entry.value;
+            size_t topic_size = strlen(sub->topic) + 1;
+            size_t filters_size = sub->filter_count * sizeof(tbus_message_filter_t);
+            uint8_t* payload = malloc(topic_size + filters_size);
+            if(!payload)
+                return -1;
+            memcpy(payload, sub->topic, topic_size);
+            if(filters_size > 0)
+                memcpy(payload + topic_size, sub->filters, filters_size);
+            int rc = handoff_send(conn, HANDOFF_SUBSCRIPTION, sub->flags, sub->sub_index, sub->interval_ms, payload, topic_size + filters_size, -1);
+            free(payload);
+            if(rc != 0)
+                return -1;
+        }
+    }
+    size_t partial_size = 0;
+    const uint8_t* partial = client->reader->get_partial(client->reader, &partial_size);
+    if(partial_size > 0 && handoff_send(conn, HANDOFF_PARTIAL, 0, 0, 0, partial, partial_size, -1) != 0)
+        return -1;
+    /** The frame being written goes first, the rest keep their order in each queue */
+    if(client->writing && handoff_send_pending(conn, client->writing) != 0)
+        return -1;
+    for(int i = TBUS_MSG_PRIORITY_LEVELS - 1; i >= 0; i--)
+    {
+        LIST_FOR_EACH(&client->buffers[i], node)
+        {
+            tbus_buffer_ref_t* ref = GET_BUFFER_REF_FROM_NODE(node);
+            if(ref == client->writing)
+                continue;
+            if(handoff_send_pending(conn, ref) != 0)
+                return -1;
+        }
+    }
+    if(client->subscriptions)
+    {
+        /** Held samples are the newest, the new broker sends them right away */
+        map_entry_t entry = {0};
+        map_forEach(client->subscriptions, entry)
+        {
+            tbus_subscription_t* sub = entry.value;
+            if(!sub->sampled)
+                continue;
+            tbus_buffer_ref_t ref = {
+                .buffer = sub->sampled,
+                .sub_index = sub->sub_index
+            };
+            if(handoff_send_pending(conn, &ref) != 0)
+                return -1;
+        }
+    }
+    return 0;
 }
 
-static tbus_buffer_ref_t* tbus_buffer_ref_new(tbus_buffer_t* buffer)
+static int handoff_send_pending(int conn, tbus_buffer_ref_t* ref)
 {
-    tbus_buffer_ref_t* ref = malloc(sizeof(tbus_buffer_ref_t));
-    if(!ref)
-        return NULL;
-    bzero(ref, sizeof(tbus_buffer_ref_t));
-    ref->buffer = buffer;
-    return ref;
+    tbus_buffer_t* buffer = ref->buffer;
+    /** The buffer may be shared, it is rewritten before each send anyway */
+    if(buffer->p_sub_index)
+        WRITE_FIELD(buffer->p_sub_index, ref->sub_index);
+    return handoff_send(conn, HANDOFF_PENDING, 0, buffer->priority, ref->bytes_written, buffer->data, buffer->size, -1);
 }
 
-static void tbus_buffer_ref_free(tbus_buffer_ref_t* ref)
+static int handoff_send_topic(int conn, tbus_topic_state_t* state)
 {
-    if(!ref)
-        return;
-    free(ref);
+    if(handoff_send(conn, HANDOFF_TOPIC, 0, state->last_seq, 0, state->topic, strlen(state->topic) + 1, -1) != 0)
+        return -1;
+    if(!state->history)
+        return 0;
+    size_t depth = broker->config.history_depth;
+    size_t oldest = (state->history_head + depth - state->history_count) % depth;
+    for(size_t i = 0; i < state->history_count; i++)
+    {
+        tbus_buffer_t* buffer = state->history[(oldest + i) % depth];
+        if(handoff_send(conn, HANDOFF_HISTORY, 0, buffer->priority, buffer->seq, buffer->data, buffer->size, -1) != 0)
+            return -1;
+    }
+    return 0;
 }
 
-static void free_list_head_with_ctx(void* data, void* ctx)
+/** A header record carrying fd if not -1, then the payload in records of up to HANDOFF_CHUNK_SIZE */
+static int handoff_send(int conn, uint32_t type, uint32_t flags, uint64_t value0, uint64_t value1, const void* data, size_t size, int fd)
 {
-    if(data)
-        free(data);
+    handoff_header_t header = {
+        .type = type,
+        .flags = flags,
+        .values = { value0, value1 },
+        .size = size
+    };
+    struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    if(fd >= 0)
+    {
+        memset(control, 0, sizeof(control));
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    if(sendmsg(conn, &hdr, MSG_NOSIGNAL) != sizeof(header))
+        return -1;
+    for(size_t offset = 0; offset < size; offset += HANDOFF_CHUNK_SIZE)
+    {
+        size_t chunk = size - offset < HANDOFF_CHUNK_SIZE ? size - offset : HANDOFF_CHUNK_SIZE;
+        if(send(conn, (const uint8_t*)data + offset, chunk, MSG_NOSIGNAL) != chunk)
+            return -1;
+    }
+    return 0;
+}
+
+/** Receive one record sent by handoff_send. data is NUL terminated, fd is -1 if none. */
+static int handoff_recv(int conn, handoff_header_t* header, uint8_t** p_data, int* p_fd)
+{
+    *p_data = NULL;
+    *p_fd = -1;
+    struct iovec iov = { .iov_base = header, .iov_len = sizeof(*header) };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    ssize_t len = recvmsg(conn, &hdr, MSG_CMSG_CLOEXEC);
+    struct cmsghdr* cmsg = len > 0 ? CMSG_FIRSTHDR(&hdr) : NULL;
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(p_fd, CMSG_DATA(cmsg), sizeof(int));
+    if(len != sizeof(*header) || (hdr.msg_flags & MSG_CTRUNC))
+        goto error;
+    if(header->size == 0)
+        return 0;
+    *p_data = malloc(header->size + 1);
+    if(!*p_data)
+        goto error;
+    for(size_t offset = 0; offset < header->size; offset += len)
+    {
+        size_t chunk = header->size - offset < HANDOFF_CHUNK_SIZE ? header->size - offset : HANDOFF_CHUNK_SIZE;
+        len = recv(conn, *p_data + offset, chunk, 0);
+        if(len != chunk)
+            goto error;
+    }
+    (*p_data)[header->size] = 0;
+    return 0;
+error:
+    if(*p_fd >= 0)
+        close(*p_fd);
+    free(*p_data);
+    *p_data = NULL;
+    *p_fd = -1;
+    return -1;
 }
@@ -0,0 +1,24 @@
+#pragma once
+
+/**
+ * Capture files written by tbus_sub -w and replayed by tbus_pub -r.
+ * A tbus_capture_header_t, then one tbus_capture_record_t per message,
+ * each followed by its topic (no \0) and its data. Host byte order.
+ */
+
+#include <stdint.h>
+
+#define TBUS_CAPTURE_MAGIC "TBUSCAP1"
+
+typedef struct
+{
+    char magic[8];
+} __attribute__((packed)) tbus_capture_header_t;
+
+typedef struct
+{
+    /** CLOCK_REALTIME when the message was received */
+    uint64_t timestamp_ns;
+    uint32_t topic_len;
+    uint32_t data_len;
+} __attribute__((packed)) tbus_capture_record_t;
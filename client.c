@@ -1,7 +1,10 @@
 #include <tev/map.h>
+#include <stdbool.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -10,21 +13,88 @@
 #include "tbus.h"
 #include "message.h"
 #include "message_reader.h"
+#include "frame_buffer.h"
 #include "message_writer.h"
 #include "common.h"
 
+_Static_assert(TBUS_PRIORITY_MAX < TBUS_MSG_PRIORITY_LEVELS, "Not enough priority queues");
+_Static_assert(TBUS_FILTER_MASKED_EQUAL == TBUS_MSG_FILTER_MASKED_EQUAL && TBUS_FILTER_RANGE == TBUS_MSG_FILTER_RANGE, "Filter ops mismatch");
+_Static_assert(TBUS_MAX_FILTERS <= TBUS_MSG_MAX_FILTERS, "The broker does not take that many filters");
+
+#define RECONNECT_MIN_DELAY_MS (100)
+#define RECONNECT_MAX_DELAY_MS (5000)
+/** Kept before loaned data, enough for the head of a frame with a topic of about 200 bytes */
+#define LOAN_HEAD_ROOM (256)
+
 typedef struct
 {
     tbus_message_sub_index_t index;    
     tbus_subscribe_callback_t callback;
     void* ctx;
+    tbus_request_callback_t request_callback;
+    void* request_ctx;
+    /** Sent with every SUB of this subscription */
+    tbus_message_filter_t* filters;
+    uint32_t filter_count;
+    tbus_message_interval_t interval_ms;
+    tbus_message_sub_flags_t flags;
 } client_subscription_t;
 
+/** Changes to a subscription that go out with its SUB */
+typedef struct
+{
+    bool set_filters;
+    const tbus_filter_t* filters;
+    uint32_t filter_count;
+    bool set_interval;
+    uint32_t interval_ms;
+    /** TBUS_MSG_SUB_FLAG_* to set */
+    tbus_message_sub_flags_t add_flags;
+} client_subscription_options_t;
+
+typedef struct tbus_client_s tbus_client_t;
+
+typedef struct
+{
+    tbus_publisher_t iface;
+    tbus_client_t* client;
+    /** The frame up to the DATA TLV header, its lengths are set on each publish */
+    uint8_t* head;
+    size_t head_len;
+} client_publisher_t;
+
+typedef struct
+{
+    tbus_loan_t iface;
+    /** The writer's memory iface.data points to */
+    message_loan_t* loan;
+} client_loan_t;
+
+typedef struct
+{
+    tbus_message_handle_t iface;
+    /** The reader's buffer the message is in */
+    uint8_t* buffer;
+    int ref_count;
+} client_message_handle_t;
+
 typedef struct
+{
+    tbus_client_t* client;
+    tbus_message_correlation_id_t id;
+    tev_timeout_handle_t timeout;
+    tbus_reply_callback_t callback;
+    void* ctx;
+} client_request_t;
+
+struct tbus_client_s
 {
     tbus_t iface;
     tev_handle_t tev;
+    /** -1 while reconnecting */
     int fd;
+    char* path;
+    int type;
     message_reader_t* reader;
     message_writer_t* writer;
     /** Map<string, client_subscription_t*> */
@@ -32,15 +102,101 @@ typedef struct
     /** Map<tbus_message_sub_index_t, client_subscription&> */
     map_handle_t subscriptions_by_index;
     tbus_message_sub_index_t next_index;
-} tbus_client_t;
+    /** Flow control */
+    bool flow_control;
+    /** The first credit from the broker is the whole window */
+    bool credit_granted;
+    /** Can go negative, a single message is allowed when nothing is outstanding */
+    int64_t credit;
+    size_t credit_outstanding;
+    tbus_message_credit_t credit_window;
+    /** Sequence of the message being delivered */
+    tbus_message_seq_t current_seq;
+    /** The message being delivered, only current while a reader still returns current_buffer */
+    const uint8_t* current_buffer;
+    const char* current_topic;
+    const uint8_t* current_data;
+    uint32_t current_data_len;
+    /** Map<tbus_message_correlation_id_t, client_request_t*> */
+    map_handle_t requests;
+    tbus_message_correlation_id_t next_correlation_id;
+    /** Reconnect instead of calling on_disconnect */
+    bool reconnect;
+    /** Publishes kept while disconnected */
+    size_t reconnect_buffer_limit;
+    size_t reconnect_buffered;
+    uint32_t reconnect_delay_ms;
+    tev_timeout_handle_t reconnect_timer;
+    /** Open a datagram socket next to each connection */
+    bool dgram;
+    /** Connected to the broker's TBUS_DGRAM_PATH_SUFFIX socket, -1 without */
+    int dgram_fd;
+    message_reader_t* dgram_reader;
+    /** The broker took our address, small publishes go as datagrams */
+    bool dgram_ready;
+};
 
-static int uds_connect(const char* path);
+static tbus_t* client_connect(tev_handle_t tev, const char* path, int type);
+static int uds_connect(const char* path, int type);
+static socklen_t uds_address(const char* path, struct sockaddr_un* addr);
 static void client_close(tbus_t* iface);
 static int client_subscribe(tbus_t* iface, const char* topic, tbus_subscribe_callback_t callback, void* ctx);
+static int client_subscribe_from(tbus_t* iface, const char* topic, uint64_t sequence, tbus_subscribe_callback_t callback, void* ctx);
+static int client_subscribe_filtered(tbus_t* iface, const char* topic, const tbus_filter_t* filters, uint32_t filter_count, tbus_subscribe_callback_t callback, void* ctx);
+static int client_subscribe_sampled(tbus_t* iface, const char* topic, uint32_t interval_ms, tbus_subscribe_callback_t callback, void* ctx);
+static client_subscription_t* client_subscribe_internal(tbus_client_t* this, const char* topic, tbus_message_seq_t* p_from_seq, const client_subscription_options_t* options);
+static int subscription_apply_options(client_subscription_t* subscription, const client_subscription_options_t* options);
+static int subscription_set_filters(client_subscription_t* subscription, const tbus_filter_t* filters, uint32_t filter_count);
+static void subscription_fill_message(client_subscription_t* subscription, tbus_message_t* msg);
+static uint64_t client_get_sequence(tbus_t* iface);
+static tbus_message_handle_t* client_retain_message(tbus_t* iface);
+static void message_handle_retain(tbus_message_handle_t* iface);
+static void message_handle_release(tbus_message_handle_t* iface);
 static void client_unsubscribe(tbus_t* iface, const char* topic);
 static int client_publish(tbus_t* iface, const char* topic, const uint8_t* data, uint32_t len);
+static int client_publish_with_priority(tbus_t* iface, const char* topic, const uint8_t* data, uint32_t len, uint8_t priority);
+static int client_publish_internal(tbus_client_t* this, const char* topic, const uint8_t* data, uint32_t len, tbus_message_priority_t* p_priority);
+static int client_reserve_publish(tbus_client_t* this, size_t size);
+static void client_commit_publish(tbus_client_t* this, size_t size);
+static tbus_publisher_t* client_create_publisher(tbus_t* iface, const char* topic);
+static int publisher_publish(tbus_publisher_t* iface, const uint8_t* data, uint32_t len);
+static void publisher_close(tbus_publisher_t* iface);
+static tbus_loan_t* client_loan(tbus_t* iface, uint32_t len);
+static int client_commit(tbus_t* iface, tbus_loan_t* loan, const char* topic);
+static void client_cancel_loan(tbus_t* iface, tbus_loan_t* loan);
+static int client_enable_flow_control(tbus_t* iface, uint32_t window);
+static int client_can_publish(tbus_t* iface, const char* topic, uint32_t len);
+static int client_has_credit(tbus_client_t* this, size_t size);
+static int client_serve(tbus_t* iface, const char* topic, tbus_request_callback_t callback, void* ctx);
+static int client_reply(tbus_t* iface, uint64_t request_id, const uint8_t* data, uint32_t len);
+static int client_request(tbus_t* iface, const char* topic, const uint8_t* data, uint32_t len, uint32_t timeout_ms, tbus_reply_callback_t callback, void* ctx);
+static int client_enable_reconnect(tbus_t* iface, uint32_t buffer_bytes);
+static int client_get_queued(tbus_t* iface, uint64_t* bytes, uint64_t* messages);
+static int client_set_watermarks(tbus_t* iface, uint64_t high, uint64_t low);
+static int client_write_control(tbus_client_t* this, const tbus_message_t* msg);
+static int client_write_publish(tbus_client_t* this, const tbus_message_t* msg);
+static int client_write_frame(tbus_client_t* this, const struct iovec* iov, int iov_count, size_t size);
+static int client_send_dgram(tbus_client_t* this, const struct iovec* iov, int iov_count, size_t size);
+static bool client_can_send_dgram(tbus_client_t* this, size_t size);
+static int client_dgram_open(tbus_client_t* this);
+static void client_dgram_close(tbus_client_t* this);
+static void on_dgram_ack(const tbus_message_t* msg, tbus_client_t* client);
+static void on_dgram_error(void* ctx);
+static void on_stream_read(void* ctx);
+static int client_attach(tbus_client_t* this, int fd);
+static void client_disconnect(tbus_client_t* this);
+static void on_reconnect_timer(void* ctx);
 static void on_message(const tbus_message_t* msg, void* ctx);
+static void set_current_message(tbus_client_t* client, const tbus_message_t* msg);
+static message_reader_t* client_delivering_reader(tbus_client_t* client);
+static void on_credit(const tbus_message_t* msg, tbus_client_t* client);
+static void on_reply(const tbus_message_t* msg, tbus_client_t* client);
+static void on_request_timeout(void* ctx);
+static void free_request(client_request_t* request);
+static void free_request_with_ctx(void* data, void* ctx);
 static void on_error(void* ctx);
+static void on_high_watermark(void* ctx);
+static void on_low_watermark(void* ctx);
 static void free_subscription(client_subscription_t* subscription);
 static void free_subscription_with_ctx(void* data, void* ctx);
 
@@ -48,38 +204,99 @@ tbus_t* tbus_connect(tev_handle_t tev, const char* uds_path)
 {
     if (!tev)
         return NULL;
-    const char* path = uds_path ? uds_path : TBUS_DEFAULT_UDS_PATH;
+    return client_connect(tev, uds_path ? uds_path : TBUS_DEFAULT_UDS_PATH, SOCK_STREAM);
+}
+
+tbus_t* tbus_connect_seqpacket(tev_handle_t tev, const char* uds_path)
+{
+    if (!tev)
+        return NULL;
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    int len = snprintf(path, sizeof(path), "%s" TBUS_SEQPACKET_PATH_SUFFIX, uds_path ? uds_path : TBUS_DEFAULT_UDS_PATH);
+    if (len < 0 || (size_t)len >= sizeof(path))
+        return NULL;
+    return client_connect(tev, path, SOCK_SEQPACKET);
+}
+
+tbus_t* tbus_connect_dgram(tev_handle_t tev, const char* uds_path)
+{
+    if (!tev)
+        return NULL;
+    tbus_t* iface = client_connect(tev, uds_path ? uds_path : TBUS_DEFAULT_UDS_PATH, SOCK_STREAM);
+    if (iface == NULL)
+        return NULL;
+    tbus_client_t* client = (tbus_client_t*)iface;
+    client->dgram = true;
+    if (client_dgram_open(client) != 0)
+    {
+        client_close(iface);
+        return NULL;
+    }
+    return iface;
+}
+
+static tbus_t* client_connect(tev_handle_t tev, const char* path, int type)
+{
     tbus_client_t* client = malloc(sizeof(tbus_client_t));
     if (client == NULL)
         goto error;
     memset(client, 0, sizeof(tbus_client_t));
     client->iface.close = client_close;
     client->iface.subscribe = client_subscribe;
+    client->iface.subscribe_from = client_subscribe_from;
+    client->iface.subscribe_filtered = client_subscribe_filtered;
+    client->iface.subscribe_sampled = client_subscribe_sampled;
+    client->iface.get_sequence = client_get_sequence;
+    client->iface.retain_message = client_retain_message;
     client->iface.unsubscribe = client_unsubscribe;
     client->iface.publish = client_publish;
+    client->iface.publish_with_priority = client_publish_with_priority;
+    client->iface.create_publisher = client_create_publisher;
+    client->iface.loan = client_loan;
+    client->iface.commit = client_commit;
+    client->iface.cancel_loan = client_cancel_loan;
+    client->iface.enable_flow_control = client_enable_flow_control;
+    client->iface.can_publish = client_can_publish;
+    client->iface.serve = client_serve;
+    client->iface.reply = client_reply;
+    client->iface.request = client_request;
+    client->iface.enable_reconnect = client_enable_reconnect;
+    client->iface.get_queued = client_get_queued;
+    client->iface.set_watermarks = client_set_watermarks;
     client->tev = tev;
+    client->fd = -1;
+    client->dgram_fd = -1;
+    client->type = type;
+    client->path = strdup(path);
+    if (client->path == NULL)
+        goto error;
     client->subscriptions_by_topic = map_create();
     if (client->subscriptions_by_topic == NULL)
         goto error;
     client->subscriptions_by_index = map_create();
     if (client->subscriptions_by_index == NULL)
         goto error;
-    client->next_index = 0;
-    client->fd = uds_connect(path);
-    if (client->fd < 0)
+    client->requests = map_create();
+    if (client->requests == NULL)
         goto error;
-    client->writer = message_writer_new(tev, client->fd);
+    client->next_index = 0;
+    client->writer = message_writer_new(tev, -1);
     if (client->writer == NULL)
         goto error;
     client->writer->callbacks.on_error = on_error;
     client->writer->callbacks.on_error_ctx = client;
-    client->reader = message_reader_new(tev, client->fd);
-    if (client->reader == NULL)
+    client->writer->callbacks.on_high_watermark = on_high_watermark;
+    client->writer->callbacks.on_high_watermark_ctx = client;
+    client->writer->callbacks.on_low_watermark = on_low_watermark;
+    client->writer->callbacks.on_low_watermark_ctx = client;
+    int fd = uds_connect(path, type);
+    if (fd < 0)
         goto error;
-    client->reader->callbacks.on_message = on_message;
-    client->reader->callbacks.on_message_ctx = client;
-    client->reader->callbacks.on_error = on_error;
-    client->reader->callbacks.on_error_ctx = client;
+    if (client_attach(client, fd) != 0)
+    {
+        close(fd);
+        goto error;
+    }
     return &client->iface;
 error:
     client_close((tbus_t*)client);
@@ -91,18 +308,13 @@ const char* tbus_get_version()
     return TBUS_VERSION;
 }
 
-static int uds_connect(const char* path)
+static int uds_connect(const char* path, int type)
 {
     struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    if(strlen(path) >= sizeof(addr.sun_path) - 1)
+    socklen_t addr_len = uds_address(path, &addr);
+    if(addr_len == 0)
         return -1;
-    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
-    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(addr.sun_path) + 1;
-    if(path[0] == '@')
-        addr.sun_path[0] = 0;
-    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int fd = socket(AF_UNIX, type | SOCK_NONBLOCK, 0);
     if(fd < 0)
         return -1;
     if(connect(fd, (struct sockaddr*)&addr, addr_len) != 0)
@@ -113,6 +325,20 @@ static int uds_connect(const char* path)
     return fd;
 }
 
+/** @return The length of the address, 0 if path is too long */
+static socklen_t uds_address(const char* path, struct sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path) - 1)
+        return 0;
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(addr->sun_path) + 1;
+    if(path[0] == '@')
+        addr->sun_path[0] = 0;
+    return addr_len;
+}
+
 static void client_close(tbus_t* iface)
 {
     tbus_client_t* client = (tbus_client_t*)iface;
@@ -130,6 +356,12 @@ static void client_close(tbus_t* iface)
     {
         close(client->fd);
     }
+    client_dgram_close(client);
+    if(client->reconnect_timer != NULL)
+    {
+        tev_clear_timeout(client->tev, client->reconnect_timer);
+    }
+    free(client->path);
     if(client->subscriptions_by_index != NULL)
     {
         /** This map only holds a reference */
@@ -139,6 +371,11 @@ static void client_close(tbus_t* iface)
     {
         map_delete(client->subscriptions_by_topic, free_subscription_with_ctx, NULL);
     }
+    if(client->requests != NULL)
+    {
+        /** Pending requests are dropped silently */
+        map_delete(client->requests, free_request_with_ctx, NULL);
+    }
     free(client);
 }
 
@@ -146,35 +383,159 @@ static int client_subscribe(tbus_t* iface, const char* topic, tbus_subscribe_cal
 {
     if(iface == NULL || topic == NULL || callback == NULL)
         return -1;
+    client_subscription_t* subscription = client_subscribe_internal((tbus_client_t*)iface, topic, NULL, NULL);
+    if(subscription == NULL)
+        return -1;
+    subscription->callback = callback;
+    subscription->ctx = ctx;
+    return 0;
+}
+
+static int client_subscribe_filtered(tbus_t* iface, const char* topic, const tbus_filter_t* filters, uint32_t filter_count, tbus_subscribe_callback_t callback, void* ctx)
+{
+    if(iface == NULL || topic == NULL || callback == NULL || (filters == NULL && filter_count > 0) || filter_count > TBUS_MAX_FILTERS)
+        return -1;
+    client_subscription_options_t options = {
+        .set_filters = true,
+        .filters = filters,
+        .filter_count = filter_count
+    };
+    client_subscription_t* subscription = client_subscribe_internal((tbus_client_t*)iface, topic, NULL, &options);
+    if(subscription == NULL)
+        return -1;
+    subscription->callback = callback;
+    subscription->ctx = ctx;
+    return 0;
+}
+
+static int client_subscribe_sampled(tbus_t* iface, const char* topic, uint32_t interval_ms, tbus_subscribe_callback_t callback, void* ctx)
+{
+    if(iface == NULL || topic == NULL || callback == NULL)
+        return -1;
+    client_subscription_options_t options = {
+        .set_interval = true,
+        .interval_ms = interval_ms
+    };
+    client_subscription_t* subscription = client_subscribe_internal((tbus_client_t*)iface, topic, NULL, &options);
+    if(subscription == NULL)
+        return -1;
+    subscription->callback = callback;
+    subscription->ctx = ctx;
+    return 0;
+}
+
+static int client_subscribe_from(tbus_t* iface, const char* topic, uint64_t sequence, tbus_subscribe_callback_t callback, void* ctx)
+{
+    if(iface == NULL || topic == NULL || callback == NULL)
+        return -1;
+    tbus_message_seq_t from_seq = sequence;
+    client_subscription_t* subscription = client_subscribe_internal((tbus_client_t*)iface, topic, &from_seq, NULL);
+    if(subscription == NULL)
+        return -1;
+    subscription->callback = callback;
+    subscription->ctx = ctx;
+    return 0;
+}
+
+static uint64_t client_get_sequence(tbus_t* iface)
+{
+    if(iface == NULL)
+        return 0;
+    return ((tbus_client_t*)iface)->current_seq;
+}
+
+static tbus_message_handle_t* client_retain_message(tbus_t* iface)
+{
     tbus_client_t* this = (tbus_client_t*)iface;
+    if(this == NULL || this->current_buffer == NULL)
+        return NULL;
+    message_reader_t* reader = client_delivering_reader(this);
+    if(reader == NULL || reader->get_buffer(reader, NULL) != this->current_buffer)
+        return NULL;
+    client_message_handle_t* handle = malloc(sizeof(client_message_handle_t));
+    if(handle == NULL)
+        return NULL;
+    memset(handle, 0, sizeof(client_message_handle_t));
+    handle->buffer = reader->take_over_buffer(reader, NULL);
+    if(handle->buffer == NULL)
+    {
+        free(handle);
+        return NULL;
+    }
+    handle->ref_count = 1;
+    handle->iface.topic = this->current_topic;
+    handle->iface.data = this->current_data;
+    handle->iface.len = this->current_data_len;
+    handle->iface.sequence = this->current_seq;
+    handle->iface.retain = message_handle_retain;
+    handle->iface.release = message_handle_release;
+    this->current_buffer = NULL;
+    return &handle->iface;
+}
+
+static void message_handle_retain(tbus_message_handle_t* iface)
+{
+    client_message_handle_t* this = (client_message_handle_t*)iface;
+    if(this == NULL)
+        return;
+    this->ref_count++;
+}
+
+static void message_handle_release(tbus_message_handle_t* iface)
+{
+    client_message_handle_t* this = (client_message_handle_t*)iface;
+    if(this == NULL || --this->ref_count > 0)
+        return;
+    frame_buffer_free(this->buffer);
+    free(this);
+}
+
+/** 
+ * Get the existing subscription of topic or subscribe. The caller sets the callbacks.
+ * options, if any, are applied before the SUB goes out.
+ */
+static client_subscription_t* client_subscribe_internal(tbus_client_t* this, const char* topic, tbus_message_seq_t* p_from_seq, const client_subscription_options_t* options)
+{
+    tbus_message_t msg;
     client_subscription_t* subscription = map_get(this->subscriptions_by_topic, (void*)topic, strlen(topic));
     if(subscription != NULL)
     {
-        // Update the subscription
-        subscription->callback = callback;
-        subscription->ctx = ctx;
-        return 0;
+        if(p_from_seq == NULL && options == NULL)
+            return subscription;
+        if(subscription_apply_options(subscription, options) != 0)
+            return NULL;
+        /** Ask for the replay again, or update the options */
+        memset(&msg, 0, sizeof(msg));
+        msg.command = TBUS_MSG_CMD_SUB;
+        msg.topic = (char*)topic;
+        msg.p_sub_index = &subscription->index;
+        msg.p_seq = p_from_seq;
+        subscription_fill_message(subscription, &msg);
+        if(client_write_control(this, &msg) != 0)
+            return NULL;
+        return subscription;
     }
     subscription = malloc(sizeof(client_subscription_t));
     if(subscription == NULL)
         goto error;
     memset(subscription, 0, sizeof(client_subscription_t));
     subscription->index = this->next_index++;
-    subscription->callback = callback;
-    subscription->ctx = ctx;
+    if(subscription_apply_options(subscription, options) != 0)
+        goto error;
     if(map_add(this->subscriptions_by_topic, (void*)topic, strlen(topic), subscription) == NULL)
         goto error;
     if(map_add(this->subscriptions_by_index, &subscription->index, sizeof(subscription->index), subscription) == NULL)
         goto error;
     /** send subscription message */
-    tbus_message_t msg;
     memset(&msg, 0, sizeof(msg));
     msg.command = TBUS_MSG_CMD_SUB;
     msg.topic = (char*)topic;
     msg.p_sub_index = &subscription->index;
-    if(this->writer->write_message(this->writer, &msg) != 0)
+    msg.p_seq = p_from_seq;
+    subscription_fill_message(subscription, &msg);
+    if(client_write_control(this, &msg) != 0)
         goto error;
-    return 0;
+    return subscription;
 error:
     if(subscription != NULL)
     {
@@ -182,7 +543,53 @@ error:
         map_remove(this->subscriptions_by_index, &subscription->index, sizeof(subscription->index));
         free_subscription(subscription);
     }
-    return -1;
+    return NULL;
+}
+
+static int subscription_apply_options(client_subscription_t* subscription, const client_subscription_options_t* options)
+{
+    if(options == NULL)
+        return 0;
+    if(options->set_filters && subscription_set_filters(subscription, options->filters, options->filter_count) != 0)
+        return -1;
+    if(options->set_interval)
+        subscription->interval_ms = options->interval_ms;
+    subscription->flags |= options->add_flags;
+    return 0;
+}
+
+static int subscription_set_filters(client_subscription_t* subscription, const tbus_filter_t* filters, uint32_t filter_count)
+{
+    tbus_message_filter_t* wire_filters = NULL;
+    if(filter_count > 0)
+    {
+        wire_filters = malloc(filter_count * sizeof(tbus_message_filter_t));
+        if(wire_filters == NULL)
+            return -1;
+    }
+    for(uint32_t i = 0; i < filter_count; i++)
+    {
+        wire_filters[i].op = filters[i].op;
+        wire_filters[i].width = filters[i].width;
+        wire_filters[i].offset = filters[i].offset;
+        wire_filters[i].a = filters[i].a;
+        wire_filters[i].b = filters[i].b;
+    }
+    free(subscription->filters);
+    subscription->filters = wire_filters;
+    subscription->filter_count = filter_count;
+    return 0;
+}
+
+/** Everything the broker keeps per subscription goes with each SUB */
+static void subscription_fill_message(client_subscription_t* subscription, tbus_message_t* msg)
+{
+    msg->p_filter = subscription->filters;
+    msg->filter_count = subscription->filter_count;
+    if(subscription->interval_ms > 0)
+        msg->p_interval = &subscription->interval_ms;
+    if(subscription->flags != 0)
+        msg->p_sub_flags = &subscription->flags;
 }
 
 static void client_unsubscribe(tbus_t* iface, const char* topic)
@@ -200,25 +607,343 @@ static void client_unsubscribe(tbus_t* iface, const char* topic)
     memset(&msg, 0, sizeof(msg));
     msg.command = TBUS_MSG_CMD_UNSUB;
     msg.topic = (char*)topic;
-    this->writer->write_message(this->writer, &msg); 
+    client_write_control(this, &msg);
 }
 
 static int client_publish(tbus_t* iface, const char* topic, const uint8_t* data, uint32_t len)
 {
     if(iface == NULL || topic == NULL || data == NULL || len == 0)
         return -1;
+    return client_publish_internal((tbus_client_t*)iface, topic, data, len, NULL);
+}
+
+static int client_publish_with_priority(tbus_t* iface, const char* topic, const uint8_t* data, uint32_t len, uint8_t priority)
+{
+    if(iface == NULL || topic == NULL || data == NULL || len == 0 || priority > TBUS_PRIORITY_MAX)
+        return -1;
+    tbus_message_priority_t message_priority = priority;
+    /** Normal priority does not need the TLV */
+    return client_publish_internal((tbus_client_t*)iface, topic, data, len, priority == TBUS_PRIORITY_NORMAL ? NULL : &message_priority);
+}
+
+static int client_publish_internal(tbus_client_t* this, const char* topic, const uint8_t* data, uint32_t len, tbus_message_priority_t* p_priority)
+{
+    tbus_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.command = TBUS_MSG_CMD_PUB;
+    msg.topic = (char*)topic;
+    msg.data = (uint8_t*)data;
+    msg.data_len = len;
+    msg.p_priority = p_priority;
+    size_t size = tbus_message_get_serialized_size(&msg);
+    if(client_reserve_publish(this, size) != 0)
+        return -1;
+    if(client_write_publish(this, &msg) != 0)
+        return -1;
+    client_commit_publish(this, size);
+    return 0;
+}
+
+/** Check that a publish of size bytes can go now, or be kept until reconnected */
+static int client_reserve_publish(tbus_client_t* this, size_t size)
+{
+    if(this->fd < 0)
+    {
+        /** Kept in the writer until reconnected */
+        if(!this->reconnect)
+            return -1;
+        if(this->reconnect_buffered + size > this->reconnect_buffer_limit)
+            return -1;
+        return 0;
+    }
+    if(this->flow_control && !client_has_credit(this, size))
+        return -1;
+    return 0;
+}
+
+/** Account for a publish reserved with client_reserve_publish and written */
+static void client_commit_publish(tbus_client_t* this, size_t size)
+{
+    if(this->fd < 0)
+        this->reconnect_buffered += size;
+    if(this->flow_control)
+    {
+        this->credit -= size;
+        this->credit_outstanding += size;
+    }
+}
+
+static tbus_publisher_t* client_create_publisher(tbus_t* iface, const char* topic)
+{
+    if(iface == NULL || topic == NULL)
+        return NULL;
+    client_publisher_t* publisher = malloc(sizeof(client_publisher_t));
+    if(publisher == NULL)
+        return NULL;
+    memset(publisher, 0, sizeof(client_publisher_t));
+    publisher->iface.publish = publisher_publish;
+    publisher->iface.close = publisher_close;
+    publisher->client = (tbus_client_t*)iface;
+    tbus_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.command = TBUS_MSG_CMD_PUB;
+    msg.topic = (char*)topic;
+    publisher->head = tbus_message_serialize_head(&msg, &publisher->head_len);
+    if(publisher->head == NULL)
+    {
+        publisher_close(&publisher->iface);
+        return NULL;
+    }
+    return &publisher->iface;
+}
+
+/** The head and data go out in one sendmsg, they are only copied if they have to be queued */
+static int publisher_publish(tbus_publisher_t* iface, const uint8_t* data, uint32_t len)
+{
+    if(iface == NULL || data == NULL || len == 0)
+        return -1;
+    client_publisher_t* this = (client_publisher_t*)iface;
+    size_t size = this->head_len + len;
+    if(client_reserve_publish(this->client, size) != 0)
+        return -1;
+    tbus_message_set_data_len(this->head, this->head_len, len);
+    struct iovec iov[2] = {
+        {.iov_base = this->head, .iov_len = this->head_len},
+        {.iov_base = (void*)data, .iov_len = len}
+    };
+    if(client_write_frame(this->client, iov, 2, size) != 0)
+        return -1;
+    client_commit_publish(this->client, size);
+    return 0;
+}
+
+static void publisher_close(tbus_publisher_t* iface)
+{
+    client_publisher_t* this = (client_publisher_t*)iface;
+    if(this == NULL)
+        return;
+    free(this->head);
+    free(this);
+}
+
+static tbus_loan_t* client_loan(tbus_t* iface, uint32_t len)
+{
+    tbus_client_t* this = (tbus_client_t*)iface;
+    if(this == NULL || len == 0)
+        return NULL;
+    client_loan_t* loan = malloc(sizeof(client_loan_t));
+    if(loan == NULL)
+        return NULL;
+    loan->loan = this->writer->loan(this->writer, LOAN_HEAD_ROOM, len);
+    if(loan->loan == NULL)
+    {
+        free(loan);
+        return NULL;
+    }
+    loan->iface.data = loan->loan->data;
+    loan->iface.len = len;
+    return &loan->iface;
+}
+
+/** The head is written into the room before the data, the data itself is not copied */
+static int client_commit(tbus_t* iface, tbus_loan_t* loan, const char* topic)
+{
+    tbus_client_t* this = (tbus_client_t*)iface;
+    if(this == NULL || loan == NULL)
+        return -1;
+    client_loan_t* client_loan = (client_loan_t*)loan;
+    uint8_t* head = NULL;
+    if(topic == NULL)
+        goto error;
+    tbus_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.command = TBUS_MSG_CMD_PUB;
+    msg.topic = (char*)topic;
+    size_t head_len = 0;
+    head = tbus_message_serialize_head(&msg, &head_len);
+    if(head == NULL)
+        goto error;
+    size_t size = head_len + loan->len;
+    if(client_reserve_publish(this, size) != 0)
+        goto error;
+    tbus_message_set_data_len(head, head_len, loan->len);
+    struct iovec iov[2] = {
+        {.iov_base = head, .iov_len = head_len},
+        {.iov_base = loan->data, .iov_len = loan->len}
+    };
+    if(client_send_dgram(this, iov, 2, size) == 0)
+    {
+        this->writer->cancel_loan(this->writer, client_loan->loan);
+    }
+    else if(this->writer->commit_loan(this->writer, client_loan->loan, head, head_len, TBUS_PRIORITY_NORMAL) != 0)
+    {
+        /** Consumed either way */
+        client_loan->loan = NULL;
+        goto error;
+    }
+    client_commit_publish(this, size);
+    free(head);
+    free(client_loan);
+    return 0;
+error:
+    free(head);
+    client_cancel_loan(iface, loan);
+    return -1;
+}
+
+static void client_cancel_loan(tbus_t* iface, tbus_loan_t* loan)
+{
+    tbus_client_t* this = (tbus_client_t*)iface;
+    client_loan_t* client_loan = (client_loan_t*)loan;
+    if(this == NULL || client_loan == NULL)
+        return;
+    this->writer->cancel_loan(this->writer, client_loan->loan);
+    free(client_loan);
+}
+
+static int client_enable_flow_control(tbus_t* iface, uint32_t window)
+{
+    if(iface == NULL)
+        return -1;
+    tbus_client_t* this = (tbus_client_t*)iface;
+    if(this->flow_control)
+        return 0;
+    tbus_message_credit_t requested = window;
+    tbus_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.command = TBUS_MSG_CMD_CREDIT;
+    msg.p_credit = &requested;
+    if(client_write_control(this, &msg) != 0)
+        return -1;
+    this->flow_control = true;
+    this->credit_window = window;
+    this->credit_granted = false;
+    this->credit = 0;
+    this->credit_outstanding = 0;
+    return 0;
+}
+
+static int client_can_publish(tbus_t* iface, const char* topic, uint32_t len)
+{
+    if(iface == NULL || topic == NULL)
+        return -1;
     tbus_client_t* this = (tbus_client_t*)iface;
+    if(!this->flow_control)
+        return 1;
     tbus_message_t msg;
     memset(&msg, 0, sizeof(msg));
     msg.command = TBUS_MSG_CMD_PUB;
     msg.topic = (char*)topic;
+    /** Only the size matters */
+    msg.data = (uint8_t*)topic;
+    msg.data_len = len;
+    return client_has_credit(this, tbus_message_get_serialized_size(&msg));
+}
+
+static int client_has_credit(tbus_client_t* this, size_t size)
+{
+    if(!this->credit_granted)
+        return 0;
+    /** Messages larger than the window can still go one at a time */
+    return this->credit >= (int64_t)size || this->credit_outstanding == 0;
+}
+
+static int client_serve(tbus_t* iface, const char* topic, tbus_request_callback_t callback, void* ctx)
+{
+    if(iface == NULL || topic == NULL || callback == NULL)
+        return -1;
+    /** Only serving subscriptions are sent requests */
+    client_subscription_options_t options = {
+        .add_flags = TBUS_MSG_SUB_FLAG_SERVE
+    };
+    client_subscription_t* subscription = client_subscribe_internal((tbus_client_t*)iface, topic, NULL, &options);
+    if(subscription == NULL)
+        return -1;
+    subscription->request_callback = callback;
+    subscription->request_ctx = ctx;
+    return 0;
+}
+
+static int client_reply(tbus_t* iface, uint64_t request_id, const uint8_t* data, uint32_t len)
+{
+    if(iface == NULL || data == NULL || len == 0)
+        return -1;
+    tbus_client_t* this = (tbus_client_t*)iface;
+    /** The request died with the connection */
+    if(this->fd < 0)
+        return -1;
+    tbus_message_correlation_id_t correlation_id = request_id;
+    tbus_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.command = TBUS_MSG_CMD_REPLY;
+    msg.p_correlation_id = &correlation_id;
     msg.data = (uint8_t*)data;
     msg.data_len = len;
     return this->writer->write_message(this->writer, &msg);
 }
 
+static int client_request(tbus_t* iface, const char* topic, const uint8_t* data, uint32_t len, uint32_t timeout_ms, tbus_reply_callback_t callback, void* ctx)
+{
+    if(iface == NULL || topic == NULL || data == NULL || len == 0 || callback == NULL)
+        return -1;
+    tbus_client_t* this = (tbus_client_t*)iface;
+    if(this->fd < 0)
+        return -1;
+    client_request_t* request = malloc(sizeof(client_request_t));
+    if(request == NULL)
+        return -1;
+    memset(request, 0, sizeof(client_request_t));
+    request->client = this;
+    request->id = ++this->next_correlation_id;
+    request->callback = callback;
+    request->ctx = ctx;
+    if(map_add(this->requests, &request->id, sizeof(request->id), request) == NULL)
+    {
+        free(request);
+        return -1;
+    }
+    /** The broker does not use the index of a request */
+    tbus_message_sub_index_t sub_index = 0;
+    tbus_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.command = TBUS_MSG_CMD_REQ;
+    msg.topic = (char*)topic;
+    msg.p_sub_index = &sub_index;
+    msg.p_correlation_id = &request->id;
+    msg.data = (uint8_t*)data;
+    msg.data_len = len;
+    if(this->writer->write_message(this->writer, &msg) != 0)
+        goto error;
+    if(timeout_ms != 0)
+    {
+        request->timeout = tev_set_timeout(this->tev, on_request_timeout, request, timeout_ms);
+        if(request->timeout == NULL)
+            goto error;
+    }
+    return 0;
+error:
+    map_remove(this->requests, &request->id, sizeof(request->id));
+    free_request(request);
+    return -1;
+}
+
 static void on_message(const tbus_message_t* msg, void* ctx)
 {
+    if(msg->command == TBUS_MSG_CMD_CREDIT)
+    {
+        on_credit(msg, (tbus_client_t*)ctx);
+        return;
+    }
+    if(msg->command == TBUS_MSG_CMD_REPLY)
+    {
+        on_reply(msg, (tbus_client_t*)ctx);
+        return;
+    }
+    if(msg->command == TBUS_MSG_CMD_DGRAM)
+    {
+        on_dgram_ack(msg, (tbus_client_t*)ctx);
+        return;
+    }
     if(msg->p_sub_index == NULL)
     {
         // Invalid message, ignore
@@ -234,12 +959,410 @@ static void on_message(const tbus_message_t* msg, void* ctx)
         // Invalid subscription, ignore
         return;
     }
+    if(msg->command == TBUS_MSG_CMD_REQ)
+    {
+        if(subscription->request_callback == NULL || msg->p_correlation_id == NULL)
+            return;
+        tbus_message_correlation_id_t request_id = 0;
+        READ_FIELD(msg->p_correlation_id, request_id);
+        set_current_message(client, msg);
+        subscription->request_callback(msg->topic, msg->data, msg->data_len, request_id, subscription->request_ctx);
+        return;
+    }
+    if(subscription->callback == NULL)
+        return;
+    set_current_message(client, msg);
     subscription->callback(msg->topic, msg->data, msg->data_len, subscription->ctx);
 }
 
+/** A reader only returns its buffer while delivering from it */
+static message_reader_t* client_delivering_reader(tbus_client_t* client)
+{
+    if(client->reader != NULL && client->reader->get_buffer(client->reader, NULL) != NULL)
+        return client->reader;
+    if(client->dgram_reader != NULL && client->dgram_reader->get_buffer(client->dgram_reader, NULL) != NULL)
+        return client->dgram_reader;
+    return NULL;
+}
+
+/** For get_sequence and retain_message in the callback */
+static void set_current_message(tbus_client_t* client, const tbus_message_t* msg)
+{
+    client->current_seq = 0;
+    if(msg->p_seq != NULL)
+        READ_FIELD(msg->p_seq, client->current_seq);
+    message_reader_t* reader = client_delivering_reader(client);
+    client->current_buffer = reader != NULL ? reader->get_buffer(reader, NULL) : NULL;
+    client->current_topic = msg->topic;
+    client->current_data = msg->data;
+    client->current_data_len = msg->data_len;
+}
+
+static void on_reply(const tbus_message_t* msg, tbus_client_t* client)
+{
+    if(msg->p_correlation_id == NULL)
+        return;
+    tbus_message_correlation_id_t id = 0;
+    READ_FIELD(msg->p_correlation_id, id);
+    client_request_t* request = map_remove(client->requests, &id, sizeof(id));
+    /** Timed out already */
+    if(request == NULL)
+        return;
+    tbus_reply_callback_t callback = request->callback;
+    void* ctx = request->ctx;
+    free_request(request);
+    if(msg->data == NULL)
+        callback(TBUS_REPLY_NO_RESPONDER, NULL, 0, ctx);
+    else
+        callback(TBUS_REPLY_OK, msg->data, msg->data_len, ctx);
+}
+
+static void on_request_timeout(void* ctx)
+{
+    client_request_t* request = (client_request_t*)ctx;
+    tbus_client_t* client = request->client;
+    /** The timer is done */
+    request->timeout = NULL;
+    map_remove(client->requests, &request->id, sizeof(request->id));
+    tbus_reply_callback_t callback = request->callback;
+    void* callback_ctx = request->ctx;
+    free_request(request);
+    callback(TBUS_REPLY_TIMEOUT, NULL, 0, callback_ctx);
+}
+
+static void on_credit(const tbus_message_t* msg, tbus_client_t* client)
+{
+    if(!client->flow_control || msg->p_credit == NULL)
+        return;
+    tbus_message_credit_t credit = 0;
+    READ_FIELD(msg->p_credit, credit);
+    client->credit += credit;
+    if(client->credit_granted)
+        client->credit_outstanding = credit > client->credit_outstanding ? 0 : client->credit_outstanding - credit;
+    client->credit_granted = true;
+    if(client->iface.callbacks.on_credit)
+        client->iface.callbacks.on_credit(client->iface.callbacks.on_credit_ctx);
+}
+
+static int client_enable_reconnect(tbus_t* iface, uint32_t buffer_bytes)
+{
+    if(iface == NULL)
+        return -1;
+    tbus_client_t* this = (tbus_client_t*)iface;
+    this->reconnect = true;
+    this->reconnect_buffer_limit = buffer_bytes;
+    return 0;
+}
+
+static int client_get_queued(tbus_t* iface, uint64_t* bytes, uint64_t* messages)
+{
+    if(iface == NULL)
+        return -1;
+    tbus_client_t* this = (tbus_client_t*)iface;
+    size_t count = 0;
+    size_t queued = this->writer->get_queued(this->writer, &count);
+    if(bytes)
+        *bytes = queued;
+    if(messages)
+        *messages = count;
+    return 0;
+}
+
+static int client_set_watermarks(tbus_t* iface, uint64_t high, uint64_t low)
+{
+    if(iface == NULL)
+        return -1;
+    tbus_client_t* this = (tbus_client_t*)iface;
+    return this->writer->set_watermarks(this->writer, high, low);
+}
+
+static void on_high_watermark(void* ctx)
+{
+    tbus_client_t* client = ctx;
+    if(client->iface.callbacks.on_backpressure)
+        client->iface.callbacks.on_backpressure(client->iface.callbacks.on_backpressure_ctx);
+}
+
+static void on_low_watermark(void* ctx)
+{
+    tbus_client_t* client = ctx;
+    if(client->iface.callbacks.on_drain)
+        client->iface.callbacks.on_drain(client->iface.callbacks.on_drain_ctx);
+}
+
+/** Subscriptions and flow control are restored on reconnect, so skip them while disconnected */
+static int client_write_control(tbus_client_t* this, const tbus_message_t* msg)
+{
+    if(this->fd < 0)
+        return 0;
+    return this->writer->write_message(this->writer, msg);
+}
+
+/** A frame that fits one datagram goes as one, otherwise or if the socket is full over the stream */
+static int client_write_publish(tbus_client_t* this, const tbus_message_t* msg)
+{
+    size_t size = tbus_message_get_serialized_size(msg);
+    if(client_can_send_dgram(this, size))
+    {
+        uint8_t* data = tbus_message_serialize(msg, &size);
+        if(data == NULL)
+            return -1;
+        struct iovec iov = {.iov_base = data, .iov_len = size};
+        int rc = client_send_dgram(this, &iov, 1, size);
+        free(data);
+        if(rc == 0)
+            return 0;
+    }
+    return this->writer->write_message(this->writer, msg);
+}
+
+/** Same as client_write_publish for a frame already serialized in pieces */
+static int client_write_frame(tbus_client_t* this, const struct iovec* iov, int iov_count, size_t size)
+{
+    if(client_send_dgram(this, iov, iov_count, size) == 0)
+        return 0;
+    return this->writer->write_frame(this->writer, iov, iov_count, TBUS_PRIORITY_NORMAL);
+}
+
+/** @return 0 if the frame went as one datagram, -1 if it has to take the stream */
+static int client_send_dgram(tbus_client_t* this, const struct iovec* iov, int iov_count, size_t size)
+{
+    if(!client_can_send_dgram(this, size))
+        return -1;
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = (struct iovec*)iov;
+    hdr.msg_iovlen = iov_count;
+    ssize_t sent = sendmsg(this->dgram_fd, &hdr, MSG_NOSIGNAL);
+    if(sent == (ssize_t)size)
+        return 0;
+    if(sent >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        client_dgram_close(this);
+    return -1;
+}
+
+/**
+ * A datagram would overtake the frames still queued on the stream or unread in its socket, so those go first.
+ * The broker reads the datagrams already there before each stream frame, so the stream cannot overtake either.
+ */
+static bool client_can_send_dgram(tbus_client_t* this, size_t size)
+{
+    if(!this->dgram_ready || size > MESSAGE_RECORD_SIZE || this->writer->get_queued(this->writer, NULL) != 0)
+        return false;
+    int unread = 0;
+    return ioctl(this->fd, SIOCOUTQ, &unread) == 0 && unread == 0;
+}
+
+/** Bind to a unique abstract address and ask the broker to use it, datagrams start once it answers */
+static int client_dgram_open(tbus_client_t* this)
+{
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    int len = snprintf(path, sizeof(path), "%s" TBUS_DGRAM_PATH_SUFFIX, this->path);
+    if(len < 0 || (size_t)len >= sizeof(path))
+        return -1;
+    struct sockaddr_un addr;
+    socklen_t addr_len = uds_address(path, &addr);
+    if(addr_len == 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if(fd < 0)
+        return -1;
+    /** Only the broker can send to a connected datagram socket */
+    if(connect(fd, (struct sockaddr*)&addr, addr_len) != 0)
+        goto error;
+    /** Autobind */
+    struct sockaddr_un local;
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    if(bind(fd, (struct sockaddr*)&local, sizeof(sa_family_t)) != 0)
+        goto error;
+    socklen_t local_len = sizeof(local);
+    if(getsockname(fd, (struct sockaddr*)&local, &local_len) != 0 || local_len <= offsetof(struct sockaddr_un, sun_path))
+        goto error;
+    this->dgram_reader = message_reader_new(this->tev, fd);
+    if(this->dgram_reader == NULL)
+        goto error;
+    this->dgram_reader->callbacks.on_message = on_message;
+    this->dgram_reader->callbacks.on_message_ctx = this;
+    this->dgram_reader->callbacks.on_error = on_dgram_error;
+    this->dgram_reader->callbacks.on_error_ctx = this;
+    this->dgram_fd = fd;
+    tbus_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.command = TBUS_MSG_CMD_DGRAM;
+    msg.data = (uint8_t*)local.sun_path;
+    msg.data_len = local_len - offsetof(struct sockaddr_un, sun_path);
+    if(client_write_control(this, &msg) != 0)
+    {
+        client_dgram_close(this);
+        return -1;
+    }
+    return 0;
+error:
+    close(fd);
+    return -1;
+}
+
+static void client_dgram_close(tbus_client_t* this)
+{
+    if(this->dgram_reader != NULL)
+    {
+        this->dgram_reader->close(this->dgram_reader);
+        this->dgram_reader = NULL;
+    }
+    if(this->dgram_fd >= 0)
+    {
+        close(this->dgram_fd);
+        this->dgram_fd = -1;
+    }
+    this->dgram_ready = false;
+}
+
+/** Send the nonce back from our address to prove we own it */
+static void on_dgram_ack(const tbus_message_t* msg, tbus_client_t* client)
+{
+    if(client->dgram_fd < 0 || msg->p_correlation_id == NULL)
+        return;
+    tbus_message_t confirm;
+    memset(&confirm, 0, sizeof(confirm));
+    confirm.command = TBUS_MSG_CMD_DGRAM;
+    confirm.p_correlation_id = msg->p_correlation_id;
+    size_t size = 0;
+    uint8_t* data = tbus_message_serialize(&confirm, &size);
+    if(data == NULL)
+        return;
+    /** Publishes sent after this are queued behind it at the broker */
+    if(send(client->dgram_fd, data, size, MSG_NOSIGNAL) == (ssize_t)size)
+        client->dgram_ready = true;
+    free(data);
+}
+
+/** The stream carries on alone */
+static void on_dgram_error(void* ctx)
+{
+    client_dgram_close((tbus_client_t*)ctx);
+}
+
+/** The broker follows the same rule as client_can_send_dgram, the datagrams already here came first */
+static void on_stream_read(void* ctx)
+{
+    tbus_client_t* client = (tbus_client_t*)ctx;
+    if(client->dgram_reader != NULL)
+        client->dgram_reader->read_pending(client->dgram_reader);
+}
+
+static int client_attach(tbus_client_t* this, int fd)
+{
+    this->reader = message_reader_new(this->tev, fd);
+    if(this->reader == NULL)
+        return -1;
+    this->reader->callbacks.on_message = on_message;
+    this->reader->callbacks.on_message_ctx = this;
+    this->reader->callbacks.on_error = on_error;
+    this->reader->callbacks.on_error_ctx = this;
+    this->reader->callbacks.on_read = on_stream_read;
+    this->reader->callbacks.on_read_ctx = this;
+    this->fd = fd;
+    return this->writer->attach(this->writer, fd);
+}
+
+static void client_disconnect(tbus_client_t* this)
+{
+    this->reader->close(this->reader);
+    this->reader = NULL;
+    client_dgram_close(this);
+    this->writer->detach(this->writer);
+    close(this->fd);
+    this->fd = -1;
+    /** The new broker grants a new window */
+    this->credit_granted = false;
+    this->credit = 0;
+    this->credit_outstanding = 0;
+    this->reconnect_buffered = 0;
+    this->reconnect_delay_ms = RECONNECT_MIN_DELAY_MS;
+    this->reconnect_timer = tev_set_timeout(this->tev, on_reconnect_timer, this, this->reconnect_delay_ms);
+    /** Requests in flight are lost with the broker's state */
+    while(map_get_length(this->requests) > 0)
+    {
+        map_entry_t entry = map_next(this->requests, (map_entry_t){0});
+        client_request_t* request = map_remove(this->requests, entry.key, entry.key_len);
+        tbus_reply_callback_t callback = request->callback;
+        void* ctx = request->ctx;
+        free_request(request);
+        callback(TBUS_REPLY_TIMEOUT, NULL, 0, ctx);
+    }
+}
+
+static void on_reconnect_timer(void* ctx)
+{
+    tbus_client_t* this = (tbus_client_t*)ctx;
+    this->reconnect_timer = NULL;
+    int fd = uds_connect(this->path, this->type);
+    if(fd < 0)
+    {
+        this->reconnect_delay_ms *= 2;
+        if(this->reconnect_delay_ms > RECONNECT_MAX_DELAY_MS)
+            this->reconnect_delay_ms = RECONNECT_MAX_DELAY_MS;
+        this->reconnect_timer = tev_set_timeout(this->tev, on_reconnect_timer, this, this->reconnect_delay_ms);
+        if(this->reconnect_timer == NULL)
+            on_error(this);
+        return;
+    }
+    /** 
+     * Queue the subscriptions ahead of the publishes buffered while disconnected.
+     * Everything goes out in one write on attach.
+     */
+    tbus_message_priority_t priority = TBUS_PRIORITY_MAX;
+    tbus_message_t msg;
+    map_entry_t entry = {0};
+    map_forEach(this->subscriptions_by_topic, entry)
+    {
+        client_subscription_t* subscription = entry.value;
+        char* topic = strndup(entry.key, entry.key_len);
+        if(topic == NULL)
+            goto error;
+        memset(&msg, 0, sizeof(msg));
+        msg.command = TBUS_MSG_CMD_SUB;
+        msg.topic = topic;
+        msg.p_sub_index = &subscription->index;
+        subscription_fill_message(subscription, &msg);
+        msg.p_priority = &priority;
+        int rc = this->writer->write_message(this->writer, &msg);
+        free(topic);
+        if(rc != 0)
+            goto error;
+    }
+    if(this->flow_control)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.command = TBUS_MSG_CMD_CREDIT;
+        msg.p_credit = &this->credit_window;
+        msg.p_priority = &priority;
+        if(this->writer->write_message(this->writer, &msg) != 0)
+            goto error;
+    }
+    this->reconnect_buffered = 0;
+    if(client_attach(this, fd) != 0)
+        goto error;
+    /** The new broker may not take datagrams, the stream does it all then */
+    if(this->dgram)
+        client_dgram_open(this);
+    return;
+error:
+    if(this->fd < 0)
+        close(fd);
+    on_error(this);
+}
+
 static void on_error(void* ctx)
 {
     tbus_client_t* client = (tbus_client_t*)ctx;
+    if(client->reconnect && client->fd >= 0)
+    {
+        client_disconnect(client);
+        if(client->reconnect_timer != NULL)
+            return;
+    }
     void (*on_disconnect)(void*) = client->iface.callbacks.on_disconnect;
     void* on_disconnect_ctx = client->iface.callbacks.on_disconnect_ctx;
     client_close((tbus_t*)client);
@@ -256,6 +1379,7 @@ static void free_subscription(client_subscription_t* subscription)
 {
     if(subscription == NULL)
         return;
+    free(subscription->filters);
     free(subscription);
 }
 
@@ -263,3 +1387,17 @@ static void free_subscription_with_ctx(void* data, void* ctx)
 {
     free_subscription((client_subscription_t*)data);
 }
+
+static void free_request(client_request_t* request)
+{
+    if(request == NULL)
+        return;
+    if(request->timeout != NULL)
+        tev_clear_timeout(request->client->tev, request->timeout);
+    free(request);
+}
+
+static void free_request_with_ctx(void* data, void* ctx)
+{
+    free_request((client_request_t*)data);
+}
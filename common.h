@@ -5,4 +5,9 @@
 #endif
 
 #define TBUS_DEFAULT_UDS_PATH "@tbus"
-
+/** The SOCK_SEQPACKET socket listens on the broker path with this suffix */
+#define TBUS_SEQPACKET_PATH_SUFFIX ".seq"
+/** The SOCK_DGRAM socket is bound to the broker path with this suffix */
+#define TBUS_DGRAM_PATH_SUFFIX ".dgram"
+/** Subscriptions to $share/<group>/<filter> are shared among the members of group */
+#define TBUS_SHARED_SUBSCRIPTION_PREFIX "$share/"
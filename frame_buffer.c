@@ -0,0 +1,229 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "frame_buffer.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define CACHE_SIZE FRAME_BUFFER_CACHE_SIZE
+
+/** Right before every buffer, keeps it 16 byte aligned */
+typedef struct
+{
+    /** 0 for malloc */
+    size_t mapped_size;
+    /** Usable bytes after the header */
+    size_t capacity;
+    /** When it was freed, while kept */
+    uint64_t freed_ms;
+    bool huge;
+    /** Kept with its pages released */
+    bool trimmed;
+    /** Prefaulted, never trimmed nor replaced */
+    bool pinned;
+} __attribute__((aligned(16))) frame_buffer_header_t;
+
+#define HEADER_OF(buffer) ((frame_buffer_header_t*)((buffer) - sizeof(frame_buffer_header_t)))
+#define BUFFER_OF(header) ((uint8_t*)(header) + sizeof(frame_buffer_header_t))
+
+static __thread frame_buffer_header_t* cache[CACHE_SIZE];
+static bool use_huge_pages = false;
+
+static uint8_t* map_buffer(size_t size);
+static void unmap_buffer(frame_buffer_header_t* header);
+static void release_pages(frame_buffer_header_t* header);
+static uint64_t now_ms();
+
+uint8_t* frame_buffer_alloc(size_t size)
+{
+    if(size <= FRAME_BUFFER_MAP_THRESHOLD)
+    {
+        frame_buffer_header_t* header = malloc(sizeof(frame_buffer_header_t) + size);
+        if(!header)
+            return NULL;
+        memset(header, 0, sizeof(frame_buffer_header_t));
+        header->capacity = size;
+        return BUFFER_OF(header);
+    }
+    frame_buffer_trim(FRAME_BUFFER_IDLE_MS);
+    /** The smallest kept one that fits */
+    int best = -1;
+    for(int i = 0; i < CACHE_SIZE; i++)
+    {
+        if(cache[i] && cache[i]->capacity >= size && (best < 0 || cache[i]->capacity < cache[best]->capacity))
+            best = i;
+    }
+    if(best >= 0)
+    {
+        frame_buffer_header_t* header = cache[best];
+        cache[best] = NULL;
+        header->trimmed = false;
+        return BUFFER_OF(header);
+    }
+    return map_buffer(size);
+}
+
+uint8_t* frame_buffer_realloc(uint8_t* buffer, size_t size)
+{
+    if(!buffer)
+        return frame_buffer_alloc(size);
+    frame_buffer_header_t* header = HEADER_OF(buffer);
+    if(header->mapped_size == 0 && size <= FRAME_BUFFER_MAP_THRESHOLD)
+    {
+        header = realloc(header, sizeof(frame_buffer_header_t) + size);
+        if(!header)
+            return NULL;
+        header->capacity = size;
+        return BUFFER_OF(header);
+    }
+    /** A mapping that fits is kept, unless it is way too big */
+    if(header->mapped_size > 0 && size <= header->capacity && size > FRAME_BUFFER_MAP_THRESHOLD)
+        return buffer;
+    uint8_t* new_buffer = frame_buffer_alloc(size);
+    if(!new_buffer)
+        return NULL;
+    memcpy(new_buffer, buffer, header->capacity < size ? header->capacity : size);
+    frame_buffer_free(buffer);
+    return new_buffer;
+}
+
+bool frame_buffer_free(uint8_t* buffer)
+{
+    if(!buffer)
+        return false;
+    frame_buffer_header_t* header = HEADER_OF(buffer);
+    if(header->mapped_size == 0)
+    {
+        free(header);
+        return false;
+    }
+    header->freed_ms = now_ms();
+    header->trimmed = false;
+    /** Keep it in an empty slot, or in place of a smaller one */
+    int slot = -1;
+    for(int i = 0; i < CACHE_SIZE; i++)
+    {
+        if(!cache[i])
+        {
+            slot = i;
+            break;
+        }
+        if(!cache[i]->pinned && cache[i]->capacity < header->capacity && (slot < 0 || cache[i]->capacity < cache[slot]->capacity))
+            slot = i;
+    }
+    if(slot < 0)
+    {
+        unmap_buffer(header);
+        return false;
+    }
+    if(cache[slot])
+        unmap_buffer(cache[slot]);
+    cache[slot] = header;
+    return true;
+}
+
+bool frame_buffer_trim(uint32_t idle_ms)
+{
+    uint64_t now = now_ms();
+    bool pending = false;
+    for(int i = 0; i < CACHE_SIZE; i++)
+    {
+        frame_buffer_header_t* header = cache[i];
+        if(!header || header->trimmed || header->pinned)
+            continue;
+        if(now - header->freed_ms < idle_ms)
+        {
+            pending = true;
+            continue;
+        }
+        if(header->huge)
+        {
+            /** Explicit huge pages are a reserved pool, give them back whole */
+            unmap_buffer(header);
+            cache[i] = NULL;
+            continue;
+        }
+        release_pages(header);
+    }
+    return pending;
+}
+
+void frame_buffer_set_huge_pages(bool enable)
+{
+    use_huge_pages = enable;
+}
+
+int frame_buffer_prefault(size_t count, size_t size)
+{
+    if(count > CACHE_SIZE || size <= FRAME_BUFFER_MAP_THRESHOLD)
+        return -1;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    for(size_t i = 0; i < count; i++)
+    {
+        uint8_t* buffer = map_buffer(size);
+        if(!buffer)
+            return -1;
+        frame_buffer_header_t* header = HEADER_OF(buffer);
+        /** The header page is written already */
+        for(size_t offset = page_size; offset < header->mapped_size; offset += page_size)
+            ((volatile uint8_t*)header)[offset] = 0;
+        header->pinned = true;
+        if(!frame_buffer_free(buffer))
+            return -1;
+    }
+    return 0;
+}
+
+static uint8_t* map_buffer(size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t mapped_size = sizeof(frame_buffer_header_t) + size;
+    bool huge = use_huge_pages && mapped_size >= HUGE_PAGE_SIZE;
+    size_t alignment = huge ? HUGE_PAGE_SIZE : page_size;
+    mapped_size = (mapped_size + alignment - 1) / alignment * alignment;
+    void* addr = MAP_FAILED;
+    if(huge)
+        addr = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(addr == MAP_FAILED)
+    {
+        addr = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(addr == MAP_FAILED)
+            return NULL;
+        /** Best effort, transparent huge pages */
+        if(huge)
+            madvise(addr, mapped_size, MADV_HUGEPAGE);
+        huge = false;
+    }
+    frame_buffer_header_t* header = addr;
+    memset(header, 0, sizeof(frame_buffer_header_t));
+    header->mapped_size = mapped_size;
+    header->capacity = mapped_size - sizeof(frame_buffer_header_t);
+    header->huge = huge;
+    return BUFFER_OF(header);
+}
+
+static void unmap_buffer(frame_buffer_header_t* header)
+{
+    munmap(header, header->mapped_size);
+}
+
+/** Everything but the page with the header, it reads back as zeros once released */
+static void release_pages(frame_buffer_header_t* header)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    if(header->mapped_size > page_size)
+        madvise((uint8_t*)header + page_size, header->mapped_size - page_size, MADV_DONTNEED);
+    header->trimmed = true;
+}
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
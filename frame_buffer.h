@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * Buffers for received frames.
+ * Small ones come from malloc. Large ones are anonymous mappings, freed ones are kept per thread
+ * and handed out again, so a steady stream of large frames neither churns the heap nor faults in fresh pages.
+ * Every buffer from here must be freed with frame_buffer_free.
+ */
+
+/** Larger buffers are mapped */
+#define FRAME_BUFFER_MAP_THRESHOLD (64 * 1024)
+/** Kept mappings unused for this long should be trimmed */
+#define FRAME_BUFFER_IDLE_MS (1000)
+/** Mappings kept per thread */
+#define FRAME_BUFFER_CACHE_SIZE (4)
+
+uint8_t* frame_buffer_alloc(size_t size);
+/** Same as realloc, the content up to the smaller of both sizes is kept */
+uint8_t* frame_buffer_realloc(uint8_t* buffer, size_t size);
+/** @return true if a mapping was kept, frame_buffer_trim should run later */
+bool frame_buffer_free(uint8_t* buffer);
+/**
+ * Release the pages of the kept mappings of this thread idle for at least idle_ms with madvise.
+ * @return true if some kept mappings still hold pages, call it again later
+ */
+bool frame_buffer_trim(uint32_t idle_ms);
+/**
+ * Back mappings of at least 2MB with explicit huge pages, which need vm.nr_hugepages.
+ * Falls back to advising transparent huge pages.
+ */
+void frame_buffer_set_huge_pages(bool enable);
+/**
+ * Map count buffers of size bytes, fault in their pages and keep them for this thread.
+ * They are never trimmed, so frames up to size do not fault after startup.
+ * @return 0 on success, -1 if count is above FRAME_BUFFER_CACHE_SIZE, size is not above
+ * FRAME_BUFFER_MAP_THRESHOLD or mapping failed
+ */
+int frame_buffer_prefault(size_t count, size_t size);
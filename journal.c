@@ -0,0 +1,363 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "list.h"
+
+#define JOURNAL_MAGIC (0x304a4254) /** "TBJ0" */
+#define JOURNAL_FILE_SUFFIX ".journal"
+#define ALIGN8(x) (((x) + 7) & ~((size_t)7))
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t reserved;
+} journal_segment_header_t;
+
+typedef struct
+{
+    /** 0 marks the end of the segment. Written last. */
+    uint32_t size;
+    uint32_t reserved;
+    uint64_t timestamp_ms;
+    uint8_t data[];
+} journal_record_header_t;
+
+typedef struct
+{
+    list_head_t node;
+    uint64_t index;
+    uint8_t* base;
+    size_t size;
+    /** Write offset */
+    size_t offset;
+    uint64_t last_timestamp_ms;
+} journal_segment_t;
+
+#define GET_SEGMENT_FROM_NODE(list_node) \
+    ((journal_segment_t*)((char*)(list_node) - offsetof(journal_segment_t, node)))
+
+typedef struct
+{
+    journal_t iface;
+    journal_config_t config;
+    char* dir;
+    char* name;
+    /** List<journal_segment_t>, oldest first */
+    list_head_t segments;
+    size_t total_bytes;
+} journal_impl_t;
+
+static void journal_close(journal_t* iface);
+static int journal_append(journal_t* iface, const uint8_t* data, size_t size);
+static void journal_trim(journal_t* iface);
+static void journal_for_each(journal_t* iface, void (*callback)(const uint8_t* data, size_t size, uint64_t timestamp_ms, void* ctx), void* ctx);
+static int journal_recover(journal_impl_t* this);
+static int compare_index(const void* a, const void* b);
+static uint64_t now_ms();
+static int segment_get_path(journal_impl_t* this, uint64_t index, char* path, size_t path_len);
+static journal_segment_t* segment_open(journal_impl_t* this, uint64_t index, size_t size);
+static void segment_scan(journal_segment_t* segment);
+static void segment_drop(journal_impl_t* this, journal_segment_t* segment);
+static void segment_free(journal_segment_t* segment);
+
+journal_t* journal_new(const char* dir, const char* name, const journal_config_t* config)
+{
+    if(!dir || !name || !config || config->segment_size == 0)
+        return NULL;
+    journal_impl_t* this = malloc(sizeof(journal_impl_t));
+    if(!this)
+        return NULL;
+    memset(this, 0, sizeof(journal_impl_t));
+    this->iface.close = journal_close;
+    this->iface.append = journal_append;
+    this->iface.trim = journal_trim;
+    this->iface.for_each = journal_for_each;
+    this->config = *config;
+    LIST_INIT(&this->segments);
+    this->dir = strdup(dir);
+    if(!this->dir)
+        goto error;
+    this->name = strdup(name);
+    if(!this->name)
+        goto error;
+    if(journal_recover(this) != 0)
+        goto error;
+    return (journal_t*)this;
+error:
+    journal_close((journal_t*)this);
+    return NULL;
+}
+
+static void journal_close(journal_t* iface)
+{
+    journal_impl_t* this = (journal_impl_t*)iface;
+    if(!this)
+        return;
+    LIST_FOR_EACH_SAFE(&this->segments, node)
+    {
+        journal_segment_t* segment = GET_SEGMENT_FROM_NODE(node);
+        LIST_UNLINK(node);
+        segment_free(segment);
+    }
+    if(this->dir)
+        free(this->dir);
+    if(this->name)
+        free(this->name);
+    free(this);
+}
+
+static int journal_append(journal_t* iface, const uint8_t* data, size_t size)
+{
+    journal_impl_t* this = (journal_impl_t*)iface;
+    if(!this || !data || size == 0 || size > UINT32_MAX)
+        return -1;
+    size_t record_size = ALIGN8(sizeof(journal_record_header_t) + size);
+    journal_segment_t* tail = LIST_IS_EMPTY(&this->segments) ? NULL : GET_SEGMENT_FROM_NODE(this->segments.prev);
+    if(!tail || tail->size - tail->offset < record_size)
+    {
+        /** Roll to a new segment */
+        size_t segment_size = this->config.segment_size;
+        if(segment_size < sizeof(journal_segment_header_t) + record_size)
+            segment_size = sizeof(journal_segment_header_t) + record_size;
+        journal_segment_t* segment = segment_open(this, tail ? tail->index + 1 : 0, segment_size);
+        if(!segment)
+            return -1;
+        LIST_LINK(&this->segments, &segment->node);
+        this->total_bytes += segment->size;
+        tail = segment;
+        /** Size based retention */
+        while(this->config.max_bytes != 0 && this->total_bytes > this->config.max_bytes)
+        {
+            journal_segment_t* head = GET_SEGMENT_FROM_NODE(this->segments.next);
+            if(head == tail)
+                break;
+            segment_drop(this, head);
+        }
+    }
+    journal_record_header_t* record = (journal_record_header_t*)(tail->base + tail->offset);
+    uint64_t timestamp_ms = now_ms();
+    record->timestamp_ms = timestamp_ms;
+    memcpy(record->data, data, size);
+    /** size marks the record as complete, write it last */
+    __atomic_store_n(&record->size, (uint32_t)size, __ATOMIC_RELEASE);
+    tail->offset += record_size;
+    tail->last_timestamp_ms = timestamp_ms;
+    return 0;
+}
+
+static void journal_trim(journal_t* iface)
+{
+    journal_impl_t* this = (journal_impl_t*)iface;
+    if(!this || this->config.max_age_s == 0)
+        return;
+    uint64_t deadline = now_ms() - (uint64_t)this->config.max_age_s * 1000;
+    LIST_FOR_EACH_SAFE(&this->segments, node)
+    {
+        journal_segment_t* segment = GET_SEGMENT_FROM_NODE(node);
+        /** Keep the segment being written */
+        if(node->next == &this->segments)
+            break;
+        if(segment->last_timestamp_ms >= deadline)
+            break;
+        segment_drop(this, segment);
+    }
+}
+
+static void journal_for_each(journal_t* iface, void (*callback)(const uint8_t* data, size_t size, uint64_t timestamp_ms, void* ctx), void* ctx)
+{
+    journal_impl_t* this = (journal_impl_t*)iface;
+    if(!this || !callback)
+        return;
+    LIST_FOR_EACH(&this->segments, node)
+    {
+        journal_segment_t* segment = GET_SEGMENT_FROM_NODE(node);
+        size_t offset = sizeof(journal_segment_header_t);
+        while(offset < segment->offset)
+        {
+            journal_record_header_t* record = (journal_record_header_t*)(segment->base + offset);
+            callback(record->data, record->size, record->timestamp_ms, ctx);
+            offset += ALIGN8(sizeof(journal_record_header_t) + record->size);
+        }
+    }
+}
+
+static int journal_recover(journal_impl_t* this)
+{
+    DIR* dir = opendir(this->dir);
+    if(!dir)
+        return -1;
+    uint64_t* indexes = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t name_len = strlen(this->name);
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL)
+    {
+        /** <name>.<index>.journal */
+        if(strncmp(entry->d_name, this->name, name_len) != 0 || entry->d_name[name_len] != '.')
+            continue;
+        char* end = NULL;
+        uint64_t index = strtoull(entry->d_name + name_len + 1, &end, 10);
+        if(end == entry->d_name + name_len + 1 || strcmp(end, JOURNAL_FILE_SUFFIX) != 0)
+            continue;
+        if(count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            uint64_t* new_indexes = realloc(indexes, capacity * sizeof(uint64_t));
+            if(!new_indexes)
+                goto error;
+            indexes = new_indexes;
+        }
+        indexes[count++] = index;
+    }
+    closedir(dir);
+    dir = NULL;
+    if(count > 0)
+        qsort(indexes, count, sizeof(uint64_t), compare_index);
+    for(size_t i = 0; i < count; i++)
+    {
+        journal_segment_t* segment = segment_open(this, indexes[i], 0);
+        if(!segment)
+            continue;
+        segment_scan(segment);
+        LIST_LINK(&this->segments, &segment->node);
+        this->total_bytes += segment->size;
+    }
+    if(indexes)
+        free(indexes);
+    return 0;
+error:
+    if(dir)
+        closedir(dir);
+    if(indexes)
+        free(indexes);
+    return -1;
+}
+
+static int compare_index(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int segment_get_path(journal_impl_t* this, uint64_t index, char* path, size_t path_len)
+{
+    int len = snprintf(path, path_len, "%s/%s.%"PRIu64 JOURNAL_FILE_SUFFIX, this->dir, this->name, index);
+    if(len < 0 || (size_t)len >= path_len)
+        return -1;
+    return 0;
+}
+
+/** size 0 opens an existing segment */
+static journal_segment_t* segment_open(journal_impl_t* this, uint64_t index, size_t size)
+{
+    char path[PATH_MAX];
+    int fd = -1;
+    journal_segment_t* segment = NULL;
+    if(segment_get_path(this, index, path, sizeof(path)) != 0)
+        goto error;
+    fd = open(path, size ? (O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC) : (O_RDWR | O_CLOEXEC), 0644);
+    if(fd < 0)
+        goto error;
+    if(size)
+    {
+        /** Allocate the blocks now, running out of space on a store to the mapping is SIGBUS */
+        if(posix_fallocate(fd, 0, size) != 0)
+        {
+            unlink(path);
+            goto error;
+        }
+    }
+    else
+    {
+        struct stat st;
+        if(fstat(fd, &st) != 0 || st.st_size < sizeof(journal_segment_header_t))
+            goto error;
+        size = st.st_size;
+    }
+    segment = malloc(sizeof(journal_segment_t));
+    if(!segment)
+        goto error;
+    memset(segment, 0, sizeof(journal_segment_t));
+    segment->index = index;
+    segment->size = size;
+    segment->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(segment->base == MAP_FAILED)
+    {
+        segment->base = NULL;
+        goto error;
+    }
+    close(fd);
+    fd = -1;
+    journal_segment_header_t* header = (journal_segment_header_t*)segment->base;
+    if(header->magic == 0)
+        header->magic = JOURNAL_MAGIC;
+    if(header->magic != JOURNAL_MAGIC)
+        goto error;
+    segment->offset = sizeof(journal_segment_header_t);
+    return segment;
+error:
+    if(fd >= 0)
+        close(fd);
+    segment_free(segment);
+    return NULL;
+}
+
+/** Find the write offset of a recovered segment */
+static void segment_scan(journal_segment_t* segment)
+{
+    size_t offset = sizeof(journal_segment_header_t);
+    while(offset + sizeof(journal_record_header_t) <= segment->size)
+    {
+        journal_record_header_t* record = (journal_record_header_t*)(segment->base + offset);
+        if(record->size == 0)
+            break;
+        size_t record_size = ALIGN8(sizeof(journal_record_header_t) + record->size);
+        if(offset + record_size > segment->size)
+            break;
+        segment->last_timestamp_ms = record->timestamp_ms;
+        offset += record_size;
+    }
+    segment->offset = offset;
+}
+
+static void segment_drop(journal_impl_t* this, journal_segment_t* segment)
+{
+    char path[PATH_MAX];
+    LIST_UNLINK(&segment->node);
+    this->total_bytes -= segment->size;
+    if(segment_get_path(this, segment->index, path, sizeof(path)) == 0)
+        unlink(path);
+    segment_free(segment);
+}
+
+static void segment_free(journal_segment_t* segment)
+{
+    if(!segment)
+        return;
+    if(segment->base)
+        munmap(segment->base, segment->size);
+    free(segment);
+}
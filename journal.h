@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Segmented append only log backed by memory mapped files.
+ * Records are already serialized frames.
+ * Appending only copies into the mapped segment, syscalls happen when a new segment is needed.
+ */
+
+typedef struct journal_s journal_t;
+
+typedef struct
+{
+    /** Size of each segment file. Larger records get a segment of their own. */
+    size_t segment_size;
+    /** Drop the oldest segments once the total size exceeds this. 0 for no limit. */
+    size_t max_bytes;
+    /** Drop the segments whose newest record is older than this. 0 for no limit. */
+    uint32_t max_age_s;
+} journal_config_t;
+
+struct journal_s
+{
+    /**
+     * @brief Unmap all segments. The files are kept.
+     * @param self the journal
+     */
+    void (*close)(journal_t* self);
+
+    /**
+     * @brief Append a record.
+     * @param self the journal
+     * @param data the record
+     * @param size the size of the record
+     * @return 0 on success, -1 on failure
+     */
+    int (*append)(journal_t* self, const uint8_t* data, size_t size);
+
+    /**
+     * @brief Apply the age based retention. Call this periodically.
+     * @param self the journal
+     */
+    void (*trim)(journal_t* self);
+
+    /**
+     * @brief Iterate over all records, oldest first.
+     * @note DO NOT append in callback.
+     * @param self the journal
+     * @param callback called with each record and its append time in ms since epoch
+     * @param ctx the context to pass to the callback
+     */
+    void (*for_each)(journal_t* self, void (*callback)(const uint8_t* data, size_t size, uint64_t timestamp_ms, void* ctx), void* ctx);
+};
+
+/**
+ * @brief Open or create a journal. Existing segments are recovered.
+ * @param dir the directory of the segment files, must exist
+ * @param name the name prefix of the segment files
+ * @param config the journal config
+ * @return the journal or NULL on failure
+ */
+journal_t* journal_new(const char* dir, const char* name, const journal_config_t* config);
@@ -14,17 +14,79 @@
         offset += sizeof(tbus_message_raw_tlv_t) + tlv_151eqt2->len; \
     }while(0)
 
-uint8_t* tbus_message_serialize(const tbus_message_t* msg, size_t* len)
+size_t tbus_message_get_serialized_size(const tbus_message_t* msg)
 {
-    if(!msg || !len)
-        return NULL;
+    if(!msg)
+        return 0;
     size_t msg_len = sizeof(tbus_message_raw_header_t);
     /** always pack in a sub index */
     msg_len += sizeof(tbus_message_raw_tlv_t) + sizeof(tbus_message_sub_index_t);
+    if(msg->p_credit)
+        msg_len += sizeof(tbus_message_raw_tlv_t) + sizeof(tbus_message_credit_t);
+    if(msg->p_seq)
+        msg_len += sizeof(tbus_message_raw_tlv_t) + sizeof(tbus_message_seq_t);
+    if(msg->p_correlation_id)
+        msg_len += sizeof(tbus_message_raw_tlv_t) + sizeof(tbus_message_correlation_id_t);
+    if(msg->p_priority)
+        msg_len += sizeof(tbus_message_raw_tlv_t) + sizeof(tbus_message_priority_t);
+    if(msg->p_origin)
+        msg_len += sizeof(tbus_message_raw_tlv_t) + sizeof(tbus_message_origin_t);
+    if(msg->p_filter && msg->filter_count > 0)
+        msg_len += sizeof(tbus_message_raw_tlv_t) + msg->filter_count * sizeof(tbus_message_filter_t);
+    if(msg->p_interval)
+        msg_len += sizeof(tbus_message_raw_tlv_t) + sizeof(tbus_message_interval_t);
+    if(msg->p_sub_flags)
+        msg_len += sizeof(tbus_message_raw_tlv_t) + sizeof(tbus_message_sub_flags_t);
     if(msg->data && msg->data_len > 0)
         msg_len += sizeof(tbus_message_raw_tlv_t) + msg->data_len;
     if(msg->topic)
         msg_len += sizeof(tbus_message_raw_tlv_t) + strlen(msg->topic) + 1 /** \0 */;
+    return msg_len;
+}
+
+tbus_message_priority_t tbus_message_get_priority(const tbus_message_t* msg)
+{
+    if(!msg || !msg->p_priority)
+        return 0;
+    tbus_message_priority_t priority = *msg->p_priority;
+    return priority < TBUS_MSG_PRIORITY_LEVELS ? priority : TBUS_MSG_PRIORITY_LEVELS - 1;
+}
+
+int tbus_message_filter_match(const tbus_message_filter_t* filters, uint32_t filter_count, const uint8_t* data, uint32_t data_len)
+{
+    for(uint32_t i = 0; i < filter_count; i++)
+    {
+        tbus_message_filter_t filter;
+        memcpy(&filter, &filters[i], sizeof(filter));
+        if(filter.width == 0 || filter.width > sizeof(uint64_t))
+            return 0;
+        if(!data || filter.offset > data_len || data_len - filter.offset < filter.width)
+            return 0;
+        uint64_t field = 0;
+        for(int j = filter.width - 1; j >= 0; j--)
+            field = (field << 8) | data[filter.offset + j];
+        switch(filter.op)
+        {
+            case TBUS_MSG_FILTER_MASKED_EQUAL:
+                if((field & filter.a) != filter.b)
+                    return 0;
+                break;
+            case TBUS_MSG_FILTER_RANGE:
+                if(field < filter.a || field > filter.b)
+                    return 0;
+                break;
+            default:
+                return 0;
+        }
+    }
+    return 1;
+}
+
+uint8_t* tbus_message_serialize(const tbus_message_t* msg, size_t* len)
+{
+    if(!msg || !len)
+        return NULL;
+    size_t msg_len = tbus_message_get_serialized_size(msg);
     tbus_message_raw_header_t* buffer = (tbus_message_raw_header_t*)malloc(msg_len);
     if(!buffer)
     {
@@ -46,6 +108,38 @@ uint8_t* tbus_message_serialize(const tbus_message_t* msg, size_t* len)
         tbus_message_sub_index_t sub_index = 0;
         WRITE_TLV_SAFE(buffer->data, offset, TBUS_MSG_TYPE_SUB_INDEX, sizeof(tbus_message_sub_index_t), &sub_index);
     }
+    if(msg->p_credit)
+    {
+        WRITE_TLV_SAFE(buffer->data, offset, TBUS_MSG_TYPE_CREDIT, sizeof(tbus_message_credit_t), msg->p_credit);
+    }
+    if(msg->p_seq)
+    {
+        WRITE_TLV_SAFE(buffer->data, offset, TBUS_MSG_TYPE_SEQ, sizeof(tbus_message_seq_t), msg->p_seq);
+    }
+    if(msg->p_correlation_id)
+    {
+        WRITE_TLV_SAFE(buffer->data, offset, TBUS_MSG_TYPE_CORRELATION_ID, sizeof(tbus_message_correlation_id_t), msg->p_correlation_id);
+    }
+    if(msg->p_priority)
+    {
+        WRITE_TLV_SAFE(buffer->data, offset, TBUS_MSG_TYPE_PRIORITY, sizeof(tbus_message_priority_t), msg->p_priority);
+    }
+    if(msg->p_origin)
+    {
+        WRITE_TLV_SAFE(buffer->data, offset, TBUS_MSG_TYPE_ORIGIN, sizeof(tbus_message_origin_t), msg->p_origin);
+    }
+    if(msg->p_filter && msg->filter_count > 0)
+    {
+        WRITE_TLV_SAFE(buffer->data, offset, TBUS_MSG_TYPE_FILTER, msg->filter_count * sizeof(tbus_message_filter_t), msg->p_filter);
+    }
+    if(msg->p_interval)
+    {
+        WRITE_TLV_SAFE(buffer->data, offset, TBUS_MSG_TYPE_INTERVAL, sizeof(tbus_message_interval_t), msg->p_interval);
+    }
+    if(msg->p_sub_flags)
+    {
+        WRITE_TLV_SAFE(buffer->data, offset, TBUS_MSG_TYPE_SUB_FLAGS, sizeof(tbus_message_sub_flags_t), msg->p_sub_flags);
+    }
     if(msg->topic)
     {
         WRITE_TLV_SAFE(buffer->data, offset, TBUS_MSG_TYPE_TOPIC, strlen(msg->topic) + 1, msg->topic);
@@ -59,6 +153,43 @@ uint8_t* tbus_message_serialize(const tbus_message_t* msg, size_t* len)
 }
 
 
+uint8_t* tbus_message_serialize_head(const tbus_message_t* msg, size_t* len)
+{
+    if(!msg || !len)
+        return NULL;
+    tbus_message_t head = *msg;
+    head.data = NULL;
+    head.data_len = 0;
+    size_t size = 0;
+    uint8_t* frame = tbus_message_serialize(&head, &size);
+    if(!frame)
+        goto error;
+    uint8_t* buffer = realloc(frame, size + sizeof(tbus_message_raw_tlv_t));
+    if(!buffer)
+    {
+        free(frame);
+        goto error;
+    }
+    tbus_message_raw_tlv_t* tlv = (tbus_message_raw_tlv_t*)(buffer + size);
+    tbus_message_raw_tlv_type_t type = TBUS_MSG_TYPE_DATA;
+    memcpy(&tlv->type, &type, sizeof(tlv->type));
+    *len = size + sizeof(tbus_message_raw_tlv_t);
+    tbus_message_set_data_len(buffer, *len, 0);
+    return buffer;
+error:
+    *len = 0;
+    return NULL;
+}
+
+void tbus_message_set_data_len(uint8_t* head, size_t head_len, uint32_t data_len)
+{
+    tbus_message_len_t msg_len = head_len + data_len;
+    memcpy(head, &msg_len, sizeof(msg_len));
+    tbus_message_raw_tlv_t* tlv = (tbus_message_raw_tlv_t*)(head + head_len - sizeof(tbus_message_raw_tlv_t));
+    tbus_message_raw_tlv_len_t tlv_len = data_len;
+    memcpy(&tlv->len, &tlv_len, sizeof(tlv->len));
+}
+
 int tbus_message_view(const uint8_t* src, size_t src_len, tbus_message_t* msg)
 {
     if(!src || !msg)
@@ -72,6 +203,7 @@ int tbus_message_view(const uint8_t* src, size_t src_len, tbus_message_t* msg)
         return -1;
     if(header_view.version != TBUS_MSG_VERSION)
         return -1;
+    memset(msg, 0, sizeof(tbus_message_t));
     msg->command = header_view.command;
     size_t offset = 0;
     size_t data_len = header_view.len - sizeof(tbus_message_raw_header_t);
@@ -97,8 +229,50 @@ int tbus_message_view(const uint8_t* src, size_t src_len, tbus_message_t* msg)
             case TBUS_MSG_TYPE_SUB_INDEX:
                 msg->p_sub_index = (tbus_message_sub_index_t*)tlv->data;
                 break;
+            case TBUS_MSG_TYPE_CREDIT:
+                if(tlv_view.len != sizeof(tbus_message_credit_t))
+                    return -1;
+                msg->p_credit = (tbus_message_credit_t*)tlv->data;
+                break;
+            case TBUS_MSG_TYPE_SEQ:
+                if(tlv_view.len != sizeof(tbus_message_seq_t))
+                    return -1;
+                msg->p_seq = (tbus_message_seq_t*)tlv->data;
+                break;
+            case TBUS_MSG_TYPE_CORRELATION_ID:
+                if(tlv_view.len != sizeof(tbus_message_correlation_id_t))
+                    return -1;
+                msg->p_correlation_id = (tbus_message_correlation_id_t*)tlv->data;
+                break;
+            case TBUS_MSG_TYPE_PRIORITY:
+                if(tlv_view.len != sizeof(tbus_message_priority_t))
+                    return -1;
+                msg->p_priority = (tbus_message_priority_t*)tlv->data;
+                break;
+            case TBUS_MSG_TYPE_ORIGIN:
+                if(tlv_view.len != sizeof(tbus_message_origin_t))
+                    return -1;
+                msg->p_origin = (tbus_message_origin_t*)tlv->data;
+                break;
+            case TBUS_MSG_TYPE_FILTER:
+                if(tlv_view.len % sizeof(tbus_message_filter_t) != 0)
+                    return -1;
+                msg->p_filter = (tbus_message_filter_t*)tlv->data;
+                msg->filter_count = tlv_view.len / sizeof(tbus_message_filter_t);
+                break;
+            case TBUS_MSG_TYPE_INTERVAL:
+                if(tlv_view.len != sizeof(tbus_message_interval_t))
+                    return -1;
+                msg->p_interval = (tbus_message_interval_t*)tlv->data;
+                break;
+            case TBUS_MSG_TYPE_SUB_FLAGS:
+                if(tlv_view.len != sizeof(tbus_message_sub_flags_t))
+                    return -1;
+                msg->p_sub_flags = (tbus_message_sub_flags_t*)tlv->data;
+                break;
             default:
-                return -1;
+                /** Optional TLV from a newer peer, skip it */
+                break;
         }
         offset += tlv->len;
     }
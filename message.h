@@ -19,6 +19,21 @@ enum
     TBUS_MSG_CMD_SUB,
     TBUS_MSG_CMD_UNSUB,
     TBUS_MSG_CMD_PUB,
+    /**
+     * client -> broker: enable flow control, optional CREDIT as the requested window.
+     * broker -> client: CREDIT bytes granted back to the client.
+     */
+    TBUS_MSG_CMD_CREDIT,
+    /** Routed like PUB, the broker remembers the requester by CORRELATION_ID */
+    TBUS_MSG_CMD_REQ,
+    /** Routed back to the requester by CORRELATION_ID. No DATA means no responder. */
+    TBUS_MSG_CMD_REPLY,
+    /**
+     * client -> broker on the stream: DATA is the address of the client's SOCK_DGRAM socket.
+     * broker -> client as a datagram: CORRELATION_ID is a nonce, the client sends it back
+     * as a datagram to prove it owns the address. Small frames then go as datagrams both ways.
+     */
+    TBUS_MSG_CMD_DGRAM,
     TBUS_MSG_CMD_MAX
 };
 
@@ -41,10 +56,65 @@ enum
     TBUS_MSG_TYPE_TOPIC,
     TBUS_MSG_TYPE_DATA,
     TBUS_MSG_TYPE_SUB_INDEX,
+    TBUS_MSG_TYPE_CREDIT,
+    /** 
+     * PUB: the per topic sequence number assigned by the broker.
+     * SUB: replay the history from this sequence number.
+     */
+    TBUS_MSG_TYPE_SEQ,
+    TBUS_MSG_TYPE_CORRELATION_ID,
+    /** Higher is more urgent. Absent means 0. */
+    TBUS_MSG_TYPE_PRIORITY,
+    /** PUB: id of the broker the message entered the bus at. 0 until a broker stamps it. */
+    TBUS_MSG_TYPE_ORIGIN,
+    /** SUB: tbus_message_filter_t array, all must pass for DATA to be delivered. Absent means no filter. */
+    TBUS_MSG_TYPE_FILTER,
+    /** SUB: deliver at most one message per this many ms, the latest. Absent or 0 means every message. */
+    TBUS_MSG_TYPE_INTERVAL,
+    /** SUB: TBUS_MSG_SUB_FLAG_* bits. Absent means 0. */
+    TBUS_MSG_TYPE_SUB_FLAGS,
     TBUS_MSG_TYPE_MAX
 };
 
 typedef uint64_t tbus_message_sub_index_t;
+typedef uint32_t tbus_message_credit_t;
+typedef uint64_t tbus_message_seq_t;
+typedef uint64_t tbus_message_correlation_id_t;
+typedef uint8_t tbus_message_priority_t;
+typedef uint64_t tbus_message_origin_t;
+typedef uint32_t tbus_message_interval_t;
+typedef uint8_t tbus_message_sub_flags_t;
+
+/** REQ matching the topic is routed to one serving subscription, others never see it */
+#define TBUS_MSG_SUB_FLAG_SERVE (1 << 0)
+/** PUB of the subscribing connection is not sent back to it, bridges use it */
+#define TBUS_MSG_SUB_FLAG_NO_LOCAL (1 << 1)
+
+enum
+{
+    /** (field & a) == b */
+    TBUS_MSG_FILTER_MASKED_EQUAL,
+    /** a <= field <= b */
+    TBUS_MSG_FILTER_RANGE,
+    TBUS_MSG_FILTER_MAX
+};
+
+/** Filters per subscription the broker accepts */
+#define TBUS_MSG_MAX_FILTERS (32)
+
+/** A condition on a little endian unsigned integer of width bytes at offset in DATA */
+typedef struct
+{
+    uint8_t op;
+    /** 1 to 8 */
+    uint8_t width;
+    uint32_t offset;
+    uint64_t a;
+    uint64_t b;
+}__attribute__((packed)) tbus_message_filter_t;
+
+/** Number of outbound queues, one per priority */
+#define TBUS_MSG_PRIORITY_LEVELS (4)
 
 typedef uint8_t tbus_message_raw_tlv_type_t;
 typedef uint32_t tbus_message_raw_tlv_len_t;
@@ -69,6 +139,29 @@ typedef struct
      * DO NOT access this directly, use READ_SUB_INDEX and WRITE_SUB_INDEX instead.
      */
     tbus_message_sub_index_t* p_sub_index;
+    /** Optional. DO NOT access this directly, use READ_FIELD and WRITE_FIELD instead. */
+    tbus_message_credit_t* p_credit;
+    /** 
+     * Optional. DO NOT access this directly, use READ_FIELD and WRITE_FIELD instead.
+     * Added to PUB by brokers with sequence numbers on.
+     */
+    tbus_message_seq_t* p_seq;
+    /** Optional. DO NOT access this directly, use READ_FIELD and WRITE_FIELD instead. */
+    tbus_message_correlation_id_t* p_correlation_id;
+    /** Optional. Use tbus_message_get_priority. */
+    tbus_message_priority_t* p_priority;
+    /** 
+     * Optional. DO NOT access this directly, use READ_FIELD and WRITE_FIELD instead.
+     * Added to PUB by brokers forwarding it over a bridge.
+     */
+    tbus_message_origin_t* p_origin;
+    /** Optional. May point into an unaligned buffer, use tbus_message_filter_match. */
+    tbus_message_filter_t* p_filter;
+    uint32_t filter_count;
+    /** Optional. DO NOT access this directly, use READ_FIELD and WRITE_FIELD instead. */
+    tbus_message_interval_t* p_interval;
+    /** Optional. */
+    tbus_message_sub_flags_t* p_sub_flags;
 } tbus_message_t;
 
 #define WRITE_SUB_INDEX(msg, sub_index) \
@@ -84,6 +177,41 @@ typedef struct
         memcpy(&(sub_index), (msg)->p_sub_index, sizeof(*(msg)->p_sub_index)); \
     } while(0)
 
+/** Access an optional field that may point into an unaligned buffer */
+#define WRITE_FIELD(p_field, value) \
+    do \
+    { \
+        __typeof__(*(p_field)) value_t8c2mx = (value);\
+        memcpy((p_field), &value_t8c2mx, sizeof(*(p_field))); \
+    } while(0)
+
+#define READ_FIELD(p_field, value) \
+    do \
+    { \
+        memcpy(&(value), (p_field), sizeof(*(p_field))); \
+    } while(0)
+
+/**
+ * Get the serialized size of a message without serializing it
+ * @param msg The message
+ * @return The size tbus_message_serialize would produce, 0 on failure
+ */
+size_t tbus_message_get_serialized_size(const tbus_message_t* msg);
+/**
+ * Get the priority of a message, clamped to the available levels.
+ * @param msg The message
+ * @return The priority, 0 if not set
+ */
+tbus_message_priority_t tbus_message_get_priority(const tbus_message_t* msg);
+/**
+ * Check data against filters. Fields out of data fail.
+ * @param filters The filters, may be unaligned
+ * @param filter_count The number of filters
+ * @param data The message data
+ * @param data_len The length of data
+ * @return 1 if all filters pass, 0 otherwise
+ */
+int tbus_message_filter_match(const tbus_message_filter_t* filters, uint32_t filter_count, const uint8_t* data, uint32_t data_len);
 /**
  * Serialize a message to a buffer
  * @param msg The message to serialize
@@ -92,10 +220,29 @@ typedef struct
  * @note The caller is responsible for freeing the returned buffer
  */
 uint8_t* tbus_message_serialize(const tbus_message_t* msg, size_t* len);
+/**
+ * Serialize everything of a message but its data, followed by the header of an empty DATA TLV.
+ * DATA is the last TLV, so the head with tbus_message_set_data_len applied and the data right after it
+ * make a complete frame. This lets a frame be sent from two buffers.
+ * @param msg The message, data is ignored
+ * @param len The length of the head
+ * @return The head or NULL on failure
+ * @note The caller is responsible for freeing the returned buffer
+ */
+uint8_t* tbus_message_serialize_head(const tbus_message_t* msg, size_t* len);
+/**
+ * Set the frame and DATA TLV lengths of a head from tbus_message_serialize_head
+ * @param head The head
+ * @param head_len The length of the head
+ * @param data_len The length of the data that follows it
+ */
+void tbus_message_set_data_len(uint8_t* head, size_t head_len, uint32_t data_len);
 /**
  * Create a view of the message.
  * The view is only valid as long as the original message is valid.
  * Be very careful when modifying the view's content. 
+ * Unknown TLV types are skipped, but only by readers since this one: 1.0 readers reject them.
+ * A new TLV that may reach 1.0 peers still needs a version bump, or has to be opt-in like SEQ and ORIGIN.
  * @param src The message to view
  * @param src_len The length of the message
  * @param msg The message view
@@ -1,14 +1,27 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
 #include "message_reader.h"
+#include "frame_buffer.h"
 
 // Fit the buffer in one page
 #define STATIC_BUFFER_SIZE (4000)
+/** Records received in one recvmmsg */
+#define RECORD_BATCH (16)
+
+_Static_assert(MESSAGE_RECORD_SIZE <= STATIC_BUFFER_SIZE, "A record must fit in a static buffer");
 
 typedef struct
 {
@@ -18,14 +31,38 @@ typedef struct
     uint8_t* buffer;
     size_t buffer_size;
     size_t buffer_offset;
+    /** The message being delivered, either buffer or one of records */
+    uint8_t* current;
+    size_t current_size;
+    /** Index in records, -1 for buffer */
+    int current_record;
+    /** SOCK_SEQPACKET or SOCK_DGRAM */
+    bool seqpacket;
+    /** SOCK_DGRAM only, each record is a whole frame with its sender */
+    bool datagram;
+    uint8_t* records[RECORD_BATCH];
+    struct sockaddr_un sources[RECORD_BATCH];
+    socklen_t source_lens[RECORD_BATCH];
+    /** Gives back the pages of large buffers once idle */
+    tev_timeout_handle_t trim_timer;
 } message_reader_impl_t;
 
 static void message_reader_close(message_reader_t* iface);
 static void message_reader_close_direct(void* ctx);
 static uint8_t* message_reader_get_buffer(message_reader_t* iface, size_t* size);
 static uint8_t* message_reader_take_over_buffer(message_reader_t* iface, size_t* size);
+static const uint8_t* message_reader_get_partial(message_reader_t* iface, size_t* size);
+static int message_reader_set_partial(message_reader_t* iface, const uint8_t* data, size_t size);
+static const struct sockaddr* message_reader_get_source(message_reader_t* iface, socklen_t* len);
+static int message_reader_read_pending(message_reader_t* iface);
 static void read_handler(void* ctx);
+static void read_records(message_reader_impl_t* this);
+static void read_record(message_reader_impl_t* this, int index, size_t size);
+static void read_datagram(message_reader_impl_t* this, int index, const struct mmsghdr* msg);
+static void dispatch(message_reader_impl_t* this, uint8_t* data, size_t size, int record);
+static void shrink_buffer(message_reader_impl_t* this);
 static void error_handler(message_reader_impl_t* this);
+static void on_trim_timer(void* ctx);
 
 message_reader_t* message_reader_new(tev_handle_t tev, int fd)
 {
@@ -38,12 +75,29 @@ message_reader_t* message_reader_new(tev_handle_t tev, int fd)
     this->iface.close = message_reader_close;
     this->iface.get_buffer = message_reader_get_buffer;
     this->iface.take_over_buffer = message_reader_take_over_buffer;
+    this->iface.get_partial = message_reader_get_partial;
+    this->iface.set_partial = message_reader_set_partial;
+    this->iface.get_source = message_reader_get_source;
+    this->iface.read_pending = message_reader_read_pending;
     this->tev = tev;
     this->fd = fd;
     this->buffer_size = STATIC_BUFFER_SIZE;
-    this->buffer = malloc(this->buffer_size);
+    this->buffer = frame_buffer_alloc(this->buffer_size);
     if(!this->buffer)
         goto error;
+    int type = 0;
+    socklen_t type_len = sizeof(type);
+    if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_len) == 0 && (type == SOCK_SEQPACKET || type == SOCK_DGRAM))
+    {
+        this->seqpacket = true;
+        this->datagram = type == SOCK_DGRAM;
+        for(int i = 0; i < RECORD_BATCH; i++)
+        {
+            this->records[i] = frame_buffer_alloc(STATIC_BUFFER_SIZE);
+            if(!this->records[i])
+                goto error;
+        }
+    }
     if(tev_set_read_handler(tev, fd, read_handler, this) != 0)
         goto error;
     return (message_reader_t*)this;
@@ -59,6 +113,14 @@ static void message_reader_close(message_reader_t* iface)
         return;
     this->iface.callbacks.on_error = NULL;
     this->iface.callbacks.on_message = NULL;
+    this->iface.callbacks.on_read = NULL;
+    /** 
+     * Stop reading now, the fd may be closed and reused before the deferred free.
+     * The buffer may still be in use by the caller, so free later.
+     */
+    if(this->fd >= 0)
+        tev_set_read_handler(this->tev, this->fd, NULL, NULL);
+    this->fd = -1;
     tev_set_timeout(this->tev, message_reader_close_direct, this, 0);
 }
 
@@ -69,8 +131,19 @@ static void message_reader_close_direct(void* ctx)
         return;
     if(this->fd >= 0 && this->tev)
         tev_set_read_handler(this->tev, this->fd, NULL, NULL);
+    if(this->trim_timer)
+    {
+        /** Nobody may be left to trim later */
+        tev_clear_timeout(this->tev, this->trim_timer);
+        frame_buffer_trim(0);
+    }
     if(this->buffer)
-        free(this->buffer);
+        frame_buffer_free(this->buffer);
+    for(int i = 0; i < RECORD_BATCH; i++)
+    {
+        if(this->records[i])
+            frame_buffer_free(this->records[i]);
+    }
     free(this);
 }
 
@@ -80,8 +153,8 @@ static uint8_t* message_reader_get_buffer(message_reader_t* iface, size_t* size)
     if(!this)
         return NULL;
     if(size)
-        *size = this->buffer_offset;
-    return this->buffer;
+        *size = this->current_size;
+    return this->current;
 }
 
 static uint8_t* message_reader_take_over_buffer(message_reader_t* iface, size_t* size)
@@ -89,15 +162,25 @@ static uint8_t* message_reader_take_over_buffer(message_reader_t* iface, size_t*
     message_reader_impl_t* this = (message_reader_impl_t*)iface;
     if(!this)
         return NULL;
-    uint8_t* new_buffer = malloc(STATIC_BUFFER_SIZE);
+    if(!this->current)
+        goto error;
+    uint8_t* new_buffer = frame_buffer_alloc(STATIC_BUFFER_SIZE);
     if(!new_buffer)
-        return NULL;
-    uint8_t* old_buffer = this->buffer;
+        goto error;
+    uint8_t* old_buffer = this->current;
     if(size)
-        *size = this->buffer_offset;
-    this->buffer = new_buffer;
-    this->buffer_size = STATIC_BUFFER_SIZE;
-    this->buffer_offset = 0;
+        *size = this->current_size;
+    if(this->current_record >= 0)
+    {
+        this->records[this->current_record] = new_buffer;
+    }
+    else
+    {
+        this->buffer = new_buffer;
+        this->buffer_size = STATIC_BUFFER_SIZE;
+        this->buffer_offset = 0;
+    }
+    this->current = NULL;
     return old_buffer;
 error:
     if(size)
@@ -105,9 +188,78 @@ error:
     return NULL;
 }
 
+static const uint8_t* message_reader_get_partial(message_reader_t* iface, size_t* size)
+{
+    message_reader_impl_t* this = (message_reader_impl_t*)iface;
+    if(!this || !size)
+        return NULL;
+    *size = this->buffer_offset;
+    return this->buffer;
+}
+
+static int message_reader_set_partial(message_reader_t* iface, const uint8_t* data, size_t size)
+{
+    message_reader_impl_t* this = (message_reader_impl_t*)iface;
+    if(!this || (!data && size > 0))
+        return -1;
+    size_t needed = size;
+    if(size >= sizeof(tbus_message_len_t))
+    {
+        tbus_message_len_t msg_len;
+        memcpy(&msg_len, data, sizeof(tbus_message_len_t));
+        /** A complete frame is never partial */
+        if(msg_len <= size)
+            return -1;
+        needed = msg_len;
+    }
+    if(needed > this->buffer_size)
+    {
+        uint8_t* new_buffer = frame_buffer_realloc(this->buffer, needed);
+        if(!new_buffer)
+            return -1;
+        this->buffer = new_buffer;
+        this->buffer_size = needed;
+    }
+    memcpy(this->buffer, data, size);
+    this->buffer_offset = size;
+    return 0;
+}
+
+static const struct sockaddr* message_reader_get_source(message_reader_t* iface, socklen_t* len)
+{
+    message_reader_impl_t* this = (message_reader_impl_t*)iface;
+    if(!this || !this->datagram || !this->current || this->current_record < 0)
+        return NULL;
+    if(len)
+        *len = this->source_lens[this->current_record];
+    return (const struct sockaddr*)&this->sources[this->current_record];
+}
+
+static int message_reader_read_pending(message_reader_t* iface)
+{
+    message_reader_impl_t* this = (message_reader_impl_t*)iface;
+    int pending = 0;
+    /** Each read takes at least a byte, EOF is left to the read handler */
+    while(this->fd >= 0 && ioctl(this->fd, FIONREAD, &pending) == 0 && pending > 0)
+        read_handler(this);
+    return this->fd >= 0 ? 0 : -1;
+}
+
 static void read_handler(void* ctx)
 {
     message_reader_impl_t* this = (message_reader_impl_t*)ctx;
+    if(this->iface.callbacks.on_read)
+    {
+        this->iface.callbacks.on_read(this->iface.callbacks.on_read_ctx);
+        /** Closed in callback */
+        if(this->fd < 0)
+            return;
+    }
+    if(this->seqpacket)
+    {
+        read_records(this);
+        return;
+    }
     /** read len first */
     tbus_message_len_t msg_len;
     if(this->buffer_offset < sizeof(tbus_message_len_t))
@@ -137,7 +289,7 @@ static void read_handler(void* ctx)
         memcpy(&msg_len, this->buffer, sizeof(tbus_message_len_t));
         if(msg_len > STATIC_BUFFER_SIZE)
         {
-            uint8_t* new_buffer = realloc(this->buffer, msg_len);
+            uint8_t* new_buffer = frame_buffer_realloc(this->buffer, msg_len);
             if(!new_buffer)
             {
                 /** Another option is to read out and ignore this packet */
@@ -173,25 +325,180 @@ static void read_handler(void* ctx)
     if(this->buffer_offset < msg_len)
         return;
     /** We have a full message */
+    dispatch(this, this->buffer, msg_len, -1);
+    this->buffer_offset = 0;
+    shrink_buffer(this);
+}
+
+static void read_records(message_reader_impl_t* this)
+{
+    struct mmsghdr msgs[RECORD_BATCH];
+    struct iovec iovs[RECORD_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for(int i = 0; i < RECORD_BATCH; i++)
+    {
+        iovs[i].iov_base = this->records[i];
+        iovs[i].iov_len = MESSAGE_RECORD_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if(this->datagram)
+        {
+            msgs[i].msg_hdr.msg_name = &this->sources[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(this->sources[i]);
+        }
+    }
+    int count = recvmmsg(this->fd, msgs, RECORD_BATCH, MSG_DONTWAIT, NULL);
+    if(count < 0)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        /** Error */
+        error_handler(this);
+        return;
+    }
+    for(int i = 0; i < count; i++)
+    {
+        if(this->datagram)
+        {
+            read_datagram(this, i, &msgs[i]);
+        }
+        else
+        {
+            /** Empty records are never sent, this is EOF */
+            if(msgs[i].msg_len == 0)
+            {
+                error_handler(this);
+                return;
+            }
+            read_record(this, i, msgs[i].msg_len);
+        }
+        /** Closed in callback */
+        if(this->fd < 0)
+            return;
+    }
+    if(count == 0 && !this->datagram)
+    {
+        /** EOF */
+        error_handler(this);
+    }
+}
+
+/** Frames are never split over datagrams, anything but one whole frame is dropped */
+static void read_datagram(message_reader_impl_t* this, int index, const struct mmsghdr* msg)
+{
+    this->source_lens[index] = msg->msg_hdr.msg_namelen;
+    if(msg->msg_len < sizeof(tbus_message_len_t) || (msg->msg_hdr.msg_flags & MSG_TRUNC))
+        return;
+    tbus_message_len_t msg_len;
+    memcpy(&msg_len, this->records[index], sizeof(tbus_message_len_t));
+    if(msg_len != msg->msg_len)
+        return;
+    dispatch(this, this->records[index], msg_len, index);
+}
+
+static void read_record(message_reader_impl_t* this, int index, size_t size)
+{
+    uint8_t* record = this->records[index];
+    tbus_message_len_t msg_len;
+    if(this->buffer_offset == 0)
+    {
+        if(size < sizeof(tbus_message_len_t))
+            return;
+        memcpy(&msg_len, record, sizeof(tbus_message_len_t));
+        if(msg_len == size)
+        {
+            /** The common case, one record is one message */
+            dispatch(this, record, size, index);
+            return;
+        }
+        if(msg_len < size)
+        {
+            /** ignore this record */
+            return;
+        }
+        if(msg_len > this->buffer_size)
+        {
+            uint8_t* new_buffer = frame_buffer_realloc(this->buffer, msg_len);
+            if(!new_buffer)
+            {
+                error_handler(this);
+                return;
+            }
+            this->buffer = new_buffer;
+            this->buffer_size = msg_len;
+        }
+    }
+    /** Part of a large message */
+    if(this->buffer_offset + size > this->buffer_size)
+    {
+        /** Broken framing */
+        error_handler(this);
+        return;
+    }
+    memcpy(this->buffer + this->buffer_offset, record, size);
+    this->buffer_offset += size;
+    memcpy(&msg_len, this->buffer, sizeof(tbus_message_len_t));
+    if(this->buffer_offset < msg_len)
+        return;
+    dispatch(this, this->buffer, msg_len, -1);
+    this->buffer_offset = 0;
+    shrink_buffer(this);
+}
+
+static void dispatch(message_reader_impl_t* this, uint8_t* data, size_t size, int record)
+{
+    tbus_message_raw_header_t header;
+    if(!this->datagram && size >= sizeof(header))
+    {
+        memcpy(&header, data, sizeof(header));
+        if(header.version != TBUS_MSG_VERSION)
+        {
+            /** Every frame of the peer would be dropped, fail the connection instead */
+            fprintf(stderr, "Peer speaks wire version %u, %u expected\n", header.version, TBUS_MSG_VERSION);
+            error_handler(this);
+            return;
+        }
+    }
     tbus_message_t msg;
-    if(tbus_message_view(this->buffer, msg_len, &msg) != 0)
+    if(tbus_message_view(data, size, &msg) != 0)
     {
         /** ignore this message */
-        goto finish;
+        return;
     }
+    this->current = data;
+    this->current_size = size;
+    this->current_record = record;
     if(this->iface.callbacks.on_message)
     {
         this->iface.callbacks.on_message(&msg, this->iface.callbacks.on_message_ctx);
     }
-finish:
-    this->buffer_offset = 0;
+    this->current = NULL;
+    this->current_size = 0;
+}
+
+static void shrink_buffer(message_reader_impl_t* this)
+{
     if(this->buffer_size > STATIC_BUFFER_SIZE)
     {
-        this->buffer = realloc(this->buffer, STATIC_BUFFER_SIZE);
+        /** The large one is kept for the next large frame */
+        uint8_t* new_buffer = frame_buffer_realloc(this->buffer, STATIC_BUFFER_SIZE);
+        if(!new_buffer)
+            return;
+        this->buffer = new_buffer;
         this->buffer_size = STATIC_BUFFER_SIZE;
+        if(!this->trim_timer)
+            this->trim_timer = tev_set_timeout(this->tev, on_trim_timer, this, FRAME_BUFFER_IDLE_MS);
     }
 }
 
+static void on_trim_timer(void* ctx)
+{
+    message_reader_impl_t* this = (message_reader_impl_t*)ctx;
+    this->trim_timer = NULL;
+    if(frame_buffer_trim(FRAME_BUFFER_IDLE_MS))
+        this->trim_timer = tev_set_timeout(this->tev, on_trim_timer, this, FRAME_BUFFER_IDLE_MS);
+}
+
 static void error_handler(message_reader_impl_t* this)
 {
     if(!this->iface.callbacks.on_error)
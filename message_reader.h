@@ -2,21 +2,48 @@
 
 #include <tev/tev.h>
 #include <stdint.h>
+#include <sys/socket.h>
 #include "message.h"
 
+/**
+ * Max size of a SOCK_SEQPACKET record.
+ * A frame that fits is sent as one record, larger frames are split over consecutive records.
+ */
+#define MESSAGE_RECORD_SIZE (4000)
+
 typedef struct message_reader_s message_reader_t;
 struct message_reader_s
 {
     void (*close)(message_reader_t* self);
+    /** Only valid in on_message */
     uint8_t* (*get_buffer)(message_reader_t* self, size_t* size);
+    /** Only valid in on_message. The buffer is the caller's then, free it with frame_buffer_free. */
     uint8_t* (*take_over_buffer)(message_reader_t* self, size_t* size);
+    /** The start of a frame read so far, to hand the connection over. Not valid in on_message. */
+    const uint8_t* (*get_partial)(message_reader_t* self, size_t* size);
+    /** Continue a frame another reader started, before any read */
+    int (*set_partial)(message_reader_t* self, const uint8_t* data, size_t size);
+    /** The sender of the datagram being delivered, NULL on other sockets. Only valid in on_message. */
+    const struct sockaddr* (*get_source)(message_reader_t* self, socklen_t* len);
+    /**
+     * Read and deliver what the socket holds already, to keep it ahead of a frame that came another way.
+     * @return 0, -1 if the reader was closed meanwhile
+     */
+    int (*read_pending)(message_reader_t* self);
     struct
     {
         void (*on_message)(const tbus_message_t* msg, void* ctx);
         void* on_message_ctx;
         void (*on_error)(void* ctx);
         void* on_error_ctx;
+        /** Called before each read, to take in first what came another way. The reader may be closed in it. */
+        void (*on_read)(void* ctx);
+        void* on_read_ctx;
     } callbacks;
 };
 
+/**
+ * Create a reader. SOCK_STREAM, SOCK_SEQPACKET and SOCK_DGRAM sockets are supported.
+ * A datagram holds exactly one frame, anything else is dropped. Datagram sockets never see EOF.
+ */
 message_reader_t* message_reader_new(tev_handle_t tev, int fd);
@@ -1,4 +1,9 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stddef.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,33 +12,77 @@
 #include <sys/socket.h>
 #include <stdio.h>
 #include "message_writer.h"
+#include "message_reader.h"
 #include "message.h"
 #include "list.h"
 
+/** Records sent in one sendmmsg */
+#define RECORD_BATCH (16)
+/** Frames gathered in one sendmsg */
+#define STREAM_BATCH (64)
+
 typedef struct
 {
     list_head_t node;
+    tbus_message_priority_t priority;
     uint8_t* buffer;
     size_t size;
     size_t bytes_written;
+    /** Loans only, buffer points into it */
+    uint8_t* allocation;
+    message_loan_t loan;
 } message_buffer_t;
 
 #define GET_MESSAGE_BUFFER_FROM_NODE(node) \
     ((message_buffer_t*)((char*)(node) - offsetof(message_buffer_t, node)))
+#define GET_MESSAGE_BUFFER_FROM_LOAN(loan) \
+    ((message_buffer_t*)((char*)(loan) - offsetof(message_buffer_t, loan)))
 
 typedef struct
 {
     message_writer_t iface;
     tev_handle_t tev;   
+    /** -1 while detached */
     int fd;
-    list_head_t buffers;
+    /** One queue per priority, the highest non empty one is sent first */
+    list_head_t buffers[TBUS_MSG_PRIORITY_LEVELS];
+    /** Partially written, it has to finish before switching queues */
+    message_buffer_t* writing;
+    bool write_handler_set;
+    /** One record per frame, or per MESSAGE_RECORD_SIZE of larger frames */
+    bool seqpacket;
+    /** Unwritten bytes of the queued frames */
+    size_t queued_bytes;
+    size_t queued_count;
+    /** 0 when off */
+    size_t high_watermark;
+    size_t low_watermark;
+    /** Between on_high_watermark and on_low_watermark */
+    bool above_high_watermark;
 } message_writer_impl_t;
 
 static void message_writer_close(message_writer_t* iface);
 static int message_writer_write_message(message_writer_t* iface, const tbus_message_t* msg);
+static int message_writer_write_frame(message_writer_t* iface, const struct iovec* iov, int iov_count, tbus_message_priority_t priority);
+static message_loan_t* message_writer_loan(message_writer_t* iface, size_t head_room, size_t size);
+static int message_writer_commit_loan(message_writer_t* iface, message_loan_t* loan, const uint8_t* head, size_t head_len, tbus_message_priority_t priority);
+static void message_writer_cancel_loan(message_writer_t* iface, message_loan_t* loan);
+static void message_writer_detach(message_writer_t* iface);
+static int message_writer_attach(message_writer_t* iface, int fd);
+static size_t message_writer_get_queued(message_writer_t* iface, size_t* count);
+static int message_writer_set_watermarks(message_writer_t* iface, size_t high, size_t low);
 static void write_handler(void* ctx);
+static int flush(message_writer_impl_t* this);
+static void check_watermarks(message_writer_impl_t* this);
+static void queue_buffer(message_writer_impl_t* this, message_buffer_t* buffer);
+static void unqueue_buffer(message_writer_impl_t* this, message_buffer_t* buffer);
+static int write_stream(message_writer_impl_t* this);
+static int write_records(message_writer_impl_t* this);
+static int collect_records(message_buffer_t* buffer, struct mmsghdr* msgs, struct iovec* iovs, message_buffer_t** owners, int count);
+static message_buffer_t* next_buffer(message_writer_impl_t* this);
 static void error_handler(message_writer_impl_t* this);
 static message_buffer_t* message_buffer_new(const tbus_message_t* msg);
+static message_buffer_t* message_buffer_new_from_iov(const struct iovec* iov, int iov_count, size_t size, tbus_message_priority_t priority);
 static void message_buffer_free(message_buffer_t* this);
 
 message_writer_t* message_writer_new(tev_handle_t tev, int fd)
@@ -44,9 +93,26 @@ message_writer_t* message_writer_new(tev_handle_t tev, int fd)
     memset(self, 0, sizeof(message_writer_impl_t));
     self->iface.close = message_writer_close;
     self->iface.write_message = message_writer_write_message;
+    self->iface.write_frame = message_writer_write_frame;
+    self->iface.loan = message_writer_loan;
+    self->iface.commit_loan = message_writer_commit_loan;
+    self->iface.cancel_loan = message_writer_cancel_loan;
+    self->iface.detach = message_writer_detach;
+    self->iface.attach = message_writer_attach;
+    self->iface.get_queued = message_writer_get_queued;
+    self->iface.set_watermarks = message_writer_set_watermarks;
     self->tev = tev;
-    self->fd = fd;
-    LIST_INIT(&self->buffers);
+    self->fd = -1;
+    for(int i = 0; i < TBUS_MSG_PRIORITY_LEVELS; i++)
+        LIST_INIT(&self->buffers[i]);
+    if(fd >= 0)
+    {
+        self->fd = fd;
+        int type = 0;
+        socklen_t type_len = sizeof(type);
+        if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_len) == 0 && type == SOCK_SEQPACKET)
+            self->seqpacket = true;
+    }
     return (message_writer_t*)self;
 }
 
@@ -57,10 +123,13 @@ static void message_writer_close(message_writer_t* iface)
     {
         return;
     }
-    LIST_FOR_EACH_SAFE(&this->buffers, node)
+    for(int i = 0; i < TBUS_MSG_PRIORITY_LEVELS; i++)
     {
-        message_buffer_t* buffer = GET_MESSAGE_BUFFER_FROM_NODE(node);
-        message_buffer_free(buffer);
+        LIST_FOR_EACH_SAFE(&this->buffers[i], node)
+        {
+            message_buffer_t* buffer = GET_MESSAGE_BUFFER_FROM_NODE(node);
+            message_buffer_free(buffer);
+        }
     }
     if(this->tev && this->fd >=0)
         tev_set_write_handler(this->tev, this->fd, NULL, NULL);
@@ -79,36 +148,389 @@ static int message_writer_write_message(message_writer_t* iface, const tbus_mess
     {
         return -1;
     }
-    LIST_LINK(&this->buffers, &buffer->node);
+    queue_buffer(this, buffer);
+    /** Otherwise wait for the socket, the queues are drained in priority order */
+    if(!this->write_handler_set && this->fd >= 0 && flush(this) != 0)
+        return 0;
+    check_watermarks(this);
+    return 0;
+}
+
+static int message_writer_write_frame(message_writer_t* iface, const struct iovec* iov, int iov_count, tbus_message_priority_t priority)
+{
+    message_writer_impl_t* this = (message_writer_impl_t*)iface;
+    if(!this || !iov || iov_count <= 0 || priority >= TBUS_MSG_PRIORITY_LEVELS)
+        return -1;
+    size_t size = 0;
+    for(int i = 0; i < iov_count; i++)
+        size += iov[i].iov_len;
+    size_t bytes_written = 0;
+    /** Larger frames take several records, leave them to write_records */
+    if(this->fd >= 0 && !this->write_handler_set && !next_buffer(this) && (!this->seqpacket || size <= MESSAGE_RECORD_SIZE))
+    {
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = (struct iovec*)iov;
+        hdr.msg_iovlen = iov_count;
+        ssize_t sent = sendmsg(this->fd, &hdr, MSG_NOSIGNAL);
+        if(sent == (ssize_t)size)
+            return 0;
+        /** Errors are found again by write_handler */
+        if(sent > 0)
+            bytes_written = sent;
+    }
+    message_buffer_t* buffer = message_buffer_new_from_iov(iov, iov_count, size, priority);
+    if(!buffer)
+        return -1;
+    buffer->bytes_written = bytes_written;
+    queue_buffer(this, buffer);
+    if(bytes_written > 0)
+        this->writing = buffer;
+    if(!this->write_handler_set && this->fd >= 0 && flush(this) != 0)
+        return 0;
+    check_watermarks(this);
+    return 0;
+}
+
+static message_loan_t* message_writer_loan(message_writer_t* iface, size_t head_room, size_t size)
+{
+    message_writer_impl_t* this = (message_writer_impl_t*)iface;
+    if(!this || size == 0)
+        return NULL;
+    message_buffer_t* buffer = malloc(sizeof(message_buffer_t));
+    if(!buffer)
+        goto error;
+    memset(buffer, 0, sizeof(message_buffer_t));
+    buffer->allocation = malloc(head_room + size);
+    if(!buffer->allocation)
+        goto error;
+    buffer->loan.data = buffer->allocation + head_room;
+    buffer->loan.size = size;
+    buffer->loan.head_room = head_room;
+    return &buffer->loan;
+error:
+    message_buffer_free(buffer);
+    return NULL;
+}
+
+static int message_writer_commit_loan(message_writer_t* iface, message_loan_t* loan, const uint8_t* head, size_t head_len, tbus_message_priority_t priority)
+{
+    message_writer_impl_t* this = (message_writer_impl_t*)iface;
+    if(!loan)
+        return -1;
+    message_buffer_t* buffer = GET_MESSAGE_BUFFER_FROM_LOAN(loan);
+    if(!this || !head || priority >= TBUS_MSG_PRIORITY_LEVELS)
+        goto error;
+    if(head_len > loan->head_room)
+    {
+        /** Rare, only for long topics */
+        struct iovec iov[2] = {
+            {.iov_base = (void*)head, .iov_len = head_len},
+            {.iov_base = loan->data, .iov_len = loan->size}
+        };
+        int rc = message_writer_write_frame(iface, iov, 2, priority);
+        message_buffer_free(buffer);
+        return rc;
+    }
+    buffer->buffer = loan->data - head_len;
+    memcpy(buffer->buffer, head, head_len);
+    buffer->size = head_len + loan->size;
+    buffer->priority = priority;
+    queue_buffer(this, buffer);
+    if(!this->write_handler_set && this->fd >= 0 && flush(this) != 0)
+        return 0;
+    check_watermarks(this);
+    return 0;
+error:
+    message_buffer_free(buffer);
+    return -1;
+}
+
+static void message_writer_cancel_loan(message_writer_t* iface, message_loan_t* loan)
+{
+    if(!loan)
+        return;
+    message_buffer_free(GET_MESSAGE_BUFFER_FROM_LOAN(loan));
+}
+
+static void message_writer_detach(message_writer_t* iface)
+{
+    message_writer_impl_t* this = (message_writer_impl_t*)iface;
+    if(!this || this->fd < 0)
+        return;
+    if(this->write_handler_set)
+    {
+        tev_set_write_handler(this->tev, this->fd, NULL, NULL);
+        this->write_handler_set = false;
+    }
+    this->fd = -1;
+    /** The rest of it means nothing to the next peer */
+    if(this->writing)
+    {
+        unqueue_buffer(this, this->writing);
+        this->writing = NULL;
+    }
+}
+
+static int message_writer_attach(message_writer_t* iface, int fd)
+{
+    message_writer_impl_t* this = (message_writer_impl_t*)iface;
+    if(!this || fd < 0)
+        return -1;
+    message_writer_detach(iface);
+    this->fd = fd;
+    int type = 0;
+    socklen_t type_len = sizeof(type);
+    this->seqpacket = getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_len) == 0 && type == SOCK_SEQPACKET;
     write_handler(this);
     return 0;
 }
 
+static size_t message_writer_get_queued(message_writer_t* iface, size_t* count)
+{
+    message_writer_impl_t* this = (message_writer_impl_t*)iface;
+    if(!this)
+        return 0;
+    if(count)
+        *count = this->queued_count;
+    return this->queued_bytes;
+}
+
+static int message_writer_set_watermarks(message_writer_t* iface, size_t high, size_t low)
+{
+    message_writer_impl_t* this = (message_writer_impl_t*)iface;
+    if(!this || (high != 0 && low >= high))
+        return -1;
+    this->high_watermark = high;
+    this->low_watermark = low;
+    /** Start over, the next crossing is reported against the new marks */
+    this->above_high_watermark = false;
+    return 0;
+}
+
 static void write_handler(void* ctx)
 {
     message_writer_impl_t* this = ctx;
-    LIST_FOR_EACH_SAFE(&this->buffers, node)
+    if(flush(this) != 0)
+        return;
+    check_watermarks(this);
+}
+
+/** @return -1 if error_handler was called, this must not be used then */
+static int flush(message_writer_impl_t* this)
+{
+    int rc = this->seqpacket ? write_records(this) : write_stream(this);
+    if(rc != 0)
     {
-        message_buffer_t* buffer = GET_MESSAGE_BUFFER_FROM_NODE(node);
-        ssize_t bytes_written = send(this->fd, buffer->buffer + buffer->bytes_written, buffer->size - buffer->bytes_written, MSG_NOSIGNAL);
-        if(bytes_written < 0)
+        error_handler(this);
+        return -1;
+    }
+    if(!next_buffer(this))
+    {
+        if(this->write_handler_set)
         {
-            if(errno == EAGAIN || errno == EWOULDBLOCK)
-                goto finish;                
-            error_handler(this);
-            return;
+            tev_set_write_handler(this->tev, this->fd, NULL, NULL);
+            this->write_handler_set = false;
         }
-        buffer->bytes_written += bytes_written;
-        if(buffer->bytes_written < buffer->size)
-            break;
-        LIST_UNLINK(node);
-        message_buffer_free(buffer);
+        return 0;
     }
-finish:
-    if(LIST_IS_EMPTY(&this->buffers))
-        return;
+    if(this->write_handler_set)
+        return 0;
     if(tev_set_write_handler(this->tev, this->fd, write_handler, this) != 0)
+    {
         error_handler(this);
+        return -1;
+    }
+    this->write_handler_set = true;
+    return 0;
+}
+
+static void check_watermarks(message_writer_impl_t* this)
+{
+    if(this->high_watermark == 0)
+        return;
+    if(!this->above_high_watermark && this->queued_bytes >= this->high_watermark)
+    {
+        this->above_high_watermark = true;
+        if(this->iface.callbacks.on_high_watermark)
+            this->iface.callbacks.on_high_watermark(this->iface.callbacks.on_high_watermark_ctx);
+    }
+    else if(this->above_high_watermark && this->queued_bytes <= this->low_watermark)
+    {
+        this->above_high_watermark = false;
+        if(this->iface.callbacks.on_low_watermark)
+            this->iface.callbacks.on_low_watermark(this->iface.callbacks.on_low_watermark_ctx);
+    }
+}
+
+static void queue_buffer(message_writer_impl_t* this, message_buffer_t* buffer)
+{
+    LIST_LINK(&this->buffers[buffer->priority], &buffer->node);
+    this->queued_bytes += buffer->size - buffer->bytes_written;
+    this->queued_count++;
+}
+
+/** Unlink and free, whether it was written or not */
+static void unqueue_buffer(message_writer_impl_t* this, message_buffer_t* buffer)
+{
+    LIST_UNLINK(&buffer->node);
+    this->queued_bytes -= buffer->size - buffer->bytes_written;
+    this->queued_count--;
+    message_buffer_free(buffer);
+}
+
+static int write_stream(message_writer_impl_t* this)
+{
+    struct iovec iovs[STREAM_BATCH];
+    message_buffer_t* owners[STREAM_BATCH];
+    for(;;)
+    {
+        /** Same order as next_buffer, queued frames go out in one call */
+        int count = 0;
+        size_t total = 0;
+        if(this->writing)
+        {
+            iovs[count].iov_base = this->writing->buffer + this->writing->bytes_written;
+            iovs[count].iov_len = this->writing->size - this->writing->bytes_written;
+            owners[count] = this->writing;
+            total += iovs[count].iov_len;
+            count++;
+        }
+        for(int i = TBUS_MSG_PRIORITY_LEVELS - 1; i >= 0 && count < STREAM_BATCH; i--)
+        {
+            LIST_FOR_EACH(&this->buffers[i], node)
+            {
+                message_buffer_t* buffer = GET_MESSAGE_BUFFER_FROM_NODE(node);
+                if(buffer == this->writing)
+                    continue;
+                iovs[count].iov_base = buffer->buffer;
+                iovs[count].iov_len = buffer->size;
+                owners[count] = buffer;
+                total += buffer->size;
+                if(++count == STREAM_BATCH)
+                    break;
+            }
+        }
+        if(count == 0)
+            return 0;
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = iovs;
+        hdr.msg_iovlen = count;
+        ssize_t bytes_written = sendmsg(this->fd, &hdr, MSG_NOSIGNAL);
+        if(bytes_written < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        size_t remaining = bytes_written;
+        for(int i = 0; i < count && remaining > 0; i++)
+        {
+            message_buffer_t* buffer = owners[i];
+            if(remaining < iovs[i].iov_len)
+            {
+                buffer->bytes_written += remaining;
+                this->queued_bytes -= remaining;
+                this->writing = buffer;
+                break;
+            }
+            remaining -= iovs[i].iov_len;
+            if(this->writing == buffer)
+                this->writing = NULL;
+            unqueue_buffer(this, buffer);
+        }
+        /** Socket is full */
+        if((size_t)bytes_written < total)
+            return 0;
+    }
+}
+
+/** Add the remaining records of buffer to the batch */
+static int collect_records(message_buffer_t* buffer, struct mmsghdr* msgs, struct iovec* iovs, message_buffer_t** owners, int count)
+{
+    size_t offset = buffer->bytes_written;
+    while(offset < buffer->size && count < RECORD_BATCH)
+    {
+        size_t len = buffer->size - offset;
+        if(len > MESSAGE_RECORD_SIZE)
+            len = MESSAGE_RECORD_SIZE;
+        iovs[count].iov_base = buffer->buffer + offset;
+        iovs[count].iov_len = len;
+        msgs[count].msg_hdr.msg_iov = &iovs[count];
+        msgs[count].msg_hdr.msg_iovlen = 1;
+        owners[count] = buffer;
+        offset += len;
+        count++;
+    }
+    return count;
+}
+
+static int write_records(message_writer_impl_t* this)
+{
+    struct mmsghdr msgs[RECORD_BATCH];
+    struct iovec iovs[RECORD_BATCH];
+    message_buffer_t* owners[RECORD_BATCH];
+    for(;;)
+    {
+        /** Same order as next_buffer */
+        memset(msgs, 0, sizeof(msgs));
+        int count = 0;
+        if(this->writing)
+            count = collect_records(this->writing, msgs, iovs, owners, count);
+        for(int i = TBUS_MSG_PRIORITY_LEVELS - 1; i >= 0 && count < RECORD_BATCH; i--)
+        {
+            LIST_FOR_EACH(&this->buffers[i], node)
+            {
+                message_buffer_t* buffer = GET_MESSAGE_BUFFER_FROM_NODE(node);
+                if(buffer == this->writing)
+                    continue;
+                count = collect_records(buffer, msgs, iovs, owners, count);
+                if(count == RECORD_BATCH)
+                    break;
+            }
+        }
+        if(count == 0)
+            return 0;
+        int sent = sendmmsg(this->fd, msgs, count, MSG_NOSIGNAL);
+        if(sent < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        /** Records are atomic, only whole records are sent */
+        for(int i = 0; i < sent; i++)
+        {
+            message_buffer_t* buffer = owners[i];
+            buffer->bytes_written += iovs[i].iov_len;
+            this->queued_bytes -= iovs[i].iov_len;
+            if(buffer->bytes_written < buffer->size)
+            {
+                this->writing = buffer;
+                continue;
+            }
+            if(this->writing == buffer)
+                this->writing = NULL;
+            unqueue_buffer(this, buffer);
+        }
+        if(sent < count)
+            return 0;
+    }
+}
+
+static message_buffer_t* next_buffer(message_writer_impl_t* this)
+{
+    /** Never interleave frames */
+    if(this->writing)
+        return this->writing;
+    for(int i = TBUS_MSG_PRIORITY_LEVELS - 1; i >= 0; i--)
+    {
+        list_head_t* node = this->buffers[i].next;
+        if(node != &this->buffers[i])
+            return GET_MESSAGE_BUFFER_FROM_NODE(node);
+    }
+    return NULL;
 }
 
 static void error_handler(message_writer_impl_t* this)
@@ -131,6 +553,7 @@ static message_buffer_t* message_buffer_new(const tbus_message_t* msg)
     }
     memset(this, 0, sizeof(message_buffer_t));
     this->bytes_written = 0;
+    this->priority = tbus_message_get_priority(msg);
     this->buffer = tbus_message_serialize(msg, &this->size);
     if(!this->buffer)
     {
@@ -142,13 +565,40 @@ error:
     return NULL;
 }
 
+static message_buffer_t* message_buffer_new_from_iov(const struct iovec* iov, int iov_count, size_t size, tbus_message_priority_t priority)
+{
+    message_buffer_t* this = malloc(sizeof(message_buffer_t));
+    if(!this)
+        goto error;
+    memset(this, 0, sizeof(message_buffer_t));
+    this->priority = priority;
+    this->size = size;
+    this->buffer = malloc(size);
+    if(!this->buffer)
+        goto error;
+    size_t offset = 0;
+    for(int i = 0; i < iov_count; i++)
+    {
+        memcpy(this->buffer + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    return this;
+error:
+    message_buffer_free(this);
+    return NULL;
+}
+
 static void message_buffer_free(message_buffer_t* this)
 {
     if(!this)
     {
         return;
     }
-    if(this->buffer)
+    if(this->allocation)
+    {
+        free(this->allocation);
+    }
+    else if(this->buffer)
     {
         free(this->buffer);
     }
@@ -1,18 +1,61 @@
 #pragma once
 
 #include <tev/tev.h>
+#include <sys/uio.h>
 #include "message.h"
 
 typedef struct message_writer_s message_writer_t;
+
+/** Outbound memory lent by loan, a frame is built in place and queued without copying */
+typedef struct
+{
+    /** size bytes for the data, the end of the frame */
+    uint8_t* data;
+    size_t size;
+    /** Free bytes right before data, for the head */
+    size_t head_room;
+} message_loan_t;
+
 struct message_writer_s
 {
     void (*close)(message_writer_t* self);
     int (*write_message)(message_writer_t* self, const tbus_message_t* msg);
+    /**
+     * Write a serialized frame given in pieces. It is sent straight from iov when nothing is queued,
+     * it is only copied when it has to be queued.
+     */
+    int (*write_frame)(message_writer_t* self, const struct iovec* iov, int iov_count, tbus_message_priority_t priority);
+    /** Lend size bytes of outbound memory with head_room bytes free before them */
+    message_loan_t* (*loan)(message_writer_t* self, size_t head_room, size_t size);
+    /**
+     * Put head right before the loaned data and queue the frame, the loan is consumed.
+     * A head larger than the head room is sent with write_frame instead.
+     */
+    int (*commit_loan)(message_writer_t* self, message_loan_t* loan, const uint8_t* head, size_t head_len, tbus_message_priority_t priority);
+    /** Give back a loan that is not going to be committed */
+    void (*cancel_loan)(message_writer_t* self, message_loan_t* loan);
+    /** Stop writing to the fd. Messages are queued until attach, a partially written one is dropped. */
+    void (*detach)(message_writer_t* self);
+    /** Start writing to fd and flush the queue */
+    int (*attach)(message_writer_t* self, int fd);
+    /** Bytes not written yet, count is set to the number of frames they belong to */
+    size_t (*get_queued)(message_writer_t* self, size_t* count);
+    /**
+     * Call on_high_watermark once the queued bytes reach high, then on_low_watermark
+     * once they are back down to low. A high of 0 turns it off.
+     */
+    int (*set_watermarks)(message_writer_t* self, size_t high, size_t low);
     struct
     {
         void (*on_error)(void* ctx);
         void* on_error_ctx;
+        /** The writer must not be closed in the watermark callbacks */
+        void (*on_high_watermark)(void* ctx);
+        void* on_high_watermark_ctx;
+        void (*on_low_watermark)(void* ctx);
+        void* on_low_watermark_ctx;
     } callbacks;
 };
 
+/** fd can be -1 to start detached */
 message_writer_t* message_writer_new(tev_handle_t tev, int fd);
@@ -0,0 +1,603 @@
+#include <tev/map.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "tbus.h"
+#include "common.h"
+
+/**
+ * A client over several independent brokers.
+ * Each concrete topic lives on the shard picked by a hash of its first segments.
+ * Filters with a wildcard in those segments are subscribed on every shard.
+ */
+
+#define MAX_SHARDS (64)
+/** Request ids of the shards are tagged with the shard index in the top bits */
+#define REQUEST_ID_SHARD_SHIFT (56)
+#define REQUEST_ID_MASK ((1ULL << REQUEST_ID_SHARD_SHIFT) - 1)
+
+typedef struct sharded_client_s sharded_client_t;
+typedef struct sharded_subscription_s sharded_subscription_t;
+
+typedef struct
+{
+    sharded_client_t* owner;
+    int index;
+    /** NULL once disconnected */
+    tbus_t* client;
+    /** Between on_backpressure and on_drain of the shard */
+    bool backpressured;
+} sharded_shard_t;
+
+/** The callback context given to one shard */
+typedef struct
+{
+    sharded_subscription_t* subscription;
+    int shard;
+} sharded_route_t;
+
+struct sharded_subscription_s
+{
+    sharded_client_t* owner;
+    tbus_subscribe_callback_t callback;
+    void* ctx;
+    tbus_request_callback_t request_callback;
+    void* request_ctx;
+    /** One per shard */
+    sharded_route_t routes[];
+};
+
+struct sharded_client_s
+{
+    tbus_t iface;
+    int hash_segments;
+    /** Map<string, sharded_subscription_t*> */
+    map_handle_t subscriptions;
+    /** The shard of the message being delivered */
+    int current_shard;
+    /** on_backpressure goes out with the first of them, on_drain once none is left */
+    int backpressured_shards;
+    int shard_count;
+    sharded_shard_t shards[];
+};
+
+static void sharded_close(tbus_t* iface);
+static int sharded_subscribe(tbus_t* iface, const char* topic, tbus_subscribe_callback_t callback, void* ctx);
+static int sharded_subscribe_from(tbus_t* iface, const char* topic, uint64_t sequence, tbus_subscribe_callback_t callback, void* ctx);
+static int sharded_subscribe_filtered(tbus_t* iface, const char* topic, const tbus_filter_t* filters, uint32_t filter_count, tbus_subscribe_callback_t callback, void* ctx);
+static int sharded_subscribe_sampled(tbus_t* iface, const char* topic, uint32_t interval_ms, tbus_subscribe_callback_t callback, void* ctx);
+static sharded_subscription_t* sharded_get_subscription(sharded_client_t* this, const char* topic);
+static uint64_t sharded_get_sequence(tbus_t* iface);
+static tbus_message_handle_t* sharded_retain_message(tbus_t* iface);
+static void sharded_unsubscribe(tbus_t* iface, const char* topic);
+static int sharded_publish(tbus_t* iface, const char* topic, const uint8_t* data, uint32_t len);
+static int sharded_publish_with_priority(tbus_t* iface, const char* topic, const uint8_t* data, uint32_t len, uint8_t priority);
+static tbus_publisher_t* sharded_create_publisher(tbus_t* iface, const char* topic);
+static tbus_loan_t* sharded_loan(tbus_t* iface, uint32_t len);
+static int sharded_commit(tbus_t* iface, tbus_loan_t* loan, const char* topic);
+static void sharded_cancel_loan(tbus_t* iface, tbus_loan_t* loan);
+static int sharded_enable_flow_control(tbus_t* iface, uint32_t window);
+static int sharded_can_publish(tbus_t* iface, const char* topic, uint32_t len);
+static int sharded_enable_reconnect(tbus_t* iface, uint32_t buffer_bytes);
+static int sharded_get_queued(tbus_t* iface, uint64_t* bytes, uint64_t* messages);
+static int sharded_set_watermarks(tbus_t* iface, uint64_t high, uint64_t low);
+static int sharded_serve(tbus_t* iface, const char* topic, tbus_request_callback_t callback, void* ctx);
+static int sharded_reply(tbus_t* iface, uint64_t request_id, const uint8_t* data, uint32_t len);
+static int sharded_request(tbus_t* iface, const char* topic, const uint8_t* data, uint32_t len, uint32_t timeout_ms, tbus_reply_callback_t callback, void* ctx);
+static int shard_of(sharded_client_t* this, const char* topic);
+static tbus_t* shard_client_of(sharded_client_t* this, const char* topic);
+static void on_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx);
+static void on_request(const char* topic, const uint8_t* data, uint32_t len, uint64_t request_id, void* ctx);
+static void on_shard_credit(void* ctx);
+static void on_shard_disconnect(void* ctx);
+static void on_shard_backpressure(void* ctx);
+static void on_shard_drain(void* ctx);
+static void free_subscription_with_ctx(void* data, void* ctx);
+
+tbus_t* tbus_connect_sharded(tev_handle_t tev, const char* const* uds_paths, int count, int hash_segments)
+{
+    if (!tev || !uds_paths || count <= 0 || count > MAX_SHARDS || hash_segments < 0)
+        return NULL;
+    sharded_client_t* this = malloc(sizeof(sharded_client_t) + count * sizeof(sharded_shard_t));
+    if (this == NULL)
+        return NULL;
+    memset(this, 0, sizeof(sharded_client_t) + count * sizeof(sharded_shard_t));
+    this->iface.close = sharded_close;
+    this->iface.subscribe = sharded_subscribe;
+    this->iface.subscribe_from = sharded_subscribe_from;
+    this->iface.subscribe_filtered = sharded_subscribe_filtered;
+    this->iface.subscribe_sampled = sharded_subscribe_sampled;
+    this->iface.get_sequence = sharded_get_sequence;
+    this->iface.retain_message = sharded_retain_message;
+    this->iface.unsubscribe = sharded_unsubscribe;
+    this->iface.publish = sharded_publish;
+    this->iface.publish_with_priority = sharded_publish_with_priority;
+    this->iface.create_publisher = sharded_create_publisher;
+    this->iface.loan = sharded_loan;
+    this->iface.commit = sharded_commit;
+    this->iface.cancel_loan = sharded_cancel_loan;
+    this->iface.enable_flow_control = sharded_enable_flow_control;
+    this->iface.enable_reconnect = sharded_enable_reconnect;
+    this->iface.can_publish = sharded_can_publish;
+    this->iface.get_queued = sharded_get_queued;
+    this->iface.set_watermarks = sharded_set_watermarks;
+    this->iface.serve = sharded_serve;
+    this->iface.reply = sharded_reply;
+    this->iface.request = sharded_request;
+    this->hash_segments = hash_segments;
+    this->shard_count = count;
+    this->subscriptions = map_create();
+    if (this->subscriptions == NULL)
+        goto error;
+    for (int i = 0; i < count; i++)
+    {
+        sharded_shard_t* shard = &this->shards[i];
+        shard->owner = this;
+        shard->index = i;
+        shard->client = tbus_connect(tev, uds_paths[i]);
+        if (shard->client == NULL)
+            goto error;
+        shard->client->callbacks.on_disconnect = on_shard_disconnect;
+        shard->client->callbacks.on_disconnect_ctx = shard;
+        shard->client->callbacks.on_credit = on_shard_credit;
+        shard->client->callbacks.on_credit_ctx = shard;
+        shard->client->callbacks.on_backpressure = on_shard_backpressure;
+        shard->client->callbacks.on_backpressure_ctx = shard;
+        shard->client->callbacks.on_drain = on_shard_drain;
+        shard->client->callbacks.on_drain_ctx = shard;
+    }
+    return &this->iface;
+error:
+    sharded_close(&this->iface);
+    return NULL;
+}
+
+static void sharded_close(tbus_t* iface)
+{
+    sharded_client_t* this = (sharded_client_t*)iface;
+    if(this == NULL)
+        return;
+    for(int i = 0; i < this->shard_count; i++)
+    {
+        if(this->shards[i].client != NULL)
+            this->shards[i].client->close(this->shards[i].client);
+    }
+    if(this->subscriptions != NULL)
+        map_delete(this->subscriptions, free_subscription_with_ctx, NULL);
+    free(this);
+}
+
+/** Hash the first hash_segments segments, -1 if they contain a wildcard */
+static int shard_of(sharded_client_t* this, const char* topic)
+{
+    if(strncmp(topic, TBUS_SHARED_SUBSCRIPTION_PREFIX, strlen(TBUS_SHARED_SUBSCRIPTION_PREFIX)) == 0)
+    {
+        /** Route by the filter of $share/<group>/<filter> */
+        const char* group = topic + strlen(TBUS_SHARED_SUBSCRIPTION_PREFIX);
+        const char* filter = strchr(group, '/');
+        if(filter == NULL)
+            return -1;
+        topic = filter + 1;
+    }
+    /** FNV-1a, stable across processes */
+    uint32_t hash = 2166136261u;
+    int segments = 0;
+    for(const char* c = topic; *c != '\0'; c++)
+    {
+        if(*c == '/' && ++segments == this->hash_segments)
+            break;
+        if(*c == '+' || *c == '#')
+            return -1;
+        hash ^= (uint8_t)*c;
+        hash *= 16777619u;
+    }
+    return hash % this->shard_count;
+}
+
+static tbus_t* shard_client_of(sharded_client_t* this, const char* topic)
+{
+    int shard = shard_of(this, topic);
+    if(shard < 0)
+        return NULL;
+    return this->shards[shard].client;
+}
+
+static sharded_subscription_t* sharded_get_subscription(sharded_client_t* this, const char* topic)
+{
+    sharded_subscription_t* subscription = map_get(this->subscriptions, topic, strlen(topic));
+    if(subscription != NULL)
+        return subscription;
+    size_t size = sizeof(sharded_subscription_t) + this->shard_count * sizeof(sharded_route_t);
+    subscription = malloc(size);
+    if(subscription == NULL)
+        return NULL;
+    memset(subscription, 0, size);
+    subscription->owner = this;
+    for(int i = 0; i < this->shard_count; i++)
+    {
+        subscription->routes[i].subscription = subscription;
+        subscription->routes[i].shard = i;
+    }
+    if(map_add(this->subscriptions, topic, strlen(topic), subscription) == NULL)
+    {
+        free(subscription);
+        return NULL;
+    }
+    return subscription;
+}
+
+static int sharded_subscribe_from(tbus_t* iface, const char* topic, uint64_t sequence, tbus_subscribe_callback_t callback, void* ctx)
+{
+    if(iface == NULL || topic == NULL || callback == NULL)
+        return -1;
+    sharded_client_t* this = (sharded_client_t*)iface;
+    sharded_subscription_t* subscription = sharded_get_subscription(this, topic);
+    if(subscription == NULL)
+        return -1;
+    subscription->callback = callback;
+    subscription->ctx = ctx;
+    int shard = shard_of(this, topic);
+    for(int i = 0; i < this->shard_count; i++)
+    {
+        if(shard >= 0 && i != shard)
+            continue;
+        tbus_t* client = this->shards[i].client;
+        if(client == NULL)
+            return -1;
+        int rc = sequence == 0
+            ? client->subscribe(client, topic, on_message, &subscription->routes[i])
+            : client->subscribe_from(client, topic, sequence, on_message, &subscription->routes[i]);
+        if(rc != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int sharded_subscribe(tbus_t* iface, const char* topic, tbus_subscribe_callback_t callback, void* ctx)
+{
+    return sharded_subscribe_from(iface, topic, 0, callback, ctx);
+}
+
+static int sharded_subscribe_filtered(tbus_t* iface, const char* topic, const tbus_filter_t* filters, uint32_t filter_count, tbus_subscribe_callback_t callback, void* ctx)
+{
+    if(iface == NULL || topic == NULL || callback == NULL)
+        return -1;
+    sharded_client_t* this = (sharded_client_t*)iface;
+    sharded_subscription_t* subscription = sharded_get_subscription(this, topic);
+    if(subscription == NULL)
+        return -1;
+    subscription->callback = callback;
+    subscription->ctx = ctx;
+    int shard = shard_of(this, topic);
+    for(int i = 0; i < this->shard_count; i++)
+    {
+        if(shard >= 0 && i != shard)
+            continue;
+        tbus_t* client = this->shards[i].client;
+        if(client == NULL || client->subscribe_filtered(client, topic, filters, filter_count, on_message, &subscription->routes[i]) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/** Each broker samples on its own, a wildcard may get one message per interval from every shard */
+static int sharded_subscribe_sampled(tbus_t* iface, const char* topic, uint32_t interval_ms, tbus_subscribe_callback_t callback, void* ctx)
+{
+    if(iface == NULL || topic == NULL || callback == NULL)
+        return -1;
+    sharded_client_t* this = (sharded_client_t*)iface;
+    sharded_subscription_t* subscription = sharded_get_subscription(this, topic);
+    if(subscription == NULL)
+        return -1;
+    subscription->callback = callback;
+    subscription->ctx = ctx;
+    int shard = shard_of(this, topic);
+    for(int i = 0; i < this->shard_count; i++)
+    {
+        if(shard >= 0 && i != shard)
+            continue;
+        tbus_t* client = this->shards[i].client;
+        if(client == NULL || client->subscribe_sampled(client, topic, interval_ms, on_message, &subscription->routes[i]) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int sharded_serve(tbus_t* iface, const char* topic, tbus_request_callback_t callback, void* ctx)
+{
+    if(iface == NULL || topic == NULL || callback == NULL)
+        return -1;
+    sharded_client_t* this = (sharded_client_t*)iface;
+    sharded_subscription_t* subscription = sharded_get_subscription(this, topic);
+    if(subscription == NULL)
+        return -1;
+    subscription->request_callback = callback;
+    subscription->request_ctx = ctx;
+    int shard = shard_of(this, topic);
+    for(int i = 0; i < this->shard_count; i++)
+    {
+        if(shard >= 0 && i != shard)
+            continue;
+        tbus_t* client = this->shards[i].client;
+        if(client == NULL || client->serve(client, topic, on_request, &subscription->routes[i]) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void sharded_unsubscribe(tbus_t* iface, const char* topic)
+{
+    if(iface == NULL || topic == NULL)
+        return;
+    sharded_client_t* this = (sharded_client_t*)iface;
+    sharded_subscription_t* subscription = map_remove(this->subscriptions, topic, strlen(topic));
+    if(subscription == NULL)
+        return;
+    /** Unsubscribing from a shard that never had it is a no-op */
+    for(int i = 0; i < this->shard_count; i++)
+    {
+        tbus_t* client = this->shards[i].client;
+        if(client != NULL)
+            client->unsubscribe(client, topic);
+    }
+    free(subscription);
+}
+
+static uint64_t sharded_get_sequence(tbus_t* iface)
+{
+    if(iface == NULL)
+        return 0;
+    sharded_client_t* this = (sharded_client_t*)iface;
+    tbus_t* client = this->shards[this->current_shard].client;
+    if(client == NULL)
+        return 0;
+    return client->get_sequence(client);
+}
+
+static tbus_message_handle_t* sharded_retain_message(tbus_t* iface)
+{
+    if(iface == NULL)
+        return NULL;
+    sharded_client_t* this = (sharded_client_t*)iface;
+    tbus_t* client = this->shards[this->current_shard].client;
+    if(client == NULL)
+        return NULL;
+    return client->retain_message(client);
+}
+
+static int sharded_publish(tbus_t* iface, const char* topic, const uint8_t* data, uint32_t len)
+{
+    if(iface == NULL || topic == NULL)
+        return -1;
+    tbus_t* client = shard_client_of((sharded_client_t*)iface, topic);
+    if(client == NULL)
+        return -1;
+    return client->publish(client, topic, data, len);
+}
+
+static int sharded_publish_with_priority(tbus_t* iface, const char* topic, const uint8_t* data, uint32_t len, uint8_t priority)
+{
+    if(iface == NULL || topic == NULL)
+        return -1;
+    tbus_t* client = shard_client_of((sharded_client_t*)iface, topic);
+    if(client == NULL)
+        return -1;
+    return client->publish_with_priority(client, topic, data, len, priority);
+}
+
+static tbus_publisher_t* sharded_create_publisher(tbus_t* iface, const char* topic)
+{
+    if(iface == NULL || topic == NULL)
+        return NULL;
+    tbus_t* client = shard_client_of((sharded_client_t*)iface, topic);
+    if(client == NULL)
+        return NULL;
+    return client->create_publisher(client, topic);
+}
+
+/** The shard is only known from the topic at commit, so the data is plain memory published from there */
+static tbus_loan_t* sharded_loan(tbus_t* iface, uint32_t len)
+{
+    if(iface == NULL || len == 0)
+        return NULL;
+    tbus_loan_t* loan = malloc(sizeof(tbus_loan_t) + len);
+    if(loan == NULL)
+        return NULL;
+    loan->data = (uint8_t*)(loan + 1);
+    loan->len = len;
+    return loan;
+}
+
+static int sharded_commit(tbus_t* iface, tbus_loan_t* loan, const char* topic)
+{
+    if(iface == NULL || loan == NULL)
+        return -1;
+    int rc = sharded_publish(iface, topic, loan->data, loan->len);
+    free(loan);
+    return rc;
+}
+
+static void sharded_cancel_loan(tbus_t* iface, tbus_loan_t* loan)
+{
+    free(loan);
+}
+
+static int sharded_enable_flow_control(tbus_t* iface, uint32_t window)
+{
+    if(iface == NULL)
+        return -1;
+    sharded_client_t* this = (sharded_client_t*)iface;
+    /** Each shard grants its own window */
+    for(int i = 0; i < this->shard_count; i++)
+    {
+        tbus_t* client = this->shards[i].client;
+        if(client == NULL || client->enable_flow_control(client, window) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int sharded_enable_reconnect(tbus_t* iface, uint32_t buffer_bytes)
+{
+    if(iface == NULL)
+        return -1;
+    sharded_client_t* this = (sharded_client_t*)iface;
+    /** Each shard reconnects on its own and buffers up to buffer_bytes */
+    for(int i = 0; i < this->shard_count; i++)
+    {
+        tbus_t* client = this->shards[i].client;
+        if(client == NULL || client->enable_reconnect(client, buffer_bytes) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int sharded_get_queued(tbus_t* iface, uint64_t* bytes, uint64_t* messages)
+{
+    if(iface == NULL)
+        return -1;
+    sharded_client_t* this = (sharded_client_t*)iface;
+    uint64_t total_bytes = 0;
+    uint64_t total_messages = 0;
+    for(int i = 0; i < this->shard_count; i++)
+    {
+        tbus_t* client = this->shards[i].client;
+        uint64_t shard_bytes = 0;
+        uint64_t shard_messages = 0;
+        if(client == NULL || client->get_queued(client, &shard_bytes, &shard_messages) != 0)
+            return -1;
+        total_bytes += shard_bytes;
+        total_messages += shard_messages;
+    }
+    if(bytes)
+        *bytes = total_bytes;
+    if(messages)
+        *messages = total_messages;
+    return 0;
+}
+
+static int sharded_set_watermarks(tbus_t* iface, uint64_t high, uint64_t low)
+{
+    if(iface == NULL)
+        return -1;
+    sharded_client_t* this = (sharded_client_t*)iface;
+    /** Each shard has its own queue, a single slow broker is enough to hold off */
+    for(int i = 0; i < this->shard_count; i++)
+    {
+        tbus_t* client = this->shards[i].client;
+        if(client == NULL || client->set_watermarks(client, high, low) != 0)
+            return -1;
+        this->shards[i].backpressured = false;
+    }
+    this->backpressured_shards = 0;
+    return 0;
+}
+
+static int sharded_can_publish(tbus_t* iface, const char* topic, uint32_t len)
+{
+    if(iface == NULL || topic == NULL)
+        return -1;
+    tbus_t* client = shard_client_of((sharded_client_t*)iface, topic);
+    if(client == NULL)
+        return -1;
+    return client->can_publish(client, topic, len);
+}
+
+static int sharded_reply(tbus_t* iface, uint64_t request_id, const uint8_t* data, uint32_t len)
+{
+    if(iface == NULL)
+        return -1;
+    sharded_client_t* this = (sharded_client_t*)iface;
+    uint64_t shard = request_id >> REQUEST_ID_SHARD_SHIFT;
+    if(shard >= (uint64_t)this->shard_count || this->shards[shard].client == NULL)
+        return -1;
+    tbus_t* client = this->shards[shard].client;
+    return client->reply(client, request_id & REQUEST_ID_MASK, data, len);
+}
+
+static int sharded_request(tbus_t* iface, const char* topic, const uint8_t* data, uint32_t len, uint32_t timeout_ms, tbus_reply_callback_t callback, void* ctx)
+{
+    if(iface == NULL || topic == NULL)
+        return -1;
+    tbus_t* client = shard_client_of((sharded_client_t*)iface, topic);
+    if(client == NULL)
+        return -1;
+    return client->request(client, topic, data, len, timeout_ms, callback, ctx);
+}
+
+static void on_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    sharded_route_t* route = (sharded_route_t*)ctx;
+    sharded_subscription_t* subscription = route->subscription;
+    /** Served but not subscribed */
+    if(subscription->callback == NULL)
+        return;
+    subscription->owner->current_shard = route->shard;
+    subscription->callback(topic, data, len, subscription->ctx);
+}
+
+static void on_request(const char* topic, const uint8_t* data, uint32_t len, uint64_t request_id, void* ctx)
+{
+    sharded_route_t* route = (sharded_route_t*)ctx;
+    sharded_subscription_t* subscription = route->subscription;
+    if(subscription->request_callback == NULL)
+        return;
+    if(request_id > REQUEST_ID_MASK)
+    {
+        fprintf(stderr, "Request id out of range, dropped.\n");
+        return;
+    }
+    request_id |= (uint64_t)route->shard << REQUEST_ID_SHARD_SHIFT;
+    subscription->request_callback(topic, data, len, request_id, subscription->request_ctx);
+}
+
+static void on_shard_credit(void* ctx)
+{
+    sharded_shard_t* shard = (sharded_shard_t*)ctx;
+    tbus_t* iface = &shard->owner->iface;
+    if(iface->callbacks.on_credit != NULL)
+        iface->callbacks.on_credit(iface->callbacks.on_credit_ctx);
+}
+
+static void on_shard_backpressure(void* ctx)
+{
+    sharded_shard_t* shard = (sharded_shard_t*)ctx;
+    sharded_client_t* this = shard->owner;
+    if(shard->backpressured)
+        return;
+    shard->backpressured = true;
+    if(this->backpressured_shards++ == 0 && this->iface.callbacks.on_backpressure != NULL)
+        this->iface.callbacks.on_backpressure(this->iface.callbacks.on_backpressure_ctx);
+}
+
+static void on_shard_drain(void* ctx)
+{
+    sharded_shard_t* shard = (sharded_shard_t*)ctx;
+    sharded_client_t* this = shard->owner;
+    if(!shard->backpressured)
+        return;
+    shard->backpressured = false;
+    if(--this->backpressured_shards == 0 && this->iface.callbacks.on_drain != NULL)
+        this->iface.callbacks.on_drain(this->iface.callbacks.on_drain_ctx);
+}
+
+static void on_shard_disconnect(void* ctx)
+{
+    sharded_shard_t* shard = (sharded_shard_t*)ctx;
+    tbus_t* iface = &shard->owner->iface;
+    /** Already closed by the shard client */
+    shard->client = NULL;
+    if(iface->callbacks.on_disconnect == NULL)
+    {
+        /** Critical error, abort */
+        fprintf(stderr, "Critical error: on_disconnect callback not set.\n");
+        exit(EXIT_FAILURE);
+    }
+    iface->callbacks.on_disconnect(iface->callbacks.on_disconnect_ctx);
+}
+
+static void free_subscription_with_ctx(void* data, void* ctx)
+{
+    free(data);
+}
@@ -7,26 +7,238 @@
 #include <stdint.h>
 #include <tev/tev.h>
 
+/** 
+ * Priorities for publish_with_priority. Each priority has its own queue in the client and the broker.
+ * Queued messages of a higher priority are sent first, at message boundaries.
+ */
+#define TBUS_PRIORITY_NORMAL (0)
+#define TBUS_PRIORITY_MAX (3)
+
+/** Content filter ops, see tbus_filter_t */
+#define TBUS_FILTER_MASKED_EQUAL (0)
+#define TBUS_FILTER_RANGE (1)
+/** Filters per subscription */
+#define TBUS_MAX_FILTERS (32)
+
+/**
+ * A condition on the little endian unsigned integer of width (1 to 8) bytes at offset in the message data.
+ * TBUS_FILTER_MASKED_EQUAL passes if (field & a) == b, TBUS_FILTER_RANGE passes if a <= field <= b.
+ * Messages too short to hold the field do not pass.
+ */
+typedef struct
+{
+    uint8_t op;
+    uint8_t width;
+    uint32_t offset;
+    uint64_t a;
+    uint64_t b;
+} tbus_filter_t;
+
 typedef void (*tbus_subscribe_callback_t)(const char* topic, const uint8_t* data, uint32_t len, void* ctx);
+/** Answer with reply(request_id, ...). Each request_id can only be replied once. */
+typedef void (*tbus_request_callback_t)(const char* topic, const uint8_t* data, uint32_t len, uint64_t request_id, void* ctx);
+typedef enum
+{
+    TBUS_REPLY_OK = 0,
+    TBUS_REPLY_TIMEOUT,
+    /** No one serves the topic */
+    TBUS_REPLY_NO_RESPONDER,
+} tbus_reply_status_t;
+/** data is only valid with TBUS_REPLY_OK */
+typedef void (*tbus_reply_callback_t)(tbus_reply_status_t status, const uint8_t* data, uint32_t len, void* ctx);
 typedef struct tbus_s tbus_t;
+typedef struct tbus_publisher_s tbus_publisher_t;
+
+/** Publishes on one topic, see create_publisher */
+struct tbus_publisher_s
+{
+    /** Same as publish on the topic of the publisher */
+    int (*publish)(tbus_publisher_t* self, const uint8_t* data, uint32_t len);
+    /** Also needed after the client is closed, the publisher must not be used then */
+    void (*close)(tbus_publisher_t* self);
+};
 
+/**
+ * A received message kept past its callback without copying, see retain_message.
+ * It stays valid after the client is closed, until the last reference is released.
+ */
+typedef struct tbus_message_handle_s tbus_message_handle_t;
+struct tbus_message_handle_s
+{
+    const char* topic;
+    const uint8_t* data;
+    uint32_t len;
+    /** As get_sequence returned for it */
+    uint64_t sequence;
+    /** Take another reference */
+    void (*retain)(tbus_message_handle_t* self);
+    /** Drop a reference, the message is freed with the last one */
+    void (*release)(tbus_message_handle_t* self);
+};
+
+/** Outbound memory to build a message in, see loan */
+typedef struct
+{
+    /** len bytes to fill with the data */
+    uint8_t* data;
+    uint32_t len;
+} tbus_loan_t;
+
+/**
+ * Members added after 1.0 are only ever appended, here and in callbacks,
+ * so applications built against an older libtbus.so.1 keep working.
+ */
 struct tbus_s
 {
     void (*close)(tbus_t* self);
+    /**
+     * Subscribe to a topic filter. $share/<group>/<filter> joins a shared subscription,
+     * each message goes to only one member of the group, the least busy one.
+     */
     int (*subscribe)(tbus_t* self, const char* topic, tbus_subscribe_callback_t callback, void* ctx);
     void (*unsubscribe)(tbus_t* self, const char* topic);
     int (*publish)(tbus_t* self, const char* topic, const uint8_t* data, uint32_t len);
     struct
     {
         /** 
-         * This will not be called if the connection is closed by calling close.
+         * This will not be called if the connection is closed by calling close,
+         * or if reconnect is enabled, unless reconnecting fails for good.
          * The client should not be used after this callback is called.
          */
         void (*on_disconnect)(void* ctx);
         void* on_disconnect_ctx;
+        /** Called when the broker grants credit back. Only with flow control enabled. */
+        void (*on_credit)(void* ctx);
+        void* on_credit_ctx;
+        /**
+         * Called when the queued bytes reach the high watermark, from within the call that queued them.
+         * The client must not be closed in it or in on_drain.
+         */
+        void (*on_backpressure)(void* ctx);
+        void* on_backpressure_ctx;
+        /** Called when the queued bytes are back down to the low watermark after on_backpressure */
+        void (*on_drain)(void* ctx);
+        void* on_drain_ctx;
     } callbacks;
+    /**
+     * Enable credit based flow control. 
+     * The broker grants up to window bytes (0 for the broker's default) for published but undelivered messages.
+     * Once enabled, publish fails when out of credit. 
+     */
+    int (*enable_flow_control)(tbus_t* self, uint32_t window);
+    /** 
+     * Check if a message can be published now.
+     * @return 1 if it can, 0 if out of credit, -1 on error.
+     */
+    int (*can_publish)(tbus_t* self, const char* topic, uint32_t len);
+    /**
+     * Subscribe and replay the broker's history from sequence onwards before live messages.
+     * Sequence numbers are per topic. A wildcard topic replays every matching topic from sequence.
+     * The broker only keeps history when started with -H.
+     * Calling it again for a subscribed topic replays in order, live messages still queued for it are not sent twice.
+     * A sampled subscription gets the replay sampled too.
+     */
+    int (*subscribe_from)(tbus_t* self, const char* topic, uint64_t sequence, tbus_subscribe_callback_t callback, void* ctx);
+    /**
+     * Get the per topic sequence number of the message being delivered.
+     * Only valid in a subscribe callback. 0 if the broker did not assign one,
+     * brokers only do when started with -Q or -H.
+     */
+    uint64_t (*get_sequence)(tbus_t* self);
+    /**
+     * Answer requests sent to topic. This shares the subscription of topic with subscribe.
+     * Each request goes to one matching server, the one with the shortest queue, ties to the least recently chosen.
+     * Plain subscriptions of topic do not receive requests.
+     */
+    int (*serve)(tbus_t* self, const char* topic, tbus_request_callback_t callback, void* ctx);
+    /** Reply to a request received in a serve callback. */
+    int (*reply)(tbus_t* self, uint64_t request_id, const uint8_t* data, uint32_t len);
+    /**
+     * Send a request. callback is called exactly once, unless the client is closed first.
+     * @param timeout_ms 0 for no timeout
+     */
+    int (*request)(tbus_t* self, const char* topic, const uint8_t* data, uint32_t len, uint32_t timeout_ms, tbus_reply_callback_t callback, void* ctx);
+    /** publish with priority from TBUS_PRIORITY_NORMAL to TBUS_PRIORITY_MAX */
+    int (*publish_with_priority)(tbus_t* self, const char* topic, const uint8_t* data, uint32_t len, uint8_t priority);
+    /**
+     * Reconnect with backoff when the broker goes away instead of calling on_disconnect.
+     * All subscriptions are restored on reconnect, before any buffered publish is sent.
+     * While disconnected, up to buffer_bytes of publishes are kept and sent on reconnect,
+     * publish fails beyond that. Pending requests fail with TBUS_REPLY_TIMEOUT.
+     */
+    int (*enable_reconnect)(tbus_t* self, uint32_t buffer_bytes);
+    /**
+     * Subscribe with content filters evaluated by the broker, only messages passing all of them are sent.
+     * Calling it again for the same topic replaces the filters, a filter_count of 0 removes them.
+     * The filters apply to everything received on topic, including requests to serve.
+     */
+    int (*subscribe_filtered)(tbus_t* self, const char* topic, const tbus_filter_t* filters, uint32_t filter_count, tbus_subscribe_callback_t callback, void* ctx);
+    /**
+     * Subscribe at a reduced rate, the broker delivers at most one message per interval_ms.
+     * Messages in between are conflated, the latest one goes out at the end of the interval.
+     * Calling it again for the same topic replaces the interval, 0 delivers every message.
+     * Requests to serve are never conflated.
+     */
+    int (*subscribe_sampled)(tbus_t* self, const char* topic, uint32_t interval_ms, tbus_subscribe_callback_t callback, void* ctx);
+    /**
+     * Create a publisher for repeated publishes on topic. Everything but the data is encoded once,
+     * each publish sends it and the data in one call without copying, unless it has to be queued.
+     */
+    tbus_publisher_t* (*create_publisher)(tbus_t* self, const char* topic);
+    /**
+     * Keep the message being delivered after the callback returns. The receive buffer is handed over
+     * to the handle, topic and data keep pointing where they did in the callback.
+     * Only valid in a subscribe or serve callback, and only once per message, NULL otherwise.
+     * The handle starts with one reference.
+     */
+    tbus_message_handle_t* (*retain_message)(tbus_t* self);
+    /**
+     * Borrow len bytes of the client's outbound memory to write the data of a message in.
+     * Room for the rest of the frame is kept before it, so commit queues it without copying the data.
+     * Each loan must be given back with commit or cancel_loan before the client is closed.
+     * The sharded client picks the broker by topic on commit and copies the data there.
+     */
+    tbus_loan_t* (*loan)(tbus_t* self, uint32_t len);
+    /** Publish the data of loan on topic, the loan is given back whether it succeeds or not */
+    int (*commit)(tbus_t* self, tbus_loan_t* loan, const char* topic);
+    void (*cancel_loan)(tbus_t* self, tbus_loan_t* loan);
+    /**
+     * Get what is waiting in the client to be written to the broker.
+     * @param bytes set to the bytes not written yet
+     * @param messages set to the number of frames they belong to, publishes and control messages alike
+     */
+    int (*get_queued)(tbus_t* self, uint64_t* bytes, uint64_t* messages);
+    /**
+     * Call on_backpressure once the queued bytes reach high, then on_drain once they are back down to low.
+     * Publishes are still queued above high, it is up to the application to hold off.
+     * A high of 0 turns it off. The sharded client applies the marks to each broker.
+     */
+    int (*set_watermarks)(tbus_t* self, uint64_t high, uint64_t low);
 };
 
 tbus_t* tbus_connect(tev_handle_t tev, const char* uds_path);
+/**
+ * Connect over SOCK_SEQPACKET, each small message is one record and is read or written in batches.
+ * The broker needs to be started with -s.
+ */
+tbus_t* tbus_connect_seqpacket(tev_handle_t tev, const char* uds_path);
+/**
+ * Connect over SOCK_STREAM and also over SOCK_DGRAM. Small frames are sent and received as one datagram each,
+ * larger ones and everything but messages go over the stream, as do frames when the datagram socket is full.
+ * A frame only goes as a datagram once the other side has read everything sent on the stream, and each side
+ * reads the datagrams already there before a stream frame, so the frames of one client arrive in order.
+ * The broker needs to be started with -d. The number of datagrams queued at the broker is capped by
+ * net.unix.max_dgram_qlen, frames beyond it take the stream.
+ */
+tbus_t* tbus_connect_dgram(tev_handle_t tev, const char* uds_path);
+/**
+ * Connect to several independent brokers and spread the topics over them.
+ * A topic goes to the broker picked by a stable hash of its first hash_segments segments.
+ * Filters with a wildcard in those segments are subscribed on every broker.
+ * All clients of the same topics must use the same uds_paths in the same order and the same hash_segments.
+ * @param count up to 64 brokers
+ * @param hash_segments 0 to hash the whole topic
+ */
+tbus_t* tbus_connect_sharded(tev_handle_t tev, const char* const* uds_paths, int count, int hash_segments);
 
 const char* tbus_get_version();
@@ -8,7 +8,37 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "tbus.h"
+#include "capture.h"
+
+/** Records published before yielding to the event loop, so the writer can drain */
+#define REPLAY_BATCH (1024)
+
+typedef struct
+{
+    tev_handle_t tev;
+    tbus_t* tbus;
+    const uint8_t* data;
+    size_t size;
+    size_t offset;
+    /** Multiple of the recorded rate, 0 for as fast as possible */
+    double speed;
+    uint64_t first_timestamp_ns;
+    uint64_t start_ns;
+    tev_timeout_handle_t timer;
+    /** Waiting for credit before the next record */
+    int blocked;
+    /** All records published, waiting for the broker to take them */
+    int draining;
+    /** Topics are not \0 terminated in the file */
+    char* topic;
+    size_t topic_capacity;
+    uint64_t count;
+} replay_t;
 
 static void exit_loop(void* ctx)
 {
@@ -16,14 +46,22 @@ static void exit_loop(void* ctx)
     tbus->close(tbus);
 }
 
+static int replay(tev_handle_t tev, tbus_t* tbus, const char* path, double speed);
+static void replay_next(void* ctx);
+static void replay_on_credit(void* ctx);
+static int replay_drained(replay_t* replay);
+static uint64_t monotonic_ns();
+
 int main(int argc, char const *argv[])
 {
     /** parse args */
     char* broker_path = NULL;
     char* topic = NULL;
     char* message = NULL;
+    char* replay_path = NULL;
+    double speed = 1;
     int opt;
-    while((opt = getopt(argc, (char**)argv, "p:t:m:hv")) != -1)
+    while((opt = getopt(argc, (char**)argv, "p:t:m:r:x:hv")) != -1)
     {
         switch(opt)
         {
@@ -36,8 +74,21 @@ int main(int argc, char const *argv[])
             case 'm':
                 message = optarg;
                 break;
+            case 'r':
+                replay_path = optarg;
+                break;
+            case 'x':
+                speed = strtod(optarg, NULL);
+                if(speed < 0)
+                {
+                    fprintf(stderr, "Invalid speed: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'h':
                 printf("Usage: %s [-p <broker_path>] [-t <topic>] [-m <message>]\n", argv[0]);
+                printf("       %s [-p <broker_path>] -r <capture_file> [-x <speed>]\n", argv[0]);
+                printf("       -x: multiple of the recorded rate, 0 for as fast as possible, 1 by default\n");
                 exit(EXIT_SUCCESS);
                 break;
             case 'v':
@@ -48,9 +99,10 @@ int main(int argc, char const *argv[])
                 break;
         }
     }
-    if(!topic || !message)
+    if(!replay_path && (!topic || !message))
     {
         fprintf(stderr, "Usage: %s -t <topic> -m <message> [-p <broker_path>]\n", argv[0]);
+        fprintf(stderr, "       %s -r <capture_file> [-x <speed>] [-p <broker_path>]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -61,12 +113,18 @@ int main(int argc, char const *argv[])
         fprintf(stderr, "Failed to create tev context\n");
         exit(EXIT_FAILURE);
     }
-    tbus_t* tbus = tbus_connect(tev, NULL);
+    tbus_t* tbus = tbus_connect(tev, broker_path);
     if(!tbus)
     {
         fprintf(stderr, "Failed to connect to tbus\n");
         exit(EXIT_FAILURE);
     }
+    if(replay_path)
+    {
+        int rc = replay(tev, tbus, replay_path, speed);
+        tev_free_ctx(tev);
+        return rc == 0 ? 0 : EXIT_FAILURE;
+    }
     int rc = tbus->publish(tbus, topic, (uint8_t*)message, strlen(message));
     if(rc != 0)
     {
@@ -83,3 +141,172 @@ int main(int argc, char const *argv[])
     tev_free_ctx(tev);
     return 0;
 }
+
+/** Publish the records of a capture file, keeping their spacing divided by speed */
+static int replay(tev_handle_t tev, tbus_t* tbus, const char* path, double speed)
+{
+    int rc = -1;
+    replay_t replay = {
+        .tev = tev,
+        .tbus = tbus,
+        .speed = speed
+    };
+    uint8_t* data = MAP_FAILED;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "Failed to open capture file %s\n", path);
+        goto error;
+    }
+    if((size_t)st.st_size < sizeof(tbus_capture_header_t))
+    {
+        fprintf(stderr, "Not a capture file: %s\n", path);
+        goto error;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if(data == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map capture file %s\n", path);
+        goto error;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    if(memcmp(((tbus_capture_header_t*)data)->magic, TBUS_CAPTURE_MAGIC, sizeof(((tbus_capture_header_t*)data)->magic)) != 0)
+    {
+        fprintf(stderr, "Not a capture file: %s\n", path);
+        goto error;
+    }
+    replay.data = data;
+    replay.size = st.st_size;
+    replay.offset = sizeof(tbus_capture_header_t);
+    if(replay.offset + sizeof(tbus_capture_record_t) <= replay.size)
+    {
+        tbus_capture_record_t record;
+        memcpy(&record, replay.data + replay.offset, sizeof(record));
+        replay.first_timestamp_ns = record.timestamp_ns;
+    }
+    replay.start_ns = monotonic_ns();
+    /** Credit keeps a slow broker from piling up the whole file in our writer */
+    if(tbus->enable_flow_control(tbus, 0) != 0)
+    {
+        fprintf(stderr, "Failed to enable flow control\n");
+        goto error;
+    }
+    tbus->callbacks.on_credit = replay_on_credit;
+    tbus->callbacks.on_credit_ctx = &replay;
+    replay.blocked = 1;
+    tev_main_loop(tev);
+    /** The replay closed it */
+    tbus = NULL;
+    if(replay.offset != replay.size)
+    {
+        fprintf(stderr, "Replay stopped after %lu messages\n", (unsigned long)replay.count);
+        goto error;
+    }
+    rc = 0;
+error:
+    if(replay.timer)
+        tev_clear_timeout(tev, replay.timer);
+    free(replay.topic);
+    if(data != MAP_FAILED)
+        munmap(data, st.st_size);
+    if(fd >= 0)
+        close(fd);
+    if(rc != 0 && tbus)
+        tbus->close(tbus);
+    return rc;
+}
+
+static void replay_next(void* ctx)
+{
+    replay_t* replay = (replay_t*)ctx;
+    replay->timer = NULL;
+    for(int i = 0; i < REPLAY_BATCH; i++)
+    {
+        if(replay->offset == replay->size)
+        {
+            replay->draining = 1;
+            if(replay_drained(replay))
+                replay->tbus->close(replay->tbus);
+            return;
+        }
+        tbus_capture_record_t record;
+        if(replay->size - replay->offset < sizeof(record))
+            goto truncated;
+        memcpy(&record, replay->data + replay->offset, sizeof(record));
+        if(replay->size - replay->offset - sizeof(record) < (uint64_t)record.topic_len + record.data_len)
+            goto truncated;
+        if(replay->speed > 0)
+        {
+            /** Captures are stamped with CLOCK_REALTIME, a step back is sent right away instead of wrapping */
+            uint64_t offset_ns = record.timestamp_ns > replay->first_timestamp_ns ? record.timestamp_ns - replay->first_timestamp_ns : 0;
+            uint64_t due_ns = replay->start_ns + (uint64_t)(offset_ns / replay->speed);
+            uint64_t now_ns = monotonic_ns();
+            if(due_ns > now_ns)
+            {
+                /** tev counts in ms, round up so it is never early */
+                replay->timer = tev_set_timeout(replay->tev, replay_next, replay, (due_ns - now_ns + 999999) / 1000000);
+                if(!replay->timer)
+                    goto error;
+                return;
+            }
+        }
+        if(record.topic_len + 1 > replay->topic_capacity)
+        {
+            char* topic = realloc(replay->topic, record.topic_len + 1);
+            if(!topic)
+                goto error;
+            replay->topic = topic;
+            replay->topic_capacity = record.topic_len + 1;
+        }
+        const uint8_t* p = replay->data + replay->offset + sizeof(record);
+        memcpy(replay->topic, p, record.topic_len);
+        replay->topic[record.topic_len] = '\0';
+        if(replay->tbus->can_publish(replay->tbus, replay->topic, record.data_len) != 1)
+        {
+            replay->blocked = 1;
+            return;
+        }
+        if(replay->tbus->publish(replay->tbus, replay->topic, p + record.topic_len, record.data_len) != 0)
+            goto error;
+        replay->offset += sizeof(record) + record.topic_len + record.data_len;
+        replay->count++;
+    }
+    /** Let the writer drain before the next batch */
+    replay->timer = tev_set_timeout(replay->tev, replay_next, replay, 0);
+    if(!replay->timer)
+        goto error;
+    return;
+truncated:
+    fprintf(stderr, "Capture file is truncated\n");
+error:
+    replay->tbus->close(replay->tbus);
+}
+
+static void replay_on_credit(void* ctx)
+{
+    replay_t* replay = (replay_t*)ctx;
+    if(replay->draining)
+    {
+        if(replay_drained(replay))
+            replay->tbus->close(replay->tbus);
+        return;
+    }
+    if(!replay->blocked)
+        return;
+    replay->blocked = 0;
+    replay_next(replay);
+}
+
+/** Larger than any window, it could only go once nothing is outstanding, that is once the broker has taken everything */
+static int replay_drained(replay_t* replay)
+{
+    return replay->tbus->can_publish(replay->tbus, "", UINT32_MAX) == 1;
+}
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -8,20 +8,35 @@
 #include <stdio.h>
 #include <time.h>
 #include <inttypes.h>
-#include "tbus.h"
-
-#ifdef USE_SIGNAL
+#include <string.h>
+#include <stdbool.h>
 #include <sys/eventfd.h>
 #include <signal.h>
+#include "tbus.h"
+#include "capture.h"
+
+/** Captures are written through a large buffer to keep up with the bus */
+#define CAPTURE_BUFFER_SIZE (4 * 1024 * 1024)
+
 static void signal_handler(int signal);
 static void signal_event_fd_read_handler(void* ctx);
 static int signal_event_fd = -1;
-#endif
 
 static void on_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx);
+static void on_capture_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx);
+static FILE* capture_open(const char* path);
+static void count_message();
+static void on_disconnect(void* ctx);
+static void stop();
 
 static tev_handle_t tev = NULL;
 static tbus_t* tbus = NULL;
+static FILE* capture = NULL;
+static char* capture_buffer = NULL;
+/** Stop after this many messages, 0 to run until interrupted */
+static uint64_t max_count = 0;
+static uint64_t count = 0;
+static bool disconnected = false;
 
 int main(int argc, char const *argv[])
 {
@@ -29,8 +44,9 @@ int main(int argc, char const *argv[])
     /** parse args */
     char* broker_path = NULL;
     char* topic = "#";
+    char* capture_path = NULL;
     int opt;
-    while((opt = getopt(argc, (char**)argv, "p:t:hv")) != -1)
+    while((opt = getopt(argc, (char**)argv, "p:t:w:n:hv")) != -1)
     {
         switch(opt)
         {
@@ -40,8 +56,14 @@ int main(int argc, char const *argv[])
             case 't':
                 topic = optarg;
                 break;
+            case 'w':
+                capture_path = optarg;
+                break;
+            case 'n':
+                max_count = strtoull(optarg, NULL, 0);
+                break;
             case 'h':
-                printf("Usage: %s [-p <broker_path>] [-t <topic>]\n", argv[0]);
+                printf("Usage: %s [-p <broker_path>] [-t <topic>] [-w <capture_file>] [-n <count>]\n", argv[0]);
                 exit(EXIT_SUCCESS);
                 break;
             case 'v':
@@ -53,6 +75,15 @@ int main(int argc, char const *argv[])
         }
     }
 
+    if(capture_path)
+    {
+        capture = capture_open(capture_path);
+        if(!capture)
+        {
+            fprintf(stderr, "Failed to open capture file %s\n", capture_path);
+            exit(EXIT_FAILURE);
+        }
+    }
     tev = tev_create_ctx();
     if(!tev)
     {
@@ -60,28 +91,36 @@ int main(int argc, char const *argv[])
         exit(EXIT_FAILURE);
     }
 #ifdef USE_SIGNAL
-    signal_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
-    if(signal_event_fd == -1)
-    {
-        fprintf(stderr, "Failed to create eventfd\n");
-        exit(EXIT_FAILURE);
-    }
-    rc = tev_set_read_handler(tev, signal_event_fd, signal_event_fd_read_handler, NULL);
-    if(rc != 0)
+    bool handle_signals = true;
+#else
+    /** An interrupted capture would lose what is still buffered, so stop the loop and let fclose flush it */
+    bool handle_signals = capture != NULL;
+#endif
+    if(handle_signals)
     {
-        fprintf(stderr, "Failed to set read handler for signal event fd\n");
-        exit(EXIT_FAILURE);
+        signal_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if(signal_event_fd == -1)
+        {
+            fprintf(stderr, "Failed to create eventfd\n");
+            exit(EXIT_FAILURE);
+        }
+        rc = tev_set_read_handler(tev, signal_event_fd, signal_event_fd_read_handler, NULL);
+        if(rc != 0)
+        {
+            fprintf(stderr, "Failed to set read handler for signal event fd\n");
+            exit(EXIT_FAILURE);
+        }
+        signal(SIGINT, signal_handler);
+        signal(SIGTERM, signal_handler);
     }
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
-#endif
     tbus = tbus_connect(tev, broker_path);
     if(!tbus)
     {
         fprintf(stderr, "Failed to connect to tbus\n");
         exit(EXIT_FAILURE);
     }
-    rc = tbus->subscribe(tbus, topic, on_message, NULL);
+    tbus->callbacks.on_disconnect = on_disconnect;
+    rc = tbus->subscribe(tbus, topic, capture ? on_capture_message : on_message, NULL);
     if(rc != 0)
     {
         fprintf(stderr, "Failed to subscribe to topic\n");
@@ -92,17 +131,24 @@ int main(int argc, char const *argv[])
 
     if(tbus)
         tbus->close(tbus);
-#ifdef USE_SIGNAL
-    signal(SIGINT, SIG_DFL);
-    signal(SIGTERM, SIG_DFL);
+    if(handle_signals)
+    {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+    }
     if(signal_event_fd >= 0)
     {
         tev_set_read_handler(tev, signal_event_fd, NULL, NULL);
         close(signal_event_fd);
     }
-#endif
     tev_free_ctx(tev);
-    return 0;
+    if(capture && fclose(capture) != 0)
+    {
+        fprintf(stderr, "Failed to write capture file\n");
+        exit(EXIT_FAILURE);
+    }
+    free(capture_buffer);
+    return disconnected ? EXIT_FAILURE : 0;
 }
 
 static void on_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
@@ -115,9 +161,83 @@ static void on_message(const char* topic, const uint8_t* data, uint32_t len, voi
     else
         printf("%sTopic\n\t%s\nData[0B]\n\t(null)\n\n",
             time_str, topic);
+    count_message();
+}
+
+static void on_capture_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    tbus_capture_record_t record = {
+        .timestamp_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+        .topic_len = strlen(topic),
+        .data_len = data ? len : 0
+    };
+    /** Only copies into the buffer, the disk is written in large chunks */
+    if(fwrite(&record, sizeof(record), 1, capture) != 1
+        || fwrite(topic, 1, record.topic_len, capture) != record.topic_len
+        || fwrite(data, 1, record.data_len, capture) != record.data_len)
+    {
+        fprintf(stderr, "Failed to write capture file\n");
+        exit(EXIT_FAILURE);
+    }
+    count_message();
+}
+
+static FILE* capture_open(const char* path)
+{
+    FILE* file = fopen(path, "wb");
+    if(!file)
+        return NULL;
+    /** glibc ignores the size without a buffer of our own. fclose flushes it. */
+    capture_buffer = malloc(CAPTURE_BUFFER_SIZE);
+    if(!capture_buffer || setvbuf(file, capture_buffer, _IOFBF, CAPTURE_BUFFER_SIZE) != 0)
+        goto error;
+    tbus_capture_header_t header;
+    memcpy(header.magic, TBUS_CAPTURE_MAGIC, sizeof(header.magic));
+    if(fwrite(&header, sizeof(header), 1, file) != 1)
+        goto error;
+    return file;
+error:
+    fclose(file);
+    free(capture_buffer);
+    capture_buffer = NULL;
+    return NULL;
+}
+
+static void count_message()
+{
+    count++;
+    if(max_count > 0 && count == max_count)
+        stop();
+}
+
+/** The broker went away, still leave through main so the capture is flushed */
+static void on_disconnect(void* ctx)
+{
+    fprintf(stderr, "Disconnected from tbus\n");
+    disconnected = true;
+    /** Closed by the client already */
+    tbus = NULL;
+    stop();
+}
+
+/** Drop everything keeping the loop running so main can flush and exit */
+static void stop()
+{
+    if(tbus)
+    {
+        tbus->close(tbus);
+        tbus = NULL;
+    }
+    if(signal_event_fd >= 0)
+    {
+        tev_set_read_handler(tev, signal_event_fd, NULL, NULL);
+        close(signal_event_fd);
+        signal_event_fd = -1;
+    }
 }
 
-#ifdef USE_SIGNAL
 static void signal_handler(int signal)
 {
     eventfd_t value = 1;
@@ -133,13 +253,5 @@ static void signal_event_fd_read_handler(void* ctx)
     eventfd_t value = 0;
     if(eventfd_read(signal_event_fd, &value) == -1)
         return;
-    if(tbus)
-    {
-        tbus->close(tbus);
-        tbus = NULL;
-    }
-    tev_set_read_handler(tev, signal_event_fd, NULL, NULL);
-    close(signal_event_fd);
-    signal_event_fd = -1;
+    stop();
 }
-#endif
@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "../tbus.h"
+
+#define MESSAGE_SIZE (64 * 1024)
+#define HIGH_WATERMARK (1024 * 1024)
+#define LOW_WATERMARK (256 * 1024)
+/** Far more than the socket takes without the broker reading */
+#define MAX_MESSAGES (1024)
+
+static tev_handle_t tev = NULL;
+static tbus_t* publisher = NULL;
+static tbus_t* subscriber = NULL;
+static uint8_t data[MESSAGE_SIZE];
+static int sent = 0;
+static int received = 0;
+static int backpressured = 0;
+static int drained = 0;
+
+static void finish(void* ctx)
+{
+    publisher->close(publisher);
+    subscriber->close(subscriber);
+}
+
+static void on_message(const char* topic, const uint8_t* msg, uint32_t len, void* ctx)
+{
+    assert(len == sizeof(data));
+    assert(memcmp(msg, data, len) == 0);
+    received++;
+    if(received == sent && drained)
+        finish(NULL);
+}
+
+static void on_backpressure(void* ctx)
+{
+    uint64_t bytes = 0;
+    uint64_t messages = 0;
+    assert(publisher->get_queued(publisher, &bytes, &messages) == 0);
+    assert(bytes >= HIGH_WATERMARK);
+    assert(messages > 0);
+    backpressured++;
+}
+
+static void on_drain(void* ctx)
+{
+    assert(backpressured == 1);
+    uint64_t bytes = 0;
+    assert(publisher->get_queued(publisher, &bytes, NULL) == 0);
+    assert(bytes <= LOW_WATERMARK);
+    drained++;
+    /** The client must not be closed from here */
+    if(received == sent)
+        tev_set_timeout(tev, finish, NULL, 0);
+}
+
+static void publish_until_backpressured(void* ctx)
+{
+    /** Nothing is read while this runs, so the queue only grows */
+    while(!backpressured)
+    {
+        assert(sent < MAX_MESSAGES);
+        assert(publisher->publish(publisher, "bp", data, sizeof(data)) == 0);
+        sent++;
+    }
+    /** Still queued above the mark, no repeated call */
+    assert(publisher->publish(publisher, "bp", data, sizeof(data)) == 0);
+    sent++;
+    assert(backpressured == 1);
+}
+
+int main(int argc, char const *argv[])
+{
+    memset(data, 0x3c, sizeof(data));
+    tev = tev_create_ctx();
+    assert(tev);
+    subscriber = tbus_connect(tev, NULL);
+    assert(subscriber);
+    assert(subscriber->subscribe(subscriber, "bp", on_message, NULL) == 0);
+    publisher = tbus_connect(tev, NULL);
+    assert(publisher);
+    uint64_t bytes = 1;
+    uint64_t messages = 1;
+    assert(publisher->get_queued(publisher, &bytes, &messages) == 0);
+    assert(bytes == 0 && messages == 0);
+    assert(publisher->set_watermarks(publisher, LOW_WATERMARK, LOW_WATERMARK) != 0);
+    assert(publisher->set_watermarks(publisher, HIGH_WATERMARK, LOW_WATERMARK) == 0);
+    publisher->callbacks.on_backpressure = on_backpressure;
+    publisher->callbacks.on_drain = on_drain;
+    tev_set_timeout(tev, publish_until_backpressured, NULL, 10);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+
+    assert(backpressured == 1);
+    assert(drained == 1);
+    assert(received == sent);
+    printf("backpressured after %d messages\n", sent);
+    return 0;
+}
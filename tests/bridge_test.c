@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../tbus.h"
+#include "../message.h"
+#include "../common.h"
+
+/** run_tests.sh starts a second broker on this path bridged to the default one for bridge/# */
+#define BRIDGED_UDS_PATH "@tbus.bridge"
+#define MESSAGE_COUNT (10)
+
+static tev_handle_t tev = NULL;
+static tbus_t* local = NULL;
+static tbus_t* remote = NULL;
+static int remote_count = 0;
+static int local_count = 0;
+static int echo_count = 0;
+static int unbridged_count = 0;
+static tev_timeout_handle_t finish_timer = NULL;
+
+static void finish(void* ctx)
+{
+    local->close(local);
+    remote->close(remote);
+}
+
+static void check_done()
+{
+    if(remote_count < MESSAGE_COUNT || local_count < MESSAGE_COUNT || echo_count < MESSAGE_COUNT)
+        return;
+    if(finish_timer)
+        return;
+    /** Wait for duplicates that should never come */
+    finish_timer = tev_set_timeout(tev, finish, NULL, 100);
+}
+
+/** bridge/a published on the default broker, received on the bridged one */
+static void on_remote_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    int value = 0;
+    assert(len == sizeof(value));
+    memcpy(&value, data, len);
+    assert(value == remote_count);
+    remote_count++;
+    check_done();
+}
+
+/** bridge/b published on the bridged broker, received on the default one */
+static void on_local_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    int value = 0;
+    assert(len == sizeof(value));
+    memcpy(&value, data, len);
+    assert(value == local_count);
+    local_count++;
+    check_done();
+}
+
+/** bridge/b on the bridged broker, it must not come back over the bridge */
+static void on_echo_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    echo_count++;
+    check_done();
+}
+
+static void on_unbridged_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    unbridged_count++;
+}
+
+static int raw_connect(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+    addr.sun_path[0] = 0;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    assert(connect(fd, (struct sockaddr*)&addr, addr_len) == 0);
+    return fd;
+}
+
+static void raw_send(int fd, tbus_message_command_t command, const char* topic, tbus_message_sub_flags_t* p_flags)
+{
+    tbus_message_sub_index_t sub_index = 0;
+    int value = 0;
+    tbus_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.command = command;
+    msg.topic = (char*)topic;
+    msg.p_sub_index = &sub_index;
+    msg.p_sub_flags = p_flags;
+    if(command == TBUS_MSG_CMD_PUB)
+    {
+        msg.data = (uint8_t*)&value;
+        msg.data_len = sizeof(value);
+    }
+    size_t size = 0;
+    uint8_t* frame = tbus_message_serialize(&msg, &size);
+    assert(frame);
+    assert(write(fd, frame, size) == size);
+    free(frame);
+}
+
+/** @return true if a frame arrived within timeout_ms */
+static bool raw_received(int fd, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if(poll(&pfd, 1, timeout_ms) != 1)
+        return false;
+    uint8_t frame[256];
+    assert(read(fd, frame, sizeof(frame)) > 0);
+    return true;
+}
+
+/** Two raw connections, one subscribing like a bridge does */
+static void check_no_local()
+{
+    int bridge_fd = raw_connect(TBUS_DEFAULT_UDS_PATH);
+    int other_fd = raw_connect(TBUS_DEFAULT_UDS_PATH);
+    tbus_message_sub_flags_t flags = TBUS_MSG_SUB_FLAG_NO_LOCAL;
+    raw_send(bridge_fd, TBUS_MSG_CMD_SUB, "bridge/raw", &flags);
+    raw_send(other_fd, TBUS_MSG_CMD_SUB, "bridge/raw", NULL);
+    usleep(50 * 1000);
+    /** What the bridge forwards reaches the others once and never comes back to it */
+    raw_send(bridge_fd, TBUS_MSG_CMD_PUB, "bridge/raw", NULL);
+    assert(raw_received(other_fd, 1000));
+    assert(!raw_received(bridge_fd, 100));
+    assert(!raw_received(other_fd, 0));
+    /** Everyone else's messages still go to it */
+    raw_send(other_fd, TBUS_MSG_CMD_PUB, "bridge/raw", NULL);
+    assert(raw_received(bridge_fd, 1000));
+    close(bridge_fd);
+    close(other_fd);
+}
+
+static void start(void* ctx)
+{
+    for(int i = 0; i < MESSAGE_COUNT; i++)
+    {
+        assert(local->publish(local, "bridge/a", (uint8_t*)&i, sizeof(i)) == 0);
+        assert(remote->publish(remote, "bridge/b", (uint8_t*)&i, sizeof(i)) == 0);
+        assert(local->publish(local, "other/a", (uint8_t*)&i, sizeof(i)) == 0);
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    check_no_local();
+    tev = tev_create_ctx();
+    assert(tev);
+    local = tbus_connect(tev, NULL);
+    assert(local);
+    remote = tbus_connect(tev, BRIDGED_UDS_PATH);
+    assert(remote);
+    assert(remote->subscribe(remote, "bridge/a", on_remote_message, NULL) == 0);
+    assert(remote->subscribe(remote, "bridge/b", on_echo_message, NULL) == 0);
+    assert(remote->subscribe(remote, "other/#", on_unbridged_message, NULL) == 0);
+    assert(local->subscribe(local, "bridge/b", on_local_message, NULL) == 0);
+    tev_set_timeout(tev, start, NULL, 100);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+
+    assert(remote_count == MESSAGE_COUNT);
+    assert(local_count == MESSAGE_COUNT);
+    assert(echo_count == MESSAGE_COUNT);
+    assert(unbridged_count == 0);
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../tbus.h"
+#include "../capture.h"
+
+#define MESSAGE_COUNT (10)
+
+static tev_handle_t tev = NULL;
+static tbus_t* client = NULL;
+static char capture_path[64];
+static pid_t tool_pid = -1;
+static int received = 0;
+
+static pid_t start_tool(const char* path, char* const argv[])
+{
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if(pid == 0)
+    {
+        execv(path, argv);
+        _exit(EXIT_FAILURE);
+    }
+    /** Let it subscribe */
+    usleep(100 * 1000);
+    return pid;
+}
+
+static void wait_tool()
+{
+    int status = 0;
+    assert(waitpid(tool_pid, &status, 0) == tool_pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    tool_pid = -1;
+}
+
+static void check_capture()
+{
+    FILE* file = fopen(capture_path, "rb");
+    assert(file);
+    tbus_capture_header_t header;
+    assert(fread(&header, sizeof(header), 1, file) == 1);
+    assert(memcmp(header.magic, TBUS_CAPTURE_MAGIC, sizeof(header.magic)) == 0);
+    uint64_t last_timestamp_ns = 0;
+    for(int i = 0; i < MESSAGE_COUNT; i++)
+    {
+        tbus_capture_record_t record;
+        char topic[16];
+        int value = 0;
+        assert(fread(&record, sizeof(record), 1, file) == 1);
+        assert(record.timestamp_ns >= last_timestamp_ns);
+        last_timestamp_ns = record.timestamp_ns;
+        assert(record.topic_len == strlen("cap/a"));
+        assert(record.data_len == sizeof(value));
+        assert(fread(topic, 1, record.topic_len, file) == record.topic_len);
+        assert(memcmp(topic, "cap/a", record.topic_len) == 0);
+        assert(fread(&value, 1, sizeof(value), file) == sizeof(value));
+        assert(value == i);
+    }
+    assert(fgetc(file) == EOF);
+    fclose(file);
+}
+
+static void replay(void* ctx)
+{
+    char* argv[] = { "tbus_pub", "-r", capture_path, "-x", "2", NULL };
+    tool_pid = start_tool("../tbus_pub", argv);
+}
+
+static void on_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    int value = 0;
+    assert(strcmp(topic, "cap/a") == 0);
+    assert(len == sizeof(value));
+    memcpy(&value, data, len);
+    /** Live, then replayed */
+    assert(value == received % MESSAGE_COUNT);
+    received++;
+    if(received == MESSAGE_COUNT)
+    {
+        /** The capture stops after MESSAGE_COUNT */
+        wait_tool();
+        check_capture();
+        tev_set_timeout(tev, replay, NULL, 0);
+    }
+    else if(received == 2 * MESSAGE_COUNT)
+    {
+        wait_tool();
+        client->close(client);
+    }
+}
+
+static void start(void* ctx)
+{
+    char* argv[] = { "tbus_sub", "-t", "cap/#", "-w", capture_path, "-n", "10", NULL };
+    tool_pid = start_tool("../tbus_sub", argv);
+    for(int i = 0; i < MESSAGE_COUNT; i++)
+        assert(client->publish(client, "cap/a", (uint8_t*)&i, sizeof(i)) == 0);
+}
+
+int main(int argc, char const *argv[])
+{
+    snprintf(capture_path, sizeof(capture_path), "/tmp/tbus_capture_test.%d", (int)getpid());
+    tev = tev_create_ctx();
+    assert(tev);
+    client = tbus_connect(tev, NULL);
+    assert(client);
+    assert(client->subscribe(client, "cap/#", on_message, NULL) == 0);
+    tev_set_timeout(tev, start, NULL, 10);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+    unlink(capture_path);
+
+    assert(received == 2 * MESSAGE_COUNT);
+    return 0;
+}
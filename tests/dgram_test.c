@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "../tbus.h"
+
+/** The broker runs with -d in run_tests.sh */
+#define SMALL_COUNT (1000)
+#define LARGE_SIZE (100 * 1024)
+/** Every other one too large for a datagram, so one topic takes both paths */
+#define MIXED_COUNT (200)
+#define MIXED_LARGE_SIZE (5 * 1024)
+
+static tev_handle_t tev = NULL;
+static tbus_t* publisher = NULL;
+static tbus_t* dgram_subscriber = NULL;
+static tbus_t* stream_subscriber = NULL;
+static uint8_t* large = NULL;
+static int counts[2] = {0};
+/** Datagrams and the stream are not ordered against each other, check that each arrives once */
+static uint8_t seen[2][SMALL_COUNT];
+static int mixed_counts[2] = {0};
+static int replied = 0;
+
+static void finish()
+{
+    if(counts[0] != SMALL_COUNT + 1 || counts[1] != SMALL_COUNT + 1 || replied == 0)
+        return;
+    if(mixed_counts[0] != MIXED_COUNT || mixed_counts[1] != MIXED_COUNT)
+        return;
+    publisher->close(publisher);
+    dgram_subscriber->close(dgram_subscriber);
+    stream_subscriber->close(stream_subscriber);
+}
+
+static void on_reply(tbus_reply_status_t status, const uint8_t* data, uint32_t len, void* ctx)
+{
+    assert(status == TBUS_REPLY_OK);
+    assert(len == 4 && memcmp(data, "pong", 4) == 0);
+    replied++;
+    finish();
+}
+
+static void on_request(const char* topic, const uint8_t* data, uint32_t len, uint64_t request_id, void* ctx)
+{
+    assert(len == 4 && memcmp(data, "ping", 4) == 0);
+    assert(dgram_subscriber->reply(dgram_subscriber, request_id, (uint8_t*)"pong", 4) == 0);
+}
+
+static void on_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    int which = (int)(intptr_t)ctx;
+    if(strcmp(topic, "dgram/small") == 0)
+    {
+        int value = 0;
+        assert(len == sizeof(value));
+        memcpy(&value, data, len);
+        assert(value >= 0 && value < SMALL_COUNT);
+        assert(!seen[which][value]);
+        seen[which][value] = 1;
+    }
+    else if(strcmp(topic, "dgram/mixed") == 0)
+    {
+        /** Whichever path each took, they arrive in order */
+        int value = 0;
+        assert(len >= sizeof(value));
+        memcpy(&value, data, sizeof(value));
+        assert(value == mixed_counts[which]);
+        assert(len == (value % 2 ? MIXED_LARGE_SIZE : sizeof(value)));
+        mixed_counts[which]++;
+        finish();
+        return;
+    }
+    else
+    {
+        /** Too large for a datagram, it takes the stream */
+        assert(len == LARGE_SIZE);
+        assert(memcmp(data, large, LARGE_SIZE) == 0);
+    }
+    counts[which]++;
+    finish();
+}
+
+static void start(void* ctx)
+{
+    for(int i = 0; i < SMALL_COUNT; i++)
+        assert(publisher->publish(publisher, "dgram/small", (uint8_t*)&i, sizeof(i)) == 0);
+    assert(publisher->publish(publisher, "dgram/large", large, LARGE_SIZE) == 0);
+    static uint8_t mixed[MIXED_LARGE_SIZE];
+    for(int i = 0; i < MIXED_COUNT; i++)
+    {
+        memcpy(mixed, &i, sizeof(i));
+        assert(publisher->publish(publisher, "dgram/mixed", mixed, i % 2 ? MIXED_LARGE_SIZE : sizeof(i)) == 0);
+    }
+    assert(publisher->request(publisher, "dgram/service", (uint8_t*)"ping", 4, 1000, on_reply, NULL) == 0);
+}
+
+int main(int argc, char const *argv[])
+{
+    large = malloc(LARGE_SIZE);
+    assert(large);
+    for(int i = 0; i < LARGE_SIZE; i++)
+        large[i] = (uint8_t)(i * 7);
+    tev = tev_create_ctx();
+    assert(tev);
+    dgram_subscriber = tbus_connect_dgram(tev, NULL);
+    assert(dgram_subscriber);
+    assert(dgram_subscriber->subscribe(dgram_subscriber, "dgram/+", on_message, (void*)0) == 0);
+    assert(dgram_subscriber->serve(dgram_subscriber, "dgram/service", on_request, NULL) == 0);
+    /** Both transports share the same broker */
+    stream_subscriber = tbus_connect(tev, NULL);
+    assert(stream_subscriber);
+    assert(stream_subscriber->subscribe(stream_subscriber, "dgram/+", on_message, (void*)1) == 0);
+    publisher = tbus_connect_dgram(tev, NULL);
+    assert(publisher);
+    tev_set_timeout(tev, start, NULL, 100);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+    free(large);
+
+    assert(counts[0] == SMALL_COUNT + 1);
+    assert(counts[1] == SMALL_COUNT + 1);
+    assert(replied == 1);
+    assert(mixed_counts[0] == MIXED_COUNT);
+    assert(mixed_counts[1] == MIXED_COUNT);
+    printf("dgram done\n");
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "../tbus.h"
+
+#define MESSAGE_COUNT (100)
+
+typedef struct
+{
+    uint32_t kind;
+    uint16_t level;
+} __attribute__((packed)) sample_t;
+
+static tev_handle_t tev = NULL;
+static tbus_t* client = NULL;
+static int filtered_count = 0;
+static int all_count = 0;
+static int expected_count = 0;
+
+static void on_filtered(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    sample_t sample;
+    assert(len == sizeof(sample));
+    memcpy(&sample, data, len);
+    assert(sample.kind == 3);
+    assert(sample.level >= 10 && sample.level <= 20);
+    filtered_count++;
+}
+
+static void on_all(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    all_count++;
+    /** The short message is last */
+    if(all_count == MESSAGE_COUNT + 1)
+        client->close(client);
+}
+
+static void start(void* ctx)
+{
+    for(int i = 0; i < MESSAGE_COUNT; i++)
+    {
+        sample_t sample = { .kind = i % 4, .level = i % 30 };
+        if(sample.kind == 3 && sample.level >= 10 && sample.level <= 20)
+            expected_count++;
+        assert(client->publish(client, "f/a", (uint8_t*)&sample, sizeof(sample)) == 0);
+    }
+    /** Too short for the fields */
+    uint8_t kind = 3;
+    assert(client->publish(client, "f/a", &kind, sizeof(kind)) == 0);
+}
+
+int main(int argc, char const *argv[])
+{
+    tev = tev_create_ctx();
+    assert(tev);
+    client = tbus_connect(tev, NULL);
+    assert(client);
+    tbus_filter_t filters[] = {
+        { .op = TBUS_FILTER_MASKED_EQUAL, .width = 4, .offset = 0, .a = 0xffffffff, .b = 3 },
+        { .op = TBUS_FILTER_RANGE, .width = 2, .offset = 4, .a = 10, .b = 20 },
+    };
+    assert(client->subscribe_filtered(client, "f/+", filters, 2, on_filtered, NULL) == 0);
+    assert(client->subscribe(client, "f/#", on_all, NULL) == 0);
+    tev_set_timeout(tev, start, NULL, 10);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+
+    assert(expected_count > 0);
+    assert(filtered_count == expected_count);
+    assert(all_count == MESSAGE_COUNT + 1);
+    return 0;
+}
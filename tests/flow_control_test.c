@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "../tbus.h"
+
+#define TOTAL_MESSAGES (1000)
+#define WINDOW (64 * 1024)
+
+static tev_handle_t tev = NULL;
+static tbus_t* publisher = NULL;
+static tbus_t* subscriber = NULL;
+static uint8_t data[1024];
+static int sent = 0;
+static int received = 0;
+static int blocked = 0;
+
+static void on_message(const char* topic, const uint8_t* msg, uint32_t len, void* ctx)
+{
+    assert(len == sizeof(data));
+    assert(memcmp(msg, data, len) == 0);
+    received++;
+    if(received == TOTAL_MESSAGES)
+    {
+        publisher->close(publisher);
+        subscriber->close(subscriber);
+    }
+}
+
+static void publish_until_blocked(void* ctx)
+{
+    while(sent < TOTAL_MESSAGES)
+    {
+        if(publisher->can_publish(publisher, "flow", sizeof(data)) != 1)
+        {
+            blocked++;
+            /** The next publish should fail as well */
+            assert(publisher->publish(publisher, "flow", data, sizeof(data)) != 0);
+            return;
+        }
+        assert(publisher->publish(publisher, "flow", data, sizeof(data)) == 0);
+        sent++;
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    memset(data, 0x5a, sizeof(data));
+    tev = tev_create_ctx();
+    assert(tev);
+    subscriber = tbus_connect(tev, NULL);
+    assert(subscriber);
+    assert(subscriber->subscribe(subscriber, "flow", on_message, NULL) == 0);
+    publisher = tbus_connect(tev, NULL);
+    assert(publisher);
+    publisher->callbacks.on_credit = publish_until_blocked;
+    assert(publisher->enable_flow_control(publisher, WINDOW) == 0);
+    /** No credit before the broker grants the window */
+    assert(publisher->can_publish(publisher, "flow", sizeof(data)) == 0);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+
+    assert(received == TOTAL_MESSAGES);
+    assert(blocked > 0);
+    printf("blocked %d times\n", blocked);
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../frame_buffer.h"
+
+#define LARGE_SIZE (4 * 1024 * 1024)
+
+int main(int argc, char const *argv[])
+{
+    /** Small ones come from malloc and are never kept */
+    uint8_t* small = frame_buffer_alloc(100);
+    assert(small);
+    memset(small, 1, 100);
+    small = frame_buffer_realloc(small, 200);
+    assert(small && small[99] == 1);
+
+    /** Growing past the threshold maps and keeps the content */
+    uint8_t* large = frame_buffer_realloc(small, LARGE_SIZE);
+    assert(large && large[0] == 1 && large[99] == 1);
+    memset(large, 2, LARGE_SIZE);
+    assert(frame_buffer_free(large));
+
+    /** The kept mapping is handed out again, pages and all */
+    uint8_t* again = frame_buffer_alloc(LARGE_SIZE - 1000);
+    assert(again == large);
+    assert(again[LARGE_SIZE - 1] == 2);
+
+    /** Shrinking gives the mapping back */
+    small = frame_buffer_realloc(again, 100);
+    assert(small && small[0] == 2);
+    assert(!frame_buffer_free(small));
+
+    /** Trimmed pages read back as zeros, the mapping is still reused */
+    assert(frame_buffer_trim(0) == false);
+    again = frame_buffer_alloc(LARGE_SIZE);
+    assert(again == large);
+    assert(again[LARGE_SIZE - 1] == 0);
+    frame_buffer_free(again);
+    /** Not idle for long enough yet */
+    assert(frame_buffer_trim(FRAME_BUFFER_IDLE_MS) == true);
+
+    /** Prefaulted mappings are handed out first and never trimmed */
+    assert(frame_buffer_prefault(FRAME_BUFFER_CACHE_SIZE + 1, LARGE_SIZE / 4) == -1);
+    assert(frame_buffer_prefault(2, LARGE_SIZE / 4) == 0);
+    uint8_t* pinned = frame_buffer_alloc(LARGE_SIZE / 4);
+    assert(pinned && pinned != large);
+    memset(pinned, 3, LARGE_SIZE / 4);
+    assert(frame_buffer_free(pinned));
+    frame_buffer_trim(0);
+    again = frame_buffer_alloc(LARGE_SIZE / 4);
+    assert(again == pinned);
+    assert(again[LARGE_SIZE / 4 - 1] == 3);
+    frame_buffer_free(again);
+    printf("frame_buffer done\n");
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <sys/wait.h>
+#include "../tbus.h"
+
+/** A private broker journaling jr/#, restarted in between */
+#define JOURNAL_UDS_PATH "@tbus.journal"
+#define JOURNALED_COUNT (3)
+
+static tev_handle_t tev = NULL;
+static tbus_t* client = NULL;
+static pid_t broker_pid = -1;
+static char journal_dir[] = "/tmp/tbus_journal_XXXXXX";
+static int received = 0;
+
+static void start_broker()
+{
+    broker_pid = fork();
+    assert(broker_pid >= 0);
+    if(broker_pid == 0)
+    {
+        execl("../tbus", "tbus", "-p", JOURNAL_UDS_PATH, "-H", "8", "-j", "jr/#", "-J", journal_dir, (char*)NULL);
+        _exit(EXIT_FAILURE);
+    }
+    /** Let it listen */
+    usleep(100 * 1000);
+}
+
+static void stop_broker()
+{
+    kill(broker_pid, SIGTERM);
+    waitpid(broker_pid, NULL, 0);
+    broker_pid = -1;
+}
+
+static void on_journaled(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    received++;
+    assert(client->get_sequence(client) == (uint64_t)received);
+    if(received == JOURNALED_COUNT)
+        client->close(client);
+}
+
+static void publish_journaled(void* ctx)
+{
+    for(int i = 1; i <= JOURNALED_COUNT; i++)
+        assert(client->publish(client, "jr/a", (uint8_t*)&i, sizeof(i)) == 0);
+}
+
+static void on_replayed(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    int value = 0;
+    assert(len == sizeof(value));
+    memcpy(&value, data, len);
+    received++;
+    assert(value == received);
+    /** The sequence goes on from where the last run left it */
+    assert(client->get_sequence(client) == (uint64_t)received);
+    if(received == JOURNALED_COUNT)
+    {
+        int next = JOURNALED_COUNT + 1;
+        assert(client->publish(client, "jr/a", (uint8_t*)&next, sizeof(next)) == 0);
+    }
+    else if(received == JOURNALED_COUNT + 1)
+    {
+        client->close(client);
+    }
+}
+
+static void run(tbus_subscribe_callback_t callback, bool replay)
+{
+    received = 0;
+    tev = tev_create_ctx();
+    assert(tev);
+    client = tbus_connect(tev, JOURNAL_UDS_PATH);
+    assert(client);
+    if(replay)
+    {
+        assert(client->subscribe_from(client, "jr/#", 1, callback, NULL) == 0);
+    }
+    else
+    {
+        assert(client->subscribe(client, "jr/#", callback, NULL) == 0);
+        tev_set_timeout(tev, publish_journaled, NULL, 10);
+    }
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+}
+
+static void remove_journal_dir()
+{
+    DIR* dir = opendir(journal_dir);
+    assert(dir);
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL)
+    {
+        if(entry->d_name[0] == '.')
+            continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", journal_dir, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    rmdir(journal_dir);
+}
+
+int main(int argc, char const *argv[])
+{
+    assert(mkdtemp(journal_dir) != NULL);
+    start_broker();
+    run(on_journaled, false);
+    assert(received == JOURNALED_COUNT);
+    stop_broker();
+
+    start_broker();
+    run(on_replayed, true);
+    assert(received == JOURNALED_COUNT + 1);
+    stop_broker();
+
+    remove_journal_dir();
+    return 0;
+}
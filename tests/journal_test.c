@@ -0,0 +1,105 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "../journal.h"
+
+#define RECORD_COUNT (1000)
+
+typedef struct
+{
+    int count;
+    int first;
+} iterate_ctx_t;
+
+static void check_record(const uint8_t* data, size_t size, uint64_t timestamp_ms, void* ctx)
+{
+    iterate_ctx_t* iterate_ctx = (iterate_ctx_t*)ctx;
+    int value = 0;
+    memcpy(&value, data, sizeof(value));
+    /** first < 0: start from whatever is retained */
+    if(iterate_ctx->first < 0)
+        iterate_ctx->first = value;
+    assert(value == iterate_ctx->first + iterate_ctx->count);
+    assert(size == sizeof(value) + value % 100);
+    assert(timestamp_ms > 0);
+    iterate_ctx->count++;
+}
+
+static void append_records(journal_t* journal, int from, int to)
+{
+    uint8_t record[sizeof(int) + 100];
+    memset(record, 0xab, sizeof(record));
+    for(int i = from; i < to; i++)
+    {
+        memcpy(record, &i, sizeof(i));
+        assert(journal->append(journal, record, sizeof(int) + i % 100) == 0);
+    }
+}
+
+static void remove_dir(const char* path)
+{
+    DIR* dir = opendir(path);
+    assert(dir);
+    struct dirent* entry;
+    char file[1024];
+    while((entry = readdir(dir)) != NULL)
+    {
+        if(entry->d_name[0] == '.')
+            continue;
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        unlink(file);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+int main(int argc, char const *argv[])
+{
+    char dir[] = "/tmp/journal_test_XXXXXX";
+    assert(mkdtemp(dir));
+    journal_config_t config = {
+        .segment_size = 4096,
+        .max_bytes = 0,
+        .max_age_s = 0
+    };
+
+    /** append and read back */
+    journal_t* journal = journal_new(dir, "test", &config);
+    assert(journal);
+    append_records(journal, 0, RECORD_COUNT);
+    iterate_ctx_t ctx = {0, 0};
+    journal->for_each(journal, check_record, &ctx);
+    assert(ctx.count == RECORD_COUNT);
+    journal->close(journal);
+
+    /** recover and continue */
+    journal = journal_new(dir, "test", &config);
+    assert(journal);
+    append_records(journal, RECORD_COUNT, RECORD_COUNT * 2);
+    ctx = (iterate_ctx_t){0, 0};
+    journal->for_each(journal, check_record, &ctx);
+    assert(ctx.count == RECORD_COUNT * 2);
+    journal->close(journal);
+
+    /** size based retention keeps the newest records */
+    config.max_bytes = 4096 * 4;
+    journal = journal_new(dir, "test", &config);
+    assert(journal);
+    append_records(journal, RECORD_COUNT * 2, RECORD_COUNT * 3);
+    ctx = (iterate_ctx_t){0, -1};
+    journal->for_each(journal, check_record, &ctx);
+    journal->close(journal);
+    assert(ctx.count > 0 && ctx.count < RECORD_COUNT);
+    assert(ctx.first + ctx.count == RECORD_COUNT * 3);
+    printf("%d records retained\n", ctx.count);
+
+    remove_dir(dir);
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "../tbus.h"
+
+#define SMALL_COUNT (1000)
+#define LARGE_SIZE (1024 * 1024)
+#define LONG_TOPIC_SIZE (400)
+
+static tev_handle_t tev = NULL;
+static tbus_t* publishers[2] = {NULL};
+static tbus_t* subscriber = NULL;
+static char long_topic[LONG_TOPIC_SIZE];
+static int counts[2] = {0};
+static int long_count = 0;
+
+static void fill(uint8_t* data, uint32_t len, int seed)
+{
+    for(uint32_t i = 0; i < len; i++)
+        data[i] = (uint8_t)(i * 7 + seed);
+}
+
+static void on_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    if(strcmp(topic, long_topic) == 0)
+    {
+        /** Does not fit the head room, sent from two pieces */
+        assert(len == sizeof(int));
+        long_count++;
+    }
+    else
+    {
+        int which = strcmp(topic, "loan/stream") == 0 ? 0 : 1;
+        assert(which == 0 || strcmp(topic, "loan/seqpacket") == 0);
+        if(counts[which] < SMALL_COUNT)
+        {
+            int value = 0;
+            assert(len == sizeof(value));
+            memcpy(&value, data, len);
+            assert(value == counts[which]);
+        }
+        else
+        {
+            assert(len == LARGE_SIZE);
+            uint8_t* expected = malloc(LARGE_SIZE);
+            assert(expected);
+            fill(expected, LARGE_SIZE, which);
+            assert(memcmp(data, expected, LARGE_SIZE) == 0);
+            free(expected);
+        }
+        counts[which]++;
+    }
+    if(counts[0] == SMALL_COUNT + 1 && counts[1] == SMALL_COUNT + 1 && long_count == 2)
+    {
+        publishers[0]->close(publishers[0]);
+        publishers[1]->close(publishers[1]);
+        subscriber->close(subscriber);
+    }
+}
+
+static void start(void* ctx)
+{
+    const char* topics[2] = {"loan/stream", "loan/seqpacket"};
+    for(int which = 0; which < 2; which++)
+    {
+        tbus_t* publisher = publishers[which];
+        /** Given back unused */
+        tbus_loan_t* loan = publisher->loan(publisher, 100);
+        assert(loan);
+        publisher->cancel_loan(publisher, loan);
+        for(int i = 0; i < SMALL_COUNT; i++)
+        {
+            loan = publisher->loan(publisher, sizeof(i));
+            assert(loan && loan->len == sizeof(i));
+            memcpy(loan->data, &i, sizeof(i));
+            assert(publisher->commit(publisher, loan, topics[which]) == 0);
+        }
+        loan = publisher->loan(publisher, LARGE_SIZE);
+        assert(loan);
+        fill(loan->data, LARGE_SIZE, which);
+        assert(publisher->commit(publisher, loan, topics[which]) == 0);
+        loan = publisher->loan(publisher, sizeof(int));
+        assert(loan);
+        memset(loan->data, 0, sizeof(int));
+        assert(publisher->commit(publisher, loan, long_topic) == 0);
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    memcpy(long_topic, "loan/", 5);
+    memset(long_topic + 5, 'x', LONG_TOPIC_SIZE - 6);
+    long_topic[LONG_TOPIC_SIZE - 1] = '\0';
+    tev = tev_create_ctx();
+    assert(tev);
+    subscriber = tbus_connect(tev, NULL);
+    assert(subscriber);
+    assert(subscriber->subscribe(subscriber, "loan/#", on_message, NULL) == 0);
+    publishers[0] = tbus_connect(tev, NULL);
+    assert(publishers[0]);
+    /** The broker runs with -s in run_tests.sh */
+    publishers[1] = tbus_connect_seqpacket(tev, NULL);
+    assert(publishers[1]);
+    assert(publishers[0]->loan(publishers[0], 0) == NULL);
+    tev_set_timeout(tev, start, NULL, 100);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+
+    assert(counts[0] == SMALL_COUNT + 1);
+    assert(counts[1] == SMALL_COUNT + 1);
+    assert(long_count == 2);
+    printf("loan done\n");
+    return 0;
+}
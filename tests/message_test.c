@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include "../message.h"
 
@@ -21,11 +22,25 @@ int main(int argc, char const *argv[])
     assert(tbus_message_view(buffer, buffer_len, &msg_view) == 0);
     assert(msg_view.command == TBUS_MSG_CMD_PUB);
     assert(strcmp(msg_view.topic, "test") == 0);
+    /** Only brokers add SEQ and ORIGIN, a plain publish is a 1.0 frame */
+    assert(msg_view.p_seq == NULL && msg_view.p_origin == NULL);
     tbus_message_sub_index_t sub_index_read;
     READ_SUB_INDEX(&msg_view, sub_index_read);
     assert(sub_index_read == 1);
     assert(msg_view.data_len == 14);
     assert(strcmp(msg_view.data, "Hello, World!") == 0);
+    /** The head followed by the data is the same frame */
+    size_t head_len = 0;
+    uint8_t* head = tbus_message_serialize_head(&msg, &head_len);
+    assert(head != NULL);
+    tbus_message_set_data_len(head, head_len, msg.data_len);
+    assert(head_len + msg.data_len == buffer_len);
+    assert(memcmp(head, buffer, head_len) == 0);
+    assert(memcmp(buffer + head_len, msg.data, msg.data_len) == 0);
+    /** Frames of another version are rejected */
+    ((tbus_message_raw_header_t*)buffer)->version = TBUS_MSG_VERSION + 1;
+    assert(tbus_message_view(buffer, buffer_len, &msg_view) != 0);
+    free(head);
     free(buffer);
     return 0;
 }
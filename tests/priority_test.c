@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "../tbus.h"
+
+#define BULK_COUNT (400)
+#define BULK_SIZE (64 * 1024)
+
+static tev_handle_t tev = NULL;
+static tbus_t* publisher = NULL;
+static tbus_t* subscriber = NULL;
+static int bulk_count = 0;
+static int urgent_at = -1;
+
+static void on_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    if(strcmp(topic, "prio/urgent") == 0)
+    {
+        assert(urgent_at == -1);
+        urgent_at = bulk_count;
+    }
+    else
+    {
+        assert(len == BULK_SIZE);
+        bulk_count++;
+    }
+    if(bulk_count == BULK_COUNT && urgent_at != -1)
+    {
+        publisher->close(publisher);
+        subscriber->close(subscriber);
+    }
+}
+
+static void start(void* ctx)
+{
+    uint8_t* bulk = malloc(BULK_SIZE);
+    assert(bulk);
+    memset(bulk, 0xAA, BULK_SIZE);
+    for(int i = 0; i < BULK_COUNT; i++)
+        assert(publisher->publish(publisher, "prio/bulk", bulk, BULK_SIZE) == 0);
+    free(bulk);
+    const char* alarm = "alarm";
+    assert(publisher->publish_with_priority(publisher, "prio/urgent", (uint8_t*)alarm, strlen(alarm), TBUS_PRIORITY_MAX) == 0);
+    assert(publisher->publish_with_priority(publisher, "prio/urgent", (uint8_t*)alarm, strlen(alarm), TBUS_PRIORITY_MAX + 1) == -1);
+}
+
+int main(int argc, char const *argv[])
+{
+    tev = tev_create_ctx();
+    assert(tev);
+    subscriber = tbus_connect(tev, NULL);
+    assert(subscriber);
+    assert(subscriber->subscribe(subscriber, "prio/#", on_message, NULL) == 0);
+    publisher = tbus_connect(tev, NULL);
+    assert(publisher);
+    tev_set_timeout(tev, start, NULL, 100);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+
+    /** The urgent message overtook the queued bulk messages */
+    assert(urgent_at >= 0 && urgent_at < BULK_COUNT);
+    printf("urgent message arrived after %d of %d bulk messages\n", urgent_at, BULK_COUNT);
+    return 0;
+}
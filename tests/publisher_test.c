@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "../tbus.h"
+
+#define SMALL_COUNT (1000)
+#define LARGE_SIZE (100 * 1024)
+
+static tev_handle_t tev = NULL;
+static tbus_t* stream_client = NULL;
+static tbus_t* seqpacket_client = NULL;
+static tbus_t* subscriber = NULL;
+static tbus_publisher_t* publishers[2] = {NULL};
+static uint8_t* large = NULL;
+static int counts[2] = {0};
+
+static void on_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    int which = strcmp(topic, "publisher/stream") == 0 ? 0 : 1;
+    assert(which == 0 || strcmp(topic, "publisher/seqpacket") == 0);
+    if(counts[which] < SMALL_COUNT)
+    {
+        int value = 0;
+        assert(len == sizeof(value));
+        memcpy(&value, data, len);
+        assert(value == counts[which]);
+    }
+    else
+    {
+        assert(len == LARGE_SIZE);
+        assert(memcmp(data, large, LARGE_SIZE) == 0);
+    }
+    counts[which]++;
+    if(counts[0] == SMALL_COUNT + 1 && counts[1] == SMALL_COUNT + 1)
+    {
+        publishers[0]->close(publishers[0]);
+        publishers[1]->close(publishers[1]);
+        stream_client->close(stream_client);
+        seqpacket_client->close(seqpacket_client);
+        subscriber->close(subscriber);
+    }
+}
+
+static void start(void* ctx)
+{
+    for(int i = 0; i < SMALL_COUNT; i++)
+    {
+        /** The same head is reused with a different data length */
+        assert(publishers[0]->publish(publishers[0], (uint8_t*)&i, sizeof(i)) == 0);
+        assert(publishers[1]->publish(publishers[1], (uint8_t*)&i, sizeof(i)) == 0);
+    }
+    assert(publishers[0]->publish(publishers[0], large, LARGE_SIZE) == 0);
+    assert(publishers[1]->publish(publishers[1], large, LARGE_SIZE) == 0);
+}
+
+int main(int argc, char const *argv[])
+{
+    large = malloc(LARGE_SIZE);
+    assert(large);
+    for(int i = 0; i < LARGE_SIZE; i++)
+        large[i] = (uint8_t)(i * 13);
+    tev = tev_create_ctx();
+    assert(tev);
+    subscriber = tbus_connect(tev, NULL);
+    assert(subscriber);
+    assert(subscriber->subscribe(subscriber, "publisher/#", on_message, NULL) == 0);
+    stream_client = tbus_connect(tev, NULL);
+    assert(stream_client);
+    publishers[0] = stream_client->create_publisher(stream_client, "publisher/stream");
+    assert(publishers[0]);
+    /** The broker runs with -s in run_tests.sh */
+    seqpacket_client = tbus_connect_seqpacket(tev, NULL);
+    assert(seqpacket_client);
+    publishers[1] = seqpacket_client->create_publisher(seqpacket_client, "publisher/seqpacket");
+    assert(publishers[1]);
+    assert(publishers[0]->publish(publishers[0], NULL, 0) == -1);
+    tev_set_timeout(tev, start, NULL, 100);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+    free(large);
+
+    assert(counts[0] == SMALL_COUNT + 1);
+    assert(counts[1] == SMALL_COUNT + 1);
+    printf("publisher done\n");
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../tbus.h"
+
+/** A private broker that this test restarts */
+#define RECONNECT_UDS_PATH "@tbus.reconnect"
+#define BUFFERED_COUNT (5)
+
+static tev_handle_t tev = NULL;
+static tbus_t* client = NULL;
+static pid_t broker_pid = -1;
+static int received = 0;
+static int disconnected = 0;
+
+static void start_broker()
+{
+    broker_pid = fork();
+    assert(broker_pid >= 0);
+    if(broker_pid == 0)
+    {
+        execl("../tbus", "tbus", "-p", RECONNECT_UDS_PATH, (char*)NULL);
+        _exit(EXIT_FAILURE);
+    }
+    /** Let it listen */
+    usleep(100 * 1000);
+}
+
+static void stop_broker()
+{
+    kill(broker_pid, SIGTERM);
+    waitpid(broker_pid, NULL, 0);
+    broker_pid = -1;
+}
+
+static void on_disconnect(void* ctx)
+{
+    disconnected = 1;
+}
+
+static void publish_during_outage(void* ctx)
+{
+    for(int i = 1; i <= BUFFERED_COUNT; i++)
+        assert(client->publish(client, "r/a", (uint8_t*)&i, sizeof(i)) == 0);
+    start_broker();
+}
+
+static void on_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    int value = 0;
+    assert(len == sizeof(value));
+    memcpy(&value, data, len);
+    assert(value == received);
+    received++;
+    if(value == 0)
+    {
+        stop_broker();
+        tev_set_timeout(tev, publish_during_outage, NULL, 50);
+    }
+    else if(value == BUFFERED_COUNT)
+    {
+        client->close(client);
+    }
+}
+
+static void start(void* ctx)
+{
+    int value = 0;
+    assert(client->publish(client, "r/a", (uint8_t*)&value, sizeof(value)) == 0);
+}
+
+int main(int argc, char const *argv[])
+{
+    start_broker();
+    tev = tev_create_ctx();
+    assert(tev);
+    client = tbus_connect(tev, RECONNECT_UDS_PATH);
+    assert(client);
+    client->callbacks.on_disconnect = on_disconnect;
+    assert(client->enable_reconnect(client, 4096) == 0);
+    assert(client->subscribe(client, "r/a", on_message, NULL) == 0);
+    tev_set_timeout(tev, start, NULL, 10);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+    stop_broker();
+
+    assert(received == BUFFERED_COUNT + 1);
+    assert(disconnected == 0);
+    return 0;
+}
@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../tbus.h"
+#include "../message.h"
+#include "../common.h"
+
+/** The broker runs with -H 16 in run_tests.sh */
+#define FIRST_BATCH (5)
+#define REPLAY_FROM (3)
+/** Much more than a socket buffer, most of them stay queued in the broker */
+#define RESUBSCRIBE_COUNT (8)
+#define RESUBSCRIBE_SIZE (256 * 1024)
+#define SAMPLE_INTERVAL_MS (100)
+
+static tev_handle_t tev = NULL;
+static tbus_t* publisher = NULL;
+static tbus_t* live = NULL;
+static tbus_t* late = NULL;
+static uint64_t live_seqs[FIRST_BATCH];
+static int live_count = 0;
+static int late_count = 0;
+static uint64_t late_last_seq = 0;
+
+static void publish(int value)
+{
+    assert(publisher->publish(publisher, "replay/a", (uint8_t*)&value, sizeof(value)) == 0);
+}
+
+static void on_late_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    int value = 0;
+    assert(len == sizeof(value));
+    memcpy(&value, data, len);
+    uint64_t seq = late->get_sequence(late);
+    /** Replayed messages first, then the live one */
+    assert(value == REPLAY_FROM + late_count);
+    if(late_count == 0)
+        assert(seq == live_seqs[REPLAY_FROM]);
+    else
+        assert(seq == late_last_seq + 1);
+    late_last_seq = seq;
+    late_count++;
+    if(late_count == FIRST_BATCH - REPLAY_FROM)
+    {
+        /** Replay done, continue live */
+        publish(FIRST_BATCH);
+    }
+    else if(late_count == FIRST_BATCH - REPLAY_FROM + 1)
+    {
+        publisher->close(publisher);
+        live->close(live);
+        late->close(late);
+    }
+}
+
+static void on_live_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    if(live_count >= FIRST_BATCH)
+        return;
+    int value = 0;
+    memcpy(&value, data, sizeof(value));
+    assert(value == live_count);
+    live_seqs[live_count] = live->get_sequence(live);
+    assert(live_seqs[live_count] != 0);
+    if(live_count > 0)
+        assert(live_seqs[live_count] == live_seqs[live_count - 1] + 1);
+    live_count++;
+    if(live_count == FIRST_BATCH)
+    {
+        late = tbus_connect(tev, NULL);
+        assert(late);
+        assert(late->subscribe_from(late, "replay/#", live_seqs[REPLAY_FROM], on_late_message, NULL) == 0);
+    }
+}
+
+static int raw_connect(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+    addr.sun_path[0] = 0;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    assert(connect(fd, (struct sockaddr*)&addr, addr_len) == 0);
+    return fd;
+}
+
+static void raw_write(int fd, tbus_message_t* msg)
+{
+    size_t size = 0;
+    uint8_t* frame = tbus_message_serialize(msg, &size);
+    assert(frame);
+    assert(write(fd, frame, size) == size);
+    free(frame);
+}
+
+static void raw_subscribe(int fd, const char* topic, tbus_message_seq_t* p_from_seq, tbus_message_interval_t* p_interval)
+{
+    tbus_message_sub_index_t sub_index = 0;
+    tbus_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.command = TBUS_MSG_CMD_SUB;
+    msg.topic = (char*)topic;
+    msg.p_sub_index = &sub_index;
+    msg.p_seq = p_from_seq;
+    msg.p_interval = p_interval;
+    raw_write(fd, &msg);
+}
+
+static void raw_publish(int fd, const char* topic, int value)
+{
+    static uint8_t data[RESUBSCRIBE_SIZE];
+    memcpy(data, &value, sizeof(value));
+    tbus_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.command = TBUS_MSG_CMD_PUB;
+    msg.topic = (char*)topic;
+    msg.data = data;
+    msg.data_len = sizeof(data);
+    raw_write(fd, &msg);
+}
+
+/** @return the value of the next frame, -1 if none arrived within timeout_ms */
+static int raw_receive(int fd, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if(poll(&pfd, 1, timeout_ms) != 1)
+        return -1;
+    tbus_message_len_t len = 0;
+    assert(read(fd, &len, sizeof(len)) == sizeof(len));
+    uint8_t* frame = malloc(len);
+    assert(frame);
+    memcpy(frame, &len, sizeof(len));
+    for(size_t received = sizeof(len); received < len;)
+    {
+        ssize_t rc = read(fd, frame + received, len - received);
+        assert(rc > 0);
+        received += rc;
+    }
+    tbus_message_t view;
+    assert(tbus_message_view(frame, len, &view) == 0);
+    int value = 0;
+    memcpy(&value, view.data, sizeof(value));
+    free(frame);
+    return value;
+}
+
+/** Resubscribe from the start while live frames are still queued for the subscription */
+static void check_resubscribe()
+{
+    char topic[64];
+    snprintf(topic, sizeof(topic), "resubscribe/%d", getpid());
+    int sub_fd = raw_connect(TBUS_DEFAULT_UDS_PATH);
+    int pub_fd = raw_connect(TBUS_DEFAULT_UDS_PATH);
+    int sampled_fd = raw_connect(TBUS_DEFAULT_UDS_PATH);
+    raw_subscribe(sub_fd, topic, NULL, NULL);
+    usleep(50 * 1000);
+    for(int i = 0; i < RESUBSCRIBE_COUNT; i++)
+        raw_publish(pub_fd, topic, i);
+    usleep(100 * 1000);
+    tbus_message_seq_t from_seq = 0;
+    raw_subscribe(sub_fd, topic, &from_seq, NULL);
+    tbus_message_interval_t interval_ms = SAMPLE_INTERVAL_MS;
+    raw_subscribe(sampled_fd, topic, &from_seq, &interval_ms);
+    /** What went out before the SUB, then the replay in order, the queued frames only once */
+    int values[2 * RESUBSCRIBE_COUNT];
+    int count = 0;
+    int value;
+    while((value = raw_receive(sub_fd, 500)) >= 0)
+    {
+        assert(count < 2 * RESUBSCRIBE_COUNT);
+        values[count++] = value;
+    }
+    assert(count < 2 * RESUBSCRIBE_COUNT);
+    assert(values[0] == 0);
+    assert(values[count - 1] == RESUBSCRIBE_COUNT - 1);
+    bool restarted = false;
+    for(int i = 1; i < count; i++)
+    {
+        if(values[i] == values[i - 1] + 1)
+            continue;
+        assert(!restarted);
+        assert(values[i] == 0);
+        restarted = true;
+    }
+    /** Sampled like live messages, the first right away and the latest after the interval */
+    assert(raw_receive(sampled_fd, 0) == 0);
+    assert(raw_receive(sampled_fd, 10 * SAMPLE_INTERVAL_MS) == RESUBSCRIBE_COUNT - 1);
+    assert(raw_receive(sampled_fd, 2 * SAMPLE_INTERVAL_MS) < 0);
+    close(sub_fd);
+    close(pub_fd);
+    close(sampled_fd);
+}
+
+static void start(void* ctx)
+{
+    for(int i = 0; i < FIRST_BATCH; i++)
+        publish(i);
+}
+
+int main(int argc, char const *argv[])
+{
+    check_resubscribe();
+    tev = tev_create_ctx();
+    assert(tev);
+    live = tbus_connect(tev, NULL);
+    assert(live);
+    assert(live->subscribe(live, "replay/a", on_live_message, NULL) == 0);
+    publisher = tbus_connect(tev, NULL);
+    assert(publisher);
+    tev_set_timeout(tev, start, NULL, 100);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+
+    assert(late_count == FIRST_BATCH - REPLAY_FROM + 1);
+    printf("replayed from %"PRIu64"\n", live_seqs[REPLAY_FROM]);
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "../tbus.h"
+
+static tev_handle_t tev = NULL;
+static tbus_t* server = NULL;
+static tbus_t* other_server = NULL;
+static tbus_t* monitor = NULL;
+static tbus_t* client = NULL;
+static int step = 0;
+static int served = 0;
+
+static void on_request(const char* topic, const uint8_t* data, uint32_t len, uint64_t request_id, void* ctx)
+{
+    tbus_t* self = (tbus_t*)ctx;
+    assert(strcmp(topic, "rpc/echo") == 0 || strcmp(topic, "rpc/silent") == 0);
+    served++;
+    if(strcmp(topic, "rpc/silent") == 0)
+        return;
+    assert(self->reply(self, request_id, data, len) == 0);
+}
+
+static void on_monitor(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    /** Plain subscriptions never see requests */
+    assert(0);
+}
+
+static void on_reply(tbus_reply_status_t status, const uint8_t* data, uint32_t len, void* ctx);
+
+static void next_step()
+{
+    const char* value = "ping";
+    switch(step)
+    {
+        case 0:
+            assert(client->request(client, "rpc/echo", (uint8_t*)value, strlen(value) + 1, 1000, on_reply, NULL) == 0);
+            break;
+        case 1:
+            assert(client->request(client, "nobody/home", (uint8_t*)value, strlen(value) + 1, 1000, on_reply, NULL) == 0);
+            break;
+        case 2:
+            assert(client->request(client, "rpc/silent", (uint8_t*)value, strlen(value) + 1, 50, on_reply, NULL) == 0);
+            break;
+        default:
+            server->close(server);
+            other_server->close(other_server);
+            monitor->close(monitor);
+            client->close(client);
+            break;
+    }
+}
+
+static void on_reply(tbus_reply_status_t status, const uint8_t* data, uint32_t len, void* ctx)
+{
+    switch(step)
+    {
+        case 0:
+            assert(status == TBUS_REPLY_OK);
+            assert(len == 5 && strcmp((const char*)data, "ping") == 0);
+            /** One of both servers */
+            assert(served == 1);
+            break;
+        case 1:
+            /** Even though the monitor matches */
+            assert(status == TBUS_REPLY_NO_RESPONDER);
+            assert(served == 1);
+            break;
+        case 2:
+            assert(status == TBUS_REPLY_TIMEOUT);
+            break;
+    }
+    step++;
+    next_step();
+}
+
+static void start(void* ctx)
+{
+    next_step();
+}
+
+int main(int argc, char const *argv[])
+{
+    tev = tev_create_ctx();
+    assert(tev);
+    server = tbus_connect(tev, NULL);
+    assert(server);
+    assert(server->serve(server, "rpc/+", on_request, server) == 0);
+    other_server = tbus_connect(tev, NULL);
+    assert(other_server);
+    assert(other_server->serve(other_server, "rpc/echo", on_request, other_server) == 0);
+    monitor = tbus_connect(tev, NULL);
+    assert(monitor);
+    assert(monitor->subscribe(monitor, "#", on_monitor, NULL) == 0);
+    client = tbus_connect(tev, NULL);
+    assert(client);
+    tev_set_timeout(tev, start, NULL, 100);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+
+    assert(step == 3);
+    printf("request/reply done\n");
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "../tbus.h"
+
+#define SMALL_COUNT (100)
+#define LARGE_SIZE (1024 * 1024)
+
+static tev_handle_t tev = NULL;
+static tbus_t* publisher = NULL;
+static tbus_t* subscribers[2] = {NULL};
+static tbus_message_handle_t* handles[2][SMALL_COUNT + 1] = {{NULL}};
+static uint8_t* large = NULL;
+static int counts[2] = {0};
+
+static void check_and_release(void* ctx)
+{
+    for(int which = 0; which < 2; which++)
+    {
+        for(int i = 0; i < SMALL_COUNT; i++)
+        {
+            tbus_message_handle_t* handle = handles[which][i];
+            assert(strcmp(handle->topic, "retain/small") == 0);
+            assert(handle->len == sizeof(i));
+            /** Still intact after later messages were read */
+            assert(memcmp(handle->data, &i, sizeof(i)) == 0);
+            handle->release(handle);
+        }
+        tbus_message_handle_t* handle = handles[which][SMALL_COUNT];
+        assert(strcmp(handle->topic, "retain/large") == 0);
+        assert(handle->len == LARGE_SIZE);
+        assert(memcmp(handle->data, large, LARGE_SIZE) == 0);
+        /** The extra reference taken in the callback */
+        handle->release(handle);
+        handle->release(handle);
+    }
+}
+
+static void on_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    int which = (int)(intptr_t)ctx;
+    tbus_t* subscriber = subscribers[which];
+    tbus_message_handle_t* handle = subscriber->retain_message(subscriber);
+    assert(handle);
+    /** No copy, and only once per message */
+    assert(handle->data == data && handle->topic == topic && handle->len == len);
+    assert(subscriber->retain_message(subscriber) == NULL);
+    if(counts[which] == SMALL_COUNT)
+        handle->retain(handle);
+    handles[which][counts[which]++] = handle;
+    if(counts[0] == SMALL_COUNT + 1 && counts[1] == SMALL_COUNT + 1)
+    {
+        publisher->close(publisher);
+        subscribers[0]->close(subscribers[0]);
+        subscribers[1]->close(subscribers[1]);
+        /** Handles outlive the clients */
+        tev_set_timeout(tev, check_and_release, NULL, 10);
+    }
+}
+
+static void start(void* ctx)
+{
+    /** Not in a callback */
+    assert(subscribers[0]->retain_message(subscribers[0]) == NULL);
+    for(int i = 0; i < SMALL_COUNT; i++)
+        assert(publisher->publish(publisher, "retain/small", (uint8_t*)&i, sizeof(i)) == 0);
+    assert(publisher->publish(publisher, "retain/large", large, LARGE_SIZE) == 0);
+}
+
+int main(int argc, char const *argv[])
+{
+    large = malloc(LARGE_SIZE);
+    assert(large);
+    for(int i = 0; i < LARGE_SIZE; i++)
+        large[i] = (uint8_t)(i * 11);
+    tev = tev_create_ctx();
+    assert(tev);
+    subscribers[0] = tbus_connect(tev, NULL);
+    assert(subscribers[0]);
+    assert(subscribers[0]->subscribe(subscribers[0], "retain/#", on_message, (void*)0) == 0);
+    /** The broker runs with -s in run_tests.sh */
+    subscribers[1] = tbus_connect_seqpacket(tev, NULL);
+    assert(subscribers[1]);
+    assert(subscribers[1]->subscribe(subscribers[1], "retain/#", on_message, (void*)1) == 0);
+    publisher = tbus_connect(tev, NULL);
+    assert(publisher);
+    tev_set_timeout(tev, start, NULL, 100);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+    free(large);
+
+    assert(counts[0] == SMALL_COUNT + 1);
+    assert(counts[1] == SMALL_COUNT + 1);
+    printf("retain done\n");
+    return 0;
+}
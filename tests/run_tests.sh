@@ -1,9 +1,16 @@
 #!/bin/bash
 
 # Start the broker in background
-../tbus &
+# -H: keep some history for replay_test
+# -s: listen on SOCK_SEQPACKET for seqpacket_test
+# -d: take datagrams for dgram_test
+../tbus -H 16 -s -d &
 BROKER_PID=$!
 sleep 0.1
+# A second broker bridged to the first one for bridge_test, also a shard for sharded_test
+../tbus -p @tbus.bridge -b @tbus -f "bridge/#" &
+BRIDGE_BROKER_PID=$!
+sleep 0.1
 # Set environment variables
 export LD_LIBRARY_PATH=$(pwd)/..
 # Get all tests
@@ -16,12 +23,12 @@ do
     ./$test
     if [ $? -ne 0 ]; then
         echo "Test $test failed"
-        kill $BROKER_PID
+        kill $BROKER_PID $BRIDGE_BROKER_PID
         exit 1
     fi
 done
 
 # Kill the broker
-kill $BROKER_PID
+kill $BROKER_PID $BRIDGE_BROKER_PID
 echo "All tests passed"
 exit 0
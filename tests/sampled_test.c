@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "../tbus.h"
+
+#define MESSAGE_COUNT (100)
+#define INTERVAL_MS (100)
+
+static tev_handle_t tev = NULL;
+static tbus_t* client = NULL;
+static int sampled_count = 0;
+static int last_sampled = -1;
+static int all_count = 0;
+
+static void try_close()
+{
+    if(all_count == MESSAGE_COUNT && last_sampled == MESSAGE_COUNT - 1)
+        client->close(client);
+}
+
+static void on_sampled(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    int value = 0;
+    assert(len == sizeof(value));
+    memcpy(&value, data, len);
+    assert(value > last_sampled);
+    last_sampled = value;
+    sampled_count++;
+    try_close();
+}
+
+static void on_all(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    all_count++;
+    try_close();
+}
+
+static void start(void* ctx)
+{
+    /** Much faster than the interval */
+    for(int i = 0; i < MESSAGE_COUNT; i++)
+        assert(client->publish(client, "s/a", (uint8_t*)&i, sizeof(i)) == 0);
+}
+
+int main(int argc, char const *argv[])
+{
+    tev = tev_create_ctx();
+    assert(tev);
+    client = tbus_connect(tev, NULL);
+    assert(client);
+    assert(client->subscribe_sampled(client, "s/+", INTERVAL_MS, on_sampled, NULL) == 0);
+    assert(client->subscribe(client, "s/#", on_all, NULL) == 0);
+    tev_set_timeout(tev, start, NULL, 10);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+
+    assert(all_count == MESSAGE_COUNT);
+    /** The first one right away, the latest at the end of the interval */
+    assert(sampled_count == 2);
+    assert(last_sampled == MESSAGE_COUNT - 1);
+    return 0;
+}
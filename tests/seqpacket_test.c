@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "../tbus.h"
+
+/** The broker runs with -s in run_tests.sh */
+#define SMALL_COUNT (1000)
+#define LARGE_SIZE (100 * 1024)
+
+static tev_handle_t tev = NULL;
+static tbus_t* publisher = NULL;
+static tbus_t* seqpacket_subscriber = NULL;
+static tbus_t* stream_subscriber = NULL;
+static uint8_t* large = NULL;
+static int counts[2] = {0};
+
+static void on_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    int which = (int)(intptr_t)ctx;
+    if(counts[which] < SMALL_COUNT)
+    {
+        int value = 0;
+        assert(len == sizeof(value));
+        memcpy(&value, data, len);
+        /** In order */
+        assert(value == counts[which]);
+    }
+    else
+    {
+        /** Split over several records and put back together */
+        assert(len == LARGE_SIZE);
+        assert(memcmp(data, large, LARGE_SIZE) == 0);
+    }
+    counts[which]++;
+    if(counts[0] == SMALL_COUNT + 1 && counts[1] == SMALL_COUNT + 1)
+    {
+        publisher->close(publisher);
+        seqpacket_subscriber->close(seqpacket_subscriber);
+        stream_subscriber->close(stream_subscriber);
+    }
+}
+
+static void start(void* ctx)
+{
+    for(int i = 0; i < SMALL_COUNT; i++)
+        assert(publisher->publish(publisher, "seqpacket/small", (uint8_t*)&i, sizeof(i)) == 0);
+    assert(publisher->publish(publisher, "seqpacket/large", large, LARGE_SIZE) == 0);
+}
+
+int main(int argc, char const *argv[])
+{
+    large = malloc(LARGE_SIZE);
+    assert(large);
+    for(int i = 0; i < LARGE_SIZE; i++)
+        large[i] = (uint8_t)(i * 7);
+    tev = tev_create_ctx();
+    assert(tev);
+    seqpacket_subscriber = tbus_connect_seqpacket(tev, NULL);
+    assert(seqpacket_subscriber);
+    assert(seqpacket_subscriber->subscribe(seqpacket_subscriber, "seqpacket/#", on_message, (void*)0) == 0);
+    /** Both transports share the same broker */
+    stream_subscriber = tbus_connect(tev, NULL);
+    assert(stream_subscriber);
+    assert(stream_subscriber->subscribe(stream_subscriber, "seqpacket/#", on_message, (void*)1) == 0);
+    publisher = tbus_connect_seqpacket(tev, NULL);
+    assert(publisher);
+    tev_set_timeout(tev, start, NULL, 100);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+    free(large);
+
+    assert(counts[0] == SMALL_COUNT + 1);
+    assert(counts[1] == SMALL_COUNT + 1);
+    printf("seqpacket done\n");
+    return 0;
+}
@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../tbus.h"
+
+/** A private broker tracking the sequences of two topics at most */
+#define SEQUENCE_UDS_PATH "@tbus.sequence"
+
+static const char* topics[] = {"s/a", "s/b", "s/a", "s/c", "s/b", "s/a"};
+/** s/b is the idlest when s/c comes, then s/a when s/b comes back */
+static const uint64_t expected[] = {1, 1, 2, 1, 1, 1};
+#define MESSAGE_COUNT (sizeof(topics) / sizeof(topics[0]))
+
+static tev_handle_t tev = NULL;
+static tbus_t* client = NULL;
+static size_t received = 0;
+
+static void on_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    assert(received < MESSAGE_COUNT);
+    assert(strcmp(topic, topics[received]) == 0);
+    assert(client->get_sequence(client) == expected[received]);
+    received++;
+    if(received == MESSAGE_COUNT)
+        client->close(client);
+}
+
+static void publish_all(void* ctx)
+{
+    uint8_t value = 0;
+    for(size_t i = 0; i < MESSAGE_COUNT; i++)
+        assert(client->publish(client, topics[i], &value, sizeof(value)) == 0);
+}
+
+int main(int argc, char const *argv[])
+{
+    pid_t broker_pid = fork();
+    assert(broker_pid >= 0);
+    if(broker_pid == 0)
+    {
+        execl("../tbus", "tbus", "-p", SEQUENCE_UDS_PATH, "-Q", "-K", "2", (char*)NULL);
+        _exit(EXIT_FAILURE);
+    }
+    /** Let it listen */
+    usleep(100 * 1000);
+    tev = tev_create_ctx();
+    assert(tev);
+    client = tbus_connect(tev, SEQUENCE_UDS_PATH);
+    assert(client);
+    assert(client->subscribe(client, "s/#", on_message, NULL) == 0);
+    tev_set_timeout(tev, publish_all, NULL, 10);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+    kill(broker_pid, SIGTERM);
+    waitpid(broker_pid, NULL, 0);
+
+    assert(received == MESSAGE_COUNT);
+    return 0;
+}
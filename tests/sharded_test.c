@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "../tbus.h"
+
+/** Both brokers started by run_tests.sh */
+#define SHARD_COUNT (2)
+#define TOPIC_COUNT (16)
+
+static const char* shard_paths[SHARD_COUNT] = {"@tbus", "@tbus.bridge"};
+static tev_handle_t tev = NULL;
+static tbus_t* publisher = NULL;
+static tbus_t* subscriber = NULL;
+static tbus_t* observers[SHARD_COUNT] = {0};
+static int observer_counts[SHARD_COUNT] = {0};
+static int wildcard_count = 0;
+static int concrete_count = 0;
+static int reply_count = 0;
+
+static void finish(void* ctx)
+{
+    publisher->close(publisher);
+    subscriber->close(subscriber);
+    for(int i = 0; i < SHARD_COUNT; i++)
+        observers[i]->close(observers[i]);
+}
+
+static void check_done()
+{
+    if(wildcard_count < TOPIC_COUNT || reply_count < TOPIC_COUNT)
+        return;
+    /** Wait for duplicates that should never come */
+    tev_set_timeout(tev, finish, NULL, 100);
+}
+
+static void on_wildcard_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    wildcard_count++;
+    check_done();
+}
+
+static void on_concrete_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    assert(strcmp(topic, "t3/x") == 0);
+    concrete_count++;
+}
+
+static void on_observer_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    observer_counts[(intptr_t)ctx]++;
+}
+
+static void on_request(const char* topic, const uint8_t* data, uint32_t len, uint64_t request_id, void* ctx)
+{
+    assert(subscriber->reply(subscriber, request_id, data, len) == 0);
+}
+
+static void on_reply(tbus_reply_status_t status, const uint8_t* data, uint32_t len, void* ctx)
+{
+    assert(status == TBUS_REPLY_OK);
+    assert(len == sizeof(int));
+    assert(memcmp(data, &ctx, sizeof(int)) == 0);
+    reply_count++;
+    check_done();
+}
+
+static void start(void* ctx)
+{
+    for(int i = 0; i < TOPIC_COUNT; i++)
+    {
+        char topic[32];
+        snprintf(topic, sizeof(topic), "t%d/x", i);
+        assert(publisher->publish(publisher, topic, (uint8_t*)&i, sizeof(i)) == 0);
+        snprintf(topic, sizeof(topic), "t%d/rpc", i);
+        assert(publisher->request(publisher, topic, (uint8_t*)&i, sizeof(i), 1000, on_reply, (void*)(intptr_t)i) == 0);
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    tev = tev_create_ctx();
+    assert(tev);
+    publisher = tbus_connect_sharded(tev, shard_paths, SHARD_COUNT, 1);
+    assert(publisher);
+    subscriber = tbus_connect_sharded(tev, shard_paths, SHARD_COUNT, 1);
+    assert(subscriber);
+    /** Wildcard in the hashed segment, on every shard */
+    assert(subscriber->subscribe(subscriber, "+/x", on_wildcard_message, NULL) == 0);
+    /** On one shard only */
+    assert(subscriber->subscribe(subscriber, "t3/#", on_concrete_message, NULL) == 0);
+    assert(subscriber->serve(subscriber, "+/rpc", on_request, NULL) == 0);
+    for(int i = 0; i < SHARD_COUNT; i++)
+    {
+        observers[i] = tbus_connect(tev, shard_paths[i]);
+        assert(observers[i]);
+        assert(observers[i]->subscribe(observers[i], "+/x", on_observer_message, (void*)(intptr_t)i) == 0);
+    }
+    tev_set_timeout(tev, start, NULL, 100);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+
+    assert(wildcard_count == TOPIC_COUNT);
+    assert(concrete_count == 1);
+    assert(reply_count == TOPIC_COUNT);
+    for(int i = 0; i < SHARD_COUNT; i++)
+    {
+        /** Every topic is published to exactly one shard */
+        printf("shard %d: %d\n", i, observer_counts[i]);
+        assert(observer_counts[i] > 0);
+    }
+    assert(observer_counts[0] + observer_counts[1] == TOPIC_COUNT);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "../tbus.h"
+
+#define MESSAGE_COUNT (10)
+#define WORKER_COUNT (2)
+
+static tev_handle_t tev = NULL;
+static tbus_t* publisher = NULL;
+static tbus_t* observer = NULL;
+static tbus_t* workers[WORKER_COUNT] = {0};
+static int worker_counts[WORKER_COUNT] = {0};
+static int seen[MESSAGE_COUNT] = {0};
+static int observer_count = 0;
+
+static void check_done()
+{
+    int total = 0;
+    for(int i = 0; i < WORKER_COUNT; i++)
+        total += worker_counts[i];
+    if(total < MESSAGE_COUNT || observer_count < MESSAGE_COUNT)
+        return;
+    publisher->close(publisher);
+    observer->close(observer);
+    for(int i = 0; i < WORKER_COUNT; i++)
+        workers[i]->close(workers[i]);
+}
+
+static void on_worker_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    int worker = (int)(intptr_t)ctx;
+    int value = 0;
+    assert(len == sizeof(value));
+    memcpy(&value, data, len);
+    assert(value >= 0 && value < MESSAGE_COUNT);
+    /** Exactly one member of the group gets each message */
+    assert(seen[value] == 0);
+    seen[value] = 1;
+    worker_counts[worker]++;
+    check_done();
+}
+
+static void on_observer_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    observer_count++;
+    check_done();
+}
+
+static void start(void* ctx)
+{
+    for(int i = 0; i < MESSAGE_COUNT; i++)
+        assert(publisher->publish(publisher, "jobs/a", (uint8_t*)&i, sizeof(i)) == 0);
+}
+
+int main(int argc, char const *argv[])
+{
+    tev = tev_create_ctx();
+    assert(tev);
+    for(int i = 0; i < WORKER_COUNT; i++)
+    {
+        workers[i] = tbus_connect(tev, NULL);
+        assert(workers[i]);
+        assert(workers[i]->subscribe(workers[i], "$share/workers/jobs/#", on_worker_message, (void*)(intptr_t)i) == 0);
+    }
+    observer = tbus_connect(tev, NULL);
+    assert(observer);
+    /** Plain subscribers still get everything */
+    assert(observer->subscribe(observer, "jobs/+", on_observer_message, NULL) == 0);
+    publisher = tbus_connect(tev, NULL);
+    assert(publisher);
+    tev_set_timeout(tev, start, NULL, 100);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+
+    for(int i = 0; i < WORKER_COUNT; i++)
+    {
+        /** Idle members take turns */
+        assert(worker_counts[i] > 0);
+        printf("worker %d: %d\n", i, worker_counts[i]);
+    }
+    assert(observer_count == MESSAGE_COUNT);
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "../topic_intern.h"
+
+#define TOPIC_COUNT (1000)
+
+int main(int argc, char const *argv[])
+{
+    topic_intern_t* names = topic_intern_new();
+    assert(names);
+    char topic[32];
+    const char* interned[TOPIC_COUNT];
+    /** Enough to grow the buckets a few times */
+    for(int i = 0; i < TOPIC_COUNT; i++)
+    {
+        snprintf(topic, sizeof(topic), "a/b/%d", i);
+        interned[i] = names->get(names, topic);
+        assert(interned[i] && interned[i] != topic);
+        assert(strcmp(interned[i], topic) == 0);
+    }
+    assert(names->count(names) == TOPIC_COUNT);
+    /** The same topic is the same pointer */
+    for(int i = 0; i < TOPIC_COUNT; i++)
+    {
+        snprintf(topic, sizeof(topic), "a/b/%d", i);
+        assert(names->find(names, topic) == interned[i]);
+        assert(names->get(names, topic) == interned[i]);
+    }
+    assert(names->count(names) == TOPIC_COUNT);
+    assert(names->find(names, "a/b") == NULL);
+    /** Removed with the last reference */
+    for(int i = 0; i < TOPIC_COUNT; i++)
+        names->release(names, interned[i]);
+    assert(names->count(names) == TOPIC_COUNT);
+    assert(names->find(names, "a/b/7") == interned[7]);
+    for(int i = 0; i < TOPIC_COUNT; i += 2)
+        names->release(names, interned[i]);
+    assert(names->count(names) == TOPIC_COUNT / 2);
+    assert(names->find(names, "a/b/6") == NULL);
+    assert(names->find(names, "a/b/7") == interned[7]);
+    names->free(names);
+    printf("topic_intern done\n");
+    return 0;
+}
@@ -67,6 +67,45 @@ int main(int argc, char const *argv[])
     assert(test_data[5].match_count == 1);
     assert(test_data[6].match_count == 1);
 
+    /** Same matches and order as match, a + segment in the topic does not match twice */
+    void* matches[8];
+    size_t count = tree->match_all(tree, "a/b/c", matches, 8);
+    assert(count == 3);
+    assert(matches[0] == &test_data[1]);
+    assert(matches[1] == &test_data[5]);
+    assert(matches[2] == &test_data[6]);
+    count = tree->match_all(tree, "+/b/c", matches, 8);
+    assert(count == 1);
+    assert(matches[0] == &test_data[6]);
+    count = tree->match_all(tree, "a/b/c", matches, 1);
+    assert(count == 3);
+    assert(matches[0] == &test_data[1]);
+
+    /** The reverse, the tree entries are topics and + and # in them are literal */
+    size_t data_count = sizeof(test_data)/sizeof(test_data_t);
+    for (int i = 0; i < data_count; i++)
+        test_data[i].match_count = 0;
+    tree->match_pattern(tree, "a/#", callback, NULL);
+    assert(test_data[0].match_count == 1);
+    assert(test_data[1].match_count == 1);
+    assert(test_data[2].match_count == 1);
+    assert(test_data[3].match_count == 0);
+    assert(test_data[4].match_count == 1);
+    assert(test_data[5].match_count == 1);
+    assert(test_data[6].match_count == 0);
+    for (int i = 0; i < data_count; i++)
+        test_data[i].match_count = 0;
+    tree->match_pattern(tree, "+/b", callback, NULL);
+    tree->match_pattern(tree, "bcd", callback, NULL);
+    tree->match_pattern(tree, "a/b/+/d", callback, NULL);
+    assert(test_data[0].match_count == 1);
+    assert(test_data[3].match_count == 1);
+    for (int i = 0; i < data_count; i++)
+        assert(test_data[i].match_count == (i == 0 || i == 3));
+    tree->match_pattern(tree, "#", callback, NULL);
+    for (int i = 0; i < data_count; i++)
+        assert(test_data[i].match_count == 1 + (i == 0 || i == 3));
+
     for (int i = 0; i < sizeof(test_data)/sizeof(test_data_t); i++)
     {
         test_data_t* data = &test_data[i];
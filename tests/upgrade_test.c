@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include "../tbus.h"
+
+/** Private brokers, the second one takes over from the first */
+#define UPGRADE_UDS_PATH "@tbus.upgrade"
+#define UPGRADE_HANDOFF_PATH "@tbus.upgrade.handoff"
+#define MESSAGE_COUNT (10)
+
+static tev_handle_t tev = NULL;
+static tbus_t* client = NULL;
+static int received = 0;
+static int disconnected = 0;
+static uint64_t last_seq = 0;
+
+static pid_t start_broker()
+{
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if(pid == 0)
+    {
+        execl("../tbus", "tbus", "-p", UPGRADE_UDS_PATH, "-Q", "-U", UPGRADE_HANDOFF_PATH, (char*)NULL);
+        _exit(EXIT_FAILURE);
+    }
+    /** Let it listen */
+    usleep(100 * 1000);
+    return pid;
+}
+
+/** Take the state of the running broker like a new one would, but never commit */
+static void abort_upgrade()
+{
+    int conn = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    assert(conn >= 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, UPGRADE_HANDOFF_PATH, sizeof(addr.sun_path) - 1);
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(addr.sun_path) + 1;
+    addr.sun_path[0] = 0;
+    assert(connect(conn, (struct sockaddr*)&addr, addr_len) == 0);
+    struct timeval timeout = { .tv_usec = 200 * 1000 };
+    assert(setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0);
+    int records = 0;
+    for(;;)
+    {
+        uint8_t record[64 * 1024];
+        struct iovec iov = { .iov_base = record, .iov_len = sizeof(record) };
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+        /** Until the old broker waits for the commit */
+        if(recvmsg(conn, &hdr, 0) <= 0)
+            break;
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+        if(cmsg && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            int fd = -1;
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+            close(fd);
+        }
+        records++;
+    }
+    assert(records > 0);
+    close(conn);
+    /** Let it listen for upgrades again */
+    usleep(100 * 1000);
+}
+
+static void on_disconnect(void* ctx)
+{
+    disconnected = 1;
+}
+
+static void publish_rest(void* ctx)
+{
+    for(int i = 1; i < MESSAGE_COUNT; i++)
+        assert(client->publish(client, "u/a", (uint8_t*)&i, sizeof(i)) == 0);
+}
+
+static void on_message(const char* topic, const uint8_t* data, uint32_t len, void* ctx)
+{
+    pid_t* old_pid = (pid_t*)ctx;
+    int value = 0;
+    assert(len == sizeof(value));
+    memcpy(&value, data, len);
+    assert(value == received);
+    /** Sequence numbers carry over */
+    uint64_t seq = client->get_sequence(client);
+    assert(seq == last_seq + 1);
+    last_seq = seq;
+    received++;
+    if(value == 0)
+    {
+        pid_t new_pid = start_broker();
+        /** The old broker exits once it handed over */
+        int status = 0;
+        assert(waitpid(*old_pid, &status, 0) == *old_pid);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        *old_pid = new_pid;
+        tev_set_timeout(tev, publish_rest, NULL, 10);
+    }
+    else if(value == MESSAGE_COUNT - 1)
+    {
+        client->close(client);
+    }
+}
+
+static void start(void* ctx)
+{
+    /** The old broker keeps serving, the first message still comes from it */
+    abort_upgrade();
+    int value = 0;
+    assert(client->publish(client, "u/a", (uint8_t*)&value, sizeof(value)) == 0);
+}
+
+int main(int argc, char const *argv[])
+{
+    pid_t broker_pid = start_broker();
+    tev = tev_create_ctx();
+    assert(tev);
+    client = tbus_connect(tev, UPGRADE_UDS_PATH);
+    assert(client);
+    client->callbacks.on_disconnect = on_disconnect;
+    assert(client->subscribe(client, "u/a", on_message, &broker_pid) == 0);
+    tev_set_timeout(tev, start, NULL, 10);
+
+    tev_main_loop(tev);
+    tev_free_ctx(tev);
+    kill(broker_pid, SIGTERM);
+    waitpid(broker_pid, NULL, 0);
+
+    assert(received == MESSAGE_COUNT);
+    assert(disconnected == 0);
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "topic_intern.h"
+
+#define INITIAL_BUCKET_COUNT (64)
+
+typedef struct topic_intern_entry_s topic_intern_entry_t;
+struct topic_intern_entry_s
+{
+    topic_intern_entry_t* next;
+    uint32_t hash;
+    uint32_t ref_count;
+    size_t len;
+    char topic[];
+};
+
+#define GET_ENTRY_FROM_TOPIC(topic) \
+    ((topic_intern_entry_t*)((char*)(topic) - offsetof(topic_intern_entry_t, topic)))
+
+typedef struct
+{
+    topic_intern_t iface;
+    /** Power of 2 */
+    size_t bucket_count;
+    topic_intern_entry_t** buckets;
+    size_t count;
+} topic_intern_impl_t;
+
+static void topic_intern_free(topic_intern_t* iface);
+static const char* topic_intern_get(topic_intern_t* iface, const char* topic);
+static const char* topic_intern_find(topic_intern_t* iface, const char* topic);
+static void topic_intern_release(topic_intern_t* iface, const char* topic);
+static size_t topic_intern_count(topic_intern_t* iface);
+static topic_intern_entry_t* topic_intern_lookup(topic_intern_impl_t* this, const char* topic, size_t len, uint32_t hash);
+static void topic_intern_grow(topic_intern_impl_t* this);
+static uint32_t topic_hash(const char* topic, size_t len);
+
+topic_intern_t* topic_intern_new()
+{
+    topic_intern_impl_t* this = malloc(sizeof(topic_intern_impl_t));
+    if(!this)
+        return NULL;
+    memset(this, 0, sizeof(topic_intern_impl_t));
+    this->iface.free = topic_intern_free;
+    this->iface.get = topic_intern_get;
+    this->iface.find = topic_intern_find;
+    this->iface.release = topic_intern_release;
+    this->iface.count = topic_intern_count;
+    this->bucket_count = INITIAL_BUCKET_COUNT;
+    this->buckets = calloc(this->bucket_count, sizeof(topic_intern_entry_t*));
+    if(!this->buckets)
+    {
+        free(this);
+        return NULL;
+    }
+    return &this->iface;
+}
+
+static void topic_intern_free(topic_intern_t* iface)
+{
+    topic_intern_impl_t* this = (topic_intern_impl_t*)iface;
+    if(!this)
+        return;
+    for(size_t i = 0; i < this->bucket_count; i++)
+    {
+        topic_intern_entry_t* entry = this->buckets[i];
+        while(entry)
+        {
+            topic_intern_entry_t* next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(this->buckets);
+    free(this);
+}
+
+static const char* topic_intern_get(topic_intern_t* iface, const char* topic)
+{
+    topic_intern_impl_t* this = (topic_intern_impl_t*)iface;
+    if(!this || !topic)
+        return NULL;
+    size_t len = strlen(topic);
+    uint32_t hash = topic_hash(topic, len);
+    topic_intern_entry_t* entry = topic_intern_lookup(this, topic, len, hash);
+    if(entry)
+    {
+        entry->ref_count++;
+        return entry->topic;
+    }
+    entry = malloc(sizeof(topic_intern_entry_t) + len + 1);
+    if(!entry)
+        return NULL;
+    entry->hash = hash;
+    entry->ref_count = 1;
+    entry->len = len;
+    memcpy(entry->topic, topic, len + 1);
+    topic_intern_entry_t** bucket = &this->buckets[hash & (this->bucket_count - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    this->count++;
+    if(this->count > this->bucket_count)
+        topic_intern_grow(this);
+    return entry->topic;
+}
+
+static const char* topic_intern_find(topic_intern_t* iface, const char* topic)
+{
+    topic_intern_impl_t* this = (topic_intern_impl_t*)iface;
+    if(!this || !topic)
+        return NULL;
+    size_t len = strlen(topic);
+    topic_intern_entry_t* entry = topic_intern_lookup(this, topic, len, topic_hash(topic, len));
+    return entry ? entry->topic : NULL;
+}
+
+static void topic_intern_release(topic_intern_t* iface, const char* topic)
+{
+    topic_intern_impl_t* this = (topic_intern_impl_t*)iface;
+    if(!this || !topic)
+        return;
+    topic_intern_entry_t* entry = GET_ENTRY_FROM_TOPIC(topic);
+    if(--entry->ref_count > 0)
+        return;
+    /** The hash is kept, no need to go over the topic again */
+    topic_intern_entry_t** link = &this->buckets[entry->hash & (this->bucket_count - 1)];
+    while(*link && *link != entry)
+        link = &(*link)->next;
+    if(*link)
+        *link = entry->next;
+    this->count--;
+    free(entry);
+}
+
+static size_t topic_intern_count(topic_intern_t* iface)
+{
+    topic_intern_impl_t* this = (topic_intern_impl_t*)iface;
+    if(!this)
+        return 0;
+    return this->count;
+}
+
+static topic_intern_entry_t* topic_intern_lookup(topic_intern_impl_t* this, const char* topic, size_t len, uint32_t hash)
+{
+    topic_intern_entry_t* entry = this->buckets[hash & (this->bucket_count - 1)];
+    while(entry)
+    {
+        if(entry->hash == hash && entry->len == len && memcmp(entry->topic, topic, len) == 0)
+            return entry;
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+/** Double the buckets, a failure only leaves the chains longer */
+static void topic_intern_grow(topic_intern_impl_t* this)
+{
+    size_t bucket_count = this->bucket_count * 2;
+    topic_intern_entry_t** buckets = calloc(bucket_count, sizeof(topic_intern_entry_t*));
+    if(!buckets)
+        return;
+    for(size_t i = 0; i < this->bucket_count; i++)
+    {
+        topic_intern_entry_t* entry = this->buckets[i];
+        while(entry)
+        {
+            topic_intern_entry_t* next = entry->next;
+            topic_intern_entry_t** bucket = &buckets[entry->hash & (bucket_count - 1)];
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(this->buckets);
+    this->buckets = buckets;
+    this->bucket_count = bucket_count;
+}
+
+/** FNV-1a */
+static uint32_t topic_hash(const char* topic, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)topic[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A table of shared, reference counted topic strings.
+ * Each distinct topic is stored once with its hash. Two topics from the same table
+ * are equal if and only if their pointers are, so they can be compared and used as keys by pointer.
+ */
+
+typedef struct topic_intern_s topic_intern_t;
+
+struct topic_intern_s
+{
+    /**
+     * @brief Free the table. Topics still referenced become invalid.
+     * @param self the table
+     */
+    void (*free)(topic_intern_t* self);
+
+    /**
+     * @brief Get the shared copy of a topic, adding it if needed. Takes a reference.
+     * @param self the table
+     * @param topic the topic
+     * @return the shared copy, or NULL if the operation failed.
+     */
+    const char* (*get)(topic_intern_t* self, const char* topic);
+
+    /**
+     * @brief Look up the shared copy of a topic without taking a reference.
+     * @param self the table
+     * @param topic the topic
+     * @return the shared copy, or NULL if the topic is not in the table.
+     */
+    const char* (*find)(topic_intern_t* self, const char* topic);
+
+    /**
+     * @brief Drop a reference taken with get, the topic is removed with the last one.
+     * @param self the table
+     * @param topic the shared copy
+     */
+    void (*release)(topic_intern_t* self, const char* topic);
+
+    /**
+     * @param self the table
+     * @return the number of distinct topics
+     */
+    size_t (*count)(topic_intern_t* self);
+};
+
+topic_intern_t* topic_intern_new();
@@ -8,6 +8,9 @@
 #include <stdbool.h>
 #include "topic_tree.h"
 
+/** Pending nodes kept on the stack while matching, deeper topics move to the heap */
+#define MATCH_STACK_SIZE (64)
+
 typedef struct
 {
     void (*free_data)(void* data, void* ctx);
@@ -17,13 +20,46 @@ typedef struct
 typedef struct topic_tree_node_s topic_tree_node_t;
 struct topic_tree_node_s
 {
+    /** Allocated with the node, right after it. NULL for the root. */
     char* topic_segment;
     int topic_segment_len;
     topic_tree_node_t* parent;
     map_handle_t children;
+    /** The + and # children, also in children, kept here to skip the lookups */
+    topic_tree_node_t* plus_child;
+    topic_tree_node_t* hash_child;
     void* data;
 };
 
+typedef struct
+{
+    topic_tree_node_t* node;
+    /** The rest of the topic to match below node, NULL to report the data of node */
+    const char* topic;
+} topic_tree_match_frame_t;
+
+typedef struct
+{
+    topic_tree_node_t* node;
+    /** The rest of the pattern to match below node, NULL to report node and everything below */
+    const char* pattern;
+} topic_tree_pattern_frame_t;
+
+typedef struct
+{
+    topic_tree_pattern_frame_t local_stack[MATCH_STACK_SIZE];
+    topic_tree_pattern_frame_t* stack;
+    size_t size;
+    size_t depth;
+} topic_tree_pattern_stack_t;
+
+typedef struct
+{
+    void** matches;
+    size_t capacity;
+    size_t count;
+} topic_tree_match_all_ctx_t;
+
 typedef struct
 {
     topic_tree_t iface;
@@ -35,8 +71,13 @@ static void* topic_tree_insert(topic_tree_t* iface, const char* topic, void* dat
 static void* topic_tree_remove(topic_tree_t* iface, const char* topic);
 static void* topic_tree_get(topic_tree_t* iface, const char* topic);
 static void topic_tree_match(topic_tree_t* iface, const char* topic, void (*callback)(void* data, void* ctx), void* ctx);
+static size_t topic_tree_match_all(topic_tree_t* iface, const char* topic, void** matches, size_t capacity);
+static void topic_tree_match_all_callback(void* data, void* ctx);
+static void topic_tree_match_pattern(topic_tree_t* iface, const char* pattern, void (*callback)(void* data, void* ctx), void* ctx);
+static bool topic_tree_pattern_stack_push(topic_tree_pattern_stack_t* stack, topic_tree_node_t* node, const char* pattern);
 static bool is_valid_topic(const char* topic);
 static void topic_tree_match_node(topic_tree_node_t* root, const char* topic, void (*callback)(void* data, void* ctx), void* ctx);
+static void topic_tree_node_unlink(topic_tree_node_t* node);
 static void topic_tree_node_clear(topic_tree_node_t* node, topic_tree_node_free_data_ctx_t* ctx);
 static void topic_tree_node_free(topic_tree_node_t* node, topic_tree_node_free_data_ctx_t* ctx);
 static void topic_tree_node_free_with_ctx(void* data, void* ctx);
@@ -52,6 +93,8 @@ topic_tree_t* topic_tree_new()
     tree->iface.remove = topic_tree_remove;
     tree->iface.get = topic_tree_get;
     tree->iface.match = topic_tree_match;
+    tree->iface.match_all = topic_tree_match_all;
+    tree->iface.match_pattern = topic_tree_match_pattern;
     tree->root.topic_segment = NULL;
     tree->root.parent = NULL;
     tree->root.children = map_create();
@@ -89,32 +132,31 @@ static void* topic_tree_insert(topic_tree_t* iface, const char* topic, void* dat
         topic_tree_node_t* child = map_get(node->children, topic_segment, topic_segment_len);
         if(!child)
         {
-            child = malloc(sizeof(topic_tree_node_t));
+            child = malloc(sizeof(topic_tree_node_t) + topic_segment_len + 1);
             if(!child)
                 goto error;
             memset(child, 0, sizeof(topic_tree_node_t));
-            child->topic_segment = strndup(topic_segment, topic_segment_len);
-            if(!child->topic_segment)
-            {
-                free(child);
-                goto error;
-            }
+            child->topic_segment = (char*)(child + 1);
+            memcpy(child->topic_segment, topic_segment, topic_segment_len);
+            child->topic_segment[topic_segment_len] = '\0';
             child->topic_segment_len = topic_segment_len;
             child->parent = node;
             child->children = map_create();
             if(!child->children)
             {
-                free(child->topic_segment);
                 free(child);
                 goto error;
             }
             if(!map_add(node->children, child->topic_segment, child->topic_segment_len, child))
             {
                 map_delete(child->children, NULL, NULL);
-                free(child->topic_segment);
                 free(child);
                 goto error;
             }
+            if(topic_segment_len == 1 && *topic_segment == '+')
+                node->plus_child = child;
+            else if(topic_segment_len == 1 && *topic_segment == '#')
+                node->hash_child = child;
         }
         node = child;
         topic_segment += topic_segment_len;
@@ -130,8 +172,9 @@ error:
     while(node != &this->root)
     {
         topic_tree_node_t* parent = node->parent;
-        if(map_get_length(node->children) != 0)
+        if(map_get_length(node->children) != 0 || node->data)
             break;
+        topic_tree_node_unlink(node);
         topic_tree_node_free(node, NULL);
         node = parent;
     }
@@ -163,8 +206,7 @@ static void* topic_tree_remove(topic_tree_t* iface, const char* topic)
         node->data = NULL;
         if(map_get_length(node->children) == 0)
         {
-            topic_tree_node_t* parent = node->parent;
-            map_remove(parent->children, node->topic_segment, node->topic_segment_len);
+            topic_tree_node_unlink(node);
             topic_tree_node_free(node, NULL);
         }
         return data;
@@ -201,6 +243,130 @@ static void topic_tree_match(topic_tree_t* iface, const char* topic, void (*call
     topic_tree_match_node(&this->root, topic, callback, ctx);
 }
 
+static size_t topic_tree_match_all(topic_tree_t* iface, const char* topic, void** matches, size_t capacity)
+{
+    topic_tree_impl_t* this = (topic_tree_impl_t*)iface;
+    if(!this || !is_valid_topic(topic) || (!matches && capacity > 0))
+        return 0;
+    topic_tree_match_all_ctx_t ctx = {matches, capacity, 0};
+    topic_tree_match_node(&this->root, topic, topic_tree_match_all_callback, &ctx);
+    return ctx.count;
+}
+
+static void topic_tree_match_all_callback(void* data, void* ctx)
+{
+    topic_tree_match_all_ctx_t* match_all_ctx = (topic_tree_match_all_ctx_t*)ctx;
+    if(match_all_ctx->count < match_all_ctx->capacity)
+        match_all_ctx->matches[match_all_ctx->count] = data;
+    match_all_ctx->count++;
+}
+
+/**
+ * Depth first with an explicit stack like topic_tree_match_node, but the wildcards are in the pattern:
+ * + follows every child and # reports the node and its whole subtree.
+ */
+static void topic_tree_match_pattern(topic_tree_t* iface, const char* pattern, void (*callback)(void* data, void* ctx), void* ctx)
+{
+    topic_tree_impl_t* this = (topic_tree_impl_t*)iface;
+    if(!this || !is_valid_topic(pattern) || !callback)
+        return;
+    topic_tree_pattern_stack_t stack;
+    stack.stack = stack.local_stack;
+    stack.size = MATCH_STACK_SIZE;
+    stack.depth = 0;
+    topic_tree_pattern_stack_push(&stack, &this->root, pattern);
+    while(stack.depth > 0)
+    {
+        topic_tree_pattern_frame_t frame = stack.stack[--stack.depth];
+        topic_tree_node_t* node = frame.node;
+        const char* next_pattern = NULL;
+        if(frame.pattern)
+        {
+            int pattern_segment_len = strchrnul(frame.pattern, '/') - frame.pattern;
+            /** # also matches its parent level */
+            if(pattern_segment_len == 1 && *frame.pattern == '#')
+                frame.pattern = NULL;
+            else if(!*frame.pattern)
+            {
+                if(node->data && node != &this->root)
+                    callback(node->data, ctx);
+                continue;
+            }
+            else
+            {
+                next_pattern = frame.pattern + pattern_segment_len;
+                if(*next_pattern)
+                    next_pattern++;
+                if(!(pattern_segment_len == 1 && *frame.pattern == '+'))
+                {
+                    topic_tree_node_t* child = map_get(node->children, (char*)frame.pattern, pattern_segment_len);
+                    if(child && !topic_tree_pattern_stack_push(&stack, child, next_pattern))
+                        break;
+                    continue;
+                }
+            }
+        }
+        if(!frame.pattern && node->data && node != &this->root)
+            callback(node->data, ctx);
+        /** + or #, every child goes on */
+        map_entry_t entry = {0};
+        bool pushed = true;
+        map_forEach(node->children, entry)
+        {
+            pushed = topic_tree_pattern_stack_push(&stack, entry.value, next_pattern);
+            /** Out of memory, the rest is not matched */
+            if(!pushed)
+                break;
+        }
+        if(!pushed)
+            break;
+    }
+    if(stack.stack != stack.local_stack)
+        free(stack.stack);
+}
+
+static bool topic_tree_pattern_stack_push(topic_tree_pattern_stack_t* stack, topic_tree_node_t* node, const char* pattern)
+{
+    if(stack->depth == stack->size)
+    {
+        topic_tree_pattern_frame_t* new_stack = malloc(2 * stack->size * sizeof(topic_tree_pattern_frame_t));
+        if(!new_stack)
+            return false;
+        memcpy(new_stack, stack->stack, stack->depth * sizeof(topic_tree_pattern_frame_t));
+        if(stack->stack != stack->local_stack)
+            free(stack->stack);
+        stack->stack = new_stack;
+        stack->size *= 2;
+    }
+    stack->stack[stack->depth++] = (topic_tree_pattern_frame_t){node, pattern};
+    return true;
+}
+
+bool topic_tree_pattern_match(const char* pattern, const char* topic)
+{
+    if(!pattern || !topic)
+        return false;
+    while(*pattern)
+    {
+        int pattern_segment_len = strchrnul(pattern, '/') - pattern;
+        if(pattern_segment_len == 1 && *pattern == '#')
+            return true;
+        if(!*topic)
+            return false;
+        int topic_segment_len = strchrnul(topic, '/') - topic;
+        bool is_plus = pattern_segment_len == 1 && *pattern == '+';
+        if(!is_plus && (pattern_segment_len != topic_segment_len || memcmp(pattern, topic, topic_segment_len) != 0))
+            return false;
+        pattern += pattern_segment_len;
+        if(*pattern)
+            pattern++;
+        topic += topic_segment_len;
+        if(*topic)
+            topic++;
+    }
+    return !*topic;
+}
+
 static bool is_valid_topic(const char* topic)
 {
     if(!topic)
@@ -230,45 +396,84 @@ static bool is_valid_topic(const char* topic)
     return true;
 }
 
+/**
+ * Depth first with an explicit stack, in the order of literal, + and # children.
+ * Every node is reached by one path only, so each data is reported once.
+ * A topic segment that is literally + or # is only matched by the wildcard itself.
+ */
 static void topic_tree_match_node(topic_tree_node_t* root, const char* topic, void (*callback)(void* data, void* ctx), void* ctx)
 {
-    /** Reach the end of the topic */
-    if(!*topic)
+    topic_tree_match_frame_t local_stack[MATCH_STACK_SIZE];
+    topic_tree_match_frame_t* stack = local_stack;
+    size_t stack_size = MATCH_STACK_SIZE;
+    size_t depth = 0;
+    stack[depth++] = (topic_tree_match_frame_t){root, topic};
+    while(depth > 0)
     {
-        /** check if root has data */
-        if(root->data)
-            callback(root->data, ctx);
-        /** check if root has a # child */
-        topic_tree_node_t* child = map_get(root->children, "#", 1);
-        /** The # child should have data, but whatever. */
-        if(child && child->data)
-            callback(child->data, ctx);
-        return;
+        topic_tree_match_frame_t frame = stack[--depth];
+        topic_tree_node_t* node = frame.node;
+        if(!frame.topic)
+        {
+            callback(node->data, ctx);
+            continue;
+        }
+        /** Reach the end of the topic */
+        if(!*frame.topic)
+        {
+            if(node->data)
+                callback(node->data, ctx);
+            /** The # child should have data, but whatever. */
+            if(node->hash_child && node->hash_child->data)
+                callback(node->hash_child->data, ctx);
+            continue;
+        }
+        if(depth + 3 > stack_size)
+        {
+            topic_tree_match_frame_t* new_stack = malloc(2 * stack_size * sizeof(topic_tree_match_frame_t));
+            /** Out of memory, the rest is not matched */
+            if(!new_stack)
+                break;
+            memcpy(new_stack, stack, depth * sizeof(topic_tree_match_frame_t));
+            if(stack != local_stack)
+                free(stack);
+            stack = new_stack;
+            stack_size *= 2;
+        }
+        /** Pushed in reverse, the literal child is matched first */
+        if(node->hash_child && node->hash_child->data)
+            stack[depth++] = (topic_tree_match_frame_t){node->hash_child, NULL};
+        size_t wildcard_count = (node->plus_child != NULL) + (node->hash_child != NULL);
+        int topic_segment_len = strchrnul(frame.topic, '/') - frame.topic;
+        const char* next_topic = frame.topic + topic_segment_len;
+        if(*next_topic)
+            next_topic++;
+        if(node->plus_child)
+            stack[depth++] = (topic_tree_match_frame_t){node->plus_child, next_topic};
+        /** Skip the lookup when only wildcards are below */
+        if(map_get_length(node->children) == wildcard_count)
+            continue;
+        topic_tree_node_t* child = map_get(node->children, (char*)frame.topic, topic_segment_len);
+        if(child && child != node->plus_child && child != node->hash_child)
+            stack[depth++] = (topic_tree_match_frame_t){child, next_topic};
     }
-    int topic_segment_len = strchrnul(topic, '/') - topic;
-    topic_tree_node_t* child = map_get(root->children, (char*)topic, topic_segment_len);
-    char* next_topic = (char*)topic + topic_segment_len;
-    if(*next_topic)
-        next_topic++;
-    if(child)
-        topic_tree_match_node(child, next_topic, callback, ctx);
-    child = map_get(root->children, "+", 1);
-    if(child)
-        topic_tree_match_node(child, next_topic, callback, ctx);
-    child = map_get(root->children, "#", 1);
-    if(child && child->data)
-        callback(child->data, ctx);
+    if(stack != local_stack)
+        free(stack);
+}
+
+static void topic_tree_node_unlink(topic_tree_node_t* node)
+{
+    topic_tree_node_t* parent = node->parent;
+    map_remove(parent->children, node->topic_segment, node->topic_segment_len);
+    if(parent->plus_child == node)
+        parent->plus_child = NULL;
+    if(parent->hash_child == node)
+        parent->hash_child = NULL;
 }
 
 static void topic_tree_node_clear(topic_tree_node_t* node, topic_tree_node_free_data_ctx_t* ctx)
 {
     if(!node)
         return;
-    if(node->topic_segment)
-    {
-        free(node->topic_segment);
-        node->topic_segment = NULL;
-    }
     if(node->children)
     {
         map_delete(node->children, topic_tree_node_free_with_ctx, ctx);
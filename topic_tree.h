@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
 typedef struct topic_tree_s topic_tree_t;
 
 struct topic_tree_s
@@ -45,6 +48,34 @@ struct topic_tree_s
      * @param ctx the context to pass to the callback
      */
     void (*match)(topic_tree_t* self, const char* topic, void (*callback)(void* data, void* ctx), void* ctx);
+
+    /**
+     * @brief Collect the data of every match, in the same order as match.
+     * @param self the topic tree
+     * @param topic the topic to match
+     * @param matches filled with up to capacity data
+     * @param capacity the size of matches
+     * @return the number of matches, more than capacity if some did not fit
+     */
+    size_t (*match_all)(topic_tree_t* self, const char* topic, void** matches, size_t capacity);
+
+    /**
+     * @brief The reverse of match, call callback with the data of each topic in the tree that pattern matches.
+     * @note DO NOT modify the tree in callback. + and # in the tree are taken literally.
+     * @param self the topic tree
+     * @param pattern the pattern, may contain + and #
+     * @param callback the callback to call for each match
+     * @param ctx the context to pass to the callback
+     */
+    void (*match_pattern)(topic_tree_t* self, const char* pattern, void (*callback)(void* data, void* ctx), void* ctx);
 };
 
 topic_tree_t* topic_tree_new();
+
+/**
+ * @brief Check if a topic matches a pattern, with the same rules as match.
+ * @param pattern the pattern, may contain + and #
+ * @param topic the topic
+ * @return true if it matches
+ */
+bool topic_tree_pattern_match(const char* pattern, const char* topic);